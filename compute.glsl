@@ -1,10 +1,16 @@
-#version 430
-
-// CHANGE THE C DEFINE FIRST, THEN THE FRAGMENT SHADER
-#define NUM_POINT_SOURCE 32
-#define LOCAL_FIELD_SIZE_X 32
-#define LOCAL_FIELD_SIZE_Y 32
+// Compiled behind the preamble from shader-cache.c, which defines #version,
+// NUM_DIMS, the launch shape (LOCAL_FIELD_SIZE_X/Y, PIXELS_PER_INVOCATION,
+// SOURCE_CHUNK_SIZE) and, in variants specialised to a scenario, SOURCE_COUNT
+#if NUM_DIMS != 2
+#error compute.glsl only evaluates 2D fields
+#endif
+#define LOCAL_INVOCATIONS (LOCAL_FIELD_SIZE_X*LOCAL_FIELD_SIZE_Y)
+// Samples along x covered by one work group
+#define GROUP_SIZE_X (LOCAL_FIELD_SIZE_X*PIXELS_PER_INVOCATION)
+// Also holds the per-invocation partials of the FieldData reduction
+#define SHARED_SIZE (SOURCE_CHUNK_SIZE > LOCAL_INVOCATIONS ? SOURCE_CHUNK_SIZE : LOCAL_INVOCATIONS)
 #define PI 3.1415926535
+#define HUGE 3.402823e38
 
 layout(local_size_x = LOCAL_FIELD_SIZE_X,
        local_size_y = LOCAL_FIELD_SIZE_Y,
@@ -14,21 +20,47 @@ uniform FieldInfo {
     float mat_c;
 
     int psn;
-    vec2 ps_loc[NUM_POINT_SOURCE];
-    float ps_freq[NUM_POINT_SOURCE];
-    float ps_phase[NUM_POINT_SOURCE];
 
     vec2 fieldoffset;
     vec2 fielddims;
     uvec2 fieldsize;
 };
 
+struct PointSource {
+    vec2 loc;
+    float freq;
+    float phase;
+};
+
 layout(rg32f,binding = 0) uniform image2D field;
-layout(binding = 0) coherent buffer FieldData {
-    int written;
-    float field_max;
-    float field_min;
+layout(std430,binding = 1) readonly buffer PointSources {
+    PointSource ps[];
 };
+// Incremental updates: new and negated old records of edited sources, summed
+// on top of what's already in the field instead of starting from scratch
+layout(std430,binding = 2) readonly buffer PointSourceUpdates {
+    PointSource ps_update[];
+};
+uniform int ps_update_count;
+// Level of the viewer's field pyramid being evaluated (progressive.h): every
+// 2^level-th sample of the field, at the same positions as at full resolution
+uniform int level;
+// Samples in [keep.xy,keep.zw) already hold their value and are left as they
+// are; work groups entirely inside skip the sources altogether
+uniform ivec4 keep;
+// First pass of the FieldData reduction: (min, max, sum, sum of squares) of
+// |field| over each work group, indexed by work group; reduce.glsl does the rest
+layout(std430,binding = 3) writeonly buffer FieldPartials {
+    vec4 partial[];
+};
+
+// One chunk of sources at a time, (loc, k, phase), read from the SSBO once
+// per work group rather than once per invocation
+shared vec4 chunk[SHARED_SIZE];
+
+vec4 combine(vec4 a, vec4 b) {
+    return vec4(min(a.x,b.x),max(a.y,b.y),a.z+b.z,a.w+b.w);
+}
 
 vec2 cmult(vec2 c1, vec2 c2) {
     return vec2(c1.x*c2.x-c1.y*c2.y,c1.x*c2.y+c1.y*c2.x);
@@ -38,31 +70,85 @@ vec2 cexp(vec2 c) {
     return exp(c.x)*vec2(cos(c.y),sin(c.y));
 }
 
+// Contribution of source s, as (loc, k, phase), at pos
+vec2 sourceTerm(vec2 pos, vec4 s) {
+    float r = length(pos-s.xy);
+    return cmult( cexp( vec2(0.,s.w) )/sqrt(r),
+                  cexp( vec2(0.,s.z*r) ) );
+}
+
 void main() {
-    if (gl_GlobalInvocationID.x >= fieldsize.x ||
-        gl_GlobalInvocationID.y >= fieldsize.y) return;
-    
-    vec2 pos = fieldoffset
-        +vec2(gl_GlobalInvocationID.xy)/vec2(fieldsize)*fielddims;
-    ivec2 ipos = ivec2(gl_GlobalInvocationID.xy);
-
-    vec2 fv = vec2(0.,0.); //imageLoad(field,ipos).rg; <- This way for fun!
-    float r,k;
-    for (int i = 0; i<psn && i<NUM_POINT_SOURCE; ++i) {
-        r = length(pos-ps_loc[i]);
-        k = ps_freq[i]*2.*PI/mat_c;
-        fv += cmult( cexp( vec2(0.,ps_phase[i]) )/sqrt(r),
-                     cexp( vec2(0.,k*r) ) );
+    // Sized like the texture's mip level
+    ivec2 size = max(ivec2(fieldsize) >> level,ivec2(1));
+
+    ivec2 groupmin = ivec2(gl_WorkGroupID.xy)*ivec2(GROUP_SIZE_X,LOCAL_FIELD_SIZE_Y);
+    ivec2 groupmax = min(groupmin+ivec2(GROUP_SIZE_X,LOCAL_FIELD_SIZE_Y),size);
+    bool groupkept = all(greaterThanEqual(groupmin,keep.xy)) &&
+                     all(lessThanEqual(groupmax,keep.zw));
+
+    bool update = ps_update_count > 0;
+    int sources = groupkept ? 0 : update ? ps_update_count : psn;
+
+    // No early out: every invocation has to help load and reach the barriers
+    ivec2 ipos[PIXELS_PER_INVOCATION];
+    vec2 pos[PIXELS_PER_INVOCATION];
+    bool inside[PIXELS_PER_INVOCATION];
+    bool kept[PIXELS_PER_INVOCATION];
+    vec2 fv[PIXELS_PER_INVOCATION];
+    vec2 held[PIXELS_PER_INVOCATION];
+    for (int p = 0; p<PIXELS_PER_INVOCATION; ++p) {
+        ipos[p] = groupmin+ivec2(gl_LocalInvocationID.xy)+ivec2(p*LOCAL_FIELD_SIZE_X,0);
+        pos[p] = fieldoffset
+            +vec2(ipos[p] << level)/vec2(fieldsize)*fielddims;
+        inside[p] = all(lessThan(ipos[p],size));
+        kept[p] = all(greaterThanEqual(ipos[p],keep.xy)) && all(lessThan(ipos[p],keep.zw));
+
+        fv[p] = vec2(0.,0.);
+        if ((update || kept[p]) && inside[p]) fv[p] = imageLoad(field,ipos[p]).rg;
+        held[p] = fv[p];
+    }
+
+    int li = int(gl_LocalInvocationIndex);
+    for (int base = 0; base<sources; base += SOURCE_CHUNK_SIZE) {
+        for (int c = li; c<SOURCE_CHUNK_SIZE && base+c<sources; c += LOCAL_INVOCATIONS) {
+            PointSource s = update ? ps_update[base+c] : ps[base+c];
+            chunk[c] = vec4(s.loc,s.freq*2.*PI/mat_c,s.phase);
+        }
+        barrier();
+
+        int n = min(SOURCE_CHUNK_SIZE,sources-base);
+#if defined(SOURCE_COUNT) && SOURCE_COUNT <= SOURCE_CHUNK_SIZE
+        // A full pass of the scenario this was specialised to is this one
+        // chunk, with a trip count the compiler can unroll
+        if (!update) n = SOURCE_COUNT;
+#endif
+        for (int i = 0; i<n; ++i) {
+            vec4 s = chunk[i];
+            for (int p = 0; p<PIXELS_PER_INVOCATION; ++p) fv[p] += sourceTerm(pos[p],s);
+        }
+        barrier();
+    }
+
+    // Samples right on top of a source aren't finite; leave them out
+    vec4 acc = vec4(HUGE,-HUGE,0.,0.);
+    for (int p = 0; p<PIXELS_PER_INVOCATION; ++p) {
+        if (kept[p]) fv[p] = held[p];
+        else if (inside[p]) imageStore(field,ipos[p],vec4(fv[p],0.,1.));
+
+        float m = length(fv[p]);
+        if (inside[p] && !isinf(m) && !isnan(m)) acc = combine(acc,vec4(m,m,m,m*m));
+    }
+
+    // The source chunk is free again after the last barrier. Fixed pairing,
+    // so the result doesn't depend on scheduling.
+    chunk[li] = acc;
+    barrier();
+    for (int stride = LOCAL_INVOCATIONS/2; stride>0; stride /= 2) {
+        if (li < stride) chunk[li] = combine(chunk[li],chunk[li+stride]);
+        barrier();
     }
 
-    imageStore(field,ivec2(ipos),vec4(fv,0.,1.));
-    float m = length(fv);
-    if (written == 0) {
-        written = 1;
-        field_min = m;
-        field_max = m;
-    } else if (written == 1) {
-        if (m < field_min) field_min = m;
-        else if (m > field_max) field_max = m;
+    if (li == 0) {
+        partial[gl_WorkGroupID.y*gl_NumWorkGroups.x+gl_WorkGroupID.x] = chunk[0];
     }
 }
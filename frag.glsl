@@ -1,7 +1,7 @@
-#version 430
-
 // FOR FUCKS SAKE DONT CHANGE THIS WITHOUT CHECKING THE C CODE AND THE COMPUTE SHADER
-#define NUM_POINT_SOURCE 32
+// (FieldInfo has to be declared exactly as in compute.glsl to share the UBO)
+// Compiled behind the preamble from shader-cache.c, which defines #version and
+// MAX_LEVEL
 #define PI 3.1415926535
 
 out vec4 c;
@@ -9,14 +9,20 @@ out vec4 c;
 uniform float window_width;
 uniform float window_height;
 uniform float time;
+// Time-harmonic playback: show Re(field*e^(i*wt)) with w scaled down to
+// playback_rate cycles per second. Exact for single frequency scenes; with
+// several frequencies every source is played back at the same rate.
+uniform int animate;
+uniform float playback_rate;
+// Progressive evaluation: which samples of each level of the field pyramid
+// hold current values (x0, y0, x1, y1); each pixel shows the finest that does
+uniform int top_level;
+uniform ivec4 level_valid[MAX_LEVEL+1];
 
 uniform FieldInfo {
     float mat_c;
 
     int psn;
-    vec2 ps_loc[NUM_POINT_SOURCE];
-    float ps_freq[NUM_POINT_SOURCE];
-    float ps_phase[NUM_POINT_SOURCE];
 
     vec2 fieldoffset;
     vec2 fielddims;
@@ -25,10 +31,13 @@ uniform FieldInfo {
 
 layout(rg32f,binding = 0) uniform image2D field;
 uniform sampler2D fieldsampler;
+// Same declaration as in reduce.glsl, which fills it
 layout(binding = 0) coherent buffer FieldData {
     int written;
     float field_max;
     float field_min;
+    float field_mean;
+    float field_rms;
 };
 
 vec4 mapStoC(float scalar) {
@@ -45,8 +54,25 @@ vec4 mapStoC(float scalar) {
 
 void main(void) {
     vec2 pos = gl_FragCoord.xy/vec2(window_width,window_height);
-    c = mapStoC( clamp((length(texture(fieldsampler,pos).rg)-field_min)/
-                       (field_max-field_min),0.,1.) );
+    ivec2 texel = ivec2(pos*vec2(fieldsize));
+    int level = top_level;
+    for (int l = 0; l<top_level; ++l) {
+        ivec2 s = texel >> l;
+        if (all(greaterThanEqual(s,level_valid[l].xy)) && all(lessThan(s,level_valid[l].zw))) {
+            level = l;
+            break;
+        }
+    }
+    texel = min(texel >> level,textureSize(fieldsampler,level)-1);
+    vec2 fv = texelFetch(fieldsampler,texel,level).rg;
+    if (animate != 0) {
+        float wt = 2.*PI*fract(playback_rate*time);
+        float re = fv.x*cos(wt)-fv.y*sin(wt);
+        c = mapStoC( clamp(.5+.5*re/field_max,0.,1.) );
+    } else {
+        c = mapStoC( clamp((length(fv)-field_min)/
+                           (field_max-field_min),0.,1.) );
+    }
     /*if (written == 2) c = vec4(1.,0.,0.,1.);
     else c = vec4(0.,1.,0.,1.);*/
 }
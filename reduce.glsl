@@ -0,0 +1,66 @@
+// Second pass of the FieldData reduction. A single work group folds the
+// per-work-group partials written by compute.glsl, first each invocation over
+// a fixed stride, then pairwise in shared memory, so the result is the same
+// every run. Compiled behind the preamble from shader-cache.c.
+#define REDUCE_SIZE 1024
+#define HUGE 3.402823e38
+
+layout(local_size_x = REDUCE_SIZE, local_size_y = 1, local_size_z = 1) in;
+
+// Has to match compute.glsl and frag.glsl
+uniform FieldInfo {
+    float mat_c;
+
+    int psn;
+
+    vec2 fieldoffset;
+    vec2 fielddims;
+    uvec2 fieldsize;
+};
+
+layout(binding = 0) coherent buffer FieldData {
+    int written;
+    float field_max;
+    float field_min;
+    float field_mean;
+    float field_rms;
+};
+layout(std430,binding = 3) readonly buffer FieldPartials {
+    vec4 partial[];
+};
+uniform int partial_count;
+// Pyramid level compute.glsl evaluated
+uniform int level;
+
+shared vec4 folded[REDUCE_SIZE];
+
+vec4 combine(vec4 a, vec4 b) {
+    return vec4(min(a.x,b.x),max(a.y,b.y),a.z+b.z,a.w+b.w);
+}
+
+void main() {
+    int li = int(gl_LocalInvocationIndex);
+
+    vec4 acc = vec4(HUGE,-HUGE,0.,0.);
+    for (int i = li; i<partial_count; i += REDUCE_SIZE) acc = combine(acc,partial[i]);
+    folded[li] = acc;
+    barrier();
+
+    for (int stride = REDUCE_SIZE/2; stride>0; stride /= 2) {
+        if (li < stride) folded[li] = combine(folded[li],folded[li+stride]);
+        barrier();
+    }
+
+    if (li != 0) return;
+
+    // Range given in the input file stays as it is
+    if (written != 2) {
+        written = 1;
+        field_min = folded[0].x;
+        field_max = folded[0].y;
+    }
+    ivec2 size = max(ivec2(fieldsize) >> level,ivec2(1));
+    float n = float(size.x)*float(size.y);
+    field_mean = folded[0].z/n;
+    field_rms = sqrt(folded[0].w/n);
+}
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <GL/glew.h>
+
+#include "common.h"
+#include "fim.h"
+#include "shader-cache.h"
+#include "autotune.h"
+
+// compute.glsl stages sources and, after them, the per-invocation partials of
+// its reduction as vec4s in the same shared array
+#define SHARED_BYTES_PER_ENTRY 16
+
+typedef struct {
+    unsigned long long key;
+    GLuint width;
+    GLuint height;
+    GLint localx;
+    GLint localy;
+    GLint pixels;
+    GLint chunk;
+    double ms;
+} TuneEntry;
+
+typedef struct {
+    TuneBenchFunc bench;
+    void* arg;
+    GLint maxinvocations;
+    GLint maxsize[2];
+    GLint maxshared;
+    ShaderVariant best;
+    double besttime;
+    double defaulttime;
+} TuneSearch;
+
+// Candidates for each stage of the search; powers of two throughout, which the
+// reduction in compute.glsl relies on
+static const GLint localSizes[][2] = {
+    { 8, 8 }, { 16, 4 }, { 16, 8 }, { 16, 16 }, { 32, 2 }, { 32, 4 }, { 32, 8 },
+    { 32, 16 }, { 32, 32 }, { 64, 1 }, { 64, 2 }, { 64, 4 }, { 64, 8 }, { 64, 16 },
+    { 128, 1 }, { 128, 2 }, { 128, 4 }, { 128, 8 }, { 256, 1 }, { 256, 2 }, { 256, 4 }
+};
+static const GLint pixelCounts[] = { 1, 2, 4, 8 };
+static const GLint chunkSizes[] = { 128, 256, 512, 1024, 2048, 4096 };
+
+static void tuningFile(char* const path, size_t size) {
+    char dir[FILENAME_MAX-32];
+    shaderCacheDirectory(dir,sizeof(dir));
+    path[0] = '\0';
+    if (dir[0] != '\0') snprintf(path,size,"%s/%s",dir,AUTOTUNE_FILE);
+}
+
+static int readTuning(const char* const path, TuneEntry* const entries, int max) {
+    FILE* fp = fopen(path,"r");
+    if (fp == NULL) return 0;
+
+    int n = 0;
+    TuneEntry e;
+    while (n < max && fscanf(fp,"%llx %u %u %d %d %d %d %lf",&e.key,&e.width,&e.height,
+                             &e.localx,&e.localy,&e.pixels,&e.chunk,&e.ms) == 8) {
+        if (e.localx > 0 && e.localy > 0 && e.pixels > 0 && e.chunk > 0) entries[n++] = e;
+    }
+    fclose(fp);
+    return n;
+}
+
+static int sameTuning(const TuneEntry* const e, unsigned long long key, const FieldInfoMap* const fim) {
+    return e->key == key && e->width == fim->fieldsize[0] && e->height == fim->fieldsize[1];
+}
+
+// What the device allows a work group
+static void queryShapeLimits(TuneSearch* const search) {
+    glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS,&search->maxinvocations);
+    glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE,0,search->maxsize);
+    glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE,1,search->maxsize+1);
+    glGetIntegerv(GL_MAX_COMPUTE_SHARED_MEMORY_SIZE,&search->maxshared);
+}
+
+static int shapeFits(const TuneSearch* const search, const ShaderVariant* const v) {
+    const GLint invocations = v->localx*v->localy;
+    const GLint shared = v->chunk > invocations ? v->chunk : invocations;
+    return invocations <= search->maxinvocations &&
+           v->localx <= search->maxsize[0] && v->localy <= search->maxsize[1] &&
+           shared*SHARED_BYTES_PER_ENTRY <= search->maxshared;
+}
+
+// A shape the reductions in compute.glsl and reduce.glsl can halve down to one
+// invocation, and that the device runs
+static int shapeUsable(const TuneSearch* const search, const ShaderVariant* const v) {
+    const long long invocations = (long long)v->localx*v->localy;
+    return invocations <= search->maxinvocations && (invocations & (invocations-1)) == 0 &&
+           v->chunk <= search->maxshared/SHARED_BYTES_PER_ENTRY && shapeFits(search,v);
+}
+
+int loadTuning(const FieldInfoMap* const fim, ShaderVariant* const variant) {
+    char path[FILENAME_MAX];
+    tuningFile(path,sizeof(path));
+    if (path[0] == '\0') return 1;
+
+    TuneEntry* const entries = (TuneEntry*)malloc(sizeof(TuneEntry)*AUTOTUNE_MAX_ENTRIES);
+    if (entries == NULL) return 1;
+
+    TuneSearch limits;
+    queryShapeLimits(&limits);
+
+    const unsigned long long key = driverKey();
+    const int n = readTuning(path,entries,AUTOTUNE_MAX_ENTRIES);
+    int i, failed = 1;
+    for (i=0; i<n && failed; ++i) {
+        if (!sameTuning(entries+i,key,fim)) continue;
+        ShaderVariant tuned = *variant;
+        tuned.localx = entries[i].localx;
+        tuned.localy = entries[i].localy;
+        tuned.pixels = entries[i].pixels;
+        tuned.chunk = entries[i].chunk;
+        if (!shapeUsable(&limits,&tuned)) {
+            record(1,"Ignoring tuned launch shape %dx%d, %d sources per chunk in %s; "
+                     "the work group isn't a power of two or doesn't fit this device\n",
+                   tuned.localx,tuned.localy,tuned.chunk,path);
+            break;
+        }
+        *variant = tuned;
+        failed = 0;
+    }
+    free(entries);
+
+    if (!failed) {
+        record(0,"Using tuned launch shape %dx%d, %d samples per invocation, %d sources per chunk\n",
+               variant->localx,variant->localy,variant->pixels,variant->chunk);
+    }
+    return failed;
+}
+
+static void saveTuning(const FieldInfoMap* const fim, const ShaderVariant* const variant, double ms) {
+    char path[FILENAME_MAX];
+    tuningFile(path,sizeof(path));
+    if (path[0] == '\0') return;
+
+    TuneEntry* const entries = (TuneEntry*)malloc(sizeof(TuneEntry)*AUTOTUNE_MAX_ENTRIES);
+    if (entries == NULL) return;
+
+    const unsigned long long key = driverKey();
+    int n = readTuning(path,entries,AUTOTUNE_MAX_ENTRIES);
+    int i;
+    for (i=0; i<n && !sameTuning(entries+i,key,fim); ++i);
+    // A full file forgets its oldest entry
+    if (i == AUTOTUNE_MAX_ENTRIES) {
+        memmove(entries,entries+1,sizeof(TuneEntry)*(n-1));
+        i = --n;
+    }
+    if (i == n) ++n;
+    entries[i].key = key;
+    entries[i].width = fim->fieldsize[0];
+    entries[i].height = fim->fieldsize[1];
+    entries[i].localx = variant->localx;
+    entries[i].localy = variant->localy;
+    entries[i].pixels = variant->pixels;
+    entries[i].chunk = variant->chunk;
+    entries[i].ms = ms;
+
+    // Same temporary-and-rename as the program binaries next to it
+    char tmp[FILENAME_MAX];
+    snprintf(tmp,sizeof(tmp),"%s.%d",path,(int)getpid());
+    FILE* fp = fopen(tmp,"w");
+    int failed = fp == NULL;
+    for (i=0; i<n && !failed; ++i) {
+        failed = fprintf(fp,"%016llx %u %u %d %d %d %d %.4f\n",entries[i].key,
+                         entries[i].width,entries[i].height,entries[i].localx,
+                         entries[i].localy,entries[i].pixels,entries[i].chunk,entries[i].ms) < 0;
+    }
+    if (fp != NULL) failed = fclose(fp) != 0 || failed;
+    if (!failed) failed = rename(tmp,path) != 0;
+    if (failed) {
+        record(1,"Could not write tuning file %s\n",path);
+        remove(tmp);
+    } else {
+        record(1,"Saved launch shape to %s\n",path);
+    }
+    free(entries);
+}
+
+static void tryShape(TuneSearch* const search, const ShaderVariant* const v) {
+    if (!shapeFits(search,v)) return;
+
+    const double t = search->bench(search->arg,v);
+    if (t < 0) {
+        record(1,"  %4dx%-4d %2d   %5d        failed\n",v->localx,v->localy,v->pixels,v->chunk);
+        return;
+    }
+    record(1,"  %4dx%-4d %2d   %5d   %10.3f\n",v->localx,v->localy,v->pixels,v->chunk,t*1e3);
+
+    if (search->besttime < 0 || t < search->besttime) {
+        search->best = *v;
+        search->besttime = t;
+    }
+}
+
+int runAutotune(const FieldInfoMap* const fim, TuneBenchFunc bench, void* arg,
+                ShaderVariant* const variant)
+{
+    TuneSearch search;
+    search.bench = bench;
+    search.arg = arg;
+    queryShapeLimits(&search);
+    search.best = *variant;
+    search.besttime = -1;
+
+    record(1,"Tuning compute.glsl for a %ux%u field, %d sources\n"
+             "  %d invocations, %dx%d per work group and %d bytes shared at most\n\n"
+             "  local     px  chunk     ms/field\n",
+           fim->fieldsize[0],fim->fieldsize[1],*(fim->psn),
+           search.maxinvocations,search.maxsize[0],search.maxsize[1],search.maxshared);
+
+    // The shape to beat; variant is where it starts
+    tryShape(&search,variant);
+    search.defaulttime = search.besttime;
+
+    // One parameter at a time, each stage starting from the best so far
+    ShaderVariant v;
+    size_t i;
+    for (i=0; i<sizeof(localSizes)/sizeof(localSizes[0]); ++i) {
+        v = search.best;
+        v.localx = localSizes[i][0];
+        v.localy = localSizes[i][1];
+        if (v.localx != variant->localx || v.localy != variant->localy) tryShape(&search,&v);
+    }
+    const ShaderVariant afterlocal = search.best;
+    for (i=0; i<sizeof(pixelCounts)/sizeof(pixelCounts[0]); ++i) {
+        v = afterlocal;
+        v.pixels = pixelCounts[i];
+        if (v.pixels != afterlocal.pixels) tryShape(&search,&v);
+    }
+    const ShaderVariant afterpixels = search.best;
+    for (i=0; i<sizeof(chunkSizes)/sizeof(chunkSizes[0]); ++i) {
+        v = afterpixels;
+        v.chunk = chunkSizes[i];
+        if (v.chunk != afterpixels.chunk) tryShape(&search,&v);
+    }
+
+    if (search.besttime < 0) {
+        record(1,"\nNo launch shape could be timed\n");
+        return 1;
+    }
+
+    record(1,"\nFastest: %dx%d, %d samples per invocation, %d sources per chunk; "
+             "%.3f ms per field",
+           search.best.localx,search.best.localy,search.best.pixels,search.best.chunk,
+           search.besttime*1e3);
+    if (search.defaulttime > 0) {
+        record(1,", %.2fx the starting shape\n",search.defaulttime/search.besttime);
+    } else {
+        record(1,"\n");
+    }
+
+    *variant = search.best;
+    saveTuning(fim,variant,search.besttime*1e3);
+    return 0;
+}
@@ -0,0 +1,25 @@
+// Launch shape tuning for compute.glsl. -autotune times full evaluations of
+// the loaded scenario over the work group sizes, pixels per invocation and
+// source chunk sizes the device can run, one at a time starting from the
+// default shape, and records the fastest in AUTOTUNE_FILE in the shader cache
+// directory (shader-cache.h): one line per driver and field size, as
+//   <driver key> <width> <height> <localx> <localy> <pixels> <chunk> <ms>
+// Later launches with the same driver and field size start from that shape.
+#define AUTOTUNE_FILE "autotune.txt"
+#define AUTOTUNE_MAX_ENTRIES 256
+// Each candidate runs until it has taken this many seconds or this many
+// evaluations, whichever comes first; the fastest run counts
+#define AUTOTUNE_MIN_TIME 0.5
+#define AUTOTUNE_MAX_REPEATS 10
+
+// Seconds one full evaluation of the field takes with variant, negative if
+// the variant couldn't be built
+typedef double (*TuneBenchFunc)(void* arg, const ShaderVariant* const variant);
+
+// Take the launch shape tuned for this driver and fim's field size into
+// variant, keeping what it's specialised to; returns 0 if there is one
+int loadTuning(const FieldInfoMap* const fim, ShaderVariant* const variant);
+// Search from variant's launch shape and leave the fastest found in it, saved
+// for later launches; returns nonzero if nothing could be timed
+int runAutotune(const FieldInfoMap* const fim, TuneBenchFunc bench, void* arg,
+                ShaderVariant* const variant);
@@ -0,0 +1,752 @@
+// Benchmarks for the CPU side of the toolkit: parsing, the field kernels, the
+// min/max reduction and a whole load-evaluate-write run, over generated
+// scenarios, written as JSON so runs can be compared for regressions and
+// across machines. Scenarios come from a seeded generator, so every run of the
+// same settings times the same work.
+//
+// A separate program from the viewer; it needs no GL context. Build it from
+// bench.c, common.c, fim.c, fi-parser.c, scenario.c, field-file.c,
+// cpu-field.c and reflect.c with -lm -lpthread.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+#include <GL/gl.h>
+
+#include "common.h"
+#include "fim.h"
+#include "fi-parser.h"
+#include "scenario.h"
+#include "field-file.h"
+#include "cpu-field.h"
+
+#define BENCH_VERSION 1
+#define BENCH_DEFAULT_OUTPUT "bench.json"
+#define BENCH_DEFAULT_SEED 1
+#define BENCH_DEFAULT_MIN_TIME 0.2
+// pixels*sources at most per field, so the big corners of the grid don't run
+// for minutes; -max-work raises it
+#define BENCH_DEFAULT_MAX_WORK 2147483648.0
+#define BENCH_QUICK_MAX_WORK 67108864.0
+#define BENCH_MIN_REPS 3
+#define BENCH_MAX_REPS 1000
+#define BENCH_KERNEL_POINTS 4096
+// The field every thread count is timed on
+#define BENCH_SCALING_SIZE 1024
+#define BENCH_SCALING_SOURCES 256
+#define BENCH_SPEED_OF_SOUND 343.0f
+
+#define BENCH_SUITE_PARSE 1
+#define BENCH_SUITE_KERNEL 2
+#define BENCH_SUITE_FIELD 4
+#define BENCH_SUITE_REDUCE 8
+#define BENCH_SUITE_THREADS 16
+#define BENCH_SUITE_END_TO_END 32
+#define BENCH_SUITE_ALL 63
+
+static const int sourceCounts[] = { 1, 4, 16, 64, 256, 1024, 4096 };
+static const GLuint fieldSizes[] = { 128, 256, 512, 1024, 2048, 4096, 8192 };
+// Sources split across this many sets of array blocks; 0 is one PointSource
+// block per source
+static const int blockGroups[] = { 1, 16, 256, 0 };
+static const char* const kernelNames[] = { "scalar", "avx2", "avx512" };
+static const struct { const char* name; int bit; } suiteNames[] = {
+    { "parse", BENCH_SUITE_PARSE }, { "kernel", BENCH_SUITE_KERNEL },
+    { "field", BENCH_SUITE_FIELD }, { "reduce", BENCH_SUITE_REDUCE },
+    { "threads", BENCH_SUITE_THREADS }, { "end-to-end", BENCH_SUITE_END_TO_END }
+};
+
+typedef struct {
+    unsigned int seed;
+    double mintime;
+    double maxwork;
+    unsigned int threads;
+    int quick;
+    int suites;
+    const char* tmpdir;
+} BenchSettings;
+
+typedef struct {
+    int reps;
+    double best;
+    double mean;
+} BenchTiming;
+
+// One JSON array of objects at a time
+typedef struct {
+    FILE* fp;
+    int first;
+} BenchOutput;
+
+typedef int (*BenchRun)(void* arg);
+
+/* ----
+ *  Timing and output
+ ---- */
+
+/*
+ * One run to warm caches and fault pages in, then runs until mintime has
+ * passed and there have been BENCH_MIN_REPS. A first run that already took
+ * mintime is the only sample, so the largest cases cost one run, not four.
+ */
+static int timeBench(const BenchSettings* const settings, BenchRun run, void* arg,
+                     BenchTiming* const timing)
+{
+    double start = wallClock();
+    if (run(arg)) return 1;
+    double t = wallClock()-start;
+
+    timing->reps = 1;
+    timing->best = t;
+    timing->mean = t;
+    if (t >= settings->mintime) return 0;
+
+    double total = 0;
+    timing->reps = 0;
+    while (timing->reps < BENCH_MAX_REPS &&
+           (timing->reps < BENCH_MIN_REPS || total < settings->mintime)) {
+        start = wallClock();
+        if (run(arg)) return 1;
+        t = wallClock()-start;
+        if (timing->reps == 0 || t < timing->best) timing->best = t;
+        total += t;
+        ++timing->reps;
+    }
+    timing->mean = total/timing->reps;
+    return 0;
+}
+
+static void beginArray(BenchOutput* const out, const char* const name) {
+    fprintf(out->fp,",\n  \"%s\": [",name);
+    out->first = 1;
+}
+
+static void endArray(BenchOutput* const out) {
+    fprintf(out->fp,out->first ? "]" : "\n  ]");
+}
+
+static void beginEntry(BenchOutput* const out) {
+    fprintf(out->fp,out->first ? "\n    { " : ",\n    { ");
+    out->first = 0;
+}
+
+static void writeTiming(BenchOutput* const out, const BenchTiming* const timing) {
+    fprintf(out->fp,"\"reps\": %d, \"best_ms\": %.4f, \"mean_ms\": %.4f",
+            timing->reps,timing->best*1e3,timing->mean*1e3);
+}
+
+/* ----
+ *  Scenarios
+ ---- */
+
+static GLfloat nextRandom(unsigned int* const state) {
+    // xorshift32; the same sequence on every machine
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return (GLfloat)(x >> 8)/16777216.0f;
+}
+
+/*
+ * .fi text for numsources sources scattered over a width x height field one
+ * unit wide, the source arrays split into groups sets of blocks (0 for one
+ * PointSource block each). Sets *numblocks to the number of blocks.
+ */
+static char* generateScenario(const BenchSettings* const settings, int numsources, int groups,
+                              GLuint width, GLuint height, size_t* const size,
+                              int* const numblocks)
+{
+    char* text = NULL;
+    FILE* fp = open_memstream(&text,size);
+    if (fp == NULL) return NULL;
+
+    unsigned int state = settings->seed*2654435761u+(unsigned int)numsources;
+    if (state == 0) state = 1;
+    const GLfloat aspect = (GLfloat)height/(GLfloat)width;
+    GLfloat* const values = (GLfloat*)malloc(sizeof(GLfloat)*4*numsources);
+    if (values == NULL) {
+        fclose(fp);
+        free(text);
+        return NULL;
+    }
+    int i, g;
+    for (i=0; i<numsources; ++i) {
+        values[4*i] = nextRandom(&state);
+        values[4*i+1] = nextRandom(&state)*aspect;
+        values[4*i+2] = 1000.0f+19000.0f*nextRandom(&state);
+        values[4*i+3] = 6.2831853f*nextRandom(&state);
+    }
+
+    fprintf(fp,"[ Material-C %.1f ]\n[ PointSource-Number %d ]\n",BENCH_SPEED_OF_SOUND,numsources);
+    *numblocks = 5;
+    if (groups == 0) {
+        for (i=0; i<numsources; ++i) {
+            fprintf(fp,"[ PointSource (%.6f, %.6f) %.3f %.6f ]\n",
+                    values[4*i],values[4*i+1],values[4*i+2],values[4*i+3]);
+        }
+        *numblocks += numsources;
+    } else {
+        for (g=0; g<groups; ++g) {
+            const int first = (int)((long)numsources*g/groups);
+            const int last = (int)((long)numsources*(g+1)/groups);
+            fprintf(fp,"[ PointSource-Location");
+            for (i=first; i<last; ++i) fprintf(fp," (%.6f, %.6f)",values[4*i],values[4*i+1]);
+            fprintf(fp," ]\n[ PointSource-Frequency");
+            for (i=first; i<last; ++i) fprintf(fp,i > first ? ", %.3f" : " %.3f",values[4*i+2]);
+            fprintf(fp," ]\n[ PointSource-Phase");
+            for (i=first; i<last; ++i) fprintf(fp,i > first ? ", %.6f" : " %.6f",values[4*i+3]);
+            fprintf(fp," ]\n");
+        }
+        *numblocks += 3*groups;
+    }
+    fprintf(fp,"[ Field-Offset (0.0, 0.0) ]\n[ Field-Dimensions (1.0, %.6f) ]\n"
+               "[ Field-Size (%u, %u) ]\n",aspect,width,height);
+
+    free(values);
+    if (fclose(fp) != 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+// A host-side FieldInfoMap and FieldDataMap loaded from generated text
+static int loadScenario(const char* const text, size_t size,
+                        FieldInfoMap* const fim, FieldDataMap* const fdm)
+{
+    if (initFieldInfoMapHost(fim)) return 1;
+    if (initFieldDataMapHost(fdm)) {
+        freeFieldInfoMap(fim);
+        return 1;
+    }
+    if (parseFieldInfo(text,size,fim,fdm)) {
+        record(1,"Generated scenario failed to parse\n");
+        free(fdm->block_start);
+        freeFieldInfoMap(fim);
+        return 1;
+    }
+    return 0;
+}
+
+static void freeScenario(FieldInfoMap* const fim, FieldDataMap* const fdm) {
+    free(fdm->block_start);
+    freeFieldInfoMap(fim);
+}
+
+/* ----
+ *  Parsing
+ ---- */
+
+typedef struct {
+    const char* text;
+    size_t size;
+    FieldInfoMap fim;
+    FieldDataMap fdm;
+} ParseBench;
+
+static int runParse(void* arg) {
+    ParseBench* const b = (ParseBench*)arg;
+    return parseFieldInfo(b->text,b->size,&b->fim,&b->fdm);
+}
+
+static int benchParse(const BenchSettings* const settings, BenchOutput* const out) {
+    beginArray(out,"parse");
+
+    size_t s, g;
+    for (s=0; s<sizeof(sourceCounts)/sizeof(sourceCounts[0]); ++s) {
+        const int n = sourceCounts[s];
+        if (settings->quick && n > 1024) continue;
+        for (g=0; g<sizeof(blockGroups)/sizeof(blockGroups[0]); ++g) {
+            const int groups = blockGroups[g];
+            // Groups beyond one per source are the per-source case again
+            if (groups > n) continue;
+
+            ParseBench b;
+            int numblocks;
+            char* const text = generateScenario(settings,n,groups,256,256,&b.size,&numblocks);
+            if (text == NULL || loadScenario(text,b.size,&b.fim,&b.fdm)) {
+                record(1,"Failed to set up parse benchmark\n");
+                free(text);
+                return 1;
+            }
+            b.text = text;
+
+            BenchTiming timing;
+            const int failed = timeBench(settings,runParse,&b,&timing);
+            freeScenario(&b.fim,&b.fdm);
+            free(text);
+            if (failed) return 1;
+
+            beginEntry(out);
+            fprintf(out->fp,"\"sources\": %d, \"blocks\": %d, \"bytes\": %zu, ",n,numblocks,b.size);
+            writeTiming(out,&timing);
+            fprintf(out->fp,", \"mb_per_s\": %.2f, \"blocks_per_s\": %.0f }",
+                    b.size/timing.best/1e6,numblocks/timing.best);
+            record(0,"parse: %d sources in %d blocks, %.3f ms\n",n,numblocks,timing.best*1e3);
+        }
+    }
+
+    endArray(out);
+    return 0;
+}
+
+/* ----
+ *  Kernels, one thread, no tiling
+ ---- */
+
+typedef struct {
+    const CpuFieldEngine* engine;
+    int n;
+    const GLfloat* sources;
+    const GLfloat* px;
+    const GLfloat* py;
+    GLfloat* out;
+} KernelBench;
+
+static int runKernel(void* arg) {
+    KernelBench* const b = (KernelBench*)arg;
+    const int n = b->n;
+    sumSourcesCpu(b->engine,n,b->sources,b->sources+n,b->sources+2*n,b->sources+3*n,NULL,
+                  BENCH_KERNEL_POINTS,b->px,b->py,b->out);
+    return 0;
+}
+
+static int benchKernels(const BenchSettings* const settings, BenchOutput* const out) {
+    const int maxn = sourceCounts[sizeof(sourceCounts)/sizeof(sourceCounts[0])-1];
+    CpuFieldEngine* const engine = createCpuFieldEngine(1);
+    GLfloat* const sources = (GLfloat*)malloc(sizeof(GLfloat)*4*maxn);
+    GLfloat* const points = (GLfloat*)malloc(sizeof(GLfloat)*4*(BENCH_KERNEL_POINTS+CPU_POINT_PADDING));
+    if (engine == NULL || sources == NULL || points == NULL) {
+        record(1,"Failed to set up kernel benchmark\n");
+        destroyCpuFieldEngine(engine);
+        free(sources);
+        free(points);
+        return 1;
+    }
+
+    KernelBench b;
+    b.engine = engine;
+    b.px = points;
+    b.py = points+BENCH_KERNEL_POINTS+CPU_POINT_PADDING;
+    b.out = points+2*(BENCH_KERNEL_POINTS+CPU_POINT_PADDING);
+    int i;
+    // One row across a unit field
+    for (i=0; i<BENCH_KERNEL_POINTS+CPU_POINT_PADDING; ++i) {
+        points[i] = (GLfloat)i/BENCH_KERNEL_POINTS;
+        points[BENCH_KERNEL_POINTS+CPU_POINT_PADDING+i] = 0.5f;
+    }
+
+    beginArray(out,"kernel");
+    int failed = 0;
+    size_t k, s;
+    for (k=0; k<sizeof(kernelNames)/sizeof(kernelNames[0]) && !failed; ++k) {
+        if (setCpuFieldKernel(engine,kernelNames[k])) continue;
+        for (s=0; s<sizeof(sourceCounts)/sizeof(sourceCounts[0]) && !failed; ++s) {
+            const int n = sourceCounts[s];
+            unsigned int state = settings->seed+(unsigned int)n;
+            for (i=0; i<n; ++i) {
+                sources[i] = nextRandom(&state);
+                sources[n+i] = nextRandom(&state);
+                sources[2*n+i] = (1000.0f+19000.0f*nextRandom(&state))*6.2831853f/BENCH_SPEED_OF_SOUND;
+                sources[3*n+i] = 6.2831853f*nextRandom(&state);
+            }
+            b.n = n;
+            b.sources = sources;
+
+            BenchTiming timing;
+            failed = timeBench(settings,runKernel,&b,&timing);
+            if (failed) break;
+
+            const double terms = (double)BENCH_KERNEL_POINTS*n;
+            beginEntry(out);
+            fprintf(out->fp,"\"kernel\": \"%s\", \"sources\": %d, \"points\": %d, ",
+                    kernelNames[k],n,BENCH_KERNEL_POINTS);
+            writeTiming(out,&timing);
+            fprintf(out->fp,", \"terms_per_s\": %.4g }",terms/timing.best);
+            record(0,"kernel %s: %d sources, %.3g terms/s\n",kernelNames[k],n,terms/timing.best);
+        }
+    }
+    endArray(out);
+
+    destroyCpuFieldEngine(engine);
+    free(sources);
+    free(points);
+    return failed;
+}
+
+/* ----
+ *  Whole fields and their reduction
+ ---- */
+
+typedef struct {
+    CpuFieldEngine* engine;
+    FieldInfoMap fim;
+    FieldDataMap fdm;
+    GLfloat* field;
+} FieldBench;
+
+static int runField(void* arg) {
+    FieldBench* const b = (FieldBench*)arg;
+    return computeFieldCpu(b->engine,&b->fim,&b->fdm,b->field);
+}
+
+static int runReduce(void* arg) {
+    FieldBench* const b = (FieldBench*)arg;
+    return reduceFieldCpu(b->engine,&b->fim,&b->fdm,b->field);
+}
+
+static int setupField(const BenchSettings* const settings, CpuFieldEngine* const engine,
+                      int numsources, GLuint size, FieldBench* const b)
+{
+    size_t textsize;
+    int numblocks;
+    char* const text = generateScenario(settings,numsources,1,size,size,&textsize,&numblocks);
+    if (text == NULL || loadScenario(text,textsize,&b->fim,&b->fdm)) {
+        free(text);
+        return 1;
+    }
+    free(text);
+
+    b->engine = engine;
+    b->field = (GLfloat*)malloc(sizeof(GLfloat)*2*(size_t)size*size);
+    if (b->field == NULL) {
+        freeScenario(&b->fim,&b->fdm);
+        return 1;
+    }
+    return 0;
+}
+
+static void freeField(FieldBench* const b) {
+    free(b->field);
+    freeScenario(&b->fim,&b->fdm);
+}
+
+static int benchFields(const BenchSettings* const settings, CpuFieldEngine* const engine,
+                       BenchOutput* const out)
+{
+    beginArray(out,"field");
+
+    size_t z, s;
+    for (z=0; z<sizeof(fieldSizes)/sizeof(fieldSizes[0]); ++z) {
+        const GLuint size = fieldSizes[z];
+        for (s=0; s<sizeof(sourceCounts)/sizeof(sourceCounts[0]); ++s) {
+            const int n = sourceCounts[s];
+            const double terms = (double)size*size*n;
+            if (terms > settings->maxwork) continue;
+
+            FieldBench b;
+            if (setupField(settings,engine,n,size,&b)) {
+                record(1,"Skipping %ux%u field of %d sources: out of memory\n",size,size,n);
+                continue;
+            }
+            BenchTiming timing;
+            const int failed = timeBench(settings,runField,&b,&timing);
+            freeField(&b);
+            if (failed) return 1;
+
+            beginEntry(out);
+            fprintf(out->fp,"\"width\": %u, \"height\": %u, \"sources\": %d, ",size,size,n);
+            writeTiming(out,&timing);
+            fprintf(out->fp,", \"terms_per_s\": %.4g, \"pixels_per_s\": %.4g }",
+                    terms/timing.best,(double)size*size/timing.best);
+            record(0,"field %ux%u, %d sources: %.3f ms, %.3g terms/s\n",
+                   size,size,n,timing.best*1e3,terms/timing.best);
+        }
+    }
+
+    endArray(out);
+    return 0;
+}
+
+static int benchReduce(const BenchSettings* const settings, CpuFieldEngine* const engine,
+                       BenchOutput* const out)
+{
+    beginArray(out,"reduce");
+
+    size_t z;
+    for (z=0; z<sizeof(fieldSizes)/sizeof(fieldSizes[0]); ++z) {
+        const GLuint size = fieldSizes[z];
+        if (settings->quick && size > 2048) continue;
+
+        // Reduced over a real field rather than zeros, evaluated once
+        FieldBench b;
+        if (setupField(settings,engine,1,size,&b)) {
+            record(1,"Skipping %ux%u reduction: out of memory\n",size,size);
+            continue;
+        }
+        BenchTiming timing;
+        int failed = runField(&b);
+        if (!failed) failed = timeBench(settings,runReduce,&b,&timing);
+        freeField(&b);
+        if (failed) return 1;
+
+        const double pixels = (double)size*size;
+        beginEntry(out);
+        fprintf(out->fp,"\"width\": %u, \"height\": %u, ",size,size);
+        writeTiming(out,&timing);
+        fprintf(out->fp,", \"pixels_per_s\": %.4g, \"gb_per_s\": %.3f }",
+                pixels/timing.best,pixels*2*sizeof(GLfloat)/timing.best/1e9);
+        record(0,"reduce %ux%u: %.3f ms\n",size,size,timing.best*1e3);
+    }
+
+    endArray(out);
+    return 0;
+}
+
+// The same field on 1, 2, 4, ... threads up to the machine's
+static int benchThreads(const BenchSettings* const settings, BenchOutput* const out) {
+    beginArray(out,"threads");
+
+    double single = 0;
+    unsigned int threads = 1;
+    int last = 0;
+    while (!last) {
+        if (threads >= settings->threads) {
+            threads = settings->threads;
+            last = 1;
+        }
+        CpuFieldEngine* const engine = createCpuFieldEngine(threads);
+        FieldBench b;
+        if (engine == NULL || setupField(settings,engine,BENCH_SCALING_SOURCES,BENCH_SCALING_SIZE,&b)) {
+            record(1,"Failed to set up thread scaling benchmark\n");
+            destroyCpuFieldEngine(engine);
+            return 1;
+        }
+        BenchTiming timing;
+        const int failed = timeBench(settings,runField,&b,&timing);
+        freeField(&b);
+        // Fewer threads than asked for if some didn't start
+        threads = cpuFieldThreads(engine);
+        destroyCpuFieldEngine(engine);
+        if (failed) return 1;
+
+        if (single == 0) single = timing.best;
+        beginEntry(out);
+        fprintf(out->fp,"\"threads\": %u, \"width\": %u, \"height\": %u, \"sources\": %d, ",
+                threads,BENCH_SCALING_SIZE,BENCH_SCALING_SIZE,BENCH_SCALING_SOURCES);
+        writeTiming(out,&timing);
+        fprintf(out->fp,", \"speedup\": %.3f, \"efficiency\": %.3f }",
+                single/timing.best,single/timing.best/threads);
+        record(0,"threads %u: %.3f ms, %.2fx\n",threads,timing.best*1e3,single/timing.best);
+        threads *= 2;
+    }
+
+    endArray(out);
+    return 0;
+}
+
+/* ----
+ *  Load, evaluate and write, as -headless does
+ ---- */
+
+typedef struct {
+    CpuFieldEngine* engine;
+    const char* infile;
+    const char* outfile;
+} EndToEndBench;
+
+static int runEndToEnd(void* arg) {
+    EndToEndBench* const b = (EndToEndBench*)arg;
+    FieldInfoMap fim;
+    FieldDataMap fdm;
+    if (initFieldInfoMapHost(&fim)) return 1;
+    if (initFieldDataMapHost(&fdm)) {
+        freeFieldInfoMap(&fim);
+        return 1;
+    }
+
+    int failed = loadFieldInfoFile(b->infile,&fim,&fdm);
+    GLfloat* field = NULL;
+    if (!failed) {
+        field = (GLfloat*)malloc(sizeof(GLfloat)*2*(size_t)fim.fieldsize[0]*fim.fieldsize[1]);
+        failed = field == NULL;
+    }
+    if (!failed) failed = computeFieldCpu(b->engine,&fim,&fdm,field);
+    if (!failed) failed = writeFieldFile(b->outfile,&fim,&fdm,field);
+
+    free(field);
+    freeScenario(&fim,&fdm);
+    return failed;
+}
+
+static int benchEndToEnd(const BenchSettings* const settings, CpuFieldEngine* const engine,
+                         BenchOutput* const out)
+{
+    static const struct { GLuint size; int sources; } cases[] = {
+        { 256, 16 }, { 512, 64 }, { 1024, 256 }, { 2048, 1024 }
+    };
+
+    char infile[FILENAME_MAX], outfile[FILENAME_MAX];
+    snprintf(infile,sizeof(infile),"%s/acoustics-bench-%d.fi",settings->tmpdir,(int)getpid());
+    snprintf(outfile,sizeof(outfile),"%s/acoustics-bench-%d.bin",settings->tmpdir,(int)getpid());
+
+    beginArray(out,"end_to_end");
+    int failed = 0;
+    size_t c;
+    for (c=0; c<sizeof(cases)/sizeof(cases[0]) && !failed; ++c) {
+        const GLuint size = cases[c].size;
+        const int n = cases[c].sources;
+        if ((double)size*size*n > settings->maxwork) continue;
+
+        size_t textsize;
+        int numblocks;
+        char* const text = generateScenario(settings,n,1,size,size,&textsize,&numblocks);
+        FILE* fp = text != NULL ? fopen(infile,"w") : NULL;
+        failed = fp == NULL || fwrite(text,1,textsize,fp) != textsize;
+        if (fp != NULL && fclose(fp) != 0) failed = 1;
+        free(text);
+        if (failed) {
+            record(1,"Failed to write scenario to %s\n",infile);
+            break;
+        }
+
+        EndToEndBench b;
+        b.engine = engine;
+        b.infile = infile;
+        b.outfile = outfile;
+        BenchTiming timing;
+        failed = timeBench(settings,runEndToEnd,&b,&timing);
+        if (failed) break;
+
+        beginEntry(out);
+        fprintf(out->fp,"\"width\": %u, \"height\": %u, \"sources\": %d, \"input_bytes\": %zu, ",
+                size,size,n,textsize);
+        writeTiming(out,&timing);
+        fprintf(out->fp,", \"terms_per_s\": %.4g }",(double)size*size*n/timing.best);
+        record(0,"end to end %ux%u, %d sources: %.3f ms\n",size,size,n,timing.best*1e3);
+    }
+    endArray(out);
+
+    remove(infile);
+    remove(outfile);
+    return failed;
+}
+
+/* ----
+ *  Driver
+ ---- */
+
+static int parseSuites(const char* const list) {
+    int suites = 0;
+    const char* p = list;
+    while (*p != '\0') {
+        const size_t length = strcspn(p,",");
+        size_t i;
+        for (i=0; i<sizeof(suiteNames)/sizeof(suiteNames[0]); ++i) {
+            if (strlen(suiteNames[i].name) == length && strncmp(p,suiteNames[i].name,length) == 0)
+                break;
+        }
+        if (i == sizeof(suiteNames)/sizeof(suiteNames[0])) {
+            record(1,"Unknown benchmark suite \"%.*s\"\n",(int)length,p);
+            return 0;
+        }
+        suites |= suiteNames[i].bit;
+        p += length;
+        if (*p == ',') ++p;
+    }
+    return suites;
+}
+
+static void writeHeader(FILE* const fp, const BenchSettings* const settings,
+                        const CpuFieldEngine* const engine)
+{
+    struct utsname host;
+    if (uname(&host) != 0) memset(&host,0,sizeof(host));
+
+    fprintf(fp,"{\n  \"version\": %d,\n  \"machine\": { \"system\": \"%s\", \"release\": \"%s\", "
+               "\"arch\": \"%s\", \"threads\": %u, \"kernel\": \"%s\", \"kernels\": [",
+            BENCH_VERSION,host.sysname,host.release,host.machine,
+            cpuFieldThreads(engine),cpuFieldKernelName(engine));
+    // What setCpuFieldKernel accepts here, on a throwaway engine
+    CpuFieldEngine* const probe = createCpuFieldEngine(1);
+    size_t k;
+    int first = 1;
+    for (k=0; k<sizeof(kernelNames)/sizeof(kernelNames[0]) && probe != NULL; ++k) {
+        if (setCpuFieldKernel(probe,kernelNames[k])) continue;
+        fprintf(fp,first ? "\"%s\"" : ", \"%s\"",kernelNames[k]);
+        first = 0;
+    }
+    destroyCpuFieldEngine(probe);
+    fprintf(fp,"] },\n  \"settings\": { \"seed\": %u, \"min_time_s\": %g, \"max_work\": %.0f, "
+               "\"quick\": %d }",
+            settings->seed,settings->mintime,settings->maxwork,settings->quick);
+}
+
+int main(int argc, char** argv) {
+    BenchSettings settings;
+    settings.seed = BENCH_DEFAULT_SEED;
+    settings.mintime = BENCH_DEFAULT_MIN_TIME;
+    settings.maxwork = BENCH_DEFAULT_MAX_WORK;
+    settings.threads = 0;
+    settings.quick = 0;
+    settings.suites = BENCH_SUITE_ALL;
+    settings.tmpdir = getenv("TMPDIR") != NULL ? getenv("TMPDIR") : "/tmp";
+    const char* outfile = BENCH_DEFAULT_OUTPUT;
+    int maxworkset = 0;
+
+    int arg;
+    for (arg=1; arg<argc; ++arg) {
+        if (strcmp(argv[arg],"-v") == 0) {
+            setVerbose(1);
+        } else if (strcmp(argv[arg],"-o") == 0 && arg+1 < argc) {
+            outfile = argv[++arg];
+        } else if (strcmp(argv[arg],"-quick") == 0) {
+            settings.quick = 1;
+        } else if (strcmp(argv[arg],"-seed") == 0 && arg+1 < argc) {
+            settings.seed = (unsigned int)strtoul(argv[++arg],NULL,10);
+        } else if (strcmp(argv[arg],"-threads") == 0 && arg+1 < argc) {
+            settings.threads = (unsigned int)strtoul(argv[++arg],NULL,10);
+        } else if (strcmp(argv[arg],"-min-time") == 0 && arg+1 < argc) {
+            settings.mintime = strtod(argv[++arg],NULL);
+        } else if (strcmp(argv[arg],"-max-work") == 0 && arg+1 < argc) {
+            settings.maxwork = strtod(argv[++arg],NULL);
+            maxworkset = 1;
+        } else if (strcmp(argv[arg],"-suite") == 0 && arg+1 < argc) {
+            settings.suites = parseSuites(argv[++arg]);
+            if (settings.suites == 0) return 1;
+        } else {
+            record(1,"Ignoring unrecognised argument \"%s\"\n",argv[arg]);
+        }
+    }
+    if (settings.quick && !maxworkset) settings.maxwork = BENCH_QUICK_MAX_WORK;
+
+    CpuFieldEngine* const engine = createCpuFieldEngine(settings.threads);
+    if (engine == NULL) {
+        record(1,"Failed to create CPU field engine\n");
+        return 1;
+    }
+    settings.threads = cpuFieldThreads(engine);
+
+    FILE* fp = fopen(outfile,"w");
+    if (fp == NULL) {
+        record(1,"Failed to open output file %s\n",outfile);
+        destroyCpuFieldEngine(engine);
+        return 1;
+    }
+
+    BenchOutput out;
+    out.fp = fp;
+    writeHeader(fp,&settings,engine);
+
+    const double start = wallClock();
+    int failed = 0;
+    if (!failed && (settings.suites & BENCH_SUITE_PARSE)) failed = benchParse(&settings,&out);
+    if (!failed && (settings.suites & BENCH_SUITE_KERNEL)) failed = benchKernels(&settings,&out);
+    if (!failed && (settings.suites & BENCH_SUITE_FIELD)) failed = benchFields(&settings,engine,&out);
+    if (!failed && (settings.suites & BENCH_SUITE_REDUCE)) failed = benchReduce(&settings,engine,&out);
+    if (!failed && (settings.suites & BENCH_SUITE_THREADS)) failed = benchThreads(&settings,&out);
+    if (!failed && (settings.suites & BENCH_SUITE_END_TO_END))
+        failed = benchEndToEnd(&settings,engine,&out);
+    fprintf(fp,",\n  \"total_s\": %.3f\n}\n",wallClock()-start);
+
+    if (fclose(fp) != 0) failed = 1;
+    if (failed) record(1,"Benchmark failed; %s is incomplete\n",outfile);
+    else record(1,"Wrote benchmarks to %s in %.1fs\n",outfile,wallClock()-start);
+
+    destroyCpuFieldEngine(engine);
+    return failed;
+}
@@ -0,0 +1,461 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <GL/gl.h>
+
+#include "common.h"
+#include "fim.h"
+#include "cpu-field.h"
+#include "field-file.h"
+#include "broadband.h"
+
+#define BROADBAND_SEGMENT 64
+// Relative to the highest frequency; bins closer to even spacing than this
+// use the recurrence
+#define BROADBAND_UNIFORM_TOLERANCE 1e-6
+
+typedef struct {
+    GLfloat x;
+    GLfloat y;
+    GLfloat freq;
+    GLfloat phase;
+} BroadbandSource;
+
+// Sum of e^(i*phase) over the sources of one emitter in one bin
+typedef struct {
+    int bin;
+    GLfloat re;
+    GLfloat im;
+} BroadbandTerm;
+
+typedef struct {
+    int numbins;
+    GLfloat* freq;
+    GLfloat* k;
+    int uniform;
+    GLfloat dk;
+
+    int numemitters;
+    GLfloat* x;
+    GLfloat* y;
+    int* first; // terms of emitter e are [first[e],first[e+1]), ascending bin
+    BroadbandTerm* terms;
+} BroadbandSet;
+
+typedef struct {
+    GLfloat min;
+    GLfloat max;
+    double sum;
+    double sumsq;
+} BroadbandStats;
+
+typedef struct {
+    const BroadbandSet* set;
+    GLuint width;
+    GLuint height;
+    GLuint y0;
+    GLuint rows;
+    int segsx;
+    const GLfloat* xs;
+    GLfloat yoffset;
+    GLfloat ydims;
+    GLfloat* layers;       // numbins bands of rows*width (re,im)
+    int steps;
+    const GLfloat* weights; // steps*numbins (re,im) per layer and snapshot
+    GLfloat* pulses;        // steps bands of rows*width (re,im)
+    GLfloat* scratch;
+    BroadbandStats* stats;  // one per layer, then one per snapshot
+} BroadbandJob;
+
+int parsePulseSpec(const char* const spec, PulseSpec* const pulse) {
+    char tail;
+    if (sscanf(spec,"%f:%f:%d%c",&pulse->start,&pulse->stop,&pulse->steps,&tail) != 3 ||
+        pulse->steps < 1) {
+        record(1,"Invalid pulse %s, expected Start:Stop:Steps\n",spec);
+        return 1;
+    }
+    return 0;
+}
+
+static int compareFloat(const void* a, const void* b) {
+    const GLfloat fa = *(const GLfloat*)a, fb = *(const GLfloat*)b;
+    return fa < fb ? -1 : fa > fb;
+}
+
+static int compareSource(const void* a, const void* b) {
+    const BroadbandSource* const sa = (const BroadbandSource*)a;
+    const BroadbandSource* const sb = (const BroadbandSource*)b;
+    if (sa->x != sb->x) return sa->x < sb->x ? -1 : 1;
+    if (sa->y != sb->y) return sa->y < sb->y ? -1 : 1;
+    return compareFloat(&sa->freq,&sb->freq);
+}
+
+static void freeBroadbandSet(BroadbandSet* const set) {
+    free(set->freq);
+    free(set->k);
+    free(set->x);
+    free(set->y);
+    free(set->first);
+    free(set->terms);
+}
+
+static int buildBroadbandSet(BroadbandSet* const set, const FieldInfoMap* const fim) {
+    int n = *(fim->psn);
+    if (n > fim->ps_capacity) n = fim->ps_capacity;
+    memset(set,0,sizeof(BroadbandSet));
+
+    BroadbandSource* const src = (BroadbandSource*)malloc(sizeof(BroadbandSource)*n);
+    set->freq = (GLfloat*)malloc(sizeof(GLfloat)*n);
+    set->k = (GLfloat*)malloc(sizeof(GLfloat)*n);
+    set->x = (GLfloat*)malloc(sizeof(GLfloat)*n);
+    set->y = (GLfloat*)malloc(sizeof(GLfloat)*n);
+    set->first = (int*)malloc(sizeof(int)*(n+1));
+    set->terms = (BroadbandTerm*)malloc(sizeof(BroadbandTerm)*n);
+    if (src == NULL || set->freq == NULL || set->k == NULL || set->x == NULL ||
+        set->y == NULL || set->first == NULL || set->terms == NULL) {
+        record(1,"Failed to allocate broadband sources\n");
+        free(src);
+        freeBroadbandSet(set);
+        return 1;
+    }
+
+    int i,j;
+    for (i=0; i<n; ++i) {
+        src[i].x = fim->ps_loc[NUM_DIMS*i];
+        src[i].y = fim->ps_loc[NUM_DIMS*i+1];
+        src[i].freq = fim->ps_freq[i];
+        src[i].phase = fim->ps_phase[i];
+        set->freq[i] = fim->ps_freq[i];
+    }
+
+    qsort(set->freq,n,sizeof(GLfloat),compareFloat);
+    for (i=0; i<n; ++i) {
+        if (set->numbins == 0 || set->freq[i] != set->freq[set->numbins-1])
+            set->freq[set->numbins++] = set->freq[i];
+    }
+    const int last = set->numbins-1;
+    for (i=0; i<set->numbins; ++i)
+        set->k[i] = set->freq[i]*2.0f*(GLfloat)PI/(*(fim->mat_c));
+
+    set->uniform = set->numbins > 2;
+    const double df = last > 0 ? ((double)set->freq[last]-set->freq[0])/last : 0;
+    for (i=1; i<last && set->uniform; ++i) {
+        if (fabs(set->freq[0]+i*df-set->freq[i]) > BROADBAND_UNIFORM_TOLERANCE*set->freq[last])
+            set->uniform = 0;
+    }
+    set->dk = last > 0 ? (set->k[last]-set->k[0])/(GLfloat)last : 0;
+
+    qsort(src,n,sizeof(BroadbandSource),compareSource);
+    int numterms = 0;
+    for (i=0; i<n; ++i) {
+        if (i == 0 || src[i].x != src[i-1].x || src[i].y != src[i-1].y) {
+            set->x[set->numemitters] = src[i].x;
+            set->y[set->numemitters] = src[i].y;
+            set->first[set->numemitters++] = numterms;
+        }
+        const GLfloat* const bin = (const GLfloat*)bsearch(&src[i].freq,set->freq,set->numbins,
+                                                           sizeof(GLfloat),compareFloat);
+        j = bin-set->freq;
+        if (numterms == set->first[set->numemitters-1] || set->terms[numterms-1].bin != j) {
+            set->terms[numterms].bin = j;
+            set->terms[numterms].re = 0;
+            set->terms[numterms].im = 0;
+            ++numterms;
+        }
+        set->terms[numterms-1].re += cosf(src[i].phase);
+        set->terms[numterms-1].im += sinf(src[i].phase);
+    }
+    set->first[set->numemitters] = numterms;
+
+    free(src);
+    return 0;
+}
+
+static void accumulateStats(BroadbandStats* const stats, const GLfloat* const field,
+                            size_t pixels)
+{
+    GLfloat fmin = INFINITY, fmax = -INFINITY;
+    double sum = 0, sumsq = 0;
+    size_t i;
+    for (i=0; i<pixels; ++i) {
+        const GLfloat m = sqrtf(field[2*i]*field[2*i]+field[2*i+1]*field[2*i+1]);
+        if (!isfinite(m)) continue;
+        if (m < fmin) fmin = m;
+        if (m > fmax) fmax = m;
+        sum += m;
+        sumsq += (double)m*m;
+    }
+    if (fmin < stats->min) stats->min = fmin;
+    if (fmax > stats->max) stats->max = fmax;
+    stats->sum += sum;
+    stats->sumsq += sumsq;
+}
+
+static void bandTask(void* arg, int task, unsigned int thread) {
+    BroadbandJob* const job = (BroadbandJob*)arg;
+    const BroadbandSet* const set = job->set;
+
+    const GLuint row = task / job->segsx;
+    const GLuint x0 = (task % job->segsx)*BROADBAND_SEGMENT;
+    const int w = x0+BROADBAND_SEGMENT > job->width ? job->width-x0 : BROADBAND_SEGMENT;
+    const size_t bandsize = 2*(size_t)job->rows*job->width;
+    const size_t at = 2*((size_t)row*job->width+x0);
+
+    GLfloat* const r = job->scratch+thread*6*BROADBAND_SEGMENT;
+    GLfloat* const a = r+BROADBAND_SEGMENT;
+    GLfloat* const zre = a+BROADBAND_SEGMENT;
+    GLfloat* const zim = zre+BROADBAND_SEGMENT;
+    GLfloat* const wre = zim+BROADBAND_SEGMENT;
+    GLfloat* const wim = wre+BROADBAND_SEGMENT;
+
+    // Same expression as the compute shader so the sample points agree
+    const GLfloat py = job->yoffset+(GLfloat)(job->y0+row)/(GLfloat)job->height*job->ydims;
+
+    int i,e,t,l,j;
+    for (l=0; l<set->numbins; ++l)
+        memset(job->layers+l*bandsize+at,0,sizeof(GLfloat)*2*w);
+
+    for (e=0; e<set->numemitters; ++e) {
+        for (i=0; i<w; ++i) {
+            const GLfloat dx = job->xs[x0+i]-set->x[e];
+            const GLfloat dy = py-set->y[e];
+            r[i] = sqrtf(dx*dx+dy*dy);
+            a[i] = 1.0f/sqrtf(r[i]);
+        }
+
+        int prev = -2, steps = 0, havestep = 0;
+        for (t=set->first[e]; t<set->first[e+1]; ++t) {
+            const BroadbandTerm* const term = set->terms+t;
+            if (set->uniform && term->bin == prev+1 && steps < BROADBAND_RESEED-1) {
+                if (!havestep) {
+                    for (i=0; i<w; ++i) {
+                        wre[i] = cosf(set->dk*r[i]);
+                        wim[i] = sinf(set->dk*r[i]);
+                    }
+                    havestep = 1;
+                }
+                for (i=0; i<w; ++i) {
+                    const GLfloat re = zre[i]*wre[i]-zim[i]*wim[i];
+                    zim[i] = zre[i]*wim[i]+zim[i]*wre[i];
+                    zre[i] = re;
+                }
+                ++steps;
+            } else {
+                for (i=0; i<w; ++i) {
+                    zre[i] = cosf(set->k[term->bin]*r[i]);
+                    zim[i] = sinf(set->k[term->bin]*r[i]);
+                }
+                steps = 0;
+            }
+            prev = term->bin;
+
+            GLfloat* const out = job->layers+term->bin*bandsize+at;
+            for (i=0; i<w; ++i) {
+                const GLfloat cre = a[i]*zre[i], cim = a[i]*zim[i];
+                out[2*i] += term->re*cre-term->im*cim;
+                out[2*i+1] += term->re*cim+term->im*cre;
+            }
+        }
+    }
+
+    for (j=0; j<job->steps; ++j) {
+        GLfloat* const out = job->pulses+j*bandsize+at;
+        memset(out,0,sizeof(GLfloat)*2*w);
+        for (l=0; l<set->numbins; ++l) {
+            const GLfloat* const in = job->layers+l*bandsize+at;
+            const GLfloat pre = job->weights[2*(j*set->numbins+l)];
+            const GLfloat pim = job->weights[2*(j*set->numbins+l)+1];
+            for (i=0; i<w; ++i) {
+                out[2*i] += in[2*i]*pre-in[2*i+1]*pim;
+                out[2*i+1] += in[2*i]*pim+in[2*i+1]*pre;
+            }
+        }
+    }
+}
+
+// One task per layer or snapshot, so each record's sums run in a fixed order
+static void statsTask(void* arg, int task, unsigned int thread) {
+    BroadbandJob* const job = (BroadbandJob*)arg;
+    const size_t pixels = (size_t)job->rows*job->width;
+    const GLfloat* const field = task < job->set->numbins ?
+        job->layers+2*pixels*task : job->pulses+2*pixels*(task-job->set->numbins);
+    (void)thread;
+    accumulateStats(job->stats+task,field,pixels);
+}
+
+static int writeRecords(int fd, const FieldInfoMap* const fim, FieldDataMap* const fdm,
+                        const BroadbandStats* const stats, int numrecords)
+{
+    const double n = (double)fim->fieldsize[0]*fim->fieldsize[1];
+    const off_t recsize = sizeof(FieldFileHeader)+
+                          (off_t)fieldRowBytes(fieldFormat(),fim->fieldsize[0])*fim->fieldsize[1];
+    const GLint written = *(fdm->written);
+
+    int failed = 0, i;
+    for (i=0; i<numrecords && !failed; ++i) {
+        if (written != 2) {
+            *(fdm->written) = 1;
+            *(fdm->field_min) = stats[i].min;
+            *(fdm->field_max) = stats[i].max;
+        }
+        *(fdm->field_mean) = stats[i].sum/n;
+        *(fdm->field_rms) = sqrt(stats[i].sumsq/n);
+
+        FieldFileHeader header;
+        fillFieldFileHeader(&header,fim,fdm);
+        failed = writeFileAt(fd,&header,sizeof(header),i*recsize);
+    }
+    return failed;
+}
+
+// A band of rows of one record, through encoded unless it's stored as it is
+static int writeBand(int fd, const GLfloat* const band, GLuint width, GLuint rows,
+                     unsigned char* const encoded, off_t at)
+{
+    const int format = fieldFormat();
+    if (format == FIELD_FORMAT_RG32F)
+        return writeFileAt(fd,band,sizeof(GLfloat)*2*(size_t)rows*width,at);
+
+    encodeFieldRows(format,band,width,rows,2*(size_t)width,encoded);
+    return writeFileAt(fd,encoded,fieldRowBytes(format,width)*rows,at);
+}
+
+static int openRecords(const char* const filename) {
+    const int fd = open(filename,O_RDWR|O_CREAT|O_TRUNC,0644);
+    if (fd < 0) record(1,"Failed to open output file %s\n",filename);
+    return fd;
+}
+
+int runBroadband(CpuFieldEngine* const engine, const FieldInfoMap* const fim,
+                 FieldDataMap* const fdm, const char* const outfile,
+                 const PulseSpec* const pulse, const char* const pulsefile)
+{
+    const GLuint width = fim->fieldsize[0];
+    const GLuint height = fim->fieldsize[1];
+    if (width == 0 || height == 0 || *(fim->psn) == 0) {
+        record(1,"Nothing to evaluate\n");
+        return 1;
+    }
+
+    BroadbandSet set;
+    if (buildBroadbandSet(&set,fim)) return 1;
+
+    record(0,"Broadband: %d sources as %d emitters in %d %s bins\n",*(fim->psn),
+           set.numemitters,set.numbins,set.uniform ? "evenly spaced" : "unevenly spaced");
+    int i,j,l;
+    for (l=0; l<set.numbins; ++l) record(0,"> Layer %d: %g Hz\n",l,set.freq[l]);
+
+    BroadbandJob job;
+    memset(&job,0,sizeof(job));
+    job.set = &set;
+    job.width = width;
+    job.height = height;
+    job.segsx = (width+BROADBAND_SEGMENT-1)/BROADBAND_SEGMENT;
+    job.yoffset = fim->fieldoffset[1];
+    job.ydims = fim->fielddims[1];
+    job.steps = pulse != NULL ? pulse->steps : 0;
+
+    const int numrecords = set.numbins+job.steps;
+    const size_t perrow = (size_t)numrecords*width;
+    const size_t bandrows = BROADBAND_BAND_BUDGET/perrow > 0 ? BROADBAND_BAND_BUDGET/perrow : 1;
+    const size_t maxrows = bandrows < height ? bandrows : height;
+
+    GLfloat* const xs = (GLfloat*)malloc(sizeof(GLfloat)*width);
+    GLfloat* const weights = (GLfloat*)malloc(sizeof(GLfloat)*2*(job.steps*set.numbins+1));
+    job.layers = (GLfloat*)malloc(sizeof(GLfloat)*2*maxrows*width*set.numbins);
+    job.pulses = (GLfloat*)malloc(sizeof(GLfloat)*2*maxrows*width*job.steps+1);
+    job.scratch = (GLfloat*)malloc(sizeof(GLfloat)*6*BROADBAND_SEGMENT*cpuFieldThreads(engine));
+    job.stats = (BroadbandStats*)malloc(sizeof(BroadbandStats)*numrecords);
+    const size_t rowbytes = fieldRowBytes(fieldFormat(),width);
+    unsigned char* const encoded = (unsigned char*)malloc(rowbytes*maxrows);
+    if (xs == NULL || weights == NULL || job.layers == NULL || job.pulses == NULL ||
+        job.scratch == NULL || job.stats == NULL || encoded == NULL) {
+        record(1,"Failed to allocate broadband bands of %zu rows\n",maxrows);
+        free(encoded);
+        free(xs);
+        free(weights);
+        free(job.layers);
+        free(job.pulses);
+        free(job.scratch);
+        free(job.stats);
+        freeBroadbandSet(&set);
+        return 1;
+    }
+
+    GLuint x;
+    for (x=0; x<width; ++x)
+        xs[x] = fim->fieldoffset[0]+(GLfloat)x/(GLfloat)width*fim->fielddims[0];
+    job.xs = xs;
+
+    // Hann window sampled at bin centres, so the edge bins still count
+    for (j=0; j<job.steps; ++j) {
+        const double t = job.steps > 1 ?
+            pulse->start+(pulse->stop-pulse->start)*(double)j/(job.steps-1) : pulse->start;
+        for (l=0; l<set.numbins; ++l) {
+            const double s = sin(PI*(l+0.5)/set.numbins);
+            const double wt = 2.0*PI*set.freq[l]*t;
+            weights[2*(j*set.numbins+l)] = s*s*cos(wt);
+            weights[2*(j*set.numbins+l)+1] = -s*s*sin(wt);
+        }
+    }
+    job.weights = weights;
+
+    for (i=0; i<numrecords; ++i) {
+        job.stats[i].min = INFINITY;
+        job.stats[i].max = -INFINITY;
+        job.stats[i].sum = 0;
+        job.stats[i].sumsq = 0;
+    }
+
+    const int fd = openRecords(outfile);
+    const int pulsefd = job.steps > 0 ? openRecords(pulsefile) : -1;
+    int failed = fd < 0 || (job.steps > 0 && pulsefd < 0);
+
+    const off_t recsize = sizeof(FieldFileHeader)+(off_t)rowbytes*height;
+    const double start = wallClock();
+    GLuint y0;
+    for (y0=0; y0<height && !failed; y0+=maxrows) {
+        job.y0 = y0;
+        job.rows = y0+maxrows > height ? height-y0 : maxrows;
+        const size_t bandsize = 2*(size_t)job.rows*width;
+
+        runCpuTasks(engine,job.rows*job.segsx,bandTask,&job);
+        runCpuTasks(engine,numrecords,statsTask,&job);
+
+        const off_t at = sizeof(FieldFileHeader)+(off_t)rowbytes*y0;
+        for (l=0; l<set.numbins && !failed; ++l)
+            failed = writeBand(fd,job.layers+l*bandsize,width,job.rows,encoded,l*recsize+at);
+        for (j=0; j<job.steps && !failed; ++j)
+            failed = writeBand(pulsefd,job.pulses+j*bandsize,width,job.rows,encoded,j*recsize+at);
+
+        record(0,"> Rows %u-%u\n",y0,y0+job.rows-1);
+    }
+
+    if (!failed) failed = writeRecords(fd,fim,fdm,job.stats,set.numbins);
+    if (!failed && job.steps > 0)
+        failed = writeRecords(pulsefd,fim,fdm,job.stats+set.numbins,job.steps);
+
+    if (fd >= 0 && close(fd) != 0) failed = 1;
+    if (pulsefd >= 0 && close(pulsefd) != 0) failed = 1;
+
+    if (failed) {
+        record(1,"Failed to write broadband field\n");
+    } else {
+        record(0,"Wrote %d layers to %s",set.numbins,outfile);
+        if (job.steps > 0) record(0," and %d pulse snapshots to %s",job.steps,pulsefile);
+        record(0," in %.2fs\n",wallClock()-start);
+    }
+
+    free(encoded);
+    free(xs);
+    free(weights);
+    free(job.layers);
+    free(job.pulses);
+    free(job.scratch);
+    free(job.stats);
+    freeBroadbandSet(&set);
+    return failed;
+}
@@ -0,0 +1,34 @@
+// Broadband evaluation: one field layer per distinct source frequency instead
+// of one blended field. Sources are grouped into emitters (distinct
+// locations) and bins (distinct frequencies); at each sample the distance and
+// spreading to an emitter are computed once and shared by all its bins. When
+// the bins are evenly spaced, e^(ikr) for the next bin is one complex
+// multiplication by e^(i*dk*r) rather than a sin/cos, reseeded every
+// BROADBAND_RESEED bins so the recurrence error stays within a few ulps.
+//
+// Layers go to one file of consecutive field records, lowest frequency first,
+// a band of rows at a time so memory is bounded by BROADBAND_BAND_BUDGET
+// samples across all layers.
+//
+// Pulse snapshots sum the layers under a Hann window across the band,
+// sum_l w_l F_l e^(-i*omega_l*t), one record per time t: the real part is the
+// pressure, the magnitude its envelope. Given on the command line as
+//
+//     Start:Stop:Steps
+//
+// in seconds.
+#define BROADBAND_RESEED 16
+#define BROADBAND_BAND_BUDGET (1<<24)
+
+typedef struct {
+    GLfloat start;
+    GLfloat stop;
+    int steps;
+} PulseSpec;
+
+int parsePulseSpec(const char* const spec, PulseSpec* const pulse);
+
+// pulse may be NULL for layers only
+int runBroadband(CpuFieldEngine* const engine, const FieldInfoMap* const fim,
+                 FieldDataMap* const fdm, const char* const outfile,
+                 const PulseSpec* const pulse, const char* const pulsefile);
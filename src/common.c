@@ -1,4 +1,10 @@
+#include <stdio.h>
 #include <stdarg.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 unsigned int verbose = 0;
 
@@ -11,3 +17,72 @@ void record(unsigned int level,const char* fmt,...) {
     va_end(args);
 }
 
+
+double wallClock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+const void* mapFile(const char* const filename, size_t* const size, int* const failed) {
+    *size = 0;
+    *failed = 1;
+
+    const int fd = open(filename,O_RDONLY);
+    if (fd < 0) {
+        record(1,"Failed to open file %s\n",filename);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd,&st) != 0) {
+        record(1,"Failed to stat file %s\n",filename);
+        close(fd);
+        return NULL;
+    }
+
+    // mmap can't do empty files
+    void* data = NULL;
+    if (st.st_size > 0) {
+        data = mmap(NULL,(size_t)st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+        if (data == MAP_FAILED) {
+            record(1,"Failed to map file %s\n",filename);
+            close(fd);
+            return NULL;
+        }
+        madvise(data,(size_t)st.st_size,MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    *size = (size_t)st.st_size;
+    *failed = 0;
+    return data;
+}
+
+void unmapFile(const void* const data, size_t size) {
+    if (data != NULL) munmap((void*)data,size);
+}
+
+int writeFileAt(int fd, const void* const data, size_t size, long long offset) {
+    const char* p = (const char*)data;
+    while (size > 0) {
+        const ssize_t n = pwrite(fd,p,size,(off_t)offset);
+        if (n <= 0) return 1;
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+int readFileAt(int fd, void* const data, size_t size, long long offset) {
+    char* p = (char*)data;
+    while (size > 0) {
+        const ssize_t n = pread(fd,p,size,(off_t)offset);
+        if (n <= 0) return 1;
+        p += n;
+        size -= n;
+        offset += n;
+    }
+    return 0;
+}
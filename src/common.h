@@ -1,2 +1,14 @@
+// To double precision; float code casts it where it needs to
+#define PI 3.14159265358979323846
+
 void setVerbose(unsigned int on);
 void record(unsigned int level,const char* fmt,...);
+double wallClock(void);
+
+// Whole file mapped read-only; NULL with *size 0 for an empty file
+const void* mapFile(const char* const filename, size_t* const size, int* const failed);
+void unmapFile(const void* const data, size_t size);
+
+// pwrite/pread the whole of size bytes at offset, retrying short transfers
+int writeFileAt(int fd, const void* const data, size_t size, long long offset);
+int readFileAt(int fd, void* const data, size_t size, long long offset);
@@ -0,0 +1,841 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <GL/gl.h>
+
+#include "common.h"
+#include "fim.h"
+#include "cpu-field.h"
+#include "reflect.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_FIELD_X86
+#include <immintrin.h>
+#endif
+
+#define CPU_VECTOR_WIDTH CPU_POINT_PADDING
+
+typedef struct {
+    int n;
+    int capacity;
+    GLfloat* x;
+    GLfloat* y;
+    GLfloat* k;
+    GLfloat* phase;
+    // Only set for the 3D kernels
+    GLfloat* z;
+    // Amplitude of each source's term, NULL for all 1; image sources
+    // (reflect.h) are the only ones with another
+    GLfloat* amp;
+} CpuSources;
+
+// Evaluates the field at n points (px[i],py[i]) into out as (re,im) pairs.
+// px and py must be readable up to n rounded up to CPU_VECTOR_WIDTH.
+typedef void (*CpuFieldKernel)(const CpuSources* const src, int n,
+                               const GLfloat* const px, const GLfloat* const py,
+                               GLfloat* const out);
+// Same in 3D, with spherical 1/r spreading
+typedef void (*CpuFieldKernel3)(const CpuSources* const src, int n,
+                                const GLfloat* const px, const GLfloat* const py,
+                                const GLfloat* const pz, GLfloat* const out);
+
+struct CpuFieldEngine {
+    unsigned int numthreads;
+    pthread_t* threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned int generation;
+    unsigned int active;
+    int shutdown;
+
+    CpuTaskFunc func;
+    void* arg;
+    int numtasks;
+    int nexttask;
+
+    CpuFieldKernel kernel;
+    CpuFieldKernel3 kernel3;
+    const char* kernelname;
+
+    CpuSources sources;
+    // sources with their images when there are reflective walls
+    ImageSources images;
+    CpuSources reflected;
+};
+
+/*
+ * ----------------------------------------------------------------------------
+ *  Kernels
+ * ----------------------------------------------------------------------------
+ */
+static void fieldKernelScalar(const CpuSources* const src, int n,
+                              const GLfloat* const px, const GLfloat* const py,
+                              GLfloat* const out)
+{
+    int i,j;
+    for (i=0; i<n; ++i) {
+        GLfloat re = 0, im = 0;
+        for (j=0; j<src->n; ++j) {
+            const GLfloat dx = px[i]-src->x[j];
+            const GLfloat dy = py[i]-src->y[j];
+            const GLfloat r = sqrtf(dx*dx+dy*dy);
+            const GLfloat a = (src->amp != NULL ? src->amp[j] : 1.0f)/sqrtf(r);
+            const GLfloat theta = src->phase[j]+src->k[j]*r;
+            re += a*cosf(theta);
+            im += a*sinf(theta);
+        }
+        out[2*i] = re;
+        out[2*i+1] = im;
+    }
+}
+
+static void fieldKernel3Scalar(const CpuSources* const src, int n,
+                               const GLfloat* const px, const GLfloat* const py,
+                               const GLfloat* const pz, GLfloat* const out)
+{
+    int i,j;
+    for (i=0; i<n; ++i) {
+        GLfloat re = 0, im = 0;
+        for (j=0; j<src->n; ++j) {
+            const GLfloat dx = px[i]-src->x[j];
+            const GLfloat dy = py[i]-src->y[j];
+            const GLfloat dz = pz[i]-src->z[j];
+            const GLfloat r = sqrtf(dx*dx+dy*dy+dz*dz);
+            const GLfloat a = (src->amp != NULL ? src->amp[j] : 1.0f)/r;
+            const GLfloat theta = src->phase[j]+src->k[j]*r;
+            re += a*cosf(theta);
+            im += a*sinf(theta);
+        }
+        out[2*i] = re;
+        out[2*i+1] = im;
+    }
+}
+
+#ifdef CPU_FIELD_X86
+// pi/2 split into three parts so that j*DP1 and j*DP2 are exact for |j| < 2^12
+#define SINCOS_TWO_OVER_PI 0.636619772367581343f
+#define SINCOS_DP1 1.5703125f
+#define SINCOS_DP2 4.837512969970703125e-4f
+#define SINCOS_DP3 7.54978995489188216e-8f
+#define SINCOS_S1 -1.6666654611e-1f
+#define SINCOS_S2 8.3321608736e-3f
+#define SINCOS_S3 -1.9515295891e-4f
+#define SINCOS_C1 4.166664568298827e-2f
+#define SINCOS_C2 -1.388731625493765e-3f
+#define SINCOS_C3 2.443315711809948e-5f
+
+__attribute__((target("avx2,fma")))
+static inline void sincos8(__m256 t, __m256* const s, __m256* const c) {
+    const __m256 j = _mm256_round_ps(_mm256_mul_ps(t,_mm256_set1_ps(SINCOS_TWO_OVER_PI)),
+                                     _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    const __m256i q = _mm256_cvtps_epi32(j);
+
+    __m256 x = _mm256_fnmadd_ps(j,_mm256_set1_ps(SINCOS_DP1),t);
+    x = _mm256_fnmadd_ps(j,_mm256_set1_ps(SINCOS_DP2),x);
+    x = _mm256_fnmadd_ps(j,_mm256_set1_ps(SINCOS_DP3),x);
+    const __m256 x2 = _mm256_mul_ps(x,x);
+
+    __m256 ps = _mm256_fmadd_ps(_mm256_set1_ps(SINCOS_S3),x2,_mm256_set1_ps(SINCOS_S2));
+    ps = _mm256_fmadd_ps(ps,x2,_mm256_set1_ps(SINCOS_S1));
+    ps = _mm256_fmadd_ps(_mm256_mul_ps(ps,x2),x,x);
+
+    __m256 pc = _mm256_fmadd_ps(_mm256_set1_ps(SINCOS_C3),x2,_mm256_set1_ps(SINCOS_C2));
+    pc = _mm256_fmadd_ps(pc,x2,_mm256_set1_ps(SINCOS_C1));
+    pc = _mm256_fmadd_ps(_mm256_mul_ps(pc,x2),x2,
+                         _mm256_fnmadd_ps(_mm256_set1_ps(0.5f),x2,_mm256_set1_ps(1.0f)));
+
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i two = _mm256_set1_epi32(2);
+    const __m256 swap = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(q,one),one));
+    const __m256 ssign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(q,two),30));
+    const __m256 csign = _mm256_castsi256_ps(
+            _mm256_slli_epi32(_mm256_and_si256(_mm256_add_epi32(q,one),two),30));
+
+    *s = _mm256_xor_ps(_mm256_blendv_ps(ps,pc,swap),ssign);
+    *c = _mm256_xor_ps(_mm256_blendv_ps(pc,ps,swap),csign);
+}
+
+__attribute__((target("avx2,fma")))
+static void fieldKernelAVX2(const CpuSources* const src, int n,
+                            const GLfloat* const px, const GLfloat* const py,
+                            GLfloat* const out)
+{
+    float re[8], im[8];
+    int i,j,l;
+    for (i=0; i<n; i+=8) {
+        const __m256 x = _mm256_loadu_ps(px+i);
+        const __m256 y = _mm256_loadu_ps(py+i);
+        __m256 accre = _mm256_setzero_ps();
+        __m256 accim = _mm256_setzero_ps();
+
+        for (j=0; j<src->n; ++j) {
+            const __m256 dx = _mm256_sub_ps(x,_mm256_broadcast_ss(src->x+j));
+            const __m256 dy = _mm256_sub_ps(y,_mm256_broadcast_ss(src->y+j));
+            const __m256 r = _mm256_sqrt_ps(_mm256_fmadd_ps(dx,dx,_mm256_mul_ps(dy,dy)));
+
+            // 1/sqrt(r) with one Newton step on the hardware estimate; the
+            // amplitude rides on the step's factor of 1/2
+            const float half = 0.5f*(src->amp != NULL ? src->amp[j] : 1.0f);
+            __m256 a = _mm256_rsqrt_ps(r);
+            a = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(half),a),
+                              _mm256_fnmadd_ps(_mm256_mul_ps(r,a),a,_mm256_set1_ps(3.0f)));
+
+            __m256 s,c;
+            sincos8(_mm256_fmadd_ps(_mm256_broadcast_ss(src->k+j),r,
+                                    _mm256_broadcast_ss(src->phase+j)),&s,&c);
+            accre = _mm256_fmadd_ps(a,c,accre);
+            accim = _mm256_fmadd_ps(a,s,accim);
+        }
+
+        _mm256_storeu_ps(re,accre);
+        _mm256_storeu_ps(im,accim);
+        for (l=0; l<8 && i+l<n; ++l) {
+            out[2*(i+l)] = re[l];
+            out[2*(i+l)+1] = im[l];
+        }
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void fieldKernel3AVX2(const CpuSources* const src, int n,
+                             const GLfloat* const px, const GLfloat* const py,
+                             const GLfloat* const pz, GLfloat* const out)
+{
+    float re[8], im[8];
+    int i,j,l;
+    for (i=0; i<n; i+=8) {
+        const __m256 x = _mm256_loadu_ps(px+i);
+        const __m256 y = _mm256_loadu_ps(py+i);
+        const __m256 z = _mm256_loadu_ps(pz+i);
+        __m256 accre = _mm256_setzero_ps();
+        __m256 accim = _mm256_setzero_ps();
+
+        for (j=0; j<src->n; ++j) {
+            const __m256 dx = _mm256_sub_ps(x,_mm256_broadcast_ss(src->x+j));
+            const __m256 dy = _mm256_sub_ps(y,_mm256_broadcast_ss(src->y+j));
+            const __m256 dz = _mm256_sub_ps(z,_mm256_broadcast_ss(src->z+j));
+            const __m256 r = _mm256_sqrt_ps(_mm256_fmadd_ps(dx,dx,
+                                            _mm256_fmadd_ps(dy,dy,_mm256_mul_ps(dz,dz))));
+
+            // 1/r with one Newton step on the hardware estimate
+            const float amp = src->amp != NULL ? src->amp[j] : 1.0f;
+            __m256 a = _mm256_rcp_ps(r);
+            a = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(amp),a),
+                              _mm256_fnmadd_ps(r,a,_mm256_set1_ps(2.0f)));
+
+            __m256 s,c;
+            sincos8(_mm256_fmadd_ps(_mm256_broadcast_ss(src->k+j),r,
+                                    _mm256_broadcast_ss(src->phase+j)),&s,&c);
+            accre = _mm256_fmadd_ps(a,c,accre);
+            accim = _mm256_fmadd_ps(a,s,accim);
+        }
+
+        _mm256_storeu_ps(re,accre);
+        _mm256_storeu_ps(im,accim);
+        for (l=0; l<8 && i+l<n; ++l) {
+            out[2*(i+l)] = re[l];
+            out[2*(i+l)+1] = im[l];
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+static inline void sincos16(__m512 t, __m512* const s, __m512* const c) {
+    const __m512 j = _mm512_roundscale_ps(_mm512_mul_ps(t,_mm512_set1_ps(SINCOS_TWO_OVER_PI)),
+                                          _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    const __m512i q = _mm512_cvtps_epi32(j);
+
+    __m512 x = _mm512_fnmadd_ps(j,_mm512_set1_ps(SINCOS_DP1),t);
+    x = _mm512_fnmadd_ps(j,_mm512_set1_ps(SINCOS_DP2),x);
+    x = _mm512_fnmadd_ps(j,_mm512_set1_ps(SINCOS_DP3),x);
+    const __m512 x2 = _mm512_mul_ps(x,x);
+
+    __m512 ps = _mm512_fmadd_ps(_mm512_set1_ps(SINCOS_S3),x2,_mm512_set1_ps(SINCOS_S2));
+    ps = _mm512_fmadd_ps(ps,x2,_mm512_set1_ps(SINCOS_S1));
+    ps = _mm512_fmadd_ps(_mm512_mul_ps(ps,x2),x,x);
+
+    __m512 pc = _mm512_fmadd_ps(_mm512_set1_ps(SINCOS_C3),x2,_mm512_set1_ps(SINCOS_C2));
+    pc = _mm512_fmadd_ps(pc,x2,_mm512_set1_ps(SINCOS_C1));
+    pc = _mm512_fmadd_ps(_mm512_mul_ps(pc,x2),x2,
+                         _mm512_fnmadd_ps(_mm512_set1_ps(0.5f),x2,_mm512_set1_ps(1.0f)));
+
+    const __m512i one = _mm512_set1_epi32(1);
+    const __m512i two = _mm512_set1_epi32(2);
+    const __mmask16 swap = _mm512_test_epi32_mask(q,one);
+    const __m512i ssign = _mm512_slli_epi32(_mm512_and_epi32(q,two),30);
+    const __m512i csign = _mm512_slli_epi32(_mm512_and_epi32(_mm512_add_epi32(q,one),two),30);
+
+    *s = _mm512_castsi512_ps(_mm512_xor_epi32(
+                _mm512_castps_si512(_mm512_mask_blend_ps(swap,ps,pc)),ssign));
+    *c = _mm512_castsi512_ps(_mm512_xor_epi32(
+                _mm512_castps_si512(_mm512_mask_blend_ps(swap,pc,ps)),csign));
+}
+
+__attribute__((target("avx512f")))
+static void fieldKernelAVX512(const CpuSources* const src, int n,
+                              const GLfloat* const px, const GLfloat* const py,
+                              GLfloat* const out)
+{
+    float re[16], im[16];
+    int i,j,l;
+    for (i=0; i<n; i+=16) {
+        const __m512 x = _mm512_loadu_ps(px+i);
+        const __m512 y = _mm512_loadu_ps(py+i);
+        __m512 accre = _mm512_setzero_ps();
+        __m512 accim = _mm512_setzero_ps();
+
+        for (j=0; j<src->n; ++j) {
+            const __m512 dx = _mm512_sub_ps(x,_mm512_set1_ps(src->x[j]));
+            const __m512 dy = _mm512_sub_ps(y,_mm512_set1_ps(src->y[j]));
+            const __m512 r = _mm512_sqrt_ps(_mm512_fmadd_ps(dx,dx,_mm512_mul_ps(dy,dy)));
+
+            const float half = 0.5f*(src->amp != NULL ? src->amp[j] : 1.0f);
+            __m512 a = _mm512_rsqrt14_ps(r);
+            a = _mm512_mul_ps(_mm512_mul_ps(_mm512_set1_ps(half),a),
+                              _mm512_fnmadd_ps(_mm512_mul_ps(r,a),a,_mm512_set1_ps(3.0f)));
+
+            __m512 s,c;
+            sincos16(_mm512_fmadd_ps(_mm512_set1_ps(src->k[j]),r,
+                                     _mm512_set1_ps(src->phase[j])),&s,&c);
+            accre = _mm512_fmadd_ps(a,c,accre);
+            accim = _mm512_fmadd_ps(a,s,accim);
+        }
+
+        _mm512_storeu_ps(re,accre);
+        _mm512_storeu_ps(im,accim);
+        for (l=0; l<16 && i+l<n; ++l) {
+            out[2*(i+l)] = re[l];
+            out[2*(i+l)+1] = im[l];
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+static void fieldKernel3AVX512(const CpuSources* const src, int n,
+                               const GLfloat* const px, const GLfloat* const py,
+                               const GLfloat* const pz, GLfloat* const out)
+{
+    float re[16], im[16];
+    int i,j,l;
+    for (i=0; i<n; i+=16) {
+        const __m512 x = _mm512_loadu_ps(px+i);
+        const __m512 y = _mm512_loadu_ps(py+i);
+        const __m512 z = _mm512_loadu_ps(pz+i);
+        __m512 accre = _mm512_setzero_ps();
+        __m512 accim = _mm512_setzero_ps();
+
+        for (j=0; j<src->n; ++j) {
+            const __m512 dx = _mm512_sub_ps(x,_mm512_set1_ps(src->x[j]));
+            const __m512 dy = _mm512_sub_ps(y,_mm512_set1_ps(src->y[j]));
+            const __m512 dz = _mm512_sub_ps(z,_mm512_set1_ps(src->z[j]));
+            const __m512 r = _mm512_sqrt_ps(_mm512_fmadd_ps(dx,dx,
+                                            _mm512_fmadd_ps(dy,dy,_mm512_mul_ps(dz,dz))));
+
+            const float amp = src->amp != NULL ? src->amp[j] : 1.0f;
+            __m512 a = _mm512_rcp14_ps(r);
+            a = _mm512_mul_ps(_mm512_mul_ps(_mm512_set1_ps(amp),a),
+                              _mm512_fnmadd_ps(r,a,_mm512_set1_ps(2.0f)));
+
+            __m512 s,c;
+            sincos16(_mm512_fmadd_ps(_mm512_set1_ps(src->k[j]),r,
+                                     _mm512_set1_ps(src->phase[j])),&s,&c);
+            accre = _mm512_fmadd_ps(a,c,accre);
+            accim = _mm512_fmadd_ps(a,s,accim);
+        }
+
+        _mm512_storeu_ps(re,accre);
+        _mm512_storeu_ps(im,accim);
+        for (l=0; l<16 && i+l<n; ++l) {
+            out[2*(i+l)] = re[l];
+            out[2*(i+l)+1] = im[l];
+        }
+    }
+}
+#endif
+
+static void selectKernel(CpuFieldEngine* const engine) {
+    engine->kernel = fieldKernelScalar;
+    engine->kernel3 = fieldKernel3Scalar;
+    engine->kernelname = "scalar";
+#ifdef CPU_FIELD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        engine->kernel = fieldKernelAVX512;
+        engine->kernel3 = fieldKernel3AVX512;
+        engine->kernelname = "avx512";
+    } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        engine->kernel = fieldKernelAVX2;
+        engine->kernel3 = fieldKernel3AVX2;
+        engine->kernelname = "avx2";
+    }
+#endif
+}
+
+int setCpuFieldKernel(CpuFieldEngine* const engine, const char* const name) {
+    if (strcmp(name,"scalar") == 0) {
+        engine->kernel = fieldKernelScalar;
+        engine->kernel3 = fieldKernel3Scalar;
+        engine->kernelname = "scalar";
+        return 0;
+    }
+#ifdef CPU_FIELD_X86
+    __builtin_cpu_init();
+    if (strcmp(name,"avx2") == 0 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        engine->kernel = fieldKernelAVX2;
+        engine->kernel3 = fieldKernel3AVX2;
+        engine->kernelname = "avx2";
+        return 0;
+    }
+    if (strcmp(name,"avx512") == 0 && __builtin_cpu_supports("avx512f")) {
+        engine->kernel = fieldKernelAVX512;
+        engine->kernel3 = fieldKernel3AVX512;
+        engine->kernelname = "avx512";
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ *  Thread pool
+ * ----------------------------------------------------------------------------
+ */
+static void runTasks(CpuFieldEngine* const engine, unsigned int thread) {
+    int task;
+    while ((task = __sync_fetch_and_add(&engine->nexttask,1)) < engine->numtasks)
+        engine->func(engine->arg,task,thread);
+}
+
+typedef struct {
+    CpuFieldEngine* engine;
+    unsigned int thread;
+} CpuWorker;
+
+static void* workerMain(void* arg) {
+    CpuWorker* const worker = (CpuWorker*)arg;
+    CpuFieldEngine* const engine = worker->engine;
+    const unsigned int thread = worker->thread;
+    unsigned int seen = 0;
+    free(worker);
+
+    for (;;) {
+        pthread_mutex_lock(&engine->lock);
+        while (engine->generation == seen && !engine->shutdown)
+            pthread_cond_wait(&engine->start,&engine->lock);
+        if (engine->shutdown) {
+            pthread_mutex_unlock(&engine->lock);
+            return NULL;
+        }
+        seen = engine->generation;
+        pthread_mutex_unlock(&engine->lock);
+
+        runTasks(engine,thread);
+
+        pthread_mutex_lock(&engine->lock);
+        if (--engine->active == 0) pthread_cond_signal(&engine->done);
+        pthread_mutex_unlock(&engine->lock);
+    }
+}
+
+void runCpuTasks(CpuFieldEngine* const engine, int numtasks,
+                 CpuTaskFunc func, void* arg)
+{
+    pthread_mutex_lock(&engine->lock);
+    engine->func = func;
+    engine->arg = arg;
+    engine->numtasks = numtasks;
+    engine->nexttask = 0;
+    engine->active = engine->numthreads-1;
+    ++engine->generation;
+    pthread_cond_broadcast(&engine->start);
+    pthread_mutex_unlock(&engine->lock);
+
+    // The calling thread works too, as thread 0
+    runTasks(engine,0);
+
+    pthread_mutex_lock(&engine->lock);
+    while (engine->active > 0) pthread_cond_wait(&engine->done,&engine->lock);
+    pthread_mutex_unlock(&engine->lock);
+}
+
+CpuFieldEngine* createCpuFieldEngine(unsigned int numthreads) {
+    if (numthreads == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        numthreads = online > 0 ? (unsigned int)online : 1;
+    }
+
+    CpuFieldEngine* const engine = (CpuFieldEngine*)calloc(1,sizeof(CpuFieldEngine));
+    if (engine == NULL) return NULL;
+
+    engine->numthreads = numthreads;
+    pthread_mutex_init(&engine->lock,NULL);
+    pthread_cond_init(&engine->start,NULL);
+    pthread_cond_init(&engine->done,NULL);
+    selectKernel(engine);
+
+    engine->threads = (pthread_t*)malloc(sizeof(pthread_t)*numthreads);
+    unsigned int i;
+    for (i=1; i<numthreads; ++i) {
+        CpuWorker* const worker = (CpuWorker*)malloc(sizeof(CpuWorker));
+        worker->engine = engine;
+        worker->thread = i;
+        if (pthread_create(engine->threads+i,NULL,workerMain,worker)) {
+            record(1,"Failed to start CPU worker thread %u; using %u threads\n",i,i);
+            free(worker);
+            engine->numthreads = i;
+            break;
+        }
+    }
+
+    record(0,"CPU field engine: %u threads, %s kernel\n",
+           engine->numthreads,engine->kernelname);
+
+    return engine;
+}
+
+void destroyCpuFieldEngine(CpuFieldEngine* const engine) {
+    if (engine == NULL) return;
+
+    pthread_mutex_lock(&engine->lock);
+    engine->shutdown = 1;
+    pthread_cond_broadcast(&engine->start);
+    pthread_mutex_unlock(&engine->lock);
+
+    unsigned int i;
+    for (i=1; i<engine->numthreads; ++i) pthread_join(engine->threads[i],NULL);
+
+    pthread_cond_destroy(&engine->start);
+    pthread_cond_destroy(&engine->done);
+    pthread_mutex_destroy(&engine->lock);
+
+    free(engine->sources.x);
+    freeImageSources(&engine->images);
+    free(engine->threads);
+    free(engine);
+}
+
+unsigned int cpuFieldThreads(const CpuFieldEngine* const engine) {
+    return engine->numthreads;
+}
+
+const char* cpuFieldKernelName(const CpuFieldEngine* const engine) {
+    return engine->kernelname;
+}
+
+void sumSourcesCpu(const CpuFieldEngine* const engine, int n,
+                   const GLfloat* const x, const GLfloat* const y,
+                   const GLfloat* const k, const GLfloat* const phase,
+                   const GLfloat* const amp, int npoints, const GLfloat* const px, const GLfloat* const py,
+                   GLfloat* const out)
+{
+    // The kernels only read through the view
+    CpuSources src;
+    src.n = n;
+    src.capacity = n;
+    src.x = (GLfloat*)x;
+    src.y = (GLfloat*)y;
+    src.k = (GLfloat*)k;
+    src.phase = (GLfloat*)phase;
+    src.z = NULL;
+    src.amp = (GLfloat*)amp;
+    engine->kernel(&src,npoints,px,py,out);
+}
+
+void sumSources3Cpu(const CpuFieldEngine* const engine, int n,
+                    const GLfloat* const x, const GLfloat* const y, const GLfloat* const z,
+                    const GLfloat* const k, const GLfloat* const phase,
+                    const GLfloat* const amp, int npoints, const GLfloat* const px,
+                    const GLfloat* const py, const GLfloat* const pz, GLfloat* const out)
+{
+    CpuSources src;
+    src.n = n;
+    src.capacity = n;
+    src.x = (GLfloat*)x;
+    src.y = (GLfloat*)y;
+    src.z = (GLfloat*)z;
+    src.k = (GLfloat*)k;
+    src.phase = (GLfloat*)phase;
+    src.amp = (GLfloat*)amp;
+    engine->kernel3(&src,npoints,px,py,pz,out);
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ *  Grid evaluation
+ * ----------------------------------------------------------------------------
+ */
+static int reserveSources(CpuSources* const src, int n) {
+    if (n > src->capacity || src->x == NULL) {
+        GLfloat* const block = (GLfloat*)malloc(sizeof(GLfloat)*4*(n > 0 ? n : 1));
+        if (block == NULL) {
+            record(1,"Failed to allocate CPU source arrays\n");
+            return 1;
+        }
+        free(src->x);
+        src->capacity = n;
+        src->x = block;
+        src->y = block+n;
+        src->k = block+2*n;
+        src->phase = block+3*n;
+    }
+    src->n = n;
+    return 0;
+}
+
+static int prepareSources(CpuSources* const src, const FieldInfoMap* const fim) {
+    int n = *(fim->psn);
+    if (n < 0) n = 0;
+    if (n > fim->ps_capacity) n = fim->ps_capacity;
+    if (reserveSources(src,n)) return 1;
+
+    int i;
+    for (i=0; i<n; ++i) {
+        src->x[i] = fim->ps_loc[NUM_DIMS*i];
+        src->y[i] = fim->ps_loc[NUM_DIMS*i+1];
+        src->k[i] = fim->ps_freq[i]*2.0f*(GLfloat)PI/(*(fim->mat_c));
+        src->phase[i] = fim->ps_phase[i];
+    }
+
+    return 0;
+}
+
+// Same, from records in the PointSources SSBO layout
+static int preparePackedSources(CpuSources* const src, const GLfloat* const packed,
+                                int n, GLfloat mat_c)
+{
+    if (reserveSources(src,n)) return 1;
+
+    int i;
+    for (i=0; i<n; ++i) {
+        const GLfloat* const p = packed+PS_PACKED_STRIDE*i;
+        src->x[i] = p[0];
+        src->y[i] = p[1];
+        src->k[i] = p[NUM_DIMS]*2.0f*(GLfloat)PI/mat_c;
+        src->phase[i] = p[NUM_DIMS+1];
+    }
+
+    return 0;
+}
+
+/*
+ * engine->sources as evaluated over fim's field: with reflective walls, the
+ * sources and their images under fim's walls, culled against the field's
+ * rectangle; otherwise the sources themselves. NULL on failure.
+ */
+static const CpuSources* reflectSources(CpuFieldEngine* const engine, const FieldInfoMap* const fim) {
+    CpuSources* const src = &engine->sources;
+    src->amp = NULL;
+    if (!fieldReflects(fim)) return src;
+
+    ReflectionPlan plan;
+    if (initReflectionPlan(fim,&plan)) return NULL;
+
+    const GLfloat x0 = fim->fieldoffset[0], x1 = x0+fim->fielddims[0];
+    const GLfloat y0 = fim->fieldoffset[1], y1 = y0+fim->fielddims[1];
+    const GLfloat region[4] = { x0 < x1 ? x0 : x1, y0 < y1 ? y0 : y1,
+                                x0 < x1 ? x1 : x0, y0 < y1 ? y1 : y0 };
+    const int failed = expandImageSources(&plan,src->n,src->x,src->y,NULL,src->k,src->phase,
+                                          region,0.5,&engine->images);
+    freeReflectionPlan(&plan);
+    if (failed) return NULL;
+
+    CpuSources* const images = &engine->reflected;
+    images->n = engine->images.n;
+    images->capacity = engine->images.capacity;
+    images->x = engine->images.x;
+    images->y = engine->images.y;
+    images->k = engine->images.k;
+    images->phase = engine->images.phase;
+    images->z = NULL;
+    images->amp = engine->images.amp;
+    return images;
+}
+
+typedef struct {
+    GLfloat min;
+    GLfloat max;
+    double sum;
+    double sumsq;
+} CpuTileStats;
+
+/*
+ * Fold stats[0..n) into stats[0] pairwise over a fixed tree, the same shape
+ * as the shared memory reduction in compute.glsl, so the result depends only
+ * on the tiling and not on which thread finished first
+ */
+static void reduceTileStats(CpuTileStats* const stats, int n) {
+    int stride,i;
+    for (stride=1; stride<n; stride*=2) {
+        for (i=0; i+stride<n; i+=2*stride) {
+            CpuTileStats* const a = stats+i;
+            const CpuTileStats* const b = stats+i+stride;
+            if (b->min < a->min) a->min = b->min;
+            if (b->max > a->max) a->max = b->max;
+            a->sum += b->sum;
+            a->sumsq += b->sumsq;
+        }
+    }
+}
+
+#define CPU_SCRATCH_SIZE (3*CPU_TILE_SIZE_X+CPU_VECTOR_WIDTH)
+
+typedef struct {
+    CpuFieldEngine* engine;
+    const CpuSources* sources;
+    GLuint width;
+    GLuint height;
+    int tilesx;
+    int accumulate;
+
+    GLfloat yoffset;
+    GLfloat ydims;
+    const GLfloat* xs;
+    GLfloat* scratch;
+
+    GLfloat* field;
+    CpuTileStats* stats;
+} CpuGridJob;
+
+static void gridTask(void* arg, int task, unsigned int thread) {
+    CpuGridJob* const job = (CpuGridJob*)arg;
+
+    const GLuint x0 = (task % job->tilesx)*CPU_TILE_SIZE_X;
+    const GLuint y0 = (task / job->tilesx)*CPU_TILE_SIZE_Y;
+    const int w = x0+CPU_TILE_SIZE_X > job->width ? job->width-x0 : CPU_TILE_SIZE_X;
+    const GLuint y1 = y0+CPU_TILE_SIZE_Y > job->height ? job->height : y0+CPU_TILE_SIZE_Y;
+
+    GLfloat* const ys = job->scratch+thread*CPU_SCRATCH_SIZE;
+    GLfloat* const delta = ys+CPU_TILE_SIZE_X+CPU_VECTOR_WIDTH;
+    GLfloat fmin = INFINITY, fmax = -INFINITY;
+    double sum = 0, sumsq = 0;
+
+    int i;
+    GLuint x,y;
+    for (y=y0; y<y1; ++y) {
+        // Same expression as the compute shader so the sample points agree
+        const GLfloat py = job->yoffset+(GLfloat)y/(GLfloat)job->height*job->ydims;
+        for (x=0; x<CPU_TILE_SIZE_X+CPU_VECTOR_WIDTH; ++x) ys[x] = py;
+
+        GLfloat* const row = job->field+2*((size_t)y*job->width+x0);
+        if (job->sources == NULL) {
+            // Stats only
+        } else if (job->accumulate) {
+            job->engine->kernel(job->sources,w,job->xs+x0,ys,delta);
+            for (i=0; i<2*w; ++i) row[i] += delta[i];
+        } else {
+            job->engine->kernel(job->sources,w,job->xs+x0,ys,row);
+        }
+
+        for (i=0; i<w; ++i) {
+            const GLfloat m = sqrtf(row[2*i]*row[2*i]+row[2*i+1]*row[2*i+1]);
+            // Samples right on top of a source aren't finite; leave them out
+            if (!isfinite(m)) continue;
+            if (m < fmin) fmin = m;
+            if (m > fmax) fmax = m;
+            sum += m;
+            sumsq += (double)m*m;
+        }
+    }
+
+    job->stats[task].min = fmin;
+    job->stats[task].max = fmax;
+    job->stats[task].sum = sum;
+    job->stats[task].sumsq = sumsq;
+}
+
+// Evaluate src over the grid of fim, into or on top of field; a NULL src
+// only takes the stats of what field holds
+static int evaluateGrid(CpuFieldEngine* const engine, const CpuSources* const src,
+                        const FieldInfoMap* const fim, FieldDataMap* const fdm,
+                        GLfloat* const field, int accumulate)
+{
+    const GLuint width = fim->fieldsize[0];
+    const GLuint height = fim->fieldsize[1];
+
+    CpuGridJob job;
+    job.engine = engine;
+    job.sources = src;
+    job.width = width;
+    job.height = height;
+    job.tilesx = (width+CPU_TILE_SIZE_X-1)/CPU_TILE_SIZE_X;
+    job.accumulate = accumulate;
+    const int tilesy = (height+CPU_TILE_SIZE_Y-1)/CPU_TILE_SIZE_Y;
+    const int numtiles = job.tilesx*tilesy;
+
+    job.yoffset = fim->fieldoffset[1];
+    job.ydims = fim->fielddims[1];
+    job.field = field;
+
+    GLfloat* const xs = (GLfloat*)malloc(sizeof(GLfloat)*(width+CPU_VECTOR_WIDTH));
+    job.scratch = (GLfloat*)malloc(sizeof(GLfloat)*engine->numthreads*CPU_SCRATCH_SIZE);
+    job.stats = (CpuTileStats*)malloc(sizeof(CpuTileStats)*numtiles);
+    if (xs == NULL || job.scratch == NULL || job.stats == NULL) {
+        record(1,"Failed to allocate CPU field scratch memory\n");
+        free(xs);
+        free(job.scratch);
+        free(job.stats);
+        return 1;
+    }
+
+    GLuint x;
+    for (x=0; x<width+CPU_VECTOR_WIDTH; ++x)
+        xs[x] = fim->fieldoffset[0]+(GLfloat)x/(GLfloat)width*fim->fielddims[0];
+    job.xs = xs;
+
+    runCpuTasks(engine,numtiles,gridTask,&job);
+
+    if (fdm != NULL) {
+        reduceTileStats(job.stats,numtiles);
+        if (*(fdm->written) != 2) {
+            *(fdm->written) = 1;
+            *(fdm->field_min) = job.stats[0].min;
+            *(fdm->field_max) = job.stats[0].max;
+        }
+        const double n = (double)width*height;
+        *(fdm->field_mean) = job.stats[0].sum/n;
+        *(fdm->field_rms) = sqrt(job.stats[0].sumsq/n);
+    }
+
+    free(xs);
+    free(job.scratch);
+    free(job.stats);
+
+    return 0;
+}
+
+int computeFieldCpu(CpuFieldEngine* const engine, const FieldInfoMap* const fim,
+                    FieldDataMap* const fdm, GLfloat* const field)
+{
+    if (fim->fieldsize[0] == 0 || fim->fieldsize[1] == 0) return 0;
+    if (prepareSources(&engine->sources,fim)) return 1;
+    const CpuSources* const src = reflectSources(engine,fim);
+    if (src == NULL) return 1;
+
+    return evaluateGrid(engine,src,fim,fdm,field,0);
+}
+
+int updateFieldCpu(CpuFieldEngine* const engine, const FieldInfoMap* const fim,
+                   const GLfloat* const deltas, int numdeltas,
+                   FieldDataMap* const fdm, GLfloat* const field)
+{
+    if (fim->fieldsize[0] == 0 || fim->fieldsize[1] == 0) return 0;
+    if (preparePackedSources(&engine->sources,deltas,numdeltas,*(fim->mat_c))) return 1;
+    // Images are linear in their source, so a delta's images are its own
+    const CpuSources* const src = reflectSources(engine,fim);
+    if (src == NULL) return 1;
+
+    return evaluateGrid(engine,src,fim,fdm,field,1);
+}
+
+int reduceFieldCpu(CpuFieldEngine* const engine, const FieldInfoMap* const fim,
+                   FieldDataMap* const fdm, GLfloat* const field)
+{
+    if (fim->fieldsize[0] == 0 || fim->fieldsize[1] == 0) return 0;
+    return evaluateGrid(engine,NULL,fim,fdm,field,0);
+}
@@ -0,0 +1,64 @@
+// CPU evaluation of the field described by a FieldInfoMap, equivalent to
+// compute.glsl. Output is fieldsize[0]*fieldsize[1] interleaved (re,im)
+// GLfloat pairs, rows in y, i.e. the same layout as an RG32F image read back
+// with GL_RG/GL_FLOAT, so it can be uploaded straight into the field texture.
+//
+// Accuracy: the SIMD kernels use their own sin/cos (Cody-Waite reduction plus
+// minimax polynomials) and a Newton-refined reciprocal square root. Against a
+// double precision evaluation each source term is within about 2e-6 relative
+// for phases |ps_phase + k*r| < 8192; the summed field differs from the
+// compute shader by less than CPU_FIELD_TOLERANCE of the field maximum.
+#define CPU_FIELD_TOLERANCE 1e-4
+#define CPU_TILE_SIZE_X 64
+#define CPU_TILE_SIZE_Y 16
+#define CPU_POINT_PADDING 16
+
+typedef struct CpuFieldEngine CpuFieldEngine;
+
+// Called once per task index in [0,numtasks) from one of the pool threads;
+// thread is in [0,numthreads) and may be used to index per-thread scratch.
+typedef void (*CpuTaskFunc)(void* arg, int task, unsigned int thread);
+
+// numthreads == 0 uses one thread per online processor
+CpuFieldEngine* createCpuFieldEngine(unsigned int numthreads);
+void destroyCpuFieldEngine(CpuFieldEngine* const engine);
+
+unsigned int cpuFieldThreads(const CpuFieldEngine* const engine);
+const char* cpuFieldKernelName(const CpuFieldEngine* const engine);
+// Use the "scalar", "avx2" or "avx512" kernels instead of the fastest this
+// processor runs; 1 if it can't run them
+int setCpuFieldKernel(CpuFieldEngine* const engine, const char* const name);
+
+void runCpuTasks(CpuFieldEngine* const engine, int numtasks,
+                 CpuTaskFunc func, void* arg);
+
+// Direct sum of n sources at (x[j],y[j]) with wavenumbers k[j], phases
+// phase[j] and amplitudes amp[j] (NULL for all 1), at npoints points
+// (px[i],py[i]), into out as (re,im) pairs. px and py must be readable up to
+// npoints+CPU_POINT_PADDING. Safe to call from task functions.
+void sumSourcesCpu(const CpuFieldEngine* const engine, int n,
+                   const GLfloat* const x, const GLfloat* const y,
+                   const GLfloat* const k, const GLfloat* const phase,
+                   const GLfloat* const amp, int npoints,
+                   const GLfloat* const px, const GLfloat* const py, GLfloat* const out);
+// Same in 3D: sources at (x[j],y[j],z[j]) spreading spherically, 1/r rather
+// than 1/sqrt(r), at points (px[i],py[i],pz[i]), all three padded likewise
+void sumSources3Cpu(const CpuFieldEngine* const engine, int n,
+                    const GLfloat* const x, const GLfloat* const y, const GLfloat* const z,
+                    const GLfloat* const k, const GLfloat* const phase,
+                    const GLfloat* const amp, int npoints, const GLfloat* const px,
+                    const GLfloat* const py, const GLfloat* const pz, GLfloat* const out);
+
+int computeFieldCpu(CpuFieldEngine* const engine, const FieldInfoMap* const fim,
+                    FieldDataMap* const fdm, GLfloat* const field);
+
+// Add the contribution of numdeltas packed source records (see field-edit.h)
+// to an already evaluated field
+int updateFieldCpu(CpuFieldEngine* const engine, const FieldInfoMap* const fim,
+                   const GLfloat* const deltas, int numdeltas,
+                   FieldDataMap* const fdm, GLfloat* const field);
+
+// FieldData of a field already evaluated, by the same tiles and tree as
+// computeFieldCpu's, without evaluating anything
+int reduceFieldCpu(CpuFieldEngine* const engine, const FieldInfoMap* const fim,
+                   FieldDataMap* const fdm, GLfloat* const field);
@@ -0,0 +1,590 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <GL/gl.h>
+
+#include "common.h"
+#include "fim.h"
+#include "cpu-field.h"
+#include "far-field.h"
+
+// Clusters closer to a tile than this many times their combined radii are
+// always summed directly
+#define FAR_SEPARATION 2.0
+// Rough cost of one direct source term in interpolation multiply-adds
+#define FAR_DIRECT_COST 4.0
+
+typedef struct {
+    GLfloat x;
+    GLfloat y;
+    GLfloat k;
+    GLfloat phase;
+} FarSource;
+
+typedef struct {
+    int first;
+    int n;
+    GLfloat cx;
+    GLfloat cy;
+    GLfloat radius;
+    GLfloat k;
+} FarCluster;
+
+typedef struct {
+    int n;
+    GLfloat* x;
+    GLfloat* y;
+    GLfloat* k;
+    GLfloat* phase;
+
+    int numclusters;
+    FarCluster* clusters;
+} FarSources;
+
+typedef struct {
+    GLfloat min;
+    GLfloat max;
+    double sum;
+    double sumsq;
+    int near;
+    int far;
+} FarTileStats;
+
+typedef struct {
+    const CpuFieldEngine* engine;
+    const FarSources* src;
+    double tolerance;
+
+    GLuint width;
+    GLuint height;
+    int tilesx;
+    GLfloat offset[2];
+    GLfloat dims[2];
+    GLfloat* field;
+
+    GLfloat* scratch;
+    size_t scratchsize;
+    FarTileStats* stats;
+} FarJob;
+
+/*
+ * ----------------------------------------------------------------------------
+ *  Clusters
+ * ----------------------------------------------------------------------------
+ */
+static int compareX(const void* a, const void* b) {
+    const GLfloat fa = ((const FarSource*)a)->x, fb = ((const FarSource*)b)->x;
+    return fa < fb ? -1 : fa > fb;
+}
+
+static int compareY(const void* a, const void* b) {
+    const GLfloat fa = ((const FarSource*)a)->y, fb = ((const FarSource*)b)->y;
+    return fa < fb ? -1 : fa > fb;
+}
+
+static int compareK(const void* a, const void* b) {
+    const GLfloat fa = ((const FarSource*)a)->k, fb = ((const FarSource*)b)->k;
+    return fa < fb ? -1 : fa > fb;
+}
+
+// Median splits across the wider side until a range fits in one cluster
+static void splitSources(FarSource* const s, int first, int n, FarSources* const src) {
+    GLfloat xmin = INFINITY, xmax = -INFINITY, ymin = INFINITY, ymax = -INFINITY;
+    int i;
+    for (i=first; i<first+n; ++i) {
+        if (s[i].x < xmin) xmin = s[i].x;
+        if (s[i].x > xmax) xmax = s[i].x;
+        if (s[i].y < ymin) ymin = s[i].y;
+        if (s[i].y > ymax) ymax = s[i].y;
+    }
+
+    if (n > FAR_CLUSTER_SIZE && (xmax > xmin || ymax > ymin)) {
+        qsort(s+first,n,sizeof(FarSource),xmax-xmin >= ymax-ymin ? compareX : compareY);
+        splitSources(s,first,n/2,src);
+        splitSources(s,first+n/2,n-n/2,src);
+        return;
+    }
+
+    FarCluster* const c = src->clusters+src->numclusters++;
+    c->first = first;
+    c->n = n;
+    c->cx = 0.5f*(xmin+xmax);
+    c->cy = 0.5f*(ymin+ymax);
+    c->k = s[first].k;
+    c->radius = 0;
+    for (i=first; i<first+n; ++i) {
+        const GLfloat dx = s[i].x-c->cx, dy = s[i].y-c->cy;
+        const GLfloat r = sqrtf(dx*dx+dy*dy);
+        if (r > c->radius) c->radius = r;
+    }
+}
+
+static void freeFarSources(FarSources* const src) {
+    free(src->x);
+    free(src->clusters);
+}
+
+static int buildFarSources(FarSources* const src, const FieldInfoMap* const fim) {
+    int n = *(fim->psn);
+    if (n < 0) n = 0;
+    if (n > fim->ps_capacity) n = fim->ps_capacity;
+    memset(src,0,sizeof(FarSources));
+
+    FarSource* const s = (FarSource*)malloc(sizeof(FarSource)*(n > 0 ? n : 1));
+    src->x = (GLfloat*)malloc(sizeof(GLfloat)*4*(n > 0 ? n : 1));
+    src->clusters = (FarCluster*)malloc(sizeof(FarCluster)*(n > 0 ? n : 1));
+    if (s == NULL || src->x == NULL || src->clusters == NULL) {
+        record(1,"Failed to allocate source clusters\n");
+        free(s);
+        freeFarSources(src);
+        return 1;
+    }
+    src->n = n;
+    src->y = src->x+n;
+    src->k = src->x+2*n;
+    src->phase = src->x+3*n;
+
+    int i,first;
+    for (i=0; i<n; ++i) {
+        s[i].x = fim->ps_loc[NUM_DIMS*i];
+        s[i].y = fim->ps_loc[NUM_DIMS*i+1];
+        s[i].k = fim->ps_freq[i]*2.0f*(GLfloat)PI/(*(fim->mat_c));
+        s[i].phase = fim->ps_phase[i];
+    }
+
+    // A cluster shares one plane wave, so only one wavenumber
+    qsort(s,n,sizeof(FarSource),compareK);
+    for (first=0; first<n; first=i) {
+        for (i=first; i<n && s[i].k == s[first].k; ++i);
+        splitSources(s,first,i-first,src);
+    }
+
+    for (i=0; i<n; ++i) {
+        src->x[i] = s[i].x;
+        src->y[i] = s[i].y;
+        src->k[i] = s[i].k;
+        src->phase[i] = s[i].phase;
+    }
+
+    free(s);
+    return 0;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ *  Tiles
+ * ----------------------------------------------------------------------------
+ */
+#define FAR_PIXELS (FAR_TILE_SIZE*FAR_TILE_SIZE)
+#define FAR_NODES (FAR_MAX_ORDER*FAR_MAX_ORDER)
+#define FAR_BASIS (FAR_TILE_SIZE*FAR_MAX_ORDER)
+
+typedef struct {
+    GLfloat* px;     // FAR_PIXELS+CPU_POINT_PADDING
+    GLfloat* py;
+    GLfloat* out;    // 2*FAR_PIXELS
+    GLfloat* direct; // 2*FAR_PIXELS
+    GLfloat* nodex;  // FAR_NODES+CPU_POINT_PADDING
+    GLfloat* nodey;
+    GLfloat* node;   // 2*FAR_NODES
+    GLfloat* lx;     // (FAR_MAX_ORDER+1)*FAR_BASIS, by order
+    GLfloat* ly;
+    GLfloat* h;      // 2*FAR_BASIS
+    GLfloat* ex;     // 2*FAR_TILE_SIZE
+    GLfloat* ey;
+    GLfloat* sum;    // 2*FAR_TILE_SIZE
+    GLfloat* nearx;  // 4*n
+    GLfloat* neary;
+    GLfloat* neark;
+    GLfloat* nearphase;
+} FarScratch;
+
+static size_t farScratchSize(int n) {
+    return 2*(FAR_PIXELS+CPU_POINT_PADDING)+4*FAR_PIXELS+
+           2*(FAR_NODES+CPU_POINT_PADDING)+2*FAR_NODES+
+           2*(FAR_MAX_ORDER+1)*FAR_BASIS+2*FAR_BASIS+6*FAR_TILE_SIZE+4*(size_t)n;
+}
+
+static void carveScratch(FarScratch* const s, GLfloat* p, int n) {
+    s->px = p; p += FAR_PIXELS+CPU_POINT_PADDING;
+    s->py = p; p += FAR_PIXELS+CPU_POINT_PADDING;
+    s->out = p; p += 2*FAR_PIXELS;
+    s->direct = p; p += 2*FAR_PIXELS;
+    s->nodex = p; p += FAR_NODES+CPU_POINT_PADDING;
+    s->nodey = p; p += FAR_NODES+CPU_POINT_PADDING;
+    s->node = p; p += 2*FAR_NODES;
+    s->lx = p; p += (FAR_MAX_ORDER+1)*FAR_BASIS;
+    s->ly = p; p += (FAR_MAX_ORDER+1)*FAR_BASIS;
+    s->h = p; p += 2*FAR_BASIS;
+    s->ex = p; p += 2*FAR_TILE_SIZE;
+    s->ey = p; p += 2*FAR_TILE_SIZE;
+    s->sum = p; p += 2*FAR_TILE_SIZE;
+    s->nearx = p; p += n;
+    s->neary = p; p += n;
+    s->neark = p; p += n;
+    s->nearphase = p;
+}
+
+static GLfloat chebyshevNode(int p, int a) {
+    return (GLfloat)cos((2*a+1)*PI/(2*p));
+}
+
+// Barycentric Lagrange basis on the p Chebyshev nodes, at m points t in
+// [-1,1]: basis[i*p+a] is the weight of node a at t[i]
+static void chebyshevBasis(int p, int m, const GLfloat* const t, GLfloat* const basis) {
+    GLfloat node[FAR_MAX_ORDER], w[FAR_MAX_ORDER];
+    int a,i;
+    for (a=0; a<p; ++a) {
+        node[a] = chebyshevNode(p,a);
+        w[a] = (GLfloat)((a & 1 ? -1 : 1)*sin((2*a+1)*PI/(2*p)));
+    }
+    for (i=0; i<m; ++i) {
+        GLfloat* const b = basis+i*p;
+        GLfloat total = 0;
+        int exact = -1;
+        for (a=0; a<p; ++a) {
+            const GLfloat d = t[i]-node[a];
+            if (fabsf(d) < 1e-7f) exact = a;
+            b[a] = exact < 0 ? w[a]/d : 0;
+            total += b[a];
+        }
+        if (exact >= 0) {
+            for (a=0; a<p; ++a) b[a] = a == exact;
+        } else {
+            for (a=0; a<p; ++a) b[a] /= total;
+        }
+    }
+}
+
+/*
+ * Lowest order whose estimated interpolation error is within tolerance, or 0.
+ * The envelope's phase varies by at most bandwidth radians from the centre to
+ * the edge of the tile, giving (e*bandwidth/2p)^p, and its amplitude by the
+ * ratio q of tile to distance, giving q^p; both once per axis.
+ */
+static int interpolationOrder(double bandwidth, double q, double tolerance) {
+    int p;
+    for (p=2; p<=FAR_MAX_ORDER; ++p) {
+        const double e = 2*(pow(M_E*bandwidth/(2*p),p)+pow(q,p));
+        if (e <= tolerance) return p;
+    }
+    return 0;
+}
+
+static void interpolateCluster(const FarJob* const job, const FarCluster* const c,
+                               FarScratch* const s, int p, int w, int h,
+                               const GLfloat* const t, const GLfloat* const half,
+                               int* const basisready)
+{
+    const FarSources* const src = job->src;
+    int a,b,i,j;
+
+    // Basis per order, once per tile
+    if (!basisready[p]) {
+        GLfloat tx[FAR_TILE_SIZE], ty[FAR_TILE_SIZE];
+        for (i=0; i<w; ++i) tx[i] = half[0] > 0 ? (s->px[i]-t[0])/half[0] : 0;
+        for (j=0; j<h; ++j) ty[j] = half[1] > 0 ? (s->py[j*w]-t[1])/half[1] : 0;
+        chebyshevBasis(p,w,tx,s->lx+p*FAR_BASIS);
+        chebyshevBasis(p,h,ty,s->ly+p*FAR_BASIS);
+        basisready[p] = 1;
+    }
+    const GLfloat* const lx = s->lx+p*FAR_BASIS;
+    const GLfloat* const ly = s->ly+p*FAR_BASIS;
+
+    // Exact cluster field at the nodes
+    for (b=0; b<p; ++b) {
+        for (a=0; a<p; ++a) {
+            s->nodex[b*p+a] = t[0]+half[0]*chebyshevNode(p,a);
+            s->nodey[b*p+a] = t[1]+half[1]*chebyshevNode(p,b);
+        }
+    }
+    for (a=p*p; a<p*p+CPU_POINT_PADDING; ++a) {
+        s->nodex[a] = t[0];
+        s->nodey[a] = t[1];
+    }
+    sumSourcesCpu(job->engine,c->n,src->x+c->first,src->y+c->first,src->k+c->first,
+                  src->phase+c->first,NULL,p*p,s->nodex,s->nodey,s->node);
+
+    // Take out the plane wave along u, measured from the tile centre
+    GLfloat ux = t[0]-c->cx, uy = t[1]-c->cy;
+    const GLfloat d = sqrtf(ux*ux+uy*uy);
+    ux *= c->k/d;
+    uy *= c->k/d;
+    for (a=0; a<p*p; ++a) {
+        const GLfloat theta = -(ux*(s->nodex[a]-t[0])+uy*(s->nodey[a]-t[1]));
+        const GLfloat cs = cosf(theta), sn = sinf(theta);
+        const GLfloat re = s->node[2*a], im = s->node[2*a+1];
+        s->node[2*a] = re*cs-im*sn;
+        s->node[2*a+1] = re*sn+im*cs;
+    }
+    for (i=0; i<w; ++i) {
+        const GLfloat theta = ux*(s->px[i]-t[0]);
+        s->ex[2*i] = cosf(theta);
+        s->ex[2*i+1] = sinf(theta);
+    }
+    for (j=0; j<h; ++j) {
+        const GLfloat theta = uy*(s->py[j*w]-t[1]);
+        s->ey[2*j] = cosf(theta);
+        s->ey[2*j+1] = sinf(theta);
+    }
+
+    // Along x for every node row, then along y for every pixel row
+    for (b=0; b<p; ++b) {
+        const GLfloat* const row = s->node+2*b*p;
+        GLfloat* const hb = s->h+2*b*FAR_TILE_SIZE;
+        for (i=0; i<w; ++i) {
+            GLfloat re = 0, im = 0;
+            for (a=0; a<p; ++a) {
+                re += lx[i*p+a]*row[2*a];
+                im += lx[i*p+a]*row[2*a+1];
+            }
+            hb[2*i] = re;
+            hb[2*i+1] = im;
+        }
+    }
+    for (j=0; j<h; ++j) {
+        memset(s->sum,0,sizeof(GLfloat)*2*w);
+        for (b=0; b<p; ++b) {
+            const GLfloat l = ly[j*p+b];
+            const GLfloat* const hb = s->h+2*b*FAR_TILE_SIZE;
+            for (i=0; i<2*w; ++i) s->sum[i] += l*hb[i];
+        }
+        GLfloat* const out = s->out+2*j*w;
+        for (i=0; i<w; ++i) {
+            const GLfloat mre = s->ex[2*i]*s->ey[2*j]-s->ex[2*i+1]*s->ey[2*j+1];
+            const GLfloat mim = s->ex[2*i]*s->ey[2*j+1]+s->ex[2*i+1]*s->ey[2*j];
+            out[2*i] += s->sum[2*i]*mre-s->sum[2*i+1]*mim;
+            out[2*i+1] += s->sum[2*i]*mim+s->sum[2*i+1]*mre;
+        }
+    }
+}
+
+static void tileTask(void* arg, int task, unsigned int thread) {
+    FarJob* const job = (FarJob*)arg;
+    const FarSources* const src = job->src;
+
+    FarScratch s;
+    carveScratch(&s,job->scratch+thread*job->scratchsize,src->n);
+
+    const GLuint x0 = (task % job->tilesx)*FAR_TILE_SIZE;
+    const GLuint y0 = (task / job->tilesx)*FAR_TILE_SIZE;
+    const int w = x0+FAR_TILE_SIZE > job->width ? job->width-x0 : FAR_TILE_SIZE;
+    const int h = y0+FAR_TILE_SIZE > job->height ? job->height-y0 : FAR_TILE_SIZE;
+
+    int i,j,c;
+    // Same expressions as the compute shader so the sample points agree
+    for (j=0; j<h; ++j) {
+        const GLfloat py = job->offset[1]+(GLfloat)(y0+j)/(GLfloat)job->height*job->dims[1];
+        for (i=0; i<w; ++i) {
+            s.px[j*w+i] = job->offset[0]+(GLfloat)(x0+i)/(GLfloat)job->width*job->dims[0];
+            s.py[j*w+i] = py;
+        }
+    }
+    for (i=w*h; i<w*h+CPU_POINT_PADDING; ++i) {
+        s.px[i] = s.px[0];
+        s.py[i] = s.py[0];
+    }
+    memset(s.out,0,sizeof(GLfloat)*2*w*h);
+
+    const GLfloat t[2] = { 0.5f*(s.px[0]+s.px[w-1]), 0.5f*(s.py[0]+s.py[(h-1)*w]) };
+    const GLfloat half[2] = { 0.5f*(s.px[w-1]-s.px[0]), 0.5f*(s.py[(h-1)*w]-s.py[0]) };
+    const double b = sqrt((double)half[0]*half[0]+(double)half[1]*half[1]);
+
+    int basisready[FAR_MAX_ORDER+1];
+    memset(basisready,0,sizeof(basisready));
+    int numnear = 0, near = 0, far = 0;
+    for (c=0; c<src->numclusters; ++c) {
+        const FarCluster* const cl = src->clusters+c;
+        const double dx = t[0]-cl->cx, dy = t[1]-cl->cy;
+        const double d = sqrt(dx*dx+dy*dy);
+        const double span = cl->radius+b;
+
+        int p = 0;
+        if (d > FAR_SEPARATION*span) {
+            p = interpolationOrder(cl->k*b*span/(d-span),b/(d-cl->radius),job->tolerance);
+            const double direct = (double)w*h*cl->n;
+            const double interp = (double)p*p*cl->n+
+                                  ((double)w*h*(p+2)+(double)w*p*p)/FAR_DIRECT_COST;
+            if (interp >= direct) p = 0;
+        }
+
+        if (p > 0) {
+            interpolateCluster(job,cl,&s,p,w,h,t,half,basisready);
+            ++far;
+        } else {
+            memcpy(s.nearx+numnear,src->x+cl->first,sizeof(GLfloat)*cl->n);
+            memcpy(s.neary+numnear,src->y+cl->first,sizeof(GLfloat)*cl->n);
+            memcpy(s.neark+numnear,src->k+cl->first,sizeof(GLfloat)*cl->n);
+            memcpy(s.nearphase+numnear,src->phase+cl->first,sizeof(GLfloat)*cl->n);
+            numnear += cl->n;
+            ++near;
+        }
+    }
+
+    if (numnear > 0) {
+        sumSourcesCpu(job->engine,numnear,s.nearx,s.neary,s.neark,s.nearphase,
+                      NULL,w*h,s.px,s.py,s.direct);
+        for (i=0; i<2*w*h; ++i) s.out[i] += s.direct[i];
+    }
+
+    GLfloat fmin = INFINITY, fmax = -INFINITY;
+    double sum = 0, sumsq = 0;
+    for (j=0; j<h; ++j) {
+        const GLfloat* const in = s.out+2*j*w;
+        memcpy(job->field+2*((size_t)(y0+j)*job->width+x0),in,sizeof(GLfloat)*2*w);
+        for (i=0; i<w; ++i) {
+            const GLfloat m = sqrtf(in[2*i]*in[2*i]+in[2*i+1]*in[2*i+1]);
+            // Samples right on top of a source aren't finite; leave them out
+            if (!isfinite(m)) continue;
+            if (m < fmin) fmin = m;
+            if (m > fmax) fmax = m;
+            sum += m;
+            sumsq += (double)m*m;
+        }
+    }
+
+    job->stats[task].min = fmin;
+    job->stats[task].max = fmax;
+    job->stats[task].sum = sum;
+    job->stats[task].sumsq = sumsq;
+    job->stats[task].near = near;
+    job->stats[task].far = far;
+}
+
+int computeFieldFar(CpuFieldEngine* const engine, const FieldInfoMap* const fim,
+                    FieldDataMap* const fdm, GLfloat* const field, double tolerance)
+{
+    const GLuint width = fim->fieldsize[0];
+    const GLuint height = fim->fieldsize[1];
+    if (width == 0 || height == 0) return 0;
+
+    FarSources src;
+    if (buildFarSources(&src,fim)) return 1;
+
+    FarJob job;
+    job.engine = engine;
+    job.src = &src;
+    job.tolerance = tolerance;
+    job.width = width;
+    job.height = height;
+    job.tilesx = (width+FAR_TILE_SIZE-1)/FAR_TILE_SIZE;
+    job.offset[0] = fim->fieldoffset[0];
+    job.offset[1] = fim->fieldoffset[1];
+    job.dims[0] = fim->fielddims[0];
+    job.dims[1] = fim->fielddims[1];
+    job.field = field;
+    const int numtiles = job.tilesx*((height+FAR_TILE_SIZE-1)/FAR_TILE_SIZE);
+
+    job.scratchsize = farScratchSize(src.n);
+    job.scratch = (GLfloat*)malloc(sizeof(GLfloat)*job.scratchsize*cpuFieldThreads(engine));
+    job.stats = (FarTileStats*)malloc(sizeof(FarTileStats)*numtiles);
+    if (job.scratch == NULL || job.stats == NULL) {
+        record(1,"Failed to allocate far field scratch memory\n");
+        free(job.scratch);
+        free(job.stats);
+        freeFarSources(&src);
+        return 1;
+    }
+
+    runCpuTasks(engine,numtiles,tileTask,&job);
+
+    // In tile order, so the result doesn't depend on the thread count
+    FarTileStats total;
+    memset(&total,0,sizeof(total));
+    total.min = INFINITY;
+    total.max = -INFINITY;
+    int i;
+    for (i=0; i<numtiles; ++i) {
+        if (job.stats[i].min < total.min) total.min = job.stats[i].min;
+        if (job.stats[i].max > total.max) total.max = job.stats[i].max;
+        total.sum += job.stats[i].sum;
+        total.sumsq += job.stats[i].sumsq;
+        total.near += job.stats[i].near;
+        total.far += job.stats[i].far;
+    }
+    record(0,"Far field: %d clusters, %d tiles, %d direct and %d interpolated pairs\n",
+           src.numclusters,numtiles,total.near,total.far);
+
+    if (fdm != NULL) {
+        if (*(fdm->written) != 2) {
+            *(fdm->written) = 1;
+            *(fdm->field_min) = total.min;
+            *(fdm->field_max) = total.max;
+        }
+        const double n = (double)width*height;
+        *(fdm->field_mean) = total.sum/n;
+        *(fdm->field_rms) = sqrt(total.sumsq/n);
+    }
+
+    free(job.scratch);
+    free(job.stats);
+    freeFarSources(&src);
+    return 0;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ *  Report
+ * ----------------------------------------------------------------------------
+ */
+static const double reporttolerances[] = { 1e-1, 1e-2, 1e-3, 1e-4, 1e-5, 1e-6 };
+
+int runFarFieldReport(CpuFieldEngine* const engine, const FieldInfoMap* const fim,
+                      FieldDataMap* const fdm)
+{
+    const size_t pixels = (size_t)fim->fieldsize[0]*fim->fieldsize[1];
+    GLfloat* const exact = (GLfloat*)malloc(sizeof(GLfloat)*2*pixels);
+    GLfloat* const approx = (GLfloat*)malloc(sizeof(GLfloat)*2*pixels);
+    if (exact == NULL || approx == NULL) {
+        record(1,"Failed to allocate report fields\n");
+        free(exact);
+        free(approx);
+        return 1;
+    }
+
+    double start = wallClock();
+    int failed = computeFieldCpu(engine,fim,fdm,exact);
+    const double directtime = wallClock()-start;
+
+    // Errors relative to the largest magnitude and to the RMS of the field
+    double fmax = 0, power = 0;
+    size_t i, n = 0;
+    for (i=0; i<pixels; ++i) {
+        const double m = hypot(exact[2*i],exact[2*i+1]);
+        if (!isfinite(m)) continue;
+        if (m > fmax) fmax = m;
+        power += m*m;
+        ++n;
+    }
+    const double rms = n > 0 ? sqrt(power/n) : 0;
+
+    record(1,"Far field accuracy against the direct sum, %d sources on %ux%u:\n",
+           *(fim->psn),fim->fieldsize[0],fim->fieldsize[1]);
+    record(1,"%12s %10s %9s %14s %14s\n","tolerance","time (s)","speedup","max err/max","rms err/rms");
+    record(1,"%12s %10.3f %9.2f %14s %14s\n","direct",directtime,1.0,"-","-");
+
+    int t;
+    for (t=0; t<(int)(sizeof(reporttolerances)/sizeof(double)) && !failed; ++t) {
+        start = wallClock();
+        failed = computeFieldFar(engine,fim,NULL,approx,reporttolerances[t]);
+        const double time = wallClock()-start;
+
+        double maxerr = 0, sqerr = 0;
+        for (i=0; i<pixels && !failed; ++i) {
+            const double e = hypot(approx[2*i]-exact[2*i],approx[2*i+1]-exact[2*i+1]);
+            if (!isfinite(e)) continue;
+            if (e > maxerr) maxerr = e;
+            sqerr += e*e;
+        }
+        if (!failed) {
+            record(1,"%12g %10.3f %9.2f %14.3e %14.3e\n",reporttolerances[t],time,
+                   directtime/time,fmax > 0 ? maxerr/fmax : 0,
+                   rms > 0 ? sqrt(sqerr/(n > 0 ? n : 1))/rms : 0);
+        }
+    }
+
+    free(exact);
+    free(approx);
+    return failed;
+}
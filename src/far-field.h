@@ -0,0 +1,24 @@
+// Approximate CPU evaluation for large arrays over large grids. Sources are
+// split into spatial clusters of one wavenumber and the grid into square
+// tiles. Seen from a tile well separated from it, a cluster's field is a plane
+// wave e^(ik u.x) along the cluster-to-tile direction u times a smooth
+// envelope; the envelope is evaluated exactly at p x p Chebyshev nodes over
+// the tile and interpolated to the pixels, p being the lowest order whose
+// error estimate is within the tolerance. Clusters near a tile, and pairs
+// where interpolation would cost more than the direct sum, are summed directly
+// with the CPU field kernel.
+//
+// The tolerance bounds the estimated error of each interpolated contribution
+// relative to that contribution, not the error of the field; the report
+// measures what a range of tolerances actually gives against the direct sum
+// on a given scenario.
+#define FAR_TILE_SIZE 32
+#define FAR_CLUSTER_SIZE 64
+#define FAR_MAX_ORDER 16
+#define FAR_DEFAULT_TOLERANCE 1e-4
+
+int computeFieldFar(CpuFieldEngine* const engine, const FieldInfoMap* const fim,
+                    FieldDataMap* const fdm, GLfloat* const field, double tolerance);
+
+int runFarFieldReport(CpuFieldEngine* const engine, const FieldInfoMap* const fim,
+                      FieldDataMap* const fdm);
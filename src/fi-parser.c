@@ -1,205 +1,440 @@
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
+#include <math.h>
 #include <GL/gl.h>
 
 #include "common.h"
 #include "fim.h"
+#include "fi-parser.h"
 
-#define MAX_BLOCKS 32
-#define RPTERRORLC(S) record(1,"Error - L%d, C%d: " S,linecount,columncount)
+#define RPTERRORAT(P,AT,S,...) record(1,"Error - L%d, C%d: " S,(P)->line, \
+                                      (int)((AT)-(P)->linestart)+1,##__VA_ARGS__)
+#define RPTERRORLC(P,S,...) RPTERRORAT(P,(P)->p,S,##__VA_ARGS__)
 
-int current_point_source_loc = 0;
-int current_point_source_freq = 0;
-int current_point_source_phase = 0;
+// Where the next value of each per-source block goes, and where we are in
+// the text. All parser state lives here so files can be parsed concurrently.
+typedef struct {
+    const char* p;
+    const char* end;
+    const char* linestart;
+    int line;
+
+    int next_loc;
+    int next_freq;
+    int next_phase;
+    int next_z;
+
+    FieldInfoMap* fim;
+    FieldDataMap* fdm;
+} FiParser;
+
+typedef struct {
+    const char* start;
+    int length;
+} FiToken;
+
+enum { PS_LOC, PS_FREQ, PS_PHASE, PS_Z };
+
+static int isDelimiter(char c) {
+    return c == ' ' || c == ',' || c == '(' || c == ')' ||
+           c == '\n' || c == '\t' || c == '\r';
+}
+
+static void advance(FiParser* const ps) {
+    if (*ps->p == '\n') {
+        ++ps->line;
+        ps->linestart = ps->p+1;
+    }
+    ++ps->p;
+}
+
+// Next token within the current block; 0 once a bracket or the end is reached
+static int nextToken(FiParser* const ps, FiToken* const token) {
+    while (ps->p < ps->end && isDelimiter(*ps->p)) advance(ps);
+    if (ps->p == ps->end || *ps->p == '[' || *ps->p == ']') return 0;
+
+    token->start = ps->p;
+    while (ps->p < ps->end && !isDelimiter(*ps->p) && *ps->p != '[' && *ps->p != ']') ++ps->p;
+    token->length = (int)(ps->p-token->start);
+    return 1;
+}
+
+static int tokenIs(const FiToken* const token, const char* const name) {
+    return (size_t)token->length == strlen(name) &&
+           memcmp(token->start,name,token->length) == 0;
+}
+
+/*
+ * Decimal number covering exactly [p,end): optional sign, digits with an
+ * optional point, optional exponent. Up to 17 significant digits are kept and
+ * scaled by an exact power of ten where possible, which is plenty for floats.
+ */
+static int scanNumber(const char* p, const char* const end,
+                      double* const value, int* const integral)
+{
+    static const double exact[] = { 1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,
+                                    1e11,1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,
+                                    1e20,1e21,1e22 };
+    uint64_t mantissa = 0;
+    int exponent = 0, digits = 0, negative = 0;
+
+    *integral = 1;
+    if (p < end && (*p == '+' || *p == '-')) negative = *p++ == '-';
+
+    for (; p < end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+        if (mantissa < 10000000000000000ULL) mantissa = 10*mantissa+(*p-'0');
+        else ++exponent;
+    }
+    if (p < end && *p == '.') {
+        *integral = 0;
+        for (++p; p < end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+            if (mantissa < 10000000000000000ULL) {
+                mantissa = 10*mantissa+(*p-'0');
+                --exponent;
+            }
+        }
+    }
+    if (digits == 0) return 0;
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        int e = 0, enegative = 0, edigits = 0;
+        *integral = 0;
+        ++p;
+        if (p < end && (*p == '+' || *p == '-')) enegative = *p++ == '-';
+        for (; p < end && *p >= '0' && *p <= '9'; ++p, ++edigits) {
+            if (e < 100000) e = 10*e+(*p-'0');
+        }
+        if (edigits == 0) return 0;
+        exponent += enegative ? -e : e;
+    }
+    if (p != end) return 0;
+
+    double v = (double)mantissa;
+    if (exponent < 0) {
+        v = -exponent <= 22 ? v/exact[-exponent] : v*pow(10.0,exponent);
+    } else if (exponent > 0) {
+        v = exponent <= 22 ? v*exact[exponent] : v*pow(10.0,exponent);
+    }
+    *value = negative ? -v : v;
+    return 1;
+}
+
+// Convert one token into target; bad tokens are reported and leave it alone
+static void storeToken(FiParser* const ps, const FiToken* const token, const int n,
+                       GLenum datatype, void* const target)
+{
+    double v;
+    int integral;
+    const int number = scanNumber(token->start,token->start+token->length,&v,&integral);
 
-void recordToken(const int valid, const int n, GLenum datatype,
-                 const char* const token, const void* const data) {
     if (datatype == GL_FLOAT) {
-        if (valid) record(0,"> Token %d: %s -> %f at %p\n",n,token,*((GLfloat*)data),data);
-        else record(1,"Error at token %d: \"%s\" <- float type expected\n",n,token);
+        if (number) {
+            *(GLfloat*)target = (GLfloat)v;
+            record(0,"> Token %d: %.*s -> %f at %p\n",n,token->length,token->start,
+                   *(GLfloat*)target,target);
+            return;
+        }
+        RPTERRORAT(ps,token->start,"token %d: \"%.*s\" <- float type expected\n",
+                   n,token->length,token->start);
     } else if (datatype == GL_INT) {
-        if (valid) record(0,"> Token %d: %s -> %d at %p\n",n,token,*((GLint*)data),data);
-        else record(1,"Error at token %d: \"%s\" <- integer type expected\n",n,token);
+        if (number && integral && v >= -2147483648.0 && v <= 2147483647.0) {
+            *(GLint*)target = (GLint)v;
+            record(0,"> Token %d: %.*s -> %d at %p\n",n,token->length,token->start,
+                   *(GLint*)target,target);
+            return;
+        }
+        RPTERRORAT(ps,token->start,"token %d: \"%.*s\" <- integer type expected\n",
+                   n,token->length,token->start);
     } else if (datatype == GL_UNSIGNED_INT) {
-        if (valid) record(0,"> Token %d: %s -> %u at %p\n",n,token,*((GLuint*)data),data);
-        else record(1,"Error at token %d: \"%s\" <- unsigned integer type expected\n",n,token);
+        if (number && integral && v >= 0 && v <= 4294967295.0) {
+            *(GLuint*)target = (GLuint)v;
+            record(0,"> Token %d: %.*s -> %u at %p\n",n,token->length,token->start,
+                   *(GLuint*)target,target);
+            return;
+        }
+        RPTERRORAT(ps,token->start,"token %d: \"%.*s\" <- unsigned integer type expected\n",
+                   n,token->length,token->start);
     }
 }
 
-int parseData(char* const cdata, const char* const delim,
-              const int n, GLenum datatype, void* target)
-{
-    int tokenvalid;
+// Up to n values into target; anything past n is skipped
+static int parseData(FiParser* const ps, const int n, GLenum datatype, void* const target) {
+    const size_t size = datatype == GL_FLOAT ? sizeof(GLfloat) :
+                        datatype == GL_INT ? sizeof(GLint) : sizeof(GLuint);
+    FiToken token;
 
     int i = 0;
-    const char* token = strtok(cdata,delim);
-    while(token != NULL && i<n) {
-        if (datatype == GL_FLOAT) {
-            tokenvalid = sscanf(token,"%f",(GLfloat*)target+i);
-            recordToken(tokenvalid,i+1,datatype,token,(void*)((GLfloat*)target+i));
-        } else if (datatype == GL_INT) {
-            tokenvalid = sscanf(token,"%d",(GLint*)target+i);
-            recordToken(tokenvalid,i+1,datatype,token,(void*)((GLint*)target+i));
-        } else if (datatype == GL_UNSIGNED_INT) {
-            tokenvalid = sscanf(token,"%u",(GLuint*)target+i);
-            recordToken(tokenvalid,i+1,datatype,token,(void*)((GLuint*)target+i));
-        } else return 0;
-        token = strtok(NULL,delim);
+    while (nextToken(ps,&token)) {
+        if (i < n) storeToken(ps,&token,i+1,datatype,(char*)target+size*i);
         ++i;
     }
 
-    return i;
+    return i < n ? i : n;
 }
 
-int parsePointSource(char* const cdata,
-                     const char* const delim,
-                     const int index,
-                     FieldInfoMap* const fim)
-{
-    GLfloat* const location = fim->ps_loc+NUM_DIMS*index;
-    GLfloat* const frequency = fim->ps_freq+index;
-    GLfloat* const phase = fim->ps_phase+index;
+static GLfloat* sourceArray(const FieldInfoMap* const fim, int which) {
+    return which == PS_LOC ? fim->ps_loc : which == PS_FREQ ? fim->ps_freq :
+           which == PS_PHASE ? fim->ps_phase : fim->ps_z;
+}
 
-    const char* tokens[NUM_DIMS+2];
-    int i = 0;
+/*
+ * Values of one per-source array, starting at element first (counted in
+ * floats, so NUM_DIMS per source for locations). Storage grows as the values
+ * come in; reservePointSources at least doubles, so this stays linear.
+ */
+static int parseSourceValues(FiParser* const ps, int first, int which) {
+    const int stride = which == PS_LOC ? NUM_DIMS : 1;
+    FiToken token;
 
-    tokens[i] = strtok(cdata,delim);
-    while (tokens[i] != NULL && i<NUM_DIMS+2) {
+    int i = 0;
+    while (nextToken(ps,&token)) {
+        if (reservePointSources(ps->fim,(first+i)/stride+1)) return -1;
+        storeToken(ps,&token,i+1,GL_FLOAT,sourceArray(ps->fim,which)+first+i);
         ++i;
-        tokens[i] = strtok(NULL,delim);
     }
 
-    const int numtokens = i;
-    int tokenvalid;
+    return i;
+}
+
+static int parsePointSource(FiParser* const ps, const int index) {
+    FieldInfoMap* const fim = ps->fim;
+    FiToken token;
+
+    if (reservePointSources(fim,index+1)) return -1;
 
-    for (i=0; i<numtokens; ++i) {
+    int i = 0;
+    while (nextToken(ps,&token)) {
         if (i < NUM_DIMS) {
-            tokenvalid = sscanf(tokens[i],"%f",location+i);
-            recordToken(tokenvalid,i+1,GL_FLOAT,tokens[i],(void*)(location+i));
+            storeToken(ps,&token,i+1,GL_FLOAT,fim->ps_loc+NUM_DIMS*index+i);
         } else if (i == NUM_DIMS) {
-            tokenvalid = sscanf(tokens[i],"%f",frequency);
-            recordToken(tokenvalid,i+1,GL_FLOAT,tokens[i],(void*)(frequency));
+            storeToken(ps,&token,i+1,GL_FLOAT,fim->ps_freq+index);
         } else if (i == NUM_DIMS+1) {
-            tokenvalid = sscanf(tokens[i],"%f",phase);
-            recordToken(tokenvalid,i+1,GL_FLOAT,tokens[i],(void*)(phase));
+            storeToken(ps,&token,i+1,GL_FLOAT,fim->ps_phase+index);
+        }
+        ++i;
+    }
+
+    return i < NUM_DIMS+2 ? i : NUM_DIMS+2;
+}
+
+// Probe points, appended to any given before; a trailing partial point is dropped
+static int parseProbeValues(FiParser* const ps) {
+    FieldInfoMap* const fim = ps->fim;
+    const int first = NUM_DIMS*fim->probe_n;
+    FiToken token;
+
+    int i = 0;
+    while (nextToken(ps,&token)) {
+        if (reserveProbes(fim,(first+i)/NUM_DIMS+1)) return -1;
+        storeToken(ps,&token,i+1,GL_FLOAT,fim->probe_loc+first+i);
+        ++i;
+    }
+
+    if (i%NUM_DIMS != 0) {
+        RPTERRORLC(ps,"Probe-Location needs %d coordinates per point; the last %d ignored\n",
+                   NUM_DIMS,i%NUM_DIMS);
+        memset(fim->probe_loc+first+i-i%NUM_DIMS,0,sizeof(GLfloat)*(i%NUM_DIMS));
+    }
+    fim->probe_n += i/NUM_DIMS;
+    return i-i%NUM_DIMS;
+}
+
+// Origin, u and v as three floats each, then the sample counts along u and v
+static int parseSlice(FiParser* const ps) {
+    FieldInfoMap* const fim = ps->fim;
+    FiToken token;
+
+    if (reserveSlices(fim,fim->slice_n+1)) return -1;
+    FieldSlice* const slice = fim->slices+fim->slice_n;
+    GLfloat* const vectors[] = { slice->origin, slice->u, slice->v };
+
+    int i = 0;
+    while (nextToken(ps,&token)) {
+        if (i < 9) {
+            storeToken(ps,&token,i+1,GL_FLOAT,vectors[i/3]+i%3);
+        } else if (i < 11) {
+            storeToken(ps,&token,i+1,GL_UNSIGNED_INT,slice->size+i-9);
         }
+        ++i;
     }
 
-    return numtokens;
+    if (i < 11 || slice->size[0] == 0 || slice->size[1] == 0) {
+        RPTERRORLC(ps,"Volume-Slice needs an origin, two axes and two nonzero sizes; ignored\n");
+        memset(slice,0,sizeof(*slice));
+        return 0;
+    }
+    ++fim->slice_n;
+    return 11;
 }
 
-int parseBlock(char* const block, FieldInfoMap* const fim, FieldDataMap* const fdm)
-{
-    const char* delim = " ,()\n";
-    const char* blockname = strtok(block,delim);
-    char* const cdata = (char* const)(blockname+strlen(blockname)+1);
-
-    int i,j;
-    int numtokens;
-
-    record(0,"Block name: \"%s\"\n",blockname);
-
-    if (strcmp("Material-C",blockname) == 0) {
-        numtokens = parseData(cdata,delim,1,GL_FLOAT,(void*)(fim->mat_c));
-    } else if (strcmp("PointSource-Number",blockname) == 0) {
-        numtokens = parseData(cdata,delim,1,GL_INT,(void*)(fim->psn));
-    } else if (strcmp("PointSource",blockname) == 0) {
-        i = current_point_source_loc < current_point_source_freq ?
-                (current_point_source_freq < current_point_source_phase ?
-                     current_point_source_phase : current_point_source_freq) :
-                (current_point_source_loc < current_point_source_phase ?
-                     current_point_source_phase : current_point_source_loc);
-
-        numtokens = parsePointSource(cdata,delim,i,fim);
-        j = numtokens > 0 ? 1 : 0;
-
-        current_point_source_loc = i+j;
-        current_point_source_freq = i+j;
-        current_point_source_phase = i+j;
-    } else if (strcmp("PointSource-Location",blockname) == 0) {
-        numtokens = parseData(cdata,delim,
-                              NUM_DIMS*(MAX_POINT_SOURCE-current_point_source_loc),
-                              GL_FLOAT,
-                              (void*)(fim->ps_loc+NUM_DIMS*current_point_source_loc));
-
-        current_point_source_loc += 1 + (numtokens - 1)/NUM_DIMS;
-    } else if (strcmp("PointSource-Frequency",blockname) == 0) {
-        numtokens = parseData(cdata,delim,MAX_POINT_SOURCE-current_point_source_freq,
-                      GL_FLOAT,(void*)(fim->ps_freq+current_point_source_freq));
-
-        current_point_source_freq += numtokens;
-    } else if (strcmp("PointSource-Phase",blockname) == 0) {
-        numtokens = parseData(cdata,delim,MAX_POINT_SOURCE-current_point_source_phase,
-                      GL_FLOAT,(void*)(fim->ps_phase+current_point_source_phase));
-
-        current_point_source_phase += numtokens;
-    } else if (strcmp("Field-Offset",blockname) == 0) {
-        numtokens = parseData(cdata,delim,NUM_DIMS,GL_FLOAT,(void*)(fim->fieldoffset));
-    } else if (strcmp("Field-Dimensions",blockname) == 0) {
-        numtokens = parseData(cdata,delim,NUM_DIMS,GL_FLOAT,(void*)(fim->fielddims));
-    } else if (strcmp("Field-Size",blockname) == 0) {
-        numtokens = parseData(cdata,delim,NUM_DIMS,
-                              GL_UNSIGNED_INT,(void*)(fim->fieldsize));
-    } else if (strcmp("Field-Max",blockname) == 0) {
+// Two points on the wall, then its reflection coefficient
+static int parseWall(FiParser* const ps) {
+    FieldInfoMap* const fim = ps->fim;
+    FiToken token;
+
+    if (reserveWalls(fim,fim->wall_n+1)) return -1;
+    GLfloat* const loc = fim->wall_loc+4*fim->wall_n;
+    GLfloat* const coef = fim->wall_coef+fim->wall_n;
+
+    int i = 0;
+    while (nextToken(ps,&token)) {
+        if (i < 4) {
+            storeToken(ps,&token,i+1,GL_FLOAT,loc+i);
+        } else if (i == 4) {
+            storeToken(ps,&token,i+1,GL_FLOAT,coef);
+        }
+        ++i;
+    }
+
+    if (i < 5) {
+        RPTERRORLC(ps,"Wall needs two points and a reflection coefficient; ignored\n");
+        memset(loc,0,sizeof(GLfloat)*4);
+        *coef = 0;
+        return 0;
+    }
+    if (*coef > 1 || *coef < -1) {
+        RPTERRORLC(ps,"Wall reflection coefficient %f clamped to [-1,1]\n",*coef);
+        *coef = *coef > 0 ? 1 : -1;
+    }
+    ++fim->wall_n;
+    return 5;
+}
+
+// Contents of one block, from just after its '[' up to its ']'
+static int parseBlock(FiParser* const ps) {
+    FieldInfoMap* const fim = ps->fim;
+    FieldDataMap* const fdm = ps->fdm;
+    FiToken blockname;
+    int i, numtokens = 0;
+
+    if (!nextToken(ps,&blockname)) {
+        RPTERRORLC(ps,"Block without a name\n");
+        return 0;
+    }
+
+    record(0,"Block name: \"%.*s\"\n",blockname.length,blockname.start);
+
+    if (tokenIs(&blockname,"Material-C")) {
+        numtokens = parseData(ps,1,GL_FLOAT,(void*)(fim->mat_c));
+    } else if (tokenIs(&blockname,"PointSource-Number")) {
+        numtokens = parseData(ps,1,GL_INT,(void*)(fim->psn));
+        if (reservePointSources(fim,*(fim->psn))) {
+            RPTERRORLC(ps,"PointSource-Number %d is more than can be held\n",*(fim->psn));
+            return -1;
+        }
+    } else if (tokenIs(&blockname,"PointSource")) {
+        i = ps->next_loc < ps->next_freq ?
+                (ps->next_freq < ps->next_phase ? ps->next_phase : ps->next_freq) :
+                (ps->next_loc < ps->next_phase ? ps->next_phase : ps->next_loc);
+
+        numtokens = parsePointSource(ps,i);
+        if (numtokens > 0) {
+            ps->next_loc = i+1;
+            ps->next_freq = i+1;
+            ps->next_phase = i+1;
+        }
+    } else if (tokenIs(&blockname,"PointSource-Location")) {
+        numtokens = parseSourceValues(ps,NUM_DIMS*ps->next_loc,PS_LOC);
+        if (numtokens > 0) ps->next_loc += (numtokens+NUM_DIMS-1)/NUM_DIMS;
+    } else if (tokenIs(&blockname,"PointSource-Frequency")) {
+        numtokens = parseSourceValues(ps,ps->next_freq,PS_FREQ);
+        if (numtokens > 0) ps->next_freq += numtokens;
+    } else if (tokenIs(&blockname,"PointSource-Phase")) {
+        numtokens = parseSourceValues(ps,ps->next_phase,PS_PHASE);
+        if (numtokens > 0) ps->next_phase += numtokens;
+    } else if (tokenIs(&blockname,"PointSource-Height")) {
+        numtokens = parseSourceValues(ps,ps->next_z,PS_Z);
+        if (numtokens > 0) ps->next_z += numtokens;
+    } else if (tokenIs(&blockname,"Probe-Location")) {
+        numtokens = parseProbeValues(ps);
+    } else if (tokenIs(&blockname,"Field-Offset")) {
+        numtokens = parseData(ps,NUM_DIMS,GL_FLOAT,(void*)(fim->fieldoffset));
+    } else if (tokenIs(&blockname,"Field-Dimensions")) {
+        numtokens = parseData(ps,NUM_DIMS,GL_FLOAT,(void*)(fim->fielddims));
+    } else if (tokenIs(&blockname,"Field-Size")) {
+        numtokens = parseData(ps,NUM_DIMS,GL_UNSIGNED_INT,(void*)(fim->fieldsize));
+    } else if (tokenIs(&blockname,"Volume-Offset")) {
+        numtokens = parseData(ps,3,GL_FLOAT,(void*)(fim->volumeoffset));
+    } else if (tokenIs(&blockname,"Volume-Dimensions")) {
+        numtokens = parseData(ps,3,GL_FLOAT,(void*)(fim->volumedims));
+    } else if (tokenIs(&blockname,"Volume-Size")) {
+        numtokens = parseData(ps,3,GL_UNSIGNED_INT,(void*)(fim->volumesize));
+    } else if (tokenIs(&blockname,"Volume-Slice")) {
+        numtokens = parseSlice(ps);
+    } else if (tokenIs(&blockname,"Wall")) {
+        numtokens = parseWall(ps);
+    } else if (tokenIs(&blockname,"Reflection-Order")) {
+        numtokens = parseData(ps,1,GL_INT,(void*)&fim->reflect_order);
+    } else if (tokenIs(&blockname,"Reflection-Threshold")) {
+        numtokens = parseData(ps,1,GL_FLOAT,(void*)&fim->reflect_threshold);
+    } else if (tokenIs(&blockname,"Field-Max")) {
         *(fdm->written) = 2;
-        numtokens = parseData(cdata,delim,1,GL_FLOAT,(void*)(fdm->field_max));
-    } else if (strcmp("Field-Min",blockname) == 0) {
+        numtokens = parseData(ps,1,GL_FLOAT,(void*)(fdm->field_max));
+    } else if (tokenIs(&blockname,"Field-Min")) {
         *(fdm->written) = 2;
-        numtokens = parseData(cdata,delim,1,GL_FLOAT,(void*)(fdm->field_min));
+        numtokens = parseData(ps,1,GL_FLOAT,(void*)(fdm->field_min));
     } else {
-        record(1,"\"%s\" does not correspond to any available data field\n",
-               blockname);
+        RPTERRORAT(ps,blockname.start,"\"%.*s\" does not correspond to any available data field\n",
+                   blockname.length,blockname.start);
+        parseData(ps,0,GL_FLOAT,NULL);
     }
 
-    record(0,"Read %d tokens from block %s\n\n",numtokens,blockname);
+    record(0,"Read %d tokens from block %.*s\n\n",numtokens,blockname.length,blockname.start);
 
     return numtokens;
 }
 
-int parseFieldInfo(char* const textbuffer, int bufsize,
+int parseFieldInfo(const char* const text, size_t size,
                    FieldInfoMap* const fim, FieldDataMap* const fdm)
 {
     record(0,"Scanning FI input buffer\n");
-    char* block_start[MAX_BLOCKS];
-
-    int i,j=0,open=0,linecount=0,columncount=0;
-    for (i = 0; i<bufsize && j<MAX_BLOCKS; ++i) {
-        if (open) {
-            if (textbuffer[i] == ']') {
-                textbuffer[i] = '\0';
-                open=0;
-                ++j;
-            } else if (textbuffer[i] == '[') {
-                RPTERRORLC("Can't open a block within a block.\n");
-                return 1;
-            }
-        } else {
-            if (textbuffer[i] == '[') {
-                block_start[j] = textbuffer+i+1;
-                open=1;
-            } else if (textbuffer[i] == ']') {
-                RPTERRORLC("No block to close\n");
-                return 1;
-            }
+
+    FiParser ps;
+    ps.p = text;
+    ps.end = text+size;
+    ps.linestart = text;
+    ps.line = 1;
+    ps.next_loc = 0;
+    ps.next_freq = 0;
+    ps.next_phase = 0;
+    ps.next_z = 0;
+    ps.fim = fim;
+    ps.fdm = fdm;
+    fim->probe_n = 0;
+    fim->slice_n = 0;
+    fim->wall_n = 0;
+
+    int numblocks = 0;
+    while (ps.p < ps.end) {
+        if (*ps.p == ']') {
+            RPTERRORLC(&ps,"No block to close\n");
+            return 1;
+        } else if (*ps.p != '[') {
+            // Anything between blocks is commentary
+            advance(&ps);
+            continue;
         }
 
-        if (textbuffer[i] == '\n') {
-            ++linecount;
-            columncount=0;
-        } else {
-            ++columncount;
+        ++ps.p;
+        if (parseBlock(&ps) < 0) return 1;
+
+        if (ps.p == ps.end) {
+            RPTERRORLC(&ps,"Block not closed before end of input\n");
+            return 1;
+        } else if (*ps.p == '[') {
+            RPTERRORLC(&ps,"Can't open a block within a block.\n");
+            return 1;
         }
+        ++ps.p;
+        ++numblocks;
     }
 
-    record(0,"%d blocks found\n\n",j);
+    record(0,"%d blocks read\n\n",numblocks);
 
-    const int numblocks = j;
-
-    j = 0;
-    const char* const delim = " ,()\n";
-    for (i=0; i<numblocks; ++i) {
-        parseBlock(block_start[i],fim,fdm);
-    }
+    // Sources past the last one given are left at zero, as they always were
+    if (*(fim->psn) < 0) *(fim->psn) = 0;
+    if (reservePointSources(fim,*(fim->psn))) return 1;
 
     return 0;
 }
@@ -1,2 +1,4 @@
-int parseFieldInfo(char* const buffer, int bufsize,
+// FI text in [text,text+size), which is only read and needn't be null
+// terminated. Keeps no state between calls.
+int parseFieldInfo(const char* const text, size_t size,
                    FieldInfoMap* const fim, FieldDataMap* const fdm);
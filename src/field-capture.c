@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <GL/glew.h>
+
+#include "common.h"
+#include "fim.h"
+#include "field-file.h"
+#include "field-capture.h"
+
+// How long a blocking wait sleeps on a fence before checking again
+#define CAPTURE_WAIT_NS 100000000
+
+enum {
+    SLOT_FREE,
+    // Copy issued, fence not yet signalled
+    SLOT_COPYING,
+    // Mapped and owned by the writer
+    SLOT_WRITING,
+    // Written; waiting for the GL thread to take it back
+    SLOT_WRITTEN
+};
+
+typedef struct {
+    GLuint pbo;
+    GLsync fence;
+    GLvoid* data;
+    FieldFileHeader header;
+    long index;
+    int state;
+} CaptureSlot;
+
+struct FieldCapture {
+    FILE* fp;
+    const char* filename;
+    int wait;
+    int persistent;
+
+    GLuint texture;
+    GLuint texturewidth;
+    GLuint textureheight;
+    GLuint fielddatassbo;
+    GLsizeiptr fdbstoragesize;
+    size_t imagebytes;
+    // Of each statistic in the FieldData block
+    ptrdiff_t writtenoffset;
+    ptrdiff_t minoffset;
+    ptrdiff_t maxoffset;
+
+    CaptureSlot slots[CAPTURE_RING_SIZE];
+    // Slot the next capture goes in, and the oldest one still copying
+    int next;
+    int handoff;
+    long captured;
+    long dropped;
+
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t done;
+    int stopping;
+    // Set by the writer, read once it has stopped
+    long written;
+    // Set by either thread, under lock; the writer skips slots once it is
+    int failed;
+};
+
+/* ----
+ *  Writer thread
+ ---- */
+
+static int writeSlot(FieldCapture* const capture, CaptureSlot* const slot) {
+    FieldFileHeader* const header = &slot->header;
+    const char* const data = (const char*)slot->data;
+
+    if (capture->fdbstoragesize > 0) {
+        const char* const block = data+capture->imagebytes;
+        memcpy(&header->written,block+capture->writtenoffset,sizeof(GLint));
+        memcpy(&header->field_min,block+capture->minoffset,sizeof(GLfloat));
+        memcpy(&header->field_max,block+capture->maxoffset,sizeof(GLfloat));
+    }
+
+    // Encoding to the header's format happens here too, off the GL thread
+    if (fwrite(header,sizeof(*header),1,capture->fp) != 1 ||
+            writeFieldRows(capture->fp,header,(const GLfloat*)data,
+                           2*(size_t)capture->texturewidth)) return 1;
+
+    record(0,"> Captured field %ld: min %f, max %f\n",slot->index,
+           header->field_min,header->field_max);
+    return 0;
+}
+
+static void* writerMain(void* arg) {
+    FieldCapture* const capture = (FieldCapture*)arg;
+    int i = 0;
+
+    // Slots are handed over in ring order, so they're written in it too
+    for (;;) {
+        CaptureSlot* const slot = capture->slots+i;
+        pthread_mutex_lock(&capture->lock);
+        while (slot->state != SLOT_WRITING && !capture->stopping) {
+            pthread_cond_wait(&capture->ready,&capture->lock);
+        }
+        if (slot->state != SLOT_WRITING) {
+            pthread_mutex_unlock(&capture->lock);
+            return NULL;
+        }
+        const int skip = capture->failed;
+        pthread_mutex_unlock(&capture->lock);
+
+        int failed = 0;
+        if (!skip) {
+            failed = writeSlot(capture,slot);
+            if (failed) {
+                record(1,"Failed to write captured field %ld to %s\n",slot->index,capture->filename);
+            } else {
+                ++capture->written;
+            }
+        }
+
+        pthread_mutex_lock(&capture->lock);
+        if (failed) capture->failed = 1;
+        slot->state = SLOT_WRITTEN;
+        pthread_cond_signal(&capture->done);
+        pthread_mutex_unlock(&capture->lock);
+        i = (i+1)%CAPTURE_RING_SIZE;
+    }
+}
+
+/* ----
+ *  Ring
+ ---- */
+
+// The fence has signalled: make the copy readable and pass it on
+static void handOver(FieldCapture* const capture, CaptureSlot* const slot) {
+    glDeleteSync(slot->fence);
+    slot->fence = 0;
+    int failed = 0;
+    if (!capture->persistent) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER,slot->pbo);
+        slot->data = glMapBufferRange(GL_PIXEL_PACK_BUFFER,0,
+                                      capture->imagebytes+capture->fdbstoragesize,GL_MAP_READ_BIT);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER,0);
+        if (slot->data == NULL) {
+            record(1,"Failed to map captured field %ld\n",slot->index);
+            failed = 1;
+        }
+    }
+
+    pthread_mutex_lock(&capture->lock);
+    if (failed) capture->failed = 1;
+    slot->state = SLOT_WRITING;
+    pthread_cond_signal(&capture->ready);
+    pthread_mutex_unlock(&capture->lock);
+    capture->handoff = (capture->handoff+1)%CAPTURE_RING_SIZE;
+}
+
+static void reclaimSlots(FieldCapture* const capture) {
+    int i;
+    pthread_mutex_lock(&capture->lock);
+    for (i=0; i<CAPTURE_RING_SIZE; ++i) {
+        CaptureSlot* const slot = capture->slots+i;
+        if (slot->state != SLOT_WRITTEN) continue;
+        if (!capture->persistent && slot->data != NULL) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER,slot->pbo);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER,0);
+            slot->data = NULL;
+        }
+        slot->state = SLOT_FREE;
+    }
+    pthread_mutex_unlock(&capture->lock);
+}
+
+void pollFieldCapture(FieldCapture* const capture) {
+    if (capture == NULL) return;
+
+    reclaimSlots(capture);
+    for (;;) {
+        CaptureSlot* const slot = capture->slots+capture->handoff;
+        if (slot->state != SLOT_COPYING) break;
+        const GLenum status = glClientWaitSync(slot->fence,0,0);
+        if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) break;
+        handOver(capture,slot);
+    }
+}
+
+// Blocks until slot is free, flushing and waiting on whatever is ahead of it
+static void waitForSlot(FieldCapture* const capture, CaptureSlot* const slot) {
+    for (;;) {
+        pollFieldCapture(capture);
+        if (slot->state == SLOT_FREE) return;
+
+        CaptureSlot* const oldest = capture->slots+capture->handoff;
+        if (oldest->state == SLOT_COPYING) {
+            const GLenum status = glClientWaitSync(oldest->fence,GL_SYNC_FLUSH_COMMANDS_BIT,
+                                                   CAPTURE_WAIT_NS);
+            if (status == GL_WAIT_FAILED) {
+                // Nothing more will come of it; let the writer skip it
+                record(1,"Waiting on a field capture failed\n");
+                pthread_mutex_lock(&capture->lock);
+                capture->failed = 1;
+                pthread_mutex_unlock(&capture->lock);
+                handOver(capture,oldest);
+            }
+        } else {
+            pthread_mutex_lock(&capture->lock);
+            while (slot->state == SLOT_WRITING) pthread_cond_wait(&capture->done,&capture->lock);
+            pthread_mutex_unlock(&capture->lock);
+        }
+    }
+}
+
+int captureField(FieldCapture* const capture, const FieldInfoMap* const fim,
+                 const FieldDataMap* const fdm)
+{
+    if (capture == NULL) return 1;
+
+    pollFieldCapture(capture);
+    CaptureSlot* const slot = capture->slots+capture->next;
+    if (slot->state != SLOT_FREE) {
+        if (!capture->wait) {
+            ++capture->dropped;
+            return 1;
+        }
+        waitForSlot(capture,slot);
+    }
+
+    fillFieldFileHeader(&slot->header,fim,fdm);
+    slot->index = capture->captured++;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER,slot->pbo);
+    glBindTexture(GL_TEXTURE_2D,capture->texture);
+    glGetTexImage(GL_TEXTURE_2D,0,GL_RG,GL_FLOAT,(GLvoid*)0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER,0);
+    if (capture->fdbstoragesize > 0) {
+        glBindBuffer(GL_COPY_READ_BUFFER,capture->fielddatassbo);
+        glBindBuffer(GL_COPY_WRITE_BUFFER,slot->pbo);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER,GL_COPY_WRITE_BUFFER,0,
+                            capture->imagebytes,capture->fdbstoragesize);
+    }
+    slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE,0);
+    // Polls don't flush, so without this the fence could wait on the next swap
+    glFlush();
+    slot->state = SLOT_COPYING;
+    capture->next = (capture->next+1)%CAPTURE_RING_SIZE;
+    return 0;
+}
+
+/* ----
+ *  Setup
+ ---- */
+
+static void freeSlots(FieldCapture* const capture) {
+    int i;
+    for (i=0; i<CAPTURE_RING_SIZE; ++i) {
+        CaptureSlot* const slot = capture->slots+i;
+        if (slot->pbo == 0) continue;
+        if (slot->data != NULL) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER,slot->pbo);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        glDeleteBuffers(1,&slot->pbo);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER,0);
+}
+
+FieldCapture* createFieldCapture(const char* const filename, int wait, GLuint texture,
+                                 GLuint texturewidth, GLuint textureheight,
+                                 GLuint fielddatassbo, GLsizeiptr fdbstoragesize,
+                                 const FieldDataMap* const fdm)
+{
+    FieldCapture* const capture = (FieldCapture*)calloc(1,sizeof(FieldCapture));
+    if (capture == NULL) {
+        record(1,"Failed to allocate field capture\n");
+        return NULL;
+    }
+
+    capture->fp = fopen(filename,"wb");
+    if (capture->fp == NULL) {
+        record(1,"Failed to open capture file %s\n",filename);
+        free(capture);
+        return NULL;
+    }
+    capture->filename = filename;
+    capture->wait = wait;
+    capture->persistent = GLEW_ARB_buffer_storage;
+    capture->texture = texture;
+    capture->texturewidth = texturewidth;
+    capture->textureheight = textureheight;
+    capture->fielddatassbo = fielddatassbo;
+    capture->fdbstoragesize = fdbstoragesize;
+    capture->imagebytes = sizeof(GLfloat)*2*(size_t)texturewidth*textureheight;
+    const char* const block = (const char*)fdm->block_start;
+    capture->writtenoffset = (const char*)fdm->written-block;
+    capture->minoffset = (const char*)fdm->field_min-block;
+    capture->maxoffset = (const char*)fdm->field_max-block;
+
+    // Drop whatever errors came before, so the check below is only of these
+    while (glGetError() != GL_NO_ERROR);
+
+    const GLsizeiptr size = capture->imagebytes+fdbstoragesize;
+    const GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    int i;
+    for (i=0; i<CAPTURE_RING_SIZE; ++i) {
+        CaptureSlot* const slot = capture->slots+i;
+        glGenBuffers(1,&slot->pbo);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER,slot->pbo);
+        if (capture->persistent) {
+            glBufferStorage(GL_PIXEL_PACK_BUFFER,size,NULL,flags);
+            slot->data = glMapBufferRange(GL_PIXEL_PACK_BUFFER,0,size,flags);
+        } else {
+            glBufferData(GL_PIXEL_PACK_BUFFER,size,NULL,GL_STREAM_READ);
+        }
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER,0);
+
+    if (glGetError() != GL_NO_ERROR || (capture->persistent && capture->slots[0].data == NULL)) {
+        record(1,"Failed to create %d field capture buffers of %.1f MB\n",
+               CAPTURE_RING_SIZE,size/1048576.0);
+        freeSlots(capture);
+        fclose(capture->fp);
+        free(capture);
+        return NULL;
+    }
+
+    pthread_mutex_init(&capture->lock,NULL);
+    pthread_cond_init(&capture->ready,NULL);
+    pthread_cond_init(&capture->done,NULL);
+    if (pthread_create(&capture->writer,NULL,writerMain,capture)) {
+        record(1,"Failed to start field capture writer thread\n");
+        pthread_cond_destroy(&capture->ready);
+        pthread_cond_destroy(&capture->done);
+        pthread_mutex_destroy(&capture->lock);
+        freeSlots(capture);
+        fclose(capture->fp);
+        free(capture);
+        return NULL;
+    }
+
+    record(0,"Capturing fields to %s through %d %s buffers of %.1f MB\n",filename,
+           CAPTURE_RING_SIZE,capture->persistent ? "persistently mapped" : "mapped",size/1048576.0);
+    return capture;
+}
+
+int finishFieldCapture(FieldCapture* const capture) {
+    if (capture == NULL) return 0;
+
+    // In ring order from the oldest, so each wait is on what's ahead of it
+    int i;
+    for (i=0; i<CAPTURE_RING_SIZE; ++i) {
+        waitForSlot(capture,capture->slots+(capture->next+i)%CAPTURE_RING_SIZE);
+    }
+
+    pthread_mutex_lock(&capture->lock);
+    capture->stopping = 1;
+    pthread_cond_signal(&capture->ready);
+    pthread_mutex_unlock(&capture->lock);
+    pthread_join(capture->writer,NULL);
+
+    pthread_cond_destroy(&capture->ready);
+    pthread_cond_destroy(&capture->done);
+    pthread_mutex_destroy(&capture->lock);
+    freeSlots(capture);
+
+    int failed = capture->failed;
+    if (fclose(capture->fp) != 0) failed = 1;
+    if (failed) {
+        record(1,"Field capture to %s is incomplete\n",capture->filename);
+    } else {
+        record(0,"Wrote %ld captured fields to %s\n",capture->written,capture->filename);
+    }
+    if (capture->dropped > 0) {
+        record(1,"%ld fields weren't captured to %s: every buffer was still in use\n",
+               capture->dropped,capture->filename);
+    }
+
+    free(capture);
+    return failed;
+}
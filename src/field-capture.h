@@ -0,0 +1,36 @@
+// Asynchronous field export. Each captured field is copied out of the field
+// image (and the FieldData block, for its header) into the next of
+// CAPTURE_RING_SIZE pixel pack buffers, with a fence after the copy. Nothing
+// waits on the copy: once a frame, buffers whose fences have signalled are
+// handed in order to a writer thread, which encodes them to the field format
+// and streams them to the file as field records (field-file.h) while the GPU
+// gets on with the next field.
+//
+// Buffers are mapped persistently where the driver has ARB_buffer_storage
+// and mapped for the duration of the write otherwise. With every buffer in
+// use a capture either waits for the oldest to come free (sweeps, which must
+// keep every record) or is dropped and counted (the viewer, which mustn't
+// stall).
+#define CAPTURE_RING_SIZE 4
+
+typedef struct FieldCapture FieldCapture;
+
+/*
+ * Records go to filename, replacing what it held. texture is the
+ * texturewidth x textureheight RG32F field image; only the field's own
+ * fieldsize corner of it is written. fielddatassbo may be 0 when
+ * fdbstoragesize is, in which case headers take the host's FieldData.
+ */
+FieldCapture* createFieldCapture(const char* const filename, int wait, GLuint texture,
+                                 GLuint texturewidth, GLuint textureheight,
+                                 GLuint fielddatassbo, GLsizeiptr fdbstoragesize,
+                                 const FieldDataMap* const fdm);
+// Queues the field image as it will be once the GL commands so far have run;
+// nonzero if it was dropped
+int captureField(FieldCapture* const capture, const FieldInfoMap* const fim,
+                 const FieldDataMap* const fdm);
+// Hands finished copies to the writer and takes back written buffers
+void pollFieldCapture(FieldCapture* const capture);
+// Writes out everything queued and frees the capture; nonzero if any of it
+// couldn't be written
+int finishFieldCapture(FieldCapture* const capture);
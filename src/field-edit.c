@@ -0,0 +1,76 @@
+#include <string.h>
+#include <GL/gl.h>
+
+#include "common.h"
+#include "fim.h"
+#include "field-edit.h"
+
+void initFieldEdits(FieldEdits* const edits) {
+    edits->count = 0;
+    edits->incremental = 0;
+    edits->full = 1;
+}
+
+static void packSource(const FieldInfoMap* const fim, int index, GLfloat* const p) {
+    int d;
+    for (d=0; d<NUM_DIMS; ++d) p[d] = fim->ps_loc[NUM_DIMS*index+d];
+    p[NUM_DIMS] = fim->ps_freq[index];
+    p[NUM_DIMS+1] = fim->ps_phase[index];
+}
+
+void recordSourceEdit(FieldEdits* const edits, const FieldInfoMap* const fim, int index) {
+    if (edits->full) return;
+
+    // Already pending: the field still holds the older state, keep that
+    int i;
+    for (i=0; i<edits->count; ++i) if (edits->index[i] == index) return;
+
+    if (edits->count == MAX_PENDING_EDITS) {
+        requestFullUpdate(edits);
+        return;
+    }
+
+    edits->index[edits->count] = index;
+    packSource(fim,index,edits->before+PS_PACKED_STRIDE*edits->count);
+    ++edits->count;
+}
+
+void requestFullUpdate(FieldEdits* const edits) {
+    edits->full = 1;
+    edits->count = 0;
+}
+
+int fieldUpdatePending(const FieldEdits* const edits) {
+    return edits->full || edits->count > 0;
+}
+
+int fieldUpdateIsIncremental(const FieldEdits* const edits) {
+    return !edits->full && edits->count > 0 &&
+           edits->incremental+edits->count <= FIELD_REFRESH_INTERVAL;
+}
+
+int packSourceDeltas(const FieldEdits* const edits, const FieldInfoMap* const fim,
+                     GLfloat* const packed)
+{
+    int i;
+    for (i=0; i<edits->count; ++i) {
+        GLfloat* const after = packed+PS_PACKED_STRIDE*(2*i);
+        GLfloat* const before = after+PS_PACKED_STRIDE;
+
+        packSource(fim,edits->index[i],after);
+        memcpy(before,edits->before+PS_PACKED_STRIDE*i,sizeof(GLfloat)*PS_PACKED_STRIDE);
+        before[NUM_DIMS+1] += PI;
+    }
+    return 2*edits->count;
+}
+
+void finishFieldUpdate(FieldEdits* const edits, int incremental) {
+    if (incremental) {
+        edits->incremental += edits->count;
+    } else {
+        edits->incremental = 0;
+        record(0,"Full field evaluation\n");
+    }
+    edits->count = 0;
+    edits->full = 0;
+}
@@ -0,0 +1,32 @@
+// Incremental field updates. Whoever changes point source i calls
+// recordSourceEdit first; the old record is kept until the field is next
+// brought up to date. If the update can be incremental, packSourceDeltas
+// turns the pending edits into a short list of PS_PACKED_STRIDE source
+// records, the new state of each edited source followed by its old state with
+// the phase advanced by pi, i.e. negated, so adding their contribution to the
+// existing field swaps old for new at the cost of 2 sources per edit.
+//
+// Each incremental update adds float rounding that a full evaluation doesn't
+// have, so after FIELD_REFRESH_INTERVAL of them the field is recomputed in
+// full. More than MAX_PENDING_EDITS at once also falls back to a full pass.
+#define MAX_PENDING_EDITS 64
+#define FIELD_REFRESH_INTERVAL 256
+
+typedef struct {
+    int count;
+    GLint index[MAX_PENDING_EDITS];
+    GLfloat before[PS_PACKED_STRIDE*MAX_PENDING_EDITS];
+
+    int incremental;
+    int full;
+} FieldEdits;
+
+void initFieldEdits(FieldEdits* const edits);
+void recordSourceEdit(FieldEdits* const edits, const FieldInfoMap* const fim, int index);
+void requestFullUpdate(FieldEdits* const edits);
+
+int fieldUpdatePending(const FieldEdits* const edits);
+int fieldUpdateIsIncremental(const FieldEdits* const edits);
+int packSourceDeltas(const FieldEdits* const edits, const FieldInfoMap* const fim,
+                     GLfloat* const packed);
+void finishFieldUpdate(FieldEdits* const edits, int incremental);
@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <GL/gl.h>
+
+#include "common.h"
+#include "fim.h"
+#include "field-file.h"
+
+static const char* const formatNames[FIELD_NUM_FORMATS] = {
+    "rg32f", "rg16f", "r32f-mag", "r16f-mag", "r32f-db", "r16f-db", "u16-mag", "u8-mag"
+};
+
+static int fieldformat = FIELD_FORMAT_RG32F;
+
+int parseFieldFormat(const char* const name) {
+    int i;
+    for (i=0; i<FIELD_NUM_FORMATS; ++i) {
+        if (strcmp(name,formatNames[i]) == 0) return i;
+    }
+    record(1,"Unknown field format %s; the formats are",name);
+    for (i=0; i<FIELD_NUM_FORMATS; ++i) record(1," %s",formatNames[i]);
+    record(1,"\n");
+    return -1;
+}
+
+const char* fieldFormatName(int format) {
+    return format >= 0 && format < FIELD_NUM_FORMATS ? formatNames[format] : "unknown";
+}
+
+void setFieldFormat(int format) { fieldformat = format; }
+int fieldFormat(void) { return fieldformat; }
+
+/* ----
+ *  Encoding
+ ---- */
+
+// Round to nearest even, as the GL does
+static GLushort floatToHalf(GLfloat f) {
+    GLuint x;
+    memcpy(&x,&f,sizeof(x));
+    const GLushort sign = (x >> 16) & 0x8000;
+    const GLuint a = x & 0x7fffffff;
+
+    if (a >= 0x7f800000) return sign | 0x7c00 | (a > 0x7f800000 ? 0x200 : 0);
+    // 65520 and up round past the largest half, 65504
+    if (a >= 0x477ff000) return sign | 0x7c00;
+    if (a >= 0x38800000) {
+        GLuint h = (a >> 13)-(112 << 10);
+        const GLuint rem = a & 0x1fff;
+        if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) ++h;
+        return sign | h;
+    }
+    // Subnormal: a multiple of 2^-24
+    if (a < 0x33000000) return sign;
+    const GLuint m = (a & 0x7fffff) | 0x800000;
+    const int shift = 126-(int)(a >> 23);
+    GLuint h = m >> shift;
+    const GLuint rem = m & ((1u << shift)-1), half = 1u << (shift-1);
+    if (rem > half || (rem == half && (h & 1))) ++h;
+    return sign | h;
+}
+
+static GLfloat halfToFloat(GLushort h) {
+    const GLuint sign = (GLuint)(h & 0x8000) << 16;
+    const GLuint e = (h >> 10) & 0x1f, m = h & 0x3ff;
+    if (e == 0) return (sign ? -1.0f : 1.0f)*(GLfloat)m*5.9604645e-8f;
+
+    const GLuint x = sign | (e == 31 ? 0x7f800000 | (m << 13) : ((e+112) << 23) | (m << 13));
+    GLfloat f;
+    memcpy(&f,&x,sizeof(f));
+    return f;
+}
+
+int fieldFormatBlocked(int format) {
+    return format == FIELD_FORMAT_U16_MAG || format == FIELD_FORMAT_U8_MAG;
+}
+
+// Per sample, not counting block scales
+static size_t sampleBytes(int format) {
+    switch (format) {
+    case FIELD_FORMAT_RG32F:
+        return 2*sizeof(GLfloat);
+    case FIELD_FORMAT_RG16F:
+    case FIELD_FORMAT_R32F_MAG:
+    case FIELD_FORMAT_R32F_DB:
+        return 4;
+    case FIELD_FORMAT_U8_MAG:
+        return 1;
+    }
+    return 2;
+}
+
+size_t fieldRowBytes(int format, size_t n) {
+    const size_t blocks = fieldFormatBlocked(format) ? (n+FIELD_FORMAT_BLOCK-1)/FIELD_FORMAT_BLOCK : 0;
+    return blocks*sizeof(GLfloat)+n*sampleBytes(format);
+}
+
+static GLfloat sampleMagnitude(const GLfloat* const v) {
+    return sqrtf(v[0]*v[0]+v[1]*v[1]);
+}
+
+// A block of up to FIELD_FORMAT_BLOCK samples: its scale, then its codes
+static unsigned char* encodeBlock(int format, const GLfloat* const field, size_t n,
+                                  unsigned char* out)
+{
+    const GLfloat levels = format == FIELD_FORMAT_U8_MAG ? 255.0f : 65535.0f;
+    GLfloat mag[FIELD_FORMAT_BLOCK];
+    GLfloat scale = 0;
+    size_t i;
+    for (i=0; i<n; ++i) {
+        mag[i] = sampleMagnitude(field+2*i);
+        if (isfinite(mag[i]) && mag[i] > scale) scale = mag[i];
+    }
+    memcpy(out,&scale,sizeof(scale));
+    out += sizeof(scale);
+
+    const GLfloat tocode = scale > 0 ? levels/scale : 0;
+    for (i=0; i<n; ++i) {
+        // NaN to 0, inf to the top code
+        GLfloat c = mag[i]*tocode+0.5f;
+        c = c > 0 ? (c < levels ? c : levels) : 0;
+        if (format == FIELD_FORMAT_U8_MAG) {
+            *out++ = (unsigned char)c;
+        } else {
+            const GLushort code = (GLushort)c;
+            memcpy(out,&code,sizeof(code));
+            out += sizeof(code);
+        }
+    }
+    return out;
+}
+
+static unsigned char* encodeRow(int format, const GLfloat* const field, size_t width,
+                                unsigned char* out)
+{
+    size_t i;
+    if (fieldFormatBlocked(format)) {
+        for (i=0; i<width; i+=FIELD_FORMAT_BLOCK) {
+            const size_t n = width-i < FIELD_FORMAT_BLOCK ? width-i : FIELD_FORMAT_BLOCK;
+            out = encodeBlock(format,field+2*i,n,out);
+        }
+        return out;
+    }
+
+    for (i=0; i<width; ++i) {
+        const GLfloat* const v = field+2*i;
+        GLfloat f[2];
+        GLushort h[2];
+        switch (format) {
+        case FIELD_FORMAT_RG32F:
+            memcpy(out,v,2*sizeof(GLfloat));
+            break;
+        case FIELD_FORMAT_RG16F:
+            h[0] = floatToHalf(v[0]);
+            h[1] = floatToHalf(v[1]);
+            memcpy(out,h,sizeof(h));
+            break;
+        case FIELD_FORMAT_R32F_MAG:
+        case FIELD_FORMAT_R16F_MAG:
+            f[0] = sampleMagnitude(v);
+            break;
+        case FIELD_FORMAT_R32F_DB:
+        case FIELD_FORMAT_R16F_DB:
+            f[0] = 20*log10f(sampleMagnitude(v));
+            break;
+        }
+        if (format == FIELD_FORMAT_R32F_MAG || format == FIELD_FORMAT_R32F_DB) {
+            memcpy(out,f,sizeof(GLfloat));
+        } else if (format == FIELD_FORMAT_R16F_MAG || format == FIELD_FORMAT_R16F_DB) {
+            h[0] = floatToHalf(f[0]);
+            memcpy(out,h,sizeof(GLushort));
+        }
+        out += sampleBytes(format);
+    }
+    return out;
+}
+
+void encodeFieldRows(int format, const GLfloat* const field, size_t width, size_t rows,
+                     size_t stride, void* const out)
+{
+    unsigned char* o = (unsigned char*)out;
+    size_t y;
+    for (y=0; y<rows; ++y) o = encodeRow(format,field+y*stride,width,o);
+}
+
+void decodeFieldMagnitude(int format, const void* const in, size_t width, size_t rows,
+                          GLfloat* const out)
+{
+    const unsigned char* p = (const unsigned char*)in;
+    const size_t n = width*rows;
+    size_t i;
+
+    if (fieldFormatBlocked(format)) {
+        const GLfloat levels = format == FIELD_FORMAT_U8_MAG ? 255.0f : 65535.0f;
+        GLfloat scale = 0;
+        for (i=0; i<n; ++i) {
+            if (i%width%FIELD_FORMAT_BLOCK == 0) {
+                memcpy(&scale,p,sizeof(scale));
+                p += sizeof(scale);
+            }
+            GLushort code;
+            if (format == FIELD_FORMAT_U8_MAG) {
+                code = *p++;
+            } else {
+                memcpy(&code,p,sizeof(code));
+                p += sizeof(code);
+            }
+            out[i] = code*scale/levels;
+        }
+        return;
+    }
+
+    for (i=0; i<n; ++i, p+=sampleBytes(format)) {
+        GLfloat f[2];
+        GLushort h;
+        switch (format) {
+        case FIELD_FORMAT_RG32F:
+            memcpy(f,p,sizeof(f));
+            out[i] = sampleMagnitude(f);
+            break;
+        case FIELD_FORMAT_RG16F:
+            memcpy(&h,p,sizeof(h));
+            f[0] = halfToFloat(h);
+            memcpy(&h,p+sizeof(h),sizeof(h));
+            f[1] = halfToFloat(h);
+            out[i] = sampleMagnitude(f);
+            break;
+        case FIELD_FORMAT_R32F_MAG:
+            memcpy(out+i,p,sizeof(GLfloat));
+            break;
+        case FIELD_FORMAT_R16F_MAG:
+            memcpy(&h,p,sizeof(h));
+            out[i] = halfToFloat(h);
+            break;
+        case FIELD_FORMAT_R32F_DB:
+            memcpy(f,p,sizeof(GLfloat));
+            out[i] = powf(10.0f,f[0]/20);
+            break;
+        case FIELD_FORMAT_R16F_DB:
+            memcpy(&h,p,sizeof(h));
+            out[i] = powf(10.0f,halfToFloat(h)/20);
+            break;
+        }
+    }
+}
+
+/* ----
+ *  Records
+ ---- */
+
+void fillFieldFileHeader(FieldFileHeader* const header, const FieldInfoMap* const fim,
+                         const FieldDataMap* const fdm)
+{
+    memset(header,0,sizeof(*header));
+    memcpy(header->magic,FIELD_FILE_MAGIC,4);
+    header->version = FIELD_FILE_VERSION;
+    header->width = fim->fieldsize[0];
+    header->height = fim->fieldsize[1];
+    header->fieldoffset[0] = fim->fieldoffset[0];
+    header->fieldoffset[1] = fim->fieldoffset[1];
+    header->fielddims[0] = fim->fielddims[0];
+    header->fielddims[1] = fim->fielddims[1];
+    header->written = *(fdm->written);
+    header->field_min = *(fdm->field_min);
+    header->field_max = *(fdm->field_max);
+    header->format = fieldformat;
+}
+
+int writeFieldRows(FILE* const fp, const FieldFileHeader* const header,
+                   const GLfloat* const field, size_t stride)
+{
+    const size_t width = header->width;
+
+    // Straight out when the rows already are the format
+    if (header->format == FIELD_FORMAT_RG32F) {
+        if (stride == 2*width) {
+            const size_t count = 2*width*header->height;
+            return fwrite(field,sizeof(GLfloat),count,fp) != count;
+        }
+        GLuint y;
+        for (y=0; y<header->height; ++y) {
+            if (fwrite(field+y*stride,sizeof(GLfloat),2*width,fp) != 2*width) return 1;
+        }
+        return 0;
+    }
+
+    const size_t rowbytes = fieldRowBytes(header->format,width);
+    unsigned char* const row = (unsigned char*)malloc(rowbytes > 0 ? rowbytes : 1);
+    if (row == NULL) {
+        record(1,"Failed to allocate field row buffer\n");
+        return 1;
+    }
+
+    int failed = 0;
+    GLuint y;
+    for (y=0; y<header->height && !failed; ++y) {
+        encodeFieldRows(header->format,field+y*stride,width,1,stride,row);
+        failed = fwrite(row,1,rowbytes,fp) != rowbytes;
+    }
+    free(row);
+    return failed;
+}
+
+int writeFieldRecord(FILE* const fp, const FieldInfoMap* const fim,
+                     const FieldDataMap* const fdm, const GLfloat* const field)
+{
+    FieldFileHeader header;
+    fillFieldFileHeader(&header,fim,fdm);
+
+    if (fwrite(&header,sizeof(header),1,fp) != 1 ||
+            writeFieldRows(fp,&header,field,2*(size_t)header.width)) {
+        record(1,"Failed to write field record\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+int writeFieldFile(const char* const filename, const FieldInfoMap* const fim,
+                   const FieldDataMap* const fdm, const GLfloat* const field)
+{
+    FILE* fp = fopen(filename,"wb");
+    if (fp == NULL) {
+        record(1,"Failed to open output file %s\n",filename);
+        return 1;
+    }
+
+    int failed = writeFieldRecord(fp,fim,fdm,field);
+    if (fclose(fp) != 0) failed = 1;
+
+    if (failed) record(1,"Failed to write field to %s\n",filename);
+    else record(0,"Wrote %ux%u field to %s as %s\n",fim->fieldsize[0],fim->fieldsize[1],
+                filename,fieldFormatName(fieldformat));
+    return failed;
+}
@@ -0,0 +1,89 @@
+// Binary field output: a FieldFileHeader followed by height rows of width
+// samples in the header's storage format, native byte order, rows in y.
+// FIELD_FORMAT_RG32F rows are exactly the contents of the RG32F field image.
+// Sweeps write several such records back to back.
+#define FIELD_FILE_MAGIC "AFLD"
+#define FIELD_FILE_VERSION 2
+
+/*
+ * Storage formats. Fields are always evaluated and reduced (FieldData's
+ * range, mean and RMS) in fp32; the format only decides how the samples are
+ * stored, and the bounds are on the stored value against the fp32 one.
+ *
+ *   rg32f    (re,im) fp32, 8 bytes. Exact.
+ *   rg16f    (re,im) half, 4 bytes. Each part within 2^-11 of itself for
+ *            |part| in [2^-14, 65504], within 2^-25 below that; larger parts
+ *            become inf.
+ *   r32f-mag |field| fp32, 4 bytes. Within 2^-23 of itself; phase dropped.
+ *   r16f-mag |field| half, 2 bytes. As rg16f, for the magnitude.
+ *   r32f-db  20 log10 |field| fp32, 4 bytes. Within 2^-22 |dB| + 1e-5 dB.
+ *   r16f-db  20 log10 |field| half, 2 bytes. Within 2^-11 |dB| more than
+ *            r32f-db, i.e. 0.03 dB at +-60 dB (0.35% of the magnitude).
+ *            In both, a magnitude of 0 comes out as -inf.
+ *   u16-mag  |field| quantised against the largest magnitude in each block of
+ *            FIELD_FORMAT_BLOCK samples along a row, stored as a GLfloat
+ *            ahead of the block's codes, 2.125 bytes. Within 1/131070 of
+ *            the block's largest magnitude, plus fp32 rounding.
+ *   u8-mag   As u16-mag with 8 bit codes, 1.125 bytes. Within 1/510 of the
+ *            block's largest magnitude, plus fp32 rounding.
+ *
+ * The field's NaN at a source stays NaN, except in u16-mag and u8-mag where
+ * it comes out as 0. Only those two have blocks; tiles and bricks written into
+ * their rows have to start on a block boundary.
+ */
+#define FIELD_FORMAT_BLOCK 32
+
+enum {
+    FIELD_FORMAT_RG32F,
+    FIELD_FORMAT_RG16F,
+    FIELD_FORMAT_R32F_MAG,
+    FIELD_FORMAT_R16F_MAG,
+    FIELD_FORMAT_R32F_DB,
+    FIELD_FORMAT_R16F_DB,
+    FIELD_FORMAT_U16_MAG,
+    FIELD_FORMAT_U8_MAG,
+    FIELD_NUM_FORMATS
+};
+
+typedef struct {
+    char magic[4];
+    GLuint version;
+    GLuint width;
+    GLuint height;
+    GLfloat fieldoffset[2];
+    GLfloat fielddims[2];
+    GLint written;
+    GLfloat field_min;
+    GLfloat field_max;
+    GLuint format;
+} FieldFileHeader;
+
+// -1 for a name that isn't one
+int parseFieldFormat(const char* const name);
+const char* fieldFormatName(int format);
+// Every field file written from now on is in format; rg32f to start with
+void setFieldFormat(int format);
+int fieldFormat(void);
+
+// Nonzero for the formats with blocks
+int fieldFormatBlocked(int format);
+// Bytes taken by the first n samples of a row, n a multiple of
+// FIELD_FORMAT_BLOCK or the whole row
+size_t fieldRowBytes(int format, size_t n);
+// rows of width samples each, stride GLfloats apart in field, into
+// rows*fieldRowBytes(format,width) bytes at out
+void encodeFieldRows(int format, const GLfloat* const field, size_t width, size_t rows,
+                     size_t stride, void* const out);
+// |field| of rows encoded as above
+void decodeFieldMagnitude(int format, const void* const in, size_t width, size_t rows,
+                          GLfloat* const out);
+
+void fillFieldFileHeader(FieldFileHeader* const header, const FieldInfoMap* const fim,
+                         const FieldDataMap* const fdm);
+// The header's width x height samples, stride GLfloats from row to row, in its format
+int writeFieldRows(FILE* const fp, const FieldFileHeader* const header,
+                   const GLfloat* const field, size_t stride);
+int writeFieldRecord(FILE* const fp, const FieldInfoMap* const fim,
+                     const FieldDataMap* const fdm, const GLfloat* const field);
+int writeFieldFile(const char* const filename, const FieldInfoMap* const fim,
+                   const FieldDataMap* const fdm, const GLfloat* const field);
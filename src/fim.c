@@ -0,0 +1,264 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <GL/gl.h>
+
+#include "common.h"
+#include "fim.h"
+#include "reflect.h"
+
+/*
+ * No volume and no slices; the 3D members are the same whatever backs the
+ * rest of the map
+ */
+void initFieldVolume(FieldInfoMap* const fim) {
+    memset(fim->volumeoffset,0,sizeof(fim->volumeoffset));
+    memset(fim->volumedims,0,sizeof(fim->volumedims));
+    memset(fim->volumesize,0,sizeof(fim->volumesize));
+    fim->slice_n = 0;
+    fim->slices = NULL;
+    fim->slice_capacity = 0;
+}
+
+// No walls, and the default order and threshold should some be added
+void initFieldWalls(FieldInfoMap* const fim) {
+    fim->wall_n = 0;
+    fim->wall_loc = NULL;
+    fim->wall_coef = NULL;
+    fim->wall_capacity = 0;
+    fim->reflect_order = REFLECT_DEFAULT_ORDER;
+    fim->reflect_threshold = REFLECT_DEFAULT_THRESHOLD;
+}
+
+/*
+ * Client-side maps for when there is no GL program to reflect the block
+ * layouts from (headless runs, the CPU engine). Members are simply packed one
+ * after the other; nothing here is uploaded to GL as-is.
+ */
+int initFieldInfoMapHost(FieldInfoMap* const fim) {
+    const size_t size = sizeof(GLfloat)            // mat_c
+                      + sizeof(GLint)              // psn
+                      + sizeof(GLfloat)*NUM_DIMS*2 // fieldoffset, fielddims
+                      + sizeof(GLuint)*NUM_DIMS;   // fieldsize
+
+    GLvoid* const buffer = malloc(size);
+    if (buffer == NULL) {
+        record(1,"Failed to allocate client-side FieldInfo buffer\n");
+        return 1;
+    }
+    memset(buffer,0,size);
+
+    fim->block_start = buffer;
+    fim->mat_c = (GLfloat*)buffer;
+    fim->psn = (GLint*)(fim->mat_c+1);
+    fim->fieldoffset = (GLfloat*)(fim->psn+1);
+    fim->fielddims = fim->fieldoffset+NUM_DIMS;
+    fim->fieldsize = (GLuint*)(fim->fielddims+NUM_DIMS);
+
+    fim->ps_loc = NULL;
+    fim->ps_freq = NULL;
+    fim->ps_phase = NULL;
+    fim->ps_z = NULL;
+    fim->ps_capacity = 0;
+    fim->ps_block_start = NULL;
+
+    fim->probe_n = 0;
+    fim->probe_loc = NULL;
+    fim->probe_capacity = 0;
+
+    initFieldVolume(fim);
+    initFieldWalls(fim);
+
+    // Same defaults as the UBO-backed map
+    fim->fielddims[0] = 1.0;
+    fim->fielddims[1] = 1.0;
+    fim->fieldsize[0] = 128;
+    fim->fieldsize[1] = 128;
+
+    fim->dirty = FIM_DIRTY_FIELD;
+
+    return 0;
+}
+
+int initFieldDataMapHost(FieldDataMap* const fdm) {
+    fdm->block_start = malloc(FDM_DUMMY_BUFFER_SIZE);
+    if (fdm->block_start == NULL) {
+        record(1,"Failed to allocate client-side FieldData buffer\n");
+        return 1;
+    }
+    memset(fdm->block_start,0,FDM_DUMMY_BUFFER_SIZE);
+
+    fdm->written = (GLint*)fdm->block_start;
+    fdm->field_max = (GLfloat*)(fdm->written+1);
+    fdm->field_min = fdm->field_max+1;
+    fdm->field_mean = fdm->field_min+1;
+    fdm->field_rms = fdm->field_mean+1;
+
+    return 0;
+}
+
+void freeFieldInfoMap(FieldInfoMap* const fim) {
+    free(fim->ps_block_start);
+    free(fim->block_start);
+    free(fim->probe_loc);
+    free(fim->slices);
+    free(fim->wall_loc);
+    fim->ps_block_start = NULL;
+    fim->block_start = NULL;
+    fim->probe_loc = NULL;
+    fim->probe_n = 0;
+    fim->probe_capacity = 0;
+    fim->slices = NULL;
+    fim->slice_n = 0;
+    fim->slice_capacity = 0;
+    fim->wall_loc = NULL;
+    fim->wall_coef = NULL;
+    fim->wall_n = 0;
+    fim->wall_capacity = 0;
+}
+
+/*
+ * Capacity for at least n records of recordsize bytes, given the current one:
+ * double it (or start from initial) until n fits, never past FIM_MAX_RECORDS.
+ * Counted in size_t so a huge n is refused rather than overflowing.
+ */
+static int growCapacity(int current, int initial, int n, size_t recordsize,
+                        const char* const what, int* const capacity)
+{
+    if (n > FIM_MAX_RECORDS || (size_t)n > SIZE_MAX/recordsize) {
+        record(1,"Can't make room for %d %s; at most %d are allowed\n",n,what,FIM_MAX_RECORDS);
+        return 1;
+    }
+
+    size_t grown = current > 0 ? 2*(size_t)current : (size_t)initial;
+    while (grown < (size_t)n) grown *= 2;
+    if (grown > FIM_MAX_RECORDS) grown = FIM_MAX_RECORDS;
+
+    *capacity = (int)grown;
+    return 0;
+}
+
+/*
+ * Make room for at least n point sources, keeping the ones already there and
+ * zeroing the rest. Capacity at least doubles so the parser can call this per
+ * block without going quadratic; more than FIM_MAX_RECORDS is an error.
+ */
+int reservePointSources(FieldInfoMap* const fim, int n) {
+    if (n <= fim->ps_capacity) return 0;
+
+    int capacity;
+    if (growCapacity(fim->ps_capacity,32,n,(NUM_DIMS+3)*sizeof(GLfloat),
+                     "point sources",&capacity)) return 1;
+
+    GLfloat* const block = (GLfloat*)calloc((NUM_DIMS+3)*(size_t)capacity,sizeof(GLfloat));
+    if (block == NULL) {
+        record(1,"Failed to allocate space for %d point sources\n",capacity);
+        return 1;
+    }
+
+    GLfloat* const ps_loc = block;
+    GLfloat* const ps_freq = ps_loc+NUM_DIMS*capacity;
+    GLfloat* const ps_phase = ps_freq+capacity;
+    GLfloat* const ps_z = ps_phase+capacity;
+
+    if (fim->ps_capacity > 0) {
+        memcpy(ps_loc,fim->ps_loc,sizeof(GLfloat)*NUM_DIMS*fim->ps_capacity);
+        memcpy(ps_freq,fim->ps_freq,sizeof(GLfloat)*fim->ps_capacity);
+        memcpy(ps_phase,fim->ps_phase,sizeof(GLfloat)*fim->ps_capacity);
+        memcpy(ps_z,fim->ps_z,sizeof(GLfloat)*fim->ps_capacity);
+    }
+    free(fim->ps_block_start);
+
+    fim->ps_block_start = block;
+    fim->ps_loc = ps_loc;
+    fim->ps_freq = ps_freq;
+    fim->ps_phase = ps_phase;
+    fim->ps_z = ps_z;
+    fim->ps_capacity = capacity;
+
+    return 0;
+}
+
+// Same for probe points, which are only ever read on the client
+int reserveProbes(FieldInfoMap* const fim, int n) {
+    if (n <= fim->probe_capacity) return 0;
+
+    int capacity;
+    if (growCapacity(fim->probe_capacity,32,n,NUM_DIMS*sizeof(GLfloat),"probes",&capacity))
+        return 1;
+
+    GLfloat* const probe_loc = (GLfloat*)calloc(NUM_DIMS*(size_t)capacity,sizeof(GLfloat));
+    if (probe_loc == NULL) {
+        record(1,"Failed to allocate space for %d probes\n",capacity);
+        return 1;
+    }
+    if (fim->probe_capacity > 0)
+        memcpy(probe_loc,fim->probe_loc,sizeof(GLfloat)*NUM_DIMS*fim->probe_capacity);
+    free(fim->probe_loc);
+
+    fim->probe_loc = probe_loc;
+    fim->probe_capacity = capacity;
+
+    return 0;
+}
+
+// And for slices
+int reserveSlices(FieldInfoMap* const fim, int n) {
+    if (n <= fim->slice_capacity) return 0;
+
+    int capacity;
+    if (growCapacity(fim->slice_capacity,8,n,sizeof(FieldSlice),"slices",&capacity))
+        return 1;
+
+    FieldSlice* const slices = (FieldSlice*)calloc(capacity,sizeof(FieldSlice));
+    if (slices == NULL) {
+        record(1,"Failed to allocate space for %d slices\n",capacity);
+        return 1;
+    }
+    if (fim->slice_capacity > 0)
+        memcpy(slices,fim->slices,sizeof(FieldSlice)*fim->slice_capacity);
+    free(fim->slices);
+
+    fim->slices = slices;
+    fim->slice_capacity = capacity;
+
+    return 0;
+}
+
+// And for walls, both arrays in one block
+int reserveWalls(FieldInfoMap* const fim, int n) {
+    if (n <= fim->wall_capacity) return 0;
+
+    int capacity;
+    if (growCapacity(fim->wall_capacity,8,n,5*sizeof(GLfloat),"walls",&capacity))
+        return 1;
+
+    GLfloat* const wall_loc = (GLfloat*)calloc(5*(size_t)capacity,sizeof(GLfloat));
+    if (wall_loc == NULL) {
+        record(1,"Failed to allocate space for %d walls\n",capacity);
+        return 1;
+    }
+    GLfloat* const wall_coef = wall_loc+4*capacity;
+    if (fim->wall_capacity > 0) {
+        memcpy(wall_loc,fim->wall_loc,sizeof(GLfloat)*4*fim->wall_capacity);
+        memcpy(wall_coef,fim->wall_coef,sizeof(GLfloat)*fim->wall_capacity);
+    }
+    free(fim->wall_loc);
+
+    fim->wall_loc = wall_loc;
+    fim->wall_coef = wall_coef;
+    fim->wall_capacity = capacity;
+
+    return 0;
+}
+
+// Interleave the first psn sources into the PointSources SSBO layout
+void packPointSources(const FieldInfoMap* const fim, GLfloat* const packed) {
+    int i,d;
+    for (i=0; i<*(fim->psn); ++i) {
+        GLfloat* const p = packed+PS_PACKED_STRIDE*i;
+        for (d=0; d<NUM_DIMS; ++d) p[d] = fim->ps_loc[NUM_DIMS*i+d];
+        p[NUM_DIMS] = fim->ps_freq[i];
+        p[NUM_DIMS+1] = fim->ps_phase[i];
+    }
+}
@@ -1,7 +1,29 @@
-// SET THIS IN THE FRAG AND COMPUTE SHADERS TOO
+// Passed to the shaders in their preamble (shader-cache.c)
 #define NUM_DIMS 2
-#define MAX_POINT_SOURCE 32
-#define FDM_DUMMY_BUFFER_SIZE 12
+#define FDM_DUMMY_BUFFER_SIZE 20
+
+// Point sources live in their own client-side block, grown on demand, and go
+// to the GPU packed as one PS_PACKED_STRIDE float record per source (loc,
+// freq, phase) in the PointSources SSBO. Only psn lives in the FieldInfo UBO.
+#define PS_PACKED_STRIDE 4
+
+// What FieldInfoMap.dirty says changed since the block was last uploaded: the
+// view alone (a pan or zoom, whose samples the pyramid already accounts for,
+// progressive.h), or anything the field itself depends on
+#define FIM_DIRTY_VIEW 1
+#define FIM_DIRTY_FIELD 2
+
+// Most point sources, probes, slices or walls a map will make room for
+#define FIM_MAX_RECORDS (1<<24)
+
+// Plane through the volume (volume.h): sample (i,j) of size[0] x size[1] is
+// at origin + i/size[0]*u + j/size[1]*v
+typedef struct {
+    GLfloat origin[3];
+    GLfloat u[3];
+    GLfloat v[3];
+    GLuint size[2];
+} FieldSlice;
 
 typedef struct FieldInfoMap {
     GLfloat* mat_c;
@@ -10,21 +32,66 @@ typedef struct FieldInfoMap {
     GLfloat* ps_loc;
     GLfloat* ps_freq;
     GLfloat* ps_phase;
+    // Height of each source above the field plane; only 3D evaluation
+    // (volume.h) reads it
+    GLfloat* ps_z;
+    GLint ps_capacity;
+    GLvoid* ps_block_start;
 
-/*  GLfloat* ref_loc;
-    GLfloat* ref */
+    // Reflective walls (reflect.h), two points x0, y0, x1, y1 per wall in
+    // wall_loc and a reflection coefficient each in wall_coef; client-side only
+    GLint wall_n;
+    GLfloat* wall_loc;
+    GLfloat* wall_coef;
+    GLint wall_capacity;
+    GLint reflect_order;
+    GLfloat reflect_threshold;
 
     GLfloat* fieldoffset;
     GLfloat* fielddims;
     GLuint* fieldsize;
 
     GLvoid* block_start;
+
+    // Points the field is wanted at besides the grid; client-side only
+    GLint probe_n;
+    GLfloat* probe_loc;
+    GLint probe_capacity;
+
+    // 3D evaluation: a volume sampled like the field with a third axis, and
+    // planes through it; client-side only, volumesize 0 for none
+    GLfloat volumeoffset[3];
+    GLfloat volumedims[3];
+    GLuint volumesize[3];
+    GLint slice_n;
+    FieldSlice* slices;
+    GLint slice_capacity;
+
+    // FIM_DIRTY_* flags, set by whoever changes the block so it gets
+    // reuploaded (and the field recomputed for FIM_DIRTY_FIELD); cleared once
+    // the GPU copy is current. Point sources are tracked separately through
+    // FieldEdits.
+    int dirty;
 } FieldInfoMap;
 
 typedef struct {
     GLint* written;
     GLfloat* field_max;
     GLfloat* field_min;
+    GLfloat* field_mean;
+    GLfloat* field_rms;
 
     GLvoid* block_start;
 } FieldDataMap;
+
+int initFieldInfoMapHost(FieldInfoMap* const fim);
+int initFieldDataMapHost(FieldDataMap* const fdm);
+void initFieldVolume(FieldInfoMap* const fim);
+void initFieldWalls(FieldInfoMap* const fim);
+void freeFieldInfoMap(FieldInfoMap* const fim);
+
+int reservePointSources(FieldInfoMap* const fim, int n);
+int reserveProbes(FieldInfoMap* const fim, int n);
+int reserveSlices(FieldInfoMap* const fim, int n);
+int reserveWalls(FieldInfoMap* const fim, int n);
+void packPointSources(const FieldInfoMap* const fim, GLfloat* const packed);
@@ -8,18 +8,40 @@
 #include "common.h"
 #include "fim.h"
 #include "fi-parser.h"
-
-#define MAX_FILE_BUF_SIZE 2048
+#include "cpu-field.h"
+#include "field-file.h"
+#include "sweep.h"
+#include "field-edit.h"
+#include "scenario.h"
+#include "tiled.h"
+#include "broadband.h"
+#include "far-field.h"
+#include "propagation.h"
+#include "probe.h"
+#include "progressive.h"
+#include "shader-cache.h"
+#include "autotune.h"
+#include "volume.h"
+#include "reflect.h"
+#include "metrics.h"
+#include "field-capture.h"
+#include "shard.h"
+
+// Displayed wave cycles per second when animating; the real frequency is far
+// too fast to watch
+#define DEFAULT_PLAYBACK_RATE 0.5
 #define WINDOW_WIDTH 800.0
 #define WINDOW_HEIGHT 600.0
+#define WINDOW_TITLE "Acoustics Toolkit"
 #define MAX_FIELDINFO_UNIFORM_NAME_LENGTH 16
 #define FIELDINFO_UBO_BINDING 0
 #define FIELDDATA_SSBO_BINDING 0
+#define POINTSOURCES_SSBO_BINDING 1
+#define POINTSOURCEUPDATES_SSBO_BINDING 2
+#define FIELDPARTIALS_SSBO_BINDING 3
 #define FIELD_IMAGE_UNIT 0
 #define FIELD_TEX_UNIT 0
-
-#define COMPUTE_LOCAL_FIELD_SIZE_X 32
-#define COMPUTE_LOCAL_FIELD_SIZE_Y 32
+#define MAX_PENDING_MOVES 16
 
 typedef struct {
     GLuint vao;
@@ -55,173 +77,11 @@ Renderable createCanvas() {
     return canvas;
 }
 
-void recordInfoLog(unsigned int level,GLuint shader) {
-    GLchar* infobuf;
-
-    GLint infobuflen = 0;
-    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &infobuflen);
-
-    infobuf = (GLchar*) malloc(sizeof(GLchar)*infobuflen);
-    glGetShaderInfoLog(shader,infobuflen,NULL,infobuf);
-    record(level,infobuf);
-    fflush(stdout);
-
-    free(infobuf);
-}
-
-int readFile(const char* filename, char* const buffer, int bufsize) {
-    FILE* fp = fopen(filename,"r");
-    if (fp == NULL) {
-        record(1,"Failed to open file %s\n",filename);
-        return 1;
-    }
-
-    long fl;
-
-    fseek(fp,0,SEEK_END);
-    fl = ftell(fp);
-    fseek(fp,0,SEEK_SET);
-
-    if (fl > bufsize) {
-        record(1,"File %s too big for buffer\n",filename);
-        return 1;
-    }
-
-    fread(buffer,sizeof(char),fl,fp);
-    fclose(fp);
-    return 0;
-}
-
-GLuint createShaderProgram() {
-    GLuint vert = glCreateShader(GL_VERTEX_SHADER);
-    GLuint frag = glCreateShader(GL_FRAGMENT_SHADER);
-
-    GLchar ss[MAX_FILE_BUF_SIZE];
-    memset(ss,0,MAX_FILE_BUF_SIZE);
-    const GLchar* ssptr = (const GLchar*)ss;
-    
-    if (readFile("vert.glsl", ss, MAX_FILE_BUF_SIZE)) {
-        record(1,"Could not read vertex shader\n");
-        return 0;
-    }
-    glShaderSource(vert,1,&ssptr,0);
-    glCompileShader(vert);
-
-    GLint compiled = 0;
-    glGetShaderiv(vert, GL_COMPILE_STATUS, &compiled);
-    if (compiled == GL_FALSE) {
-        record(1,"Compilation of vert.glsl failed:\n");
-        recordInfoLog(1,vert);
-        glDeleteShader(vert);
-        return 0;
-    }
-
-    memset(ss,0,MAX_FILE_BUF_SIZE);
-    if (readFile("frag.glsl", ss, MAX_FILE_BUF_SIZE)) {
-        record(1,"Could not read fragment shader\n");
-        return 0;
-    }
-    glShaderSource(frag,1,&ssptr,NULL);
-    glCompileShader(frag);
-
-    compiled = 0;
-    glGetShaderiv(frag, GL_COMPILE_STATUS, &compiled);
-    if(compiled == GL_FALSE) {
-        record(1,"Compilation of frag.glsl failed:\n");
-        recordInfoLog(1,frag);
-        glDeleteShader(vert);
-        glDeleteShader(frag);
-        return 0;
-    }
-    
-    GLuint prog = glCreateProgram();
-
-    glAttachShader(prog,vert);
-    glAttachShader(prog,frag);
-
-    glLinkProgram(prog);
-
-    GLint linked = 0;
-    glGetProgramiv(prog, GL_LINK_STATUS, &linked);
-    if (linked == GL_FALSE) {
-        GLint infobuflen = 0;
-        glGetProgramiv(prog, GL_INFO_LOG_LENGTH, &infobuflen);
-
-        GLchar* infobuf = (GLchar*) malloc(sizeof(GLchar)*infobuflen);
-        glGetProgramInfoLog(prog,infobuflen,NULL,infobuf);
-
-        record(1,infobuf);
-        fflush(stdout);
-
-        free(infobuf);
-
-        glDeleteProgram(prog);
-        glDeleteShader(vert);
-        glDeleteShader(frag);
-        return 0;
-    }
-
-    glDetachShader(prog,vert);
-    glDetachShader(prog,frag);
-
-    return prog;
-}
-
-GLuint createComputeProgram() {
-    GLuint compute = glCreateShader(GL_COMPUTE_SHADER);
-
-    GLchar ss[MAX_FILE_BUF_SIZE];
-    const GLchar* ssptr = (const GLchar*)ss;
-
-    memset(ss,0,MAX_FILE_BUF_SIZE);
-    readFile("compute.glsl", ss, MAX_FILE_BUF_SIZE);
-    glShaderSource(compute,1,&ssptr,NULL);
-    glCompileShader(compute);
-
-    GLint compiled = 0;
-    glGetShaderiv(compute, GL_COMPILE_STATUS, &compiled);
-    if(compiled == GL_FALSE) {
-        record(1,"Compilation of compute.glsl failed:\n");
-        recordInfoLog(1,compute);
-        glDeleteShader(compute);
-        return 0;
-    }
-
-    GLuint prog = glCreateProgram();
-
-    glAttachShader(prog,compute);
-    
-    glLinkProgram(prog);
-
-    GLint linked = 0;
-    glGetProgramiv(prog, GL_LINK_STATUS, &linked);
-    if (linked == GL_FALSE) {
-        GLint infobuflen = 0;
-        glGetProgramiv(prog, GL_INFO_LOG_LENGTH, &infobuflen);
-
-        GLchar* infobuf = (GLchar*) malloc(sizeof(GLchar)*infobuflen);
-        glGetProgramInfoLog(prog,infobuflen,NULL,infobuf);
-
-        record(1,infobuf);
-        fflush(stdout);
-
-        free(infobuf);
-
-        glDeleteProgram(prog);
-        glDeleteShader(compute);
-        return 0;
-    }
-
-    glDetachShader(prog,compute);
-
-    return prog;
-}
-
 unsigned int initFieldInfoMap(GLuint program, GLuint blockIndex, FieldInfoMap* fim, GLvoid* const buffer) {
     // Make sure buffer is big enough, because I will not check. All I care about is the pointer address.
     record(0,"Initialising FieldInfo UBO memory map\n");
 
-    int isset_mat_c = 0,isset_psn = 0,isset_ps_loc = 0,isset_ps_freq = 0,isset_ps_phase = 0,
+    int isset_mat_c = 0,isset_psn = 0,
         isset_fieldoffset = 0,isset_fielddims = 0,isset_fieldsize = 0;
 
     GLchar* const cbuffer = (GLchar* const)buffer;
@@ -233,7 +93,8 @@ unsigned int initFieldInfoMap(GLuint program, GLuint blockIndex, FieldInfoMap* f
     glGetActiveUniformBlockiv(program,blockIndex,GL_UNIFORM_BLOCK_ACTIVE_UNIFORM_INDICES,uniformindices);
 
     GLint* const uniformoffsets = (GLint* const)malloc(sizeof(GLint)*numuniforms);
-    glGetActiveUniformsiv(program,numuniforms,uniformindices,GL_UNIFORM_OFFSET,uniformoffsets);
+    glGetActiveUniformsiv(program,numuniforms,(const GLuint*)uniformindices,GL_UNIFORM_OFFSET,
+                          uniformoffsets);
 
     char uniformname[MAX_FIELDINFO_UNIFORM_NAME_LENGTH];
     GLchar* uniformlocationptr;
@@ -255,15 +116,6 @@ unsigned int initFieldInfoMap(GLuint program, GLuint blockIndex, FieldInfoMap* f
         } else if (!strcmp(uniformname,"psn")) {
             fim->psn = (GLint*)uniformlocationptr;
             isset_psn = 1;
-        } else if (!strcmp(uniformname,"ps_loc[0]")) {
-            fim->ps_loc = (GLfloat*)uniformlocationptr;
-            isset_ps_loc = 1;
-        } else if (!strcmp(uniformname,"ps_freq[0]")) {
-            fim->ps_freq = (GLfloat*)uniformlocationptr;
-            isset_ps_freq = 1;
-        } else if (!strcmp(uniformname,"ps_phase[0]")) {
-            fim->ps_phase = (GLfloat*)uniformlocationptr;
-            isset_ps_phase = 1;
 
         } else if (!strcmp(uniformname,"fieldoffset")) {
             fim->fieldoffset = (GLfloat*)uniformlocationptr;
@@ -282,8 +134,8 @@ unsigned int initFieldInfoMap(GLuint program, GLuint blockIndex, FieldInfoMap* f
     free(uniformindices);
     free(uniformoffsets);
 
-    if (!isset_mat_c || !isset_psn || !isset_ps_loc || !isset_ps_freq || !isset_ps_phase ||
-            !isset_fielddims || !isset_fieldsize) {
+    if (!isset_mat_c || !isset_psn ||
+            !isset_fieldoffset || !isset_fielddims || !isset_fieldsize) {
         record(1,"Missing field in uniform block; memory map incomplete\n");
         return 1;
     } else {
@@ -292,11 +144,28 @@ unsigned int initFieldInfoMap(GLuint program, GLuint blockIndex, FieldInfoMap* f
 
     fim->block_start = buffer;
 
+    // Point sources are allocated as the parser finds them
+    fim->ps_loc = NULL;
+    fim->ps_freq = NULL;
+    fim->ps_phase = NULL;
+    fim->ps_z = NULL;
+    fim->ps_capacity = 0;
+    fim->ps_block_start = NULL;
+
+    fim->probe_n = 0;
+    fim->probe_loc = NULL;
+    fim->probe_capacity = 0;
+
+    initFieldVolume(fim);
+    initFieldWalls(fim);
+
     fim->fielddims[0] = 1.0;
     fim->fielddims[1] = 1.0;
     fim->fieldsize[0] = 128;
     fim->fieldsize[1] = 128;
 
+    fim->dirty = FIM_DIRTY_FIELD;
+
     return 0;
 }
 
@@ -311,6 +180,10 @@ void setupDemoFieldInfo(FieldInfoMap* const fim) {
     const GLfloat ps_phase[] = { 0.0, 0.0, 0.0 };
 
     *(fim->psn) = 3;
+    if (reservePointSources(fim,3)) {
+        *(fim->psn) = 0;
+        return;
+    }
 
     const GLfloat fieldoffset[] = { 0.0, 0.0 };
     const GLfloat fielddims[] = { WINDOW_WIDTH/WINDOW_HEIGHT, 1.0 };
@@ -325,53 +198,58 @@ void setupDemoFieldInfo(FieldInfoMap* const fim) {
     memcpy(fim->fieldsize,fieldsize,sizeof(fieldsize));
 }
 
-int loadFieldInfoFile(const char* const filename,
-                      FieldInfoMap* const fim,
-                      FieldDataMap* const fdm)
-{
-    GLchar fibuf[MAX_FILE_BUF_SIZE];
-    memset(fibuf,0,MAX_FILE_BUF_SIZE);
-
-    int readfailed = readFile(filename,fibuf,MAX_FILE_BUF_SIZE);
-    if (readfailed) return 1;
-    return parseFieldInfo(fibuf, MAX_FILE_BUF_SIZE, fim, fdm);
-}
-
 int initFieldDataMap(GLuint program, GLuint blockIndex, FieldDataMap* fdm, void* const buffer) {
+    (void)blockIndex;
     record(0,"Initialising FieldData SSBO memory map\n");
 
     GLchar* const cbuffer = (GLchar* const)buffer;
 
-    GLint index_written = glGetProgramResourceIndex(program,GL_BUFFER_VARIABLE,"written");
+    GLuint index_written = glGetProgramResourceIndex(program,GL_BUFFER_VARIABLE,"written");
     if (index_written == GL_INVALID_INDEX) {
         record(1,"Variable \"written\" not found; aborting\n");
         return 1;
     }
-    GLint index_field_max = glGetProgramResourceIndex(program,GL_BUFFER_VARIABLE,"field_max");
+    GLuint index_field_max = glGetProgramResourceIndex(program,GL_BUFFER_VARIABLE,"field_max");
     if (index_field_max == GL_INVALID_INDEX) {
         record(1,"Variable \"field_max\" not found; aborting\n");
         return 1;
     }
-    GLint index_field_min = glGetProgramResourceIndex(program,GL_BUFFER_VARIABLE,"field_min");
+    GLuint index_field_min = glGetProgramResourceIndex(program,GL_BUFFER_VARIABLE,"field_min");
     if (index_field_min == GL_INVALID_INDEX) {
         record(1,"Variable \"field_min\" not found; aborting\n");
         return 1;
     }
+    GLuint index_field_mean = glGetProgramResourceIndex(program,GL_BUFFER_VARIABLE,"field_mean");
+    if (index_field_mean == GL_INVALID_INDEX) {
+        record(1,"Variable \"field_mean\" not found; aborting\n");
+        return 1;
+    }
+    GLuint index_field_rms = glGetProgramResourceIndex(program,GL_BUFFER_VARIABLE,"field_rms");
+    if (index_field_rms == GL_INVALID_INDEX) {
+        record(1,"Variable \"field_rms\" not found; aborting\n");
+        return 1;
+    }
 
-    GLint offset_written, offset_field_max, offset_field_min;
+    GLint offset_written, offset_field_max, offset_field_min, offset_field_mean, offset_field_rms;
     
     GLenum gl_offset = GL_OFFSET;
     glGetProgramResourceiv(program,GL_BUFFER_VARIABLE,index_written,1,&gl_offset,1,NULL,&offset_written);
     glGetProgramResourceiv(program,GL_BUFFER_VARIABLE,index_field_max,1,&gl_offset,1,NULL,&offset_field_max);
     glGetProgramResourceiv(program,GL_BUFFER_VARIABLE,index_field_min,1,&gl_offset,1,NULL,&offset_field_min);
+    glGetProgramResourceiv(program,GL_BUFFER_VARIABLE,index_field_mean,1,&gl_offset,1,NULL,&offset_field_mean);
+    glGetProgramResourceiv(program,GL_BUFFER_VARIABLE,index_field_rms,1,&gl_offset,1,NULL,&offset_field_rms);
 
     record(0,"> Found variable name \"written\" at offset %d\n",offset_written);
     record(0,"> Found variable name \"field_max\" at offset %d\n",offset_field_max);
     record(0,"> Found variable name \"field_min\" at offset %d\n",offset_field_min);
+    record(0,"> Found variable name \"field_mean\" at offset %d\n",offset_field_mean);
+    record(0,"> Found variable name \"field_rms\" at offset %d\n",offset_field_rms);
 
     fdm->written = (GLint*)(cbuffer+offset_written);
     fdm->field_max = (GLfloat*)(cbuffer+offset_field_max);
     fdm->field_min = (GLfloat*)(cbuffer+offset_field_min);
+    fdm->field_mean = (GLfloat*)(cbuffer+offset_field_mean);
+    fdm->field_rms = (GLfloat*)(cbuffer+offset_field_rms);
 
     fdm->block_start = buffer;
     
@@ -380,15 +258,880 @@ int initFieldDataMap(GLuint program, GLuint blockIndex, FieldDataMap* fdm, void*
     return 0;
 }
 
+/*
+ * (Re)fill the PointSources SSBO from the client-side source arrays, resizing
+ * it to however many sources there are now
+ */
+int uploadPointSources(GLuint ssbo, const FieldInfoMap* const fim) {
+    const GLsizeiptr size = sizeof(GLfloat)*PS_PACKED_STRIDE*(*(fim->psn) > 0 ? *(fim->psn) : 1);
+
+    GLfloat* const packed = (GLfloat*)malloc(size);
+    if (packed == NULL) {
+        record(1,"Failed to allocate point source upload buffer\n");
+        return 1;
+    }
+    memset(packed,0,size);
+    packPointSources(fim,packed);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER,ssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER,size,packed,GL_DYNAMIC_DRAW);
+
+    free(packed);
+    return 0;
+}
+
+typedef struct {
+    GLuint computeprogram;
+    // Launch shape computeprogram was built with
+    ShaderVariant computevariant;
+    GLuint reduceprogram;
+    GLint partialcountloc;
+    GLuint fieldpartialsssbo;
+    GLsizeiptr partialssize;
+    GLuint fieldinfoubo;
+    GLint fibstoragesize;
+    GLuint fielddatassbo;
+    GLint fdbstoragesize;
+    GLuint pointsourcessbo;
+    GLuint pointsourceupdatessbo;
+    GLint updatecountloc;
+    GLint levelloc;
+    GLint keeploc;
+    GLint reducelevelloc;
+    GLuint fieldtexture;
+    GLuint scratchtexture;
+    GLuint texturewidth;
+    GLuint textureheight;
+    GLfloat* readback;
+    // NULL outside the viewer
+    FrameMetrics* metrics;
+} GpuField;
+
+/*
+ * Run compute.glsl over one level of the field pyramid, leaving the samples in
+ * keep (x0, y0, x1, y1, or NULL for none) as they are, then fold its
+ * per-work-group partials into FieldData with reduce.glsl
+ */
+void dispatchFieldLevel(GpuField* const gpu, const FieldInfoMap* const fim,
+                        int level, const GLint* const keep)
+{
+    const GLint nokeep[] = { 0, 0, 0, 0 };
+    const GLuint width = fim->fieldsize[0]>>level > 0 ? fim->fieldsize[0]>>level : 1;
+    const GLuint height = fim->fieldsize[1]>>level > 0 ? fim->fieldsize[1]>>level : 1;
+    const GLuint groupwidth = gpu->computevariant.localx*gpu->computevariant.pixels;
+    const GLuint groupheight = gpu->computevariant.localy;
+    const GLuint groupsx = (width+groupwidth-1)/groupwidth;
+    const GLuint groupsy = (height+groupheight-1)/groupheight;
+    const GLsizeiptr partialssize = sizeof(GLfloat)*4*groupsx*groupsy;
+
+    if (partialssize > gpu->partialssize) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER,gpu->fieldpartialsssbo);
+        glBufferData(GL_SHADER_STORAGE_BUFFER,partialssize,NULL,GL_DYNAMIC_COPY);
+        gpu->partialssize = partialssize;
+    }
+
+    glBindImageTexture(FIELD_IMAGE_UNIT,gpu->fieldtexture,level,GL_TRUE,0,GL_READ_WRITE,GL_RG32F);
+    glProgramUniform1i(gpu->computeprogram,gpu->levelloc,level);
+    glProgramUniform4iv(gpu->computeprogram,gpu->keeploc,1,keep != NULL ? keep : nokeep);
+    glProgramUniform1i(gpu->reduceprogram,gpu->reducelevelloc,level);
+
+    glUseProgram(gpu->computeprogram);
+    beginStage(gpu->metrics,METRIC_DISPATCH);
+    glDispatchCompute(groupsx,groupsy,1);
+    endStage(gpu->metrics,METRIC_DISPATCH);
+    beginStage(gpu->metrics,METRIC_BARRIER);
+    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT |
+                    GL_TEXTURE_UPDATE_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+    endStage(gpu->metrics,METRIC_BARRIER);
+
+    if (gpu->fdbstoragesize == 0) return;
+
+    glProgramUniform1i(gpu->reduceprogram,gpu->partialcountloc,groupsx*groupsy);
+    glUseProgram(gpu->reduceprogram);
+    beginStage(gpu->metrics,METRIC_DISPATCH);
+    glDispatchCompute(1,1,1);
+    endStage(gpu->metrics,METRIC_DISPATCH);
+    beginStage(gpu->metrics,METRIC_BARRIER);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+    endStage(gpu->metrics,METRIC_BARRIER);
+}
+
+void dispatchField(GpuField* const gpu, const FieldInfoMap* const fim) {
+    dispatchFieldLevel(gpu,fim,0,NULL);
+}
+
+/*
+ * Make prog, built from compute.glsl as variant, the program dispatchFieldLevel
+ * runs; uniform locations and the FieldInfo binding are per program
+ */
+void useComputeProgram(GpuField* const gpu, GLuint prog, const ShaderVariant* const variant) {
+    gpu->computeprogram = prog;
+    gpu->computevariant = *variant;
+    gpu->updatecountloc = glGetUniformLocation(prog,"ps_update_count");
+    gpu->levelloc = glGetUniformLocation(prog,"level");
+    gpu->keeploc = glGetUniformLocation(prog,"keep");
+    glUniformBlockBinding(prog,glGetUniformBlockIndex(prog,"FieldInfo"),FIELDINFO_UBO_BINDING);
+}
+
+typedef struct {
+    GpuField* gpu;
+    const FieldInfoMap* fim;
+} GpuFieldBench;
+
+/*
+ * TuneBenchFunc for compute.glsl: build the variant and time full dispatches
+ * of the field already uploaded, through to glFinish, then put the program
+ * that was in use back
+ */
+double benchFieldGpu(void* arg, const ShaderVariant* const variant) {
+    GpuFieldBench* const bench = (GpuFieldBench*)arg;
+    GpuField* const gpu = bench->gpu;
+
+    const GLuint prog = createComputeProgram("compute.glsl",variant);
+    if (!prog) return -1;
+
+    const GLuint previous = gpu->computeprogram;
+    const ShaderVariant previousvariant = gpu->computevariant;
+    useComputeProgram(gpu,prog,variant);
+
+    // The first run pays for whatever the driver does lazily
+    dispatchField(gpu,bench->fim);
+    glFinish();
+
+    double best = -1, total = 0;
+    int i;
+    for (i=0; i<AUTOTUNE_MAX_REPEATS && total < AUTOTUNE_MIN_TIME; ++i) {
+        const double start = wallClock();
+        dispatchField(gpu,bench->fim);
+        glFinish();
+        const double t = wallClock()-start;
+        total += t;
+        if (best < 0 || t < best) best = t;
+    }
+    const int failed = glGetError() != GL_NO_ERROR;
+
+    useComputeProgram(gpu,previous,&previousvariant);
+    glDeleteProgram(prog);
+    return failed ? -1 : best;
+}
+
+// Reupload FieldInfo/FieldData and dispatch; programs, buffers and texture are reused
+int submitFieldGpu(GpuField* const gpu, const FieldInfoMap* const fim,
+                   const FieldDataMap* const fdm)
+{
+    glBindBuffer(GL_UNIFORM_BUFFER,gpu->fieldinfoubo);
+    glBufferSubData(GL_UNIFORM_BUFFER,0,gpu->fibstoragesize,fim->block_start);
+    if (uploadPointSources(gpu->pointsourcessbo,fim)) return 1;
+    if (gpu->fdbstoragesize > 0) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER,gpu->fielddatassbo);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER,0,gpu->fdbstoragesize,fdm->block_start);
+    }
+
+    dispatchField(gpu,fim);
+    return 0;
+}
+
+/*
+ * SweepEvalFunc for the compute shader: submit the field and read it straight
+ * back. Tiled runs use it; they need each tile in hand to place it.
+ */
+int computeFieldGpu(void* arg, const FieldInfoMap* const fim,
+                    FieldDataMap* const fdm, GLfloat* const field)
+{
+    GpuField* const gpu = (GpuField*)arg;
+    if (submitFieldGpu(gpu,fim,fdm)) return 1;
+
+    // Tiles at the edge of a tiled field only fill part of the texture
+    glBindTexture(GL_TEXTURE_2D,gpu->fieldtexture);
+    if (fim->fieldsize[0] == gpu->texturewidth && fim->fieldsize[1] == gpu->textureheight) {
+        glGetTexImage(GL_TEXTURE_2D,0,GL_RG,GL_FLOAT,field);
+    } else {
+        if (gpu->readback == NULL) {
+            gpu->readback = (GLfloat*)malloc(sizeof(GLfloat)*2*
+                                             gpu->texturewidth*gpu->textureheight);
+            if (gpu->readback == NULL) {
+                record(1,"Failed to allocate texture readback buffer\n");
+                return 1;
+            }
+        }
+        glGetTexImage(GL_TEXTURE_2D,0,GL_RG,GL_FLOAT,gpu->readback);
+
+        GLuint y;
+        for (y=0; y<fim->fieldsize[1]; ++y) {
+            memcpy(field+2*(size_t)y*fim->fieldsize[0],
+                   gpu->readback+2*(size_t)y*gpu->texturewidth,
+                   sizeof(GLfloat)*2*fim->fieldsize[0]);
+        }
+    }
+    if (gpu->fdbstoragesize > 0) {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER,gpu->fielddatassbo);
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER,0,gpu->fdbstoragesize,fdm->block_start);
+    }
+
+    return glGetError() != GL_NO_ERROR;
+}
+
+/*
+ * runSweep for the compute shader, without waiting on the readback: each
+ * variant is captured as soon as it's dispatched and written out from the
+ * capture ring while the next ones are evaluated.
+ */
+int runCapturedSweep(GpuField* const gpu, Sweep* const sweep, FieldInfoMap* const fim,
+                     FieldDataMap* const fdm, const char* const outfile)
+{
+    const int numvariants = sweepVariants(sweep);
+
+    if (beginSweep(sweep,fim,fdm)) return 1;
+    FieldCapture* const capture = createFieldCapture(outfile,1,gpu->fieldtexture,
+                                                     gpu->texturewidth,gpu->textureheight,
+                                                     gpu->fielddatassbo,gpu->fdbstoragesize,fdm);
+    if (capture == NULL) {
+        endSweep(sweep);
+        return 1;
+    }
+
+    record(0,"Sweeping %d variants of a %ux%u field into %s\n",numvariants,
+           fim->fieldsize[0],fim->fieldsize[1],outfile);
+
+    const double start = wallClock();
+    int failed = 0;
+    int variant;
+    for (variant=0; variant<numvariants && !failed; ++variant) {
+        applySweepVariant(sweep,variant,fim,fdm);
+        failed = submitFieldGpu(gpu,fim,fdm) || captureField(capture,fim,fdm) ||
+                 glGetError() != GL_NO_ERROR;
+    }
+
+    if (finishFieldCapture(capture)) failed = 1;
+    if (failed) record(1,"Sweep stopped at variant %d\n",variant-1);
+    else record(0,"Swept %d variants in %.2fs\n",numvariants,wallClock()-start);
+
+    endSweep(sweep);
+    return failed;
+}
+
+int computeFieldCpuSweep(void* arg, const FieldInfoMap* const fim,
+                         FieldDataMap* const fdm, GLfloat* const field)
+{
+    return computeFieldCpu((CpuFieldEngine*)arg,fim,fdm,field);
+}
+
+typedef struct {
+    CpuFieldEngine* engine;
+    double tolerance;
+} FarFieldEval;
+
+int computeFieldFarSweep(void* arg, const FieldInfoMap* const fim,
+                         FieldDataMap* const fdm, GLfloat* const field)
+{
+    const FarFieldEval* const far = (const FarFieldEval*)arg;
+    return computeFieldFar(far->engine,fim,fdm,field,far->tolerance);
+}
+
+// Pan (zoom 0) by dirx, diry steps, or zoom in (-1) or out (+1)
+typedef struct {
+    int zoom;
+    int dirx;
+    int diry;
+} ViewMove;
+
+typedef struct {
+    FieldInfoMap* fim;
+    FieldEdits* edits;
+    FrameMetrics* metrics;
+    int selected;
+
+    int animate;
+    GLfloat playbackrate;
+
+    // Applied by the render loop, which owns the field texture
+    ViewMove moves[MAX_PENDING_MOVES];
+    int nummoves;
+} Viewer;
+
+void queueViewMove(Viewer* const viewer, int zoom, int dirx, int diry) {
+    if (viewer->nummoves == MAX_PENDING_MOVES) return;
+
+    ViewMove* const move = viewer->moves+viewer->nummoves++;
+    move->zoom = zoom;
+    move->dirx = dirx;
+    move->diry = diry;
+}
+
+/*
+ * Interactive steering: [ and ] pick a source, up/down turn its phase,
+ * left/right and page up/down move it. A toggles playback of the wave, = and
+ * - speed it up and slow it down. Shift with the arrows pans the view, Z and
+ * X zoom in and out. T shows and hides the timing overlay.
+ */
+void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods) {
+    (void)scancode;
+    if (action == GLFW_RELEASE) return;
+
+    Viewer* const viewer = (Viewer*)glfwGetWindowUserPointer(window);
+
+    if (mods & GLFW_MOD_SHIFT) {
+        switch (key) {
+        case GLFW_KEY_RIGHT: queueViewMove(viewer,0,1,0); return;
+        case GLFW_KEY_LEFT:  queueViewMove(viewer,0,-1,0); return;
+        case GLFW_KEY_UP:    queueViewMove(viewer,0,0,1); return;
+        case GLFW_KEY_DOWN:  queueViewMove(viewer,0,0,-1); return;
+        }
+    }
+
+    switch (key) {
+    case GLFW_KEY_Z:
+        queueViewMove(viewer,-1,0,0);
+        return;
+    case GLFW_KEY_X:
+        queueViewMove(viewer,1,0,0);
+        return;
+    case GLFW_KEY_A:
+        viewer->animate = !viewer->animate;
+        record(1,"Animation %s\n",viewer->animate ? "on" : "off");
+        return;
+    case GLFW_KEY_EQUAL:
+        viewer->playbackrate *= 2;
+        record(1,"Playing back at %g cycles per second\n",viewer->playbackrate);
+        return;
+    case GLFW_KEY_MINUS:
+        viewer->playbackrate /= 2;
+        record(1,"Playing back at %g cycles per second\n",viewer->playbackrate);
+        return;
+    case GLFW_KEY_T:
+        toggleMetricsOverlay(viewer->metrics);
+        if (!metricsOverlayShown(viewer->metrics)) glfwSetWindowTitle(window,WINDOW_TITLE);
+        return;
+    }
+
+    FieldInfoMap* const fim = viewer->fim;
+    const int psn = *(fim->psn);
+    if (psn <= 0) return;
+
+    const int i = viewer->selected;
+    GLfloat dphase = 0, dx = 0, dy = 0;
+
+    switch (key) {
+    case GLFW_KEY_LEFT_BRACKET:
+        viewer->selected = (i+psn-1)%psn;
+        record(1,"Selected source %d\n",viewer->selected);
+        return;
+    case GLFW_KEY_RIGHT_BRACKET:
+        viewer->selected = (i+1)%psn;
+        record(1,"Selected source %d\n",viewer->selected);
+        return;
+    case GLFW_KEY_UP:        dphase = PI/16; break;
+    case GLFW_KEY_DOWN:      dphase = -PI/16; break;
+    case GLFW_KEY_RIGHT:     dx = 0.01*fim->fielddims[0]; break;
+    case GLFW_KEY_LEFT:      dx = -0.01*fim->fielddims[0]; break;
+    case GLFW_KEY_PAGE_UP:   dy = 0.01*fim->fielddims[1]; break;
+    case GLFW_KEY_PAGE_DOWN: dy = -0.01*fim->fielddims[1]; break;
+    default: return;
+    }
+
+    recordSourceEdit(viewer->edits,fim,i);
+    fim->ps_phase[i] += dphase;
+    fim->ps_loc[NUM_DIMS*i] += dx;
+    fim->ps_loc[NUM_DIMS*i+1] += dy;
+    record(0,"Source %d now at (%f, %f), phase %f\n",i,fim->ps_loc[NUM_DIMS*i],
+           fim->ps_loc[NUM_DIMS*i+1],fim->ps_phase[i]);
+}
+
+/*
+ * Bring the field texture up to date with edits to the sources: a pass over
+ * just the changed sources on top of the current field if few enough changed
+ * since the last full evaluation, otherwise a full pass. cpuengine selects the
+ * CPU engine (cpufield then holds the current field) over compute.glsl.
+ * compute.glsl applies incremental passes to every level of the pyramid that
+ * holds anything and leaves full ones to refineFieldTexture, coarsest first.
+ */
+void updateFieldTexture(GpuField* const gpu, const FieldInfoMap* const fim,
+                        FieldDataMap* const fdm, FieldEdits* const edits,
+                        FieldPyramid* const pyramid,
+                        CpuFieldEngine* const cpuengine, GLfloat* const cpufield)
+{
+    GLfloat deltas[2*PS_PACKED_STRIDE*MAX_PENDING_EDITS];
+    const int incremental = fieldUpdateIsIncremental(edits);
+    const int numdeltas = incremental ? packSourceDeltas(edits,fim,deltas) : 0;
+
+    // Both engines redo the whole FieldData reduction, even for incremental
+    // updates, so written needs no resetting here
+    if (cpuengine != NULL) {
+        beginStage(gpu->metrics,METRIC_CPU_FIELD);
+        const int failed = incremental ?
+            updateFieldCpu(cpuengine,fim,deltas,numdeltas,fdm,cpufield) :
+            computeFieldCpu(cpuengine,fim,fdm,cpufield);
+        endStage(gpu->metrics,METRIC_CPU_FIELD);
+        if (failed) return;
+
+        beginStage(gpu->metrics,METRIC_UPLOAD);
+        glBindTexture(GL_TEXTURE_2D,gpu->fieldtexture);
+        glTexSubImage2D(GL_TEXTURE_2D,0,0,0,fim->fieldsize[0],fim->fieldsize[1],
+                        GL_RG,GL_FLOAT,cpufield);
+        completeFieldPyramid(pyramid);
+
+        if (gpu->fdbstoragesize > 0) {
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER,gpu->fielddatassbo);
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER,0,gpu->fdbstoragesize,fdm->block_start);
+        }
+        endStage(gpu->metrics,METRIC_UPLOAD);
+    } else {
+        // Keep the full source list current for later full passes
+        if (incremental) {
+            GLfloat packed[PS_PACKED_STRIDE];
+            int i;
+            beginStage(gpu->metrics,METRIC_UPLOAD);
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER,gpu->pointsourcessbo);
+            for (i=0; i<numdeltas; i+=2) {
+                memcpy(packed,deltas+PS_PACKED_STRIDE*i,sizeof(packed));
+                glBufferSubData(GL_SHADER_STORAGE_BUFFER,
+                                sizeof(packed)*edits->index[i/2],sizeof(packed),packed);
+            }
+
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER,gpu->pointsourceupdatessbo);
+            glBufferData(GL_SHADER_STORAGE_BUFFER,sizeof(GLfloat)*PS_PACKED_STRIDE*numdeltas,
+                         deltas,GL_STREAM_DRAW);
+            endStage(gpu->metrics,METRIC_UPLOAD);
+
+            // Coarsest first so FieldData ends up describing level 0
+            int l;
+            glProgramUniform1i(gpu->computeprogram,gpu->updatecountloc,numdeltas);
+            for (l=pyramid->top; l>=0; --l) {
+                const GLint* const valid = pyramid->valid[l];
+                if (valid[0] < valid[2] && valid[1] < valid[3]) dispatchFieldLevel(gpu,fim,l,NULL);
+            }
+            glProgramUniform1i(gpu->computeprogram,gpu->updatecountloc,0);
+        } else {
+            beginStage(gpu->metrics,METRIC_UPLOAD);
+            const int failed = uploadPointSources(gpu->pointsourcessbo,fim);
+            endStage(gpu->metrics,METRIC_UPLOAD);
+            if (failed) return;
+            invalidateFieldPyramid(pyramid);
+        }
+    }
+
+    finishFieldUpdate(edits,incremental);
+}
+
+/*
+ * Evaluate the next level of the pyramid, if any, apart from the samples it
+ * already holds
+ */
+void refineFieldTexture(GpuField* const gpu, FieldPyramid* const pyramid,
+                        const FieldInfoMap* const fim)
+{
+    GLint keep[4];
+    const int level = nextPyramidLevel(pyramid,keep);
+    if (level < 0) return;
+
+    dispatchFieldLevel(gpu,fim,level,keep);
+    record(0,"Evaluated level %d of %d\n",level,pyramid->top);
+}
+
+/*
+ * Pan or zoom: carry the blocks of the pyramid that stay in view over to where
+ * they are now. The new offset and dimensions go up with the next
+ * syncFieldMaps; everything else is left to refineFieldTexture.
+ */
+void moveView(GpuField* const gpu, FieldPyramid* const pyramid, FieldInfoMap* const fim,
+              const ViewMove* const move)
+{
+    PyramidCopy copies[PROGRESSIVE_MAX_LEVEL+1];
+    GLint shift[2];
+    viewMoveShift(pyramid,fim,move->zoom,move->dirx,move->diry,shift);
+    const int numcopies = moveFieldPyramid(pyramid,fim,move->zoom,shift,copies);
+
+    // Through the scratch texture, as a block can land on another one's source
+    int i;
+    for (i=0; i<numcopies; ++i) {
+        const PyramidCopy* const c = copies+i;
+        glCopyImageSubData(gpu->fieldtexture,GL_TEXTURE_2D,c->from,c->srcx,c->srcy,0,
+                           gpu->scratchtexture,GL_TEXTURE_2D,c->from,c->srcx,c->srcy,0,
+                           c->width,c->height,1);
+    }
+    for (i=0; i<numcopies; ++i) {
+        const PyramidCopy* const c = copies+i;
+        glCopyImageSubData(gpu->scratchtexture,GL_TEXTURE_2D,c->from,c->srcx,c->srcy,0,
+                           gpu->fieldtexture,GL_TEXTURE_2D,c->level,c->dstx,c->dsty,0,
+                           c->width,c->height,1);
+    }
+}
+
+/*
+ * Push FieldInfo changes made on the host to the GPU, once per frame whatever
+ * made them. Anything that changes the field itself schedules a full
+ * evaluation; a moved view only needs the samples the pyramid lacks.
+ */
+void syncFieldMaps(const GpuField* const gpu, FieldInfoMap* const fim,
+                   FieldEdits* const edits)
+{
+    if (!fim->dirty) return;
+
+    beginStage(gpu->metrics,METRIC_UPLOAD);
+    glBindBuffer(GL_UNIFORM_BUFFER,gpu->fieldinfoubo);
+    glBufferSubData(GL_UNIFORM_BUFFER,0,gpu->fibstoragesize,fim->block_start);
+    endStage(gpu->metrics,METRIC_UPLOAD);
+
+    if (fim->dirty & FIM_DIRTY_FIELD) requestFullUpdate(edits);
+    fim->dirty = 0;
+}
+
+/*
+ * Write infile out as a binary scenario, then load that back and check it
+ * holds exactly what was read from infile
+ */
+int runConvert(const char* const infile, const char* const outfile) {
+    FieldInfoMap fim[2];
+    FieldDataMap fdm[2];
+    int failed = 0, i;
+
+    // Zeroed so that whatever did get allocated can be freed below
+    memset(fim,0,sizeof(fim));
+    memset(fdm,0,sizeof(fdm));
+    for (i=0; i<2; ++i) {
+        if (initFieldInfoMapHost(fim+i) || initFieldDataMapHost(fdm+i)) failed = 1;
+    }
+
+    if (!failed && loadFieldInfoFile(infile,fim,fdm)) {
+        record(1,"Failed to load input file %s\n",infile);
+        failed = 1;
+    }
+    if (!failed) failed = writeScenarioFile(outfile,fim,fdm);
+    if (!failed && loadFieldInfoFile(outfile,fim+1,fdm+1)) {
+        record(1,"Failed to read back scenario %s\n",outfile);
+        failed = 1;
+    }
+    if (!failed && !sameScenario(fim,fdm,fim+1,fdm+1)) {
+        record(1,"Scenario %s doesn't match %s\n",outfile,infile);
+        failed = 1;
+    }
+    if (!failed) record(0,"Converted %s to %s; round trip checked\n",infile,outfile);
+
+    for (i=0; i<2; ++i) {
+        free(fdm[i].block_start);
+        freeFieldInfoMap(fim+i);
+    }
+    return failed;
+}
+
+typedef struct {
+    GLuint tilesize;
+    const char* mapfile;
+    int broadband;
+    const PulseSpec* pulse;  // NULL for layers only
+    const char* pulsefile;
+    double fartolerance;     // > 0 uses the far field approximation
+    int farreport;           // only compare the approximation to the direct sum
+    int propagationcache;    // cache propagation for sweeps that allow it
+    const char* probefile;   // evaluate only the Probe-Location points, into this
+    int volume;              // evaluate the Volume-Size grid in 3D instead
+    int slices;              // or the Volume-Slice planes
+} HeadlessOptions;
+
+/*
+ * Evaluate infile (or every variant of it in sweep, or every frequency in it
+ * when broadband) on the CPU and write it to outfile, without touching GL
+ */
+int runHeadless(const char* const infile, const char* const outfile, Sweep* const sweep,
+                const HeadlessOptions* const options)
+{
+    GLuint tilesize = options->tilesize;
+    const char* const mapfile = options->mapfile;
+    FieldInfoMap fieldinfomap;
+    FieldDataMap fielddatamap;
+
+    if (initFieldInfoMapHost(&fieldinfomap)) return 1;
+    if (initFieldDataMapHost(&fielddatamap)) {
+        freeFieldInfoMap(&fieldinfomap);
+        return 1;
+    }
+
+    int failed = 0;
+    GLfloat* field = NULL;
+    CpuFieldEngine* engine = NULL;
+
+    record(0,"Loading FieldInfo file %s\n",infile);
+    if (loadFieldInfoFile(infile,&fieldinfomap,&fielddatamap)) {
+        record(1,"Failed to load input file %s\n",infile);
+        failed = 1;
+    }
+
+    if (!failed) {
+        engine = createCpuFieldEngine(0);
+        if (engine == NULL) {
+            record(1,"Failed to create CPU field engine\n");
+            failed = 1;
+        }
+    }
+
+    SweepEvalFunc eval = computeFieldCpuSweep;
+    void* evalarg = engine;
+    FarFieldEval far;
+    if (options->fartolerance > 0) {
+        far.engine = engine;
+        far.tolerance = options->fartolerance;
+        eval = computeFieldFarSweep;
+        evalarg = &far;
+    }
+
+    // Big fields go through in tiles even when not asked to
+    if (!failed && !options->farreport && options->probefile == NULL && sweep->numaxes == 0 && tilesize == 0 &&
+            (mapfile != NULL ||
+             (double)fieldinfomap.fieldsize[0]*fieldinfomap.fieldsize[1] > TILED_AUTO_PIXELS)) {
+        tilesize = TILED_DEFAULT_SIZE;
+    }
+
+    // The cache only pays when the propagation is shared, and must fit
+    int cached = 0;
+    if (!failed && sweep->numaxes > 0 && options->propagationcache) {
+        if (!sweepDrivesOnly(sweep) || options->fartolerance > 0) {
+            record(1,"Only direct phase sweeps can use the propagation cache; not caching\n");
+        } else if (propagationCacheBytes(&fieldinfomap) > PROPAGATION_MAX_BYTES) {
+            record(1,"Propagation cache would take %.1f MB, over the %.1f MB limit; not caching\n",
+                   propagationCacheBytes(&fieldinfomap)/1048576.0,PROPAGATION_MAX_BYTES/1048576.0);
+        } else if (fieldReflects(&fieldinfomap)) {
+            record(1,"The propagation cache doesn't hold image sources; not caching\n");
+        } else {
+            cached = 1;
+        }
+    }
+
+    // Image sources only go through the direct sum
+    if (!failed && fieldReflects(&fieldinfomap) &&
+            (options->fartolerance > 0 || options->farreport || options->broadband)) {
+        record(1,"Reflective walls can't be used with -far, -far-report or -broadband\n");
+        failed = 1;
+    }
+
+    if (!failed && options->volume) {
+        failed = runVolume(engine,&fieldinfomap,&fielddatamap,outfile);
+    } else if (!failed && options->slices) {
+        failed = runSlices(engine,&fieldinfomap,&fielddatamap,outfile);
+    } else if (!failed && options->probefile != NULL) {
+        failed = runProbes(engine,&fieldinfomap,options->probefile);
+    } else if (!failed && options->farreport) {
+        failed = runFarFieldReport(engine,&fieldinfomap,&fielddatamap);
+    } else if (!failed && options->broadband) {
+        failed = runBroadband(engine,&fieldinfomap,&fielddatamap,outfile,
+                              options->pulse,options->pulsefile);
+    } else if (!failed && cached) {
+        failed = runPropagationSweep(engine,sweep,&fieldinfomap,&fielddatamap,outfile);
+    } else if (!failed && sweep->numaxes > 0) {
+        failed = runSweep(sweep,&fieldinfomap,&fielddatamap,eval,evalarg,outfile);
+    } else if (!failed && tilesize > 0) {
+        failed = runTiled(&fieldinfomap,&fielddatamap,eval,evalarg,
+                          tilesize,outfile,mapfile);
+        if (!failed) {
+            record(0,"Field min %f, max %f, mean %f, rms %f\n",
+                   *(fielddatamap.field_min),*(fielddatamap.field_max),
+                   *(fielddatamap.field_mean),*(fielddatamap.field_rms));
+        }
+    } else if (!failed) {
+        field = (GLfloat*)malloc(sizeof(GLfloat)*2*
+                                 fieldinfomap.fieldsize[0]*fieldinfomap.fieldsize[1]);
+        if (field == NULL) {
+            record(1,"Failed to allocate field buffer\n");
+            failed = 1;
+        }
+
+        if (!failed) failed = eval(evalarg,&fieldinfomap,&fielddatamap,field);
+        if (!failed) failed = writeFieldFile(outfile,&fieldinfomap,&fielddatamap,field);
+        if (!failed) {
+            record(0,"Field min %f, max %f, mean %f, rms %f\n",
+                   *(fielddatamap.field_min),*(fielddatamap.field_max),
+                   *(fielddatamap.field_mean),*(fielddatamap.field_rms));
+        }
+    }
+
+    destroyCpuFieldEngine(engine);
+    free(field);
+    free(fielddatamap.block_start);
+    freeFieldInfoMap(&fieldinfomap);
+    return failed;
+}
+
 int main(int argc, char** argv) {
     setbuf(stdout,NULL);
-    if (argc > 1 && strcmp(argv[1],"-v") == 0){
-        setVerbose(1);
-        record(0,"Verbose mode switched on\n");
+
+    int usecpu = 0;
+    int headless = 0;
+    const char* convertfile = NULL;
+    const char* mapfile = NULL;
+    GLuint tilesize = 0;
+    int broadband = 0;
+    PulseSpec pulse;
+    pulse.steps = 0;
+    const char* pulsefile = "pulse.bin";
+    double fartolerance = 0;
+    int farreport = 0;
+    int propagationcache = 0;
+    const char* probefile = NULL;
+    int autotune = 0;
+    int volume = 0;
+    int slices = 0;
+    const char* metricsfile = NULL;
+    const char* capturefile = NULL;
+    int localworkers = 0;
+    const char* remoteworkers = NULL;
+    const char* serveaddress = NULL;
+    double shardtimeout = 0;
+    double metricsinterval = METRICS_DEFAULT_INTERVAL;
+    const char* infile = "field1.fi";
+    const char* outfile = "field.bin";
+    Sweep sweep;
+    sweep.numaxes = 0;
+
+    int arg;
+    for (arg=1; arg<argc; ++arg) {
+        if (strcmp(argv[arg],"-v") == 0) {
+            setVerbose(1);
+            record(0,"Verbose mode switched on\n");
+        } else if (strcmp(argv[arg],"-cpu") == 0) {
+            usecpu = 1;
+        } else if (strcmp(argv[arg],"-headless") == 0) {
+            headless = 1;
+        } else if (strcmp(argv[arg],"-sweep") == 0 && arg+1 < argc) {
+            if (parseSweepAxis(argv[++arg],&sweep)) return 1;
+        } else if (strcmp(argv[arg],"-convert") == 0 && arg+1 < argc) {
+            convertfile = argv[++arg];
+        } else if (strcmp(argv[arg],"-tile") == 0 && arg+1 < argc) {
+            tilesize = (GLuint)strtoul(argv[++arg],NULL,10);
+        } else if (strcmp(argv[arg],"-map") == 0 && arg+1 < argc) {
+            mapfile = argv[++arg];
+        } else if (strcmp(argv[arg],"-broadband") == 0) {
+            broadband = 1;
+        } else if (strcmp(argv[arg],"-pulse") == 0 && arg+1 < argc) {
+            if (parsePulseSpec(argv[++arg],&pulse)) return 1;
+            broadband = 1;
+        } else if (strcmp(argv[arg],"-pulse-o") == 0 && arg+1 < argc) {
+            pulsefile = argv[++arg];
+        } else if (strcmp(argv[arg],"-far") == 0 && arg+1 < argc) {
+            fartolerance = strtod(argv[++arg],NULL);
+            if (!(fartolerance > 0)) fartolerance = FAR_DEFAULT_TOLERANCE;
+        } else if (strcmp(argv[arg],"-far-report") == 0) {
+            farreport = 1;
+        } else if (strcmp(argv[arg],"-cache") == 0) {
+            propagationcache = 1;
+        } else if (strcmp(argv[arg],"-probe-o") == 0 && arg+1 < argc) {
+            probefile = argv[++arg];
+        } else if (strcmp(argv[arg],"-volume") == 0) {
+            volume = 1;
+        } else if (strcmp(argv[arg],"-slices") == 0) {
+            slices = 1;
+        } else if (strcmp(argv[arg],"-metrics") == 0 && arg+1 < argc) {
+            metricsfile = argv[++arg];
+        } else if (strcmp(argv[arg],"-metrics-interval") == 0 && arg+1 < argc) {
+            metricsinterval = atof(argv[++arg]);
+        } else if (strcmp(argv[arg],"-capture") == 0 && arg+1 < argc) {
+            capturefile = argv[++arg];
+        } else if (strcmp(argv[arg],"-format") == 0 && arg+1 < argc) {
+            const int format = parseFieldFormat(argv[++arg]);
+            if (format < 0) return 1;
+            setFieldFormat(format);
+        } else if (strcmp(argv[arg],"-local-workers") == 0 && arg+1 < argc) {
+            localworkers = atoi(argv[++arg]);
+        } else if (strcmp(argv[arg],"-workers") == 0 && arg+1 < argc) {
+            remoteworkers = argv[++arg];
+        } else if (strcmp(argv[arg],"-serve") == 0 && arg+1 < argc) {
+            serveaddress = argv[++arg];
+        } else if (strcmp(argv[arg],"-shard-timeout") == 0 && arg+1 < argc) {
+            shardtimeout = atof(argv[++arg]);
+        } else if (strcmp(argv[arg],"-autotune") == 0) {
+            autotune = 1;
+        } else if (strcmp(argv[arg],"-o") == 0 && arg+1 < argc) {
+            outfile = argv[++arg];
+        } else if (argv[arg][0] != '-') {
+            infile = argv[arg];
+        } else {
+            record(1,"Ignoring unrecognised argument \"%s\"\n",argv[arg]);
+        }
+    }
+
+    if (convertfile != NULL) return runConvert(infile,convertfile);
+    if (serveaddress != NULL) return serveShards(serveaddress,0);
+
+    // Sharded runs are tiled runs on CPU workers and nothing else
+    if (localworkers > 0 || remoteworkers != NULL) {
+        if (broadband || sweep.numaxes > 0 || fartolerance > 0 || farreport ||
+                propagationcache || probefile != NULL || volume || slices || autotune)
+            record(1,"Sharded runs only evaluate the plane in tiles; ignoring other modes\n");
+        ShardOptions shard;
+        shard.localworkers = localworkers;
+        shard.remoteworkers = remoteworkers;
+        shard.tilesize = tilesize;
+        shard.mapfile = mapfile;
+        shard.timeout = shardtimeout;
+        return runSharded(infile,outfile,&shard);
+    }
+
+    HeadlessOptions options;
+    memset(&options,0,sizeof(options));
+    options.fartolerance = fartolerance;
+    options.farreport = farreport;
+    options.propagationcache = propagationcache;
+    options.probefile = probefile;
+
+    // Tuning times compute.glsl on the scenario's own field and nothing else;
+    // the CPU engine's tile sizes are fixed when it's compiled (cpu-field.h)
+    if (autotune) {
+        if (usecpu || headless || broadband || sweep.numaxes > 0 || tilesize > 0 ||
+                mapfile != NULL || fartolerance > 0 || farreport || propagationcache ||
+                probefile != NULL || volume || slices)
+            record(1,"-autotune only times the compute shader; ignoring other modes\n");
+        usecpu = headless = broadband = volume = slices = 0;
+        sweep.numaxes = 0;
+        tilesize = 0;
+        mapfile = NULL;
+        fartolerance = 0;
+        farreport = propagationcache = 0;
+        probefile = NULL;
+    }
+
+    // 3D runs are CPU only and write nothing else
+    if (volume || slices) {
+        if (broadband || sweep.numaxes > 0 || tilesize > 0 || mapfile != NULL ||
+                fartolerance > 0 || farreport || probefile != NULL)
+            record(1,"3D runs can't be broadband, swept, tiled or probed; ignoring those options\n");
+        if (volume && slices) record(1,"-volume and -slices share the output file; ignoring -slices\n");
+        options.volume = volume;
+        options.slices = !volume;
+        return runHeadless(infile,outfile,&sweep,&options);
+    }
+
+    // Layers are written a band at a time on the CPU whatever else was asked
+    if (broadband) {
+        if (sweep.numaxes > 0 || tilesize > 0 || mapfile != NULL)
+            record(1,"Broadband runs can't be swept or tiled; ignoring -sweep, -tile and -map\n");
+        sweep.numaxes = 0;
+        options.broadband = 1;
+        options.pulse = pulse.steps > 0 ? &pulse : NULL;
+        options.pulsefile = pulsefile;
+        options.fartolerance = 0;
+        options.farreport = 0;
+        options.probefile = NULL;
+        return runHeadless(infile,outfile,&sweep,&options);
+    }
+
+    if (sweep.numaxes > 0 && (tilesize > 0 || mapfile != NULL)) {
+        record(1,"Sweeps can't be tiled; ignoring -tile and -map\n");
+        tilesize = 0;
+        mapfile = NULL;
+    }
+    if (mapfile != NULL && tilesize == 0) tilesize = TILED_DEFAULT_SIZE;
+
+    // Sweeps and tiled runs on the CPU don't need a window either, and the
+    // far field approximation, propagation cache and probes are CPU only
+    if (headless || fartolerance > 0 || farreport || probefile != NULL ||
+            (propagationcache && sweep.numaxes > 0) ||
+            (usecpu && (sweep.numaxes > 0 || tilesize > 0))) {
+        options.tilesize = tilesize;
+        options.mapfile = mapfile;
+        return runHeadless(infile,outfile,&sweep,&options);
     }
     
     if(!glfwInit()) return 1;
-    GLFWwindow* window = glfwCreateWindow(WINDOW_WIDTH,WINDOW_HEIGHT,"Acoustics Toolkit",NULL,NULL);
+    if (sweep.numaxes > 0 || tilesize > 0 || autotune) glfwWindowHint(GLFW_VISIBLE,GL_FALSE);
+    GLFWwindow* window = glfwCreateWindow(WINDOW_WIDTH,WINDOW_HEIGHT,WINDOW_TITLE,NULL,NULL);
     if (!window) {
         record(1,"Window creation failed; terminating\n");
         glfwTerminate();
@@ -402,6 +1145,11 @@ int main(int argc, char** argv) {
         return 1;
     }
 
+    // Times for the viewer's metrics, which only exist once it's running
+    double startup[METRIC_NUM_STARTUP];
+    memset(startup,0,sizeof(startup));
+    double start = wallClock();
+
     Renderable canvas = createCanvas();
     GLuint shaderprogram = createShaderProgram();
     if (!shaderprogram) {
@@ -410,12 +1158,20 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    GLuint computeprogram = createComputeProgram();
+    GLuint computeprogram = createComputeProgram("compute.glsl",NULL);
     if (!computeprogram) {
         record(1,"Failed to create compute program; terminating\n");
         glfwTerminate();
         return 1;
     }
+
+    GLuint reduceprogram = createComputeProgram("reduce.glsl",NULL);
+    if (!reduceprogram) {
+        record(1,"Failed to create reduction program; terminating\n");
+        glfwTerminate();
+        return 1;
+    }
+    startup[METRIC_STARTUP_PROGRAMS] = wallClock()-start;
 /*
  * ----------------------------------------------------------------------------
  *  Prepare a client-side buffer for upload to the FieldInfo UBO
@@ -456,14 +1212,15 @@ int main(int argc, char** argv) {
     GLint fdbstoragesize;
 
     {
-        GLuint computeBlockIndex = glGetProgramResourceIndex(computeprogram,GL_SHADER_STORAGE_BLOCK,"FieldData");
-        if (computeBlockIndex == GL_INVALID_INDEX) {
+        // reduce.glsl is the one that writes FieldData
+        GLuint reduceBlockIndex = glGetProgramResourceIndex(reduceprogram,GL_SHADER_STORAGE_BLOCK,"FieldData");
+        if (reduceBlockIndex == GL_INVALID_INDEX) {
             record(1,"FieldData block not found; no metadata will be available to the fragment shader\n\n");
             fdbstoragesize = 0;
         } else {
             GLenum gl_buffer_data_size = GL_BUFFER_DATA_SIZE;
-            glGetProgramResourceiv(computeprogram,GL_SHADER_STORAGE_BLOCK,
-                                   computeBlockIndex,1,&gl_buffer_data_size,
+            glGetProgramResourceiv(reduceprogram,GL_SHADER_STORAGE_BLOCK,
+                                   reduceBlockIndex,1,&gl_buffer_data_size,
                                    1,NULL,&fdbstoragesize);
 
             GLvoid* const ssbobuffer = malloc(sizeof(char)*fdbstoragesize);
@@ -473,7 +1230,7 @@ int main(int argc, char** argv) {
                      " Getting FieldData block information from shaders\n"
                      "------------------------------------------------------------\n\n");
             record(0,"Buffer created at %p\n",ssbobuffer);
-            if (initFieldDataMap(computeprogram,computeBlockIndex,&fielddatamap,ssbobuffer)) {
+            if (initFieldDataMap(reduceprogram,reduceBlockIndex,&fielddatamap,ssbobuffer)) {
                 record(1,"FieldData block is missing required elements;"
                          " no metadata will be available to the fragment shader\n\n");
                 fdbstoragesize = 0;
@@ -482,11 +1239,9 @@ int main(int argc, char** argv) {
         }
         // If buffer creation fucked up, we'll make a dummy for the parser
         // but not upload anything
-        if (fdbstoragesize == 0) {
-            fielddatamap.block_start = malloc(FDM_DUMMY_BUFFER_SIZE);
-            fielddatamap.written = (GLint*)fielddatamap.block_start;
-            fielddatamap.field_max = (GLfloat*)(fielddatamap.written+1);
-            fielddatamap.field_min = fielddatamap.field_max+1;
+        if (fdbstoragesize == 0 && initFieldDataMapHost(&fielddatamap)) {
+            glfwTerminate();
+            return 1;
         }
     }
 /*
@@ -495,12 +1250,83 @@ int main(int argc, char** argv) {
  * ----------------------------------------------------------------------------
  */
     record(0,"------------------------------------------------------------\n"
-             " Loading FieldInfo file field1.fi\n"
-             "------------------------------------------------------------\n\n");
-    if (loadFieldInfoFile("field1.fi",&fieldinfomap,&fielddatamap)) {
+             " Loading FieldInfo file %s\n"
+             "------------------------------------------------------------\n\n",infile);
+    start = wallClock();
+    if (loadFieldInfoFileTimed(infile,&fieldinfomap,&fielddatamap,startup+METRIC_STARTUP_PARSE)) {
         record(1,"Failed to load input file; falling back to demo\n\n");
         setupDemoFieldInfo(&fieldinfomap);
     }
+    startup[METRIC_STARTUP_LOAD] = wallClock()-start;
+/*
+ * ----------------------------------------------------------------------------
+ *  compute.glsl has no per-source amplitude to give image sources, so the
+ *  viewer evaluates reflective scenarios on the CPU
+ * ----------------------------------------------------------------------------
+ */
+    if (fieldReflects(&fieldinfomap) && !usecpu) {
+        if (sweep.numaxes > 0 || tilesize > 0) {
+            record(1,"Reflective walls are only evaluated on the CPU; rerun with -cpu\n");
+            glfwTerminate();
+            return 1;
+        }
+        record(1,"Reflective walls are only evaluated on the CPU; using -cpu\n");
+        usecpu = 1;
+    }
+/*
+ * ----------------------------------------------------------------------------
+ *  Swap in compute.glsl specialised to the scenario and launched in the shape
+ *  tuned for this driver and field size, now that both are known; the
+ *  FieldInfo block is laid out the same in every variant
+ * ----------------------------------------------------------------------------
+ */
+    ShaderVariant computevariant;
+    initShaderVariant(&computevariant);
+    {
+        const ShaderVariant plain = computevariant;
+        fieldShaderVariant(&fieldinfomap,&computevariant);
+        const int tuned = loadTuning(&fieldinfomap,&computevariant) == 0;
+        if (computevariant.sourcecount > 0 || tuned) {
+            start = wallClock();
+            GLuint specialised = createComputeProgram("compute.glsl",&computevariant);
+            startup[METRIC_STARTUP_PROGRAMS] += wallClock()-start;
+            if (specialised) {
+                if (computevariant.sourcecount > 0)
+                    record(0,"Using compute.glsl specialised to %d sources\n",computevariant.sourcecount);
+                glDeleteProgram(computeprogram);
+                computeprogram = specialised;
+            } else {
+                computevariant = plain;
+            }
+        }
+    }
+/*
+ * ----------------------------------------------------------------------------
+ *  Evaluate the field on the CPU instead of in compute.glsl if asked to; the
+ *  FieldData buffer picks up min/max before it's uploaded below
+ * ----------------------------------------------------------------------------
+ */
+    FieldEdits edits;
+    initFieldEdits(&edits);
+
+    GLfloat* cpufield = NULL;
+    CpuFieldEngine* cpuengine = NULL;
+    if (usecpu) {
+        cpuengine = createCpuFieldEngine(0);
+        cpufield = (GLfloat*)malloc(sizeof(GLfloat)*2*
+                                    fieldinfomap.fieldsize[0]*fieldinfomap.fieldsize[1]);
+        if (cpuengine == NULL || cpufield == NULL ||
+                computeFieldCpu(cpuengine,&fieldinfomap,&fielddatamap,cpufield)) {
+            record(1,"CPU field evaluation failed; falling back to compute shader\n");
+            destroyCpuFieldEngine(cpuengine);
+            free(cpufield);
+            cpuengine = NULL;
+            cpufield = NULL;
+            usecpu = 0;
+        } else {
+            finishFieldUpdate(&edits,0);
+        }
+    }
 /*
  * ----------------------------------------------------------------------------
  *  Create, fill and bind the FieldInfo uniform buffer
@@ -515,6 +1341,9 @@ int main(int argc, char** argv) {
         GLuint computeBlockIndex = glGetUniformBlockIndex(computeprogram,"FieldInfo");
         glUniformBlockBinding(computeprogram,computeBlockIndex,FIELDINFO_UBO_BINDING);
 
+        GLuint reduceBlockIndex = glGetUniformBlockIndex(reduceprogram,"FieldInfo");
+        glUniformBlockBinding(reduceprogram,reduceBlockIndex,FIELDINFO_UBO_BINDING);
+
         GLuint shaderBlockIndex = glGetUniformBlockIndex(shaderprogram,"FieldInfo");
         glUniformBlockBinding(shaderprogram,shaderBlockIndex,FIELDINFO_UBO_BINDING);
     }
@@ -526,25 +1355,93 @@ int main(int argc, char** argv) {
     if (fdbstoragesize > 0) {
         glGenBuffers(1,&fielddatassbo);
         glBindBuffer(GL_SHADER_STORAGE_BUFFER,fielddatassbo);
-        glBufferStorage(GL_SHADER_STORAGE_BUFFER,fdbstoragesize,fielddatamap.block_start,0);
+        glBufferStorage(GL_SHADER_STORAGE_BUFFER,fdbstoragesize,fielddatamap.block_start,
+                        GL_DYNAMIC_STORAGE_BIT);
         glBindBufferBase(GL_SHADER_STORAGE_BUFFER,FIELDDATA_SSBO_BINDING,fielddatassbo);
     }
+
+    // Went up with its storage
+    fieldinfomap.dirty = 0;
+/*
+ * ----------------------------------------------------------------------------
+ *  Create, fill and bind the PointSources SSBO
+ * ----------------------------------------------------------------------------
+ */
+    GLuint pointsourcessbo;
+    glGenBuffers(1,&pointsourcessbo);
+    if (uploadPointSources(pointsourcessbo,&fieldinfomap)) {
+        free(fielddatamap.block_start);
+        freeFieldInfoMap(&fieldinfomap);
+        glfwTerminate();
+        return 1;
+    }
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER,POINTSOURCES_SSBO_BINDING,pointsourcessbo);
+
+    GLuint pointsourceupdatessbo;
+    glGenBuffers(1,&pointsourceupdatessbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER,pointsourceupdatessbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER,sizeof(GLfloat)*PS_PACKED_STRIDE,NULL,GL_STREAM_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER,POINTSOURCEUPDATES_SSBO_BINDING,
+                     pointsourceupdatessbo);
+/*
+ * ----------------------------------------------------------------------------
+ *  Create and bind the SSBO for per-work-group FieldData partials; sized on
+ *  first dispatch
+ * ----------------------------------------------------------------------------
+ */
+    GLuint fieldpartialsssbo;
+    glGenBuffers(1,&fieldpartialsssbo);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER,fieldpartialsssbo);
+    glBufferData(GL_SHADER_STORAGE_BUFFER,sizeof(GLfloat)*4,NULL,GL_DYNAMIC_COPY);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER,FIELDPARTIALS_SSBO_BINDING,fieldpartialsssbo);
 /*
  * ----------------------------------------------------------------------------
  *  Create and bind texture buffer for storage of amplitude field
  * ----------------------------------------------------------------------------
  */
+    // Tiled runs only ever need one tile's worth
+    GLuint texturewidth = fieldinfomap.fieldsize[0];
+    GLuint textureheight = fieldinfomap.fieldsize[1];
+    if (tilesize > 0) {
+        if (texturewidth > tilesize) texturewidth = tilesize;
+        if (textureheight > tilesize) textureheight = tilesize;
+    }
+
+    // The viewer refines compute.glsl's fields level by level; the CPU engine,
+    // sweeps and tiled runs only produce whole fields
+    FieldPyramid pyramid;
+    const int viewing = sweep.numaxes == 0 && tilesize == 0;
+    initFieldPyramid(&pyramid,fieldinfomap.fieldsize,
+                     viewing && !usecpu ? PROGRESSIVE_MAX_LEVEL : 0);
+    if (usecpu) completeFieldPyramid(&pyramid);
+
     GLuint fieldtexture;
     glGenTextures(1,&fieldtexture);
     glBindTexture(GL_TEXTURE_2D,fieldtexture);
-    glTexStorage2D(GL_TEXTURE_2D,1,GL_RG32F,fieldinfomap.fieldsize[0],fieldinfomap.fieldsize[1]);
+    glTexStorage2D(GL_TEXTURE_2D,pyramid.top+1,GL_RG32F,texturewidth,textureheight);
     GLfloat fillColour[] = { 0.0, 1.0 };
-    glClearTexImage(fieldtexture,0,GL_RG,GL_FLOAT,(const void*)fillColour);
+    int level;
+    for (level=0; level<=pyramid.top; ++level) {
+        glClearTexImage(fieldtexture,level,GL_RG,GL_FLOAT,(const void*)fillColour);
+    }
     glBindImageTexture(FIELD_IMAGE_UNIT,fieldtexture,0,GL_TRUE,0,GL_READ_WRITE,GL_RG32F);
 
+    if (cpufield != NULL) {
+        glTexSubImage2D(GL_TEXTURE_2D,0,0,0,fieldinfomap.fieldsize[0],fieldinfomap.fieldsize[1],
+                        GL_RG,GL_FLOAT,cpufield);
+    }
+
     glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR);
 
+    // Where pans and zooms stage the blocks they carry over
+    GLuint scratchtexture = 0;
+    if (viewing) {
+        glGenTextures(1,&scratchtexture);
+        glBindTexture(GL_TEXTURE_2D,scratchtexture);
+        glTexStorage2D(GL_TEXTURE_2D,pyramid.top+1,GL_RG32F,texturewidth,textureheight);
+    }
+
     glBindTexture(GL_TEXTURE_2D,0);
 /*
  * ----------------------------------------------------------------------------
@@ -562,6 +1459,10 @@ int main(int argc, char** argv) {
     GLint wwidth = glGetUniformLocation(shaderprogram,"window_width");
     GLint wheight = glGetUniformLocation(shaderprogram,"window_height");
     GLint stime = glGetUniformLocation(shaderprogram,"time");
+    GLint animateloc = glGetUniformLocation(shaderprogram,"animate");
+    GLint playbackloc = glGetUniformLocation(shaderprogram,"playback_rate");
+    GLint toplevelloc = glGetUniformLocation(shaderprogram,"top_level");
+    GLint levelvalidloc = glGetUniformLocation(shaderprogram,"level_valid");
 
     glUseProgram(shaderprogram);
 
@@ -580,32 +1481,144 @@ int main(int argc, char** argv) {
     glfwSetWindowSize(window,(int)fieldinfomap.fieldsize[0],
                              (int)fieldinfomap.fieldsize[1]);
     glViewport(0,0,fieldinfomap.fieldsize[0],fieldinfomap.fieldsize[1]);
+/*
+ * ----------------------------------------------------------------------------
+ *  Sweeps and tiled runs go through the programs and buffers set up above
+ *  and exit without showing anything
+ * ----------------------------------------------------------------------------
+ */
+    GpuField gpu;
+    useComputeProgram(&gpu,computeprogram,&computevariant);
+    gpu.reduceprogram = reduceprogram;
+    gpu.partialcountloc = glGetUniformLocation(reduceprogram,"partial_count");
+    gpu.fieldpartialsssbo = fieldpartialsssbo;
+    gpu.partialssize = sizeof(GLfloat)*4;
+    gpu.fieldinfoubo = fieldinfoubo;
+    gpu.fibstoragesize = fibstoragesize;
+    gpu.fielddatassbo = fielddatassbo;
+    gpu.fdbstoragesize = fdbstoragesize;
+    gpu.pointsourcessbo = pointsourcessbo;
+    gpu.pointsourceupdatessbo = pointsourceupdatessbo;
+    gpu.reducelevelloc = glGetUniformLocation(reduceprogram,"level");
+    gpu.fieldtexture = fieldtexture;
+    gpu.scratchtexture = scratchtexture;
+    gpu.texturewidth = texturewidth;
+    gpu.textureheight = textureheight;
+    gpu.readback = NULL;
+    gpu.metrics = NULL;
+
+    if (autotune) {
+        GpuFieldBench bench;
+        bench.gpu = &gpu;
+        bench.fim = &fieldinfomap;
+        const int failed = runAutotune(&fieldinfomap,benchFieldGpu,&bench,&computevariant);
+
+        free(fielddatamap.block_start);
+        freeFieldInfoMap(&fieldinfomap);
+        glfwTerminate();
+        return failed;
+    }
+
+    if (sweep.numaxes > 0 || tilesize > 0) {
+        const int failed = sweep.numaxes > 0 ?
+            runCapturedSweep(&gpu,&sweep,&fieldinfomap,&fielddatamap,outfile) :
+            runTiled(&fieldinfomap,&fielddatamap,computeFieldGpu,&gpu,tilesize,outfile,mapfile);
+
+        free(gpu.readback);
+        free(fielddatamap.block_start);
+        freeFieldInfoMap(&fieldinfomap);
+        glfwTerminate();
+        return failed;
+    }
 /*
  * ----------------------------------------------------------------------------
  */
+    FrameMetrics* const metrics = createFrameMetrics(metricsfile,metricsinterval);
+    if (metrics == NULL) record(1,"Frame timing unavailable\n");
+    int i;
+    for (i=0; i<METRIC_NUM_STARTUP; ++i) recordStartupTime(metrics,i,startup[i]);
+    gpu.metrics = metrics;
+
+    Viewer viewer;
+    viewer.fim = &fieldinfomap;
+    viewer.edits = &edits;
+    viewer.metrics = metrics;
+    viewer.selected = 0;
+    viewer.animate = 0;
+    viewer.playbackrate = DEFAULT_PLAYBACK_RATE;
+    viewer.nummoves = 0;
+    glfwSetWindowUserPointer(window,&viewer);
+    glfwSetKeyCallback(window,keyCallback);
+
+    // Every field the view settles on, from the first one, goes to -capture
+    FieldCapture* capture = NULL;
+    int capturepending = 1;
+    if (capturefile != NULL) {
+        capture = createFieldCapture(capturefile,0,fieldtexture,texturewidth,textureheight,
+                                     fielddatassbo,fdbstoragesize,&fielddatamap);
+        if (capture == NULL) record(1,"Not capturing fields\n");
+    }
+
     while(!glfwWindowShouldClose(window)) {
+        beginFrame(metrics);
+        pollFieldCapture(capture);
         glClear(GL_COLOR_BUFFER_BIT);
-        glUseProgram(computeprogram);
 
-        glDispatchCompute(fieldinfomap.fieldsize[0]/COMPUTE_LOCAL_FIELD_SIZE_X+1,
-                          fieldinfomap.fieldsize[1]/COMPUTE_LOCAL_FIELD_SIZE_Y+1, 1);
-
-        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT |
-                        GL_SHADER_STORAGE_BARRIER_BIT);
+        for (i=0; i<viewer.nummoves; ++i) {
+            moveView(&gpu,&pyramid,&fieldinfomap,viewer.moves+i);
+            capturepending = 1;
+        }
+        viewer.nummoves = 0;
+        // The CPU engine has no levels to refine; it starts again from scratch
+        if (cpuengine != NULL && !fieldPyramidComplete(&pyramid)) requestFullUpdate(&edits);
+
+        // The field is only recomputed when something it depends on changed;
+        // other frames just redraw fieldtexture, refining it a level at a time
+        syncFieldMaps(&gpu,&fieldinfomap,&edits);
+        if (fieldUpdatePending(&edits)) {
+            updateFieldTexture(&gpu,&fieldinfomap,&fielddatamap,&edits,&pyramid,
+                               cpuengine,cpufield);
+            capturepending = 1;
+        }
+        refineFieldTexture(&gpu,&pyramid,&fieldinfomap);
+        if (!fieldPyramidComplete(&pyramid)) {
+            capturepending = 1;
+        } else if (capture != NULL && capturepending) {
+            captureField(capture,&fieldinfomap,&fielddatamap);
+            capturepending = 0;
+        }
 
         glUseProgram(shaderprogram);
 
         glUniform1f(stime,glfwGetTime());
+        glUniform1i(animateloc,viewer.animate);
+        glUniform1f(playbackloc,viewer.playbackrate);
+        glUniform1i(toplevelloc,pyramid.top);
+        glUniform4iv(levelvalidloc,pyramid.top+1,&pyramid.valid[0][0]);
         
         glBindVertexArray(canvas.vao);
+        beginStage(metrics,METRIC_DRAW);
         glDrawElements(GL_TRIANGLES,6,GL_UNSIGNED_INT,0);
+        endStage(metrics,METRIC_DRAW);
+        drawMetricsOverlay(metrics,fieldinfomap.fieldsize[0],fieldinfomap.fieldsize[1]);
 
+        beginStage(metrics,METRIC_SWAP);
         glfwSwapBuffers(window);
+        endStage(metrics,METRIC_SWAP);
+        if (endFrame(metrics) && metricsOverlayShown(metrics)) {
+            char title[256];
+            formatMetricsSummary(metrics,title,sizeof(title));
+            glfwSetWindowTitle(window,title);
+        }
         glfwPollEvents();
     }
 
+    finishFieldCapture(capture);
+    destroyFrameMetrics(metrics);
+    destroyCpuFieldEngine(cpuengine);
+    free(cpufield);
     free(fielddatamap.block_start);
-    free(fieldinfomap.block_start);
+    freeFieldInfoMap(&fieldinfomap);
     glfwTerminate();
     return 0;
 }
@@ -0,0 +1,400 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <GL/glew.h>
+
+#include "common.h"
+#include "metrics.h"
+
+#define OVERLAY_MARGIN 8
+#define OVERLAY_BAR_WIDTH 2
+#define OVERLAY_ROW_HEIGHT 96
+// A 60 Hz frame, marked across both rows
+#define OVERLAY_TARGET_MS 16.7
+
+static const char* const stageNames[METRIC_NUM_STAGES] = {
+    "upload", "cpu-field", "dispatch", "barrier", "draw", "swap", "frame"
+};
+static const char* const startupNames[METRIC_NUM_STARTUP] = { "load", "parse", "programs" };
+static const GLfloat stageColours[METRIC_NUM_STAGES][3] = {
+    { 0.2f, 0.4f, 1.0f }, { 0.1f, 0.8f, 0.8f }, { 1.0f, 0.6f, 0.1f }, { 0.9f, 0.1f, 0.1f },
+    { 0.2f, 0.8f, 0.2f }, { 0.8f, 0.2f, 0.8f }, { 1.0f, 1.0f, 1.0f }
+};
+
+typedef struct {
+    GLuint queries[2*METRICS_MAX_MARKS];
+    int stage[METRICS_MAX_MARKS];
+    int nummarks;
+    // Issued last, so once it's available all of them are
+    GLuint lastquery;
+    // Frame the queries were issued in, -1 when the slot is free
+    long frame;
+} MetricsSlot;
+
+typedef struct {
+    double cpu[METRIC_NUM_STAGES];
+    double gpu[METRIC_NUM_STAGES];
+    int hasgpu;
+} FrameTimes;
+
+typedef struct {
+    double start;
+    double end;
+    int frames;
+    int gpuframes;
+    int dropped;
+    double cpusum[METRIC_NUM_STAGES];
+    double cpumax[METRIC_NUM_STAGES];
+    double gpusum[METRIC_NUM_STAGES];
+    double gpumax[METRIC_NUM_STAGES];
+} MetricsInterval;
+
+struct FrameMetrics {
+    int initialised;
+    int queries;
+    MetricsSlot slots[METRICS_FRAMES_IN_FLIGHT];
+    MetricsSlot* current;
+    int openmark[METRIC_NUM_STAGES];
+    double cpustart[METRIC_NUM_STAGES];
+
+    long frame;
+    FrameTimes history[METRICS_HISTORY];
+
+    double created;
+    double length;
+    MetricsInterval interval;
+    MetricsInterval last;
+
+    double startup[METRIC_NUM_STARTUP];
+    FILE* dump;
+    int csv;
+
+    int overlay;
+};
+
+FrameMetrics* createFrameMetrics(const char* const dumpfile, double interval) {
+    FrameMetrics* const metrics = (FrameMetrics*)calloc(1,sizeof(FrameMetrics));
+    if (metrics == NULL) return NULL;
+
+    if (dumpfile != NULL) {
+        metrics->dump = fopen(dumpfile,"w");
+        if (metrics->dump == NULL) {
+            record(1,"Failed to open metrics file %s\n",dumpfile);
+            free(metrics);
+            return NULL;
+        }
+        const size_t length = strlen(dumpfile);
+        metrics->csv = length >= 4 && strcmp(dumpfile+length-4,".csv") == 0;
+        if (metrics->csv) {
+            fprintf(metrics->dump,"time_s,stage,frames,cpu_mean_ms,cpu_max_ms,"
+                                  "gpu_frames,gpu_mean_ms,gpu_max_ms,dropped\n");
+        }
+    }
+
+    int i;
+    for (i=0; i<METRICS_FRAMES_IN_FLIGHT; ++i) metrics->slots[i].frame = -1;
+    for (i=0; i<METRIC_NUM_STAGES; ++i) metrics->openmark[i] = -1;
+    metrics->length = interval > 0 ? interval : METRICS_DEFAULT_INTERVAL;
+    metrics->created = wallClock();
+    metrics->interval.start = metrics->created;
+    return metrics;
+}
+
+/* ----
+ *  Export
+ ---- */
+
+static void writeStartup(FrameMetrics* const metrics) {
+    FILE* const fp = metrics->dump;
+    int i;
+    if (metrics->csv) {
+        for (i=0; i<METRIC_NUM_STARTUP; ++i) {
+            fprintf(fp,"0.000,startup-%s,1,%.4f,%.4f,0,,,0\n",
+                    startupNames[i],metrics->startup[i]*1e3,metrics->startup[i]*1e3);
+        }
+    } else {
+        fprintf(fp,"{ \"startup\": {");
+        for (i=0; i<METRIC_NUM_STARTUP; ++i) {
+            fprintf(fp,"%s \"%s_ms\": %.4f",i > 0 ? "," : "",startupNames[i],metrics->startup[i]*1e3);
+        }
+        fprintf(fp," } }\n");
+    }
+    fflush(fp);
+}
+
+static void writeInterval(FrameMetrics* const metrics, const MetricsInterval* const in) {
+    FILE* const fp = metrics->dump;
+    const double time = in->end-metrics->created;
+    const int frames = in->frames > 0 ? in->frames : 1;
+    const int gpuframes = in->gpuframes > 0 ? in->gpuframes : 1;
+    int i;
+
+    if (metrics->csv) {
+        for (i=0; i<METRIC_NUM_STAGES; ++i) {
+            fprintf(fp,"%.3f,%s,%d,%.4f,%.4f,%d,",time,stageNames[i],in->frames,
+                    in->cpusum[i]/frames*1e3,in->cpumax[i]*1e3,in->gpuframes);
+            if (in->gpuframes > 0) {
+                fprintf(fp,"%.4f,%.4f,%d\n",in->gpusum[i]/gpuframes*1e3,in->gpumax[i]*1e3,in->dropped);
+            } else {
+                fprintf(fp,",,%d\n",in->dropped);
+            }
+        }
+    } else {
+        fprintf(fp,"{ \"time_s\": %.3f, \"frames\": %d, \"fps\": %.2f, \"gpu_frames\": %d, "
+                   "\"dropped\": %d, \"stages\": {",
+                time,in->frames,in->frames/(in->end-in->start),in->gpuframes,in->dropped);
+        for (i=0; i<METRIC_NUM_STAGES; ++i) {
+            fprintf(fp,"%s \"%s\": { \"cpu_ms\": %.4f, \"cpu_max_ms\": %.4f",i > 0 ? "," : "",
+                    stageNames[i],in->cpusum[i]/frames*1e3,in->cpumax[i]*1e3);
+            if (in->gpuframes > 0) {
+                fprintf(fp,", \"gpu_ms\": %.4f, \"gpu_max_ms\": %.4f",
+                        in->gpusum[i]/gpuframes*1e3,in->gpumax[i]*1e3);
+            }
+            fprintf(fp," }");
+        }
+        fprintf(fp," } }\n");
+    }
+    fflush(fp);
+}
+
+void destroyFrameMetrics(FrameMetrics* const metrics) {
+    if (metrics == NULL) return;
+
+    if (metrics->dump != NULL) {
+        if (metrics->interval.frames > 0) {
+            metrics->interval.end = wallClock();
+            writeInterval(metrics,&metrics->interval);
+        }
+        if (fclose(metrics->dump) != 0) record(1,"Failed to write metrics file\n");
+    }
+    if (metrics->queries) {
+        int i;
+        for (i=0; i<METRICS_FRAMES_IN_FLIGHT; ++i)
+            glDeleteQueries(2*METRICS_MAX_MARKS,metrics->slots[i].queries);
+    }
+    free(metrics);
+}
+
+void recordStartupTime(FrameMetrics* const metrics, int which, double seconds) {
+    if (metrics == NULL) return;
+    metrics->startup[which] += seconds;
+}
+
+/* ----
+ *  Frames
+ ---- */
+
+// Fold a slot's timestamps into its frame, if the GPU is done with them
+static void collectSlot(FrameMetrics* const metrics, MetricsSlot* const slot) {
+    if (slot->frame < 0) return;
+    if (slot->nummarks == 0) {
+        slot->frame = -1;
+        return;
+    }
+
+    GLint available = 0;
+    glGetQueryObjectiv(slot->lastquery,GL_QUERY_RESULT_AVAILABLE,&available);
+    if (!available) return;
+
+    double gpu[METRIC_NUM_STAGES];
+    memset(gpu,0,sizeof(gpu));
+    int i;
+    for (i=0; i<slot->nummarks; ++i) {
+        GLuint64 begin, end;
+        glGetQueryObjectui64v(slot->queries[2*i],GL_QUERY_RESULT,&begin);
+        glGetQueryObjectui64v(slot->queries[2*i+1],GL_QUERY_RESULT,&end);
+        gpu[slot->stage[i]] += end > begin ? (end-begin)*1e-9 : 0;
+    }
+
+    // Too old for the graph, but still counts towards the interval
+    if (metrics->frame-slot->frame < METRICS_HISTORY) {
+        FrameTimes* const times = metrics->history+slot->frame%METRICS_HISTORY;
+        memcpy(times->gpu,gpu,sizeof(gpu));
+        times->hasgpu = 1;
+    }
+    MetricsInterval* const in = &metrics->interval;
+    for (i=0; i<METRIC_NUM_STAGES; ++i) {
+        in->gpusum[i] += gpu[i];
+        if (gpu[i] > in->gpumax[i]) in->gpumax[i] = gpu[i];
+    }
+    ++in->gpuframes;
+    slot->frame = -1;
+}
+
+void beginFrame(FrameMetrics* const metrics) {
+    if (metrics == NULL) return;
+
+    int i;
+    if (!metrics->initialised) {
+        // Timestamps need a counter with bits; without one, CPU times only
+        GLint bits = 0;
+        glGetQueryiv(GL_TIMESTAMP,GL_QUERY_COUNTER_BITS,&bits);
+        metrics->queries = bits > 0;
+        if (metrics->queries) {
+            for (i=0; i<METRICS_FRAMES_IN_FLIGHT; ++i)
+                glGenQueries(2*METRICS_MAX_MARKS,metrics->slots[i].queries);
+        } else {
+            record(1,"No GPU timestamp counter; timing stages on the CPU only\n");
+        }
+        if (metrics->dump != NULL) writeStartup(metrics);
+        metrics->initialised = 1;
+    }
+
+    for (i=0; i<METRICS_FRAMES_IN_FLIGHT; ++i) collectSlot(metrics,metrics->slots+i);
+
+    MetricsSlot* const slot = metrics->slots+metrics->frame%METRICS_FRAMES_IN_FLIGHT;
+    if (slot->frame >= 0) ++metrics->interval.dropped;
+    slot->frame = metrics->frame;
+    slot->nummarks = 0;
+    metrics->current = slot;
+
+    memset(metrics->history+metrics->frame%METRICS_HISTORY,0,sizeof(FrameTimes));
+    for (i=0; i<METRIC_NUM_STAGES; ++i) metrics->openmark[i] = -1;
+    beginStage(metrics,METRIC_FRAME);
+}
+
+void beginStage(FrameMetrics* const metrics, int stage) {
+    if (metrics == NULL || metrics->current == NULL) return;
+
+    MetricsSlot* const slot = metrics->current;
+    metrics->openmark[stage] = -1;
+    if (metrics->queries && slot->nummarks < METRICS_MAX_MARKS) {
+        const int i = slot->nummarks++;
+        slot->stage[i] = stage;
+        glQueryCounter(slot->queries[2*i],GL_TIMESTAMP);
+        slot->lastquery = slot->queries[2*i];
+        metrics->openmark[stage] = i;
+    }
+    metrics->cpustart[stage] = wallClock();
+}
+
+void endStage(FrameMetrics* const metrics, int stage) {
+    if (metrics == NULL || metrics->current == NULL) return;
+
+    metrics->history[metrics->frame%METRICS_HISTORY].cpu[stage] += wallClock()-metrics->cpustart[stage];
+    const int i = metrics->openmark[stage];
+    if (i >= 0) {
+        MetricsSlot* const slot = metrics->current;
+        glQueryCounter(slot->queries[2*i+1],GL_TIMESTAMP);
+        slot->lastquery = slot->queries[2*i+1];
+        metrics->openmark[stage] = -1;
+    }
+}
+
+int endFrame(FrameMetrics* const metrics) {
+    if (metrics == NULL || metrics->current == NULL) return 0;
+
+    endStage(metrics,METRIC_FRAME);
+    metrics->current = NULL;
+
+    const FrameTimes* const times = metrics->history+metrics->frame%METRICS_HISTORY;
+    MetricsInterval* const in = &metrics->interval;
+    int i;
+    for (i=0; i<METRIC_NUM_STAGES; ++i) {
+        in->cpusum[i] += times->cpu[i];
+        if (times->cpu[i] > in->cpumax[i]) in->cpumax[i] = times->cpu[i];
+    }
+    ++in->frames;
+    ++metrics->frame;
+
+    const double now = wallClock();
+    if (now-in->start < metrics->length) return 0;
+
+    in->end = now;
+    metrics->last = *in;
+    if (metrics->dump != NULL) writeInterval(metrics,in);
+    memset(in,0,sizeof(*in));
+    in->start = now;
+    return 1;
+}
+
+/* ----
+ *  Overlay
+ ---- */
+
+void toggleMetricsOverlay(FrameMetrics* const metrics) {
+    if (metrics == NULL) return;
+    metrics->overlay = !metrics->overlay;
+    record(1,"Timing overlay %s\n",metrics->overlay ? "on" : "off");
+}
+
+int metricsOverlayShown(const FrameMetrics* const metrics) {
+    return metrics != NULL && metrics->overlay;
+}
+
+static void fillRect(GLint x, GLint y, GLsizei width, GLsizei height, const GLfloat* const colour) {
+    if (width <= 0 || height <= 0) return;
+    glScissor(x,y,width,height);
+    glClearColor(colour[0],colour[1],colour[2],1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+}
+
+// One row of stacked bars, gpu or cpu times, bottom at y
+static void drawRow(const FrameMetrics* const metrics, int gpu, GLint y, GLsizei width) {
+    static const GLfloat background[3] = { 0.1f, 0.1f, 0.1f };
+    static const GLfloat target[3] = { 0.6f, 0.6f, 0.6f };
+    const GLsizei rowwidth = OVERLAY_BAR_WIDTH*METRICS_HISTORY;
+    fillRect(OVERLAY_MARGIN,y,rowwidth < width ? rowwidth : width,OVERLAY_ROW_HEIGHT,background);
+
+    long f;
+    const long first = metrics->frame > METRICS_HISTORY ? metrics->frame-METRICS_HISTORY : 0;
+    for (f=first; f<metrics->frame; ++f) {
+        const FrameTimes* const times = metrics->history+f%METRICS_HISTORY;
+        if (gpu && !times->hasgpu) continue;
+
+        const GLint x = OVERLAY_MARGIN+(GLint)(f-first)*OVERLAY_BAR_WIDTH;
+        GLint top = y;
+        int i;
+        // Everything but the frame itself, which is their sum and then some
+        for (i=0; i<METRIC_FRAME && top < y+OVERLAY_ROW_HEIGHT; ++i) {
+            const double t = gpu ? times->gpu[i] : times->cpu[i];
+            GLsizei h = (GLsizei)(t*1e3/METRICS_OVERLAY_RANGE*OVERLAY_ROW_HEIGHT+0.5);
+            if (top+h > y+OVERLAY_ROW_HEIGHT) h = y+OVERLAY_ROW_HEIGHT-top;
+            fillRect(x,top,OVERLAY_BAR_WIDTH,h,stageColours[i]);
+            top += h;
+        }
+    }
+
+    fillRect(OVERLAY_MARGIN,y+(GLint)(OVERLAY_TARGET_MS/METRICS_OVERLAY_RANGE*OVERLAY_ROW_HEIGHT),
+             rowwidth,1,target);
+}
+
+void drawMetricsOverlay(const FrameMetrics* const metrics, GLsizei width, GLsizei height) {
+    if (!metricsOverlayShown(metrics)) return;
+    if (height < 2*OVERLAY_ROW_HEIGHT+3*OVERLAY_MARGIN) return;
+
+    GLfloat clear[4];
+    GLint box[4];
+    glGetFloatv(GL_COLOR_CLEAR_VALUE,clear);
+    glGetIntegerv(GL_SCISSOR_BOX,box);
+    const GLboolean scissor = glIsEnabled(GL_SCISSOR_TEST);
+    glEnable(GL_SCISSOR_TEST);
+
+    // CPU along the bottom, GPU above it
+    drawRow(metrics,0,OVERLAY_MARGIN,width-2*OVERLAY_MARGIN);
+    if (metrics->queries) drawRow(metrics,1,2*OVERLAY_MARGIN+OVERLAY_ROW_HEIGHT,width-2*OVERLAY_MARGIN);
+
+    glClearColor(clear[0],clear[1],clear[2],clear[3]);
+    glScissor(box[0],box[1],box[2],box[3]);
+    if (!scissor) glDisable(GL_SCISSOR_TEST);
+}
+
+void formatMetricsSummary(const FrameMetrics* const metrics, char* const text, size_t size) {
+    const MetricsInterval* const in = &metrics->last;
+    const int frames = in->frames > 0 ? in->frames : 1;
+    const int gpuframes = in->gpuframes > 0 ? in->gpuframes : 1;
+    size_t used = snprintf(text,size,"%.1f fps",in->end > in->start ? in->frames/(in->end-in->start) : 0);
+
+    // CPU/GPU ms of each stage that took any time
+    int i;
+    for (i=0; i<METRIC_NUM_STAGES && used < size; ++i) {
+        const double cpu = in->cpusum[i]/frames*1e3;
+        const double gpu = in->gpusum[i]/gpuframes*1e3;
+        if (cpu < 0.005 && gpu < 0.005 && i != METRIC_FRAME) continue;
+        used += metrics->queries ?
+            snprintf(text+used,size-used,"  %s %.2f/%.2f",stageNames[i],cpu,gpu) :
+            snprintf(text+used,size-used,"  %s %.2f",stageNames[i],cpu);
+    }
+    if (used < size && in->dropped > 0)
+        snprintf(text+used,size-used,"  (%d dropped)",in->dropped);
+}
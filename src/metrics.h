@@ -0,0 +1,65 @@
+// Per-stage timing of the viewer. Each stage of a frame is timed twice: on
+// the CPU, around the GL calls that make it up (so a driver blocking in
+// glMemoryBarrier or glfwSwapBuffers shows there), and on the GPU, by
+// GL_TIMESTAMP queries on either side (so the cost of the work itself shows
+// there). A stage may run several times in a frame; its times add up.
+//
+// Query results are only ever read once the driver says they're available.
+// Each frame's queries live in one of METRICS_FRAMES_IN_FLIGHT slots; a slot
+// still waiting on the GPU when its turn comes round again loses that frame's
+// GPU sample (counted as dropped) rather than stall the pipeline.
+//
+// The last METRICS_HISTORY frames are drawn as a graph over the field (T
+// toggles it): stacked bars per frame, GPU above CPU, one colour per stage,
+// with averages in the window title. Given a file (-metrics), the averages
+// and maxima over each interval are appended to it as they complete, as CSV
+// if the name ends in .csv and one JSON object per line otherwise.
+#define METRICS_FRAMES_IN_FLIGHT 4
+#define METRICS_HISTORY 128
+// Timestamp pairs per frame; stages past it are timed on the CPU only
+#define METRICS_MAX_MARKS 32
+#define METRICS_DEFAULT_INTERVAL 1.0
+// The graph's full height, in milliseconds per row
+#define METRICS_OVERLAY_RANGE 33.3
+
+enum {
+    METRIC_UPLOAD,
+    METRIC_CPU_FIELD,
+    METRIC_DISPATCH,
+    METRIC_BARRIER,
+    METRIC_DRAW,
+    METRIC_SWAP,
+    METRIC_FRAME,
+    METRIC_NUM_STAGES
+};
+
+// Once per run, CPU only
+enum {
+    METRIC_STARTUP_LOAD,
+    METRIC_STARTUP_PARSE,
+    METRIC_STARTUP_PROGRAMS,
+    METRIC_NUM_STARTUP
+};
+
+typedef struct FrameMetrics FrameMetrics;
+
+// dumpfile may be NULL. Touches no GL; queries are made on the first frame.
+FrameMetrics* createFrameMetrics(const char* const dumpfile, double interval);
+// Writes out the interval in progress
+void destroyFrameMetrics(FrameMetrics* const metrics);
+
+void recordStartupTime(FrameMetrics* const metrics, int which, double seconds);
+
+// All of these take NULL metrics and do nothing
+void beginFrame(FrameMetrics* const metrics);
+void beginStage(FrameMetrics* const metrics, int stage);
+void endStage(FrameMetrics* const metrics, int stage);
+// 1 when an interval has just completed and its summary is ready
+int endFrame(FrameMetrics* const metrics);
+
+void toggleMetricsOverlay(FrameMetrics* const metrics);
+int metricsOverlayShown(const FrameMetrics* const metrics);
+// Over a width x height framebuffer, leaving GL state as it found it
+void drawMetricsOverlay(const FrameMetrics* const metrics, GLsizei width, GLsizei height);
+// Averages of the last complete interval, for the window title
+void formatMetricsSummary(const FrameMetrics* const metrics, char* const text, size_t size);
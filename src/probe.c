@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <GL/gl.h>
+
+#include "common.h"
+#include "fim.h"
+#include "cpu-field.h"
+#include "reflect.h"
+#include "probe.h"
+
+typedef struct {
+    const CpuFieldEngine* engine;
+    int numsources;
+    const GLfloat* sources; // x, y, k, phase arrays of numsources
+    const GLfloat* amp;     // NULL without reflections
+    int n;
+    const GLfloat* px;      // padded by CPU_POINT_PADDING
+    const GLfloat* py;
+    GLfloat* values;
+} ProbeJob;
+
+static void probeTask(void* arg, int task, unsigned int thread) {
+    ProbeJob* const job = (ProbeJob*)arg;
+    const int first = task*PROBE_BATCH;
+    const int n = first+PROBE_BATCH > job->n ? job->n-first : PROBE_BATCH;
+    const int s = job->numsources;
+    (void)thread;
+
+    sumSourcesCpu(job->engine,s,job->sources,job->sources+s,job->sources+2*s,
+                  job->sources+3*s,job->amp,n,job->px+first,job->py+first,job->values+2*first);
+}
+
+int evaluateProbes(CpuFieldEngine* const engine, const FieldInfoMap* const fim,
+                   const GLfloat* const points, int n, GLfloat* const values)
+{
+    if (n <= 0) return 0;
+
+    int psn = *(fim->psn);
+    if (psn < 0) psn = 0;
+    if (psn > fim->ps_capacity) psn = fim->ps_capacity;
+
+    GLfloat* sources = (GLfloat*)malloc(sizeof(GLfloat)*4*(psn > 0 ? psn : 1));
+    GLfloat* const px = (GLfloat*)malloc(sizeof(GLfloat)*2*((size_t)n+CPU_POINT_PADDING));
+    if (sources == NULL || px == NULL) {
+        record(1,"Failed to allocate probe buffers\n");
+        free(sources);
+        free(px);
+        return 1;
+    }
+    GLfloat* const py = px+n+CPU_POINT_PADDING;
+
+    int i;
+    for (i=0; i<psn; ++i) {
+        sources[i] = fim->ps_loc[NUM_DIMS*i];
+        sources[psn+i] = fim->ps_loc[NUM_DIMS*i+1];
+        sources[2*psn+i] = fim->ps_freq[i]*2.0f*(GLfloat)PI/(*(fim->mat_c));
+        sources[3*psn+i] = fim->ps_phase[i];
+    }
+    for (i=0; i<n+CPU_POINT_PADDING; ++i) {
+        px[i] = points[NUM_DIMS*(i < n ? i : n-1)];
+        py[i] = points[NUM_DIMS*(i < n ? i : n-1)+1];
+    }
+
+    ProbeJob job;
+    job.engine = engine;
+    job.numsources = psn;
+    job.sources = sources;
+    job.amp = NULL;
+
+    // Images culled against the probes' bounding box
+    ImageSources images;
+    initImageSources(&images);
+    if (fieldReflects(fim)) {
+        GLfloat region[4] = { px[0], py[0], px[0], py[0] };
+        for (i=1; i<n; ++i) {
+            if (px[i] < region[0]) region[0] = px[i];
+            if (py[i] < region[1]) region[1] = py[i];
+            if (px[i] > region[2]) region[2] = px[i];
+            if (py[i] > region[3]) region[3] = py[i];
+        }
+        ReflectionPlan plan;
+        int failed = initReflectionPlan(fim,&plan);
+        if (!failed) {
+            failed = expandImageSources(&plan,psn,sources,sources+psn,NULL,sources+2*psn,
+                                        sources+3*psn,region,0.5,&images);
+            freeReflectionPlan(&plan);
+        }
+        if (failed) {
+            freeImageSources(&images);
+            free(sources);
+            free(px);
+            return 1;
+        }
+        // x, y, k and phase aren't contiguous in images, so repack them
+        free(sources);
+        sources = (GLfloat*)malloc(sizeof(GLfloat)*4*(images.n > 0 ? images.n : 1));
+        if (sources == NULL) {
+            record(1,"Failed to allocate probe buffers\n");
+            freeImageSources(&images);
+            free(px);
+            return 1;
+        }
+        memcpy(sources,images.x,sizeof(GLfloat)*images.n);
+        memcpy(sources+images.n,images.y,sizeof(GLfloat)*images.n);
+        memcpy(sources+2*images.n,images.k,sizeof(GLfloat)*images.n);
+        memcpy(sources+3*images.n,images.phase,sizeof(GLfloat)*images.n);
+        job.numsources = images.n;
+        job.sources = sources;
+        job.amp = images.amp;
+    }
+    job.n = n;
+    job.px = px;
+    job.py = py;
+    job.values = values;
+    runCpuTasks(engine,(n+PROBE_BATCH-1)/PROBE_BATCH,probeTask,&job);
+
+    freeImageSources(&images);
+    free(sources);
+    free(px);
+    return 0;
+}
+
+int writeProbeFile(const char* const filename, const GLfloat* const points,
+                   const GLfloat* const values, int n)
+{
+    FILE* fp = fopen(filename,"w");
+    if (fp == NULL) {
+        record(1,"Failed to open output file %s\n",filename);
+        return 1;
+    }
+
+    int failed = fprintf(fp,"# x y re im magnitude phase\n") < 0;
+    int i;
+    for (i=0; i<n && !failed; ++i) {
+        const GLfloat re = values[2*i], im = values[2*i+1];
+        failed = fprintf(fp,"%.9g %.9g %.9g %.9g %.9g %.9g\n",
+                         points[NUM_DIMS*i],points[NUM_DIMS*i+1],re,im,
+                         sqrtf(re*re+im*im),atan2f(im,re)) < 0;
+    }
+
+    if (fclose(fp) != 0) failed = 1;
+    if (failed) record(1,"Failed to write probes to %s\n",filename);
+    return failed;
+}
+
+int runProbes(CpuFieldEngine* const engine, const FieldInfoMap* const fim,
+              const char* const filename)
+{
+    if (fim->probe_n <= 0) {
+        record(1,"No Probe-Location points to evaluate\n");
+        return 1;
+    }
+
+    GLfloat* const values = (GLfloat*)malloc(sizeof(GLfloat)*2*(size_t)fim->probe_n);
+    if (values == NULL) {
+        record(1,"Failed to allocate probe values\n");
+        return 1;
+    }
+
+    const double start = wallClock();
+    int failed = evaluateProbes(engine,fim,fim->probe_loc,fim->probe_n,values);
+    const double time = wallClock()-start;
+    if (!failed) failed = writeProbeFile(filename,fim->probe_loc,values,fim->probe_n);
+    if (!failed) {
+        record(0,"Wrote %d probes to %s; evaluated in %.3fms\n",
+               fim->probe_n,filename,1000*time);
+    }
+
+    free(values);
+    return failed;
+}
@@ -0,0 +1,17 @@
+// Field at an arbitrary list of points instead of over the grid, e.g. at
+// microphone positions or along a line. Same source model as the compute
+// shader and computeFieldCpu; points go through the thread pool PROBE_BATCH
+// at a time, each batch summed over all sources by the vectorised kernel.
+#define PROBE_BATCH 256
+
+// n points of NUM_DIMS GLfloats into n (re,im) pairs
+int evaluateProbes(CpuFieldEngine* const engine, const FieldInfoMap* const fim,
+                   const GLfloat* const points, int n, GLfloat* const values);
+
+// Text, one probe per line: x y re im magnitude phase
+int writeProbeFile(const char* const filename, const GLfloat* const points,
+                   const GLfloat* const values, int n);
+
+// The probes given in fim (Probe-Location) into filename
+int runProbes(CpuFieldEngine* const engine, const FieldInfoMap* const fim,
+              const char* const filename);
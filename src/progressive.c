@@ -0,0 +1,139 @@
+#include <string.h>
+#include <math.h>
+#include <GL/gl.h>
+
+#include "common.h"
+#include "fim.h"
+#include "progressive.h"
+
+void initFieldPyramid(FieldPyramid* const pyramid, const GLuint* const fieldsize, int maxlevel) {
+    if (maxlevel > PROGRESSIVE_MAX_LEVEL) maxlevel = PROGRESSIVE_MAX_LEVEL;
+
+    const GLuint shorter = fieldsize[0] < fieldsize[1] ? fieldsize[0] : fieldsize[1];
+    int top = 0;
+    while (top < maxlevel && (shorter >> (top+1)) >= PROGRESSIVE_MIN_SIZE) ++top;
+    pyramid->top = top;
+
+    int l, d;
+    for (l=0; l<=top; ++l) {
+        for (d=0; d<2; ++d) {
+            const GLuint size = fieldsize[d] >> l;
+            pyramid->size[l][d] = size > 0 ? size : 1;
+        }
+    }
+    invalidateFieldPyramid(pyramid);
+}
+
+void invalidateFieldPyramid(FieldPyramid* const pyramid) {
+    memset(pyramid->valid,0,sizeof(pyramid->valid));
+    pyramid->next = pyramid->top;
+}
+
+void completeFieldPyramid(FieldPyramid* const pyramid) {
+    int l;
+    for (l=0; l<=pyramid->top; ++l) {
+        pyramid->valid[l][0] = 0;
+        pyramid->valid[l][1] = 0;
+        pyramid->valid[l][2] = pyramid->size[l][0];
+        pyramid->valid[l][3] = pyramid->size[l][1];
+    }
+    pyramid->next = -1;
+}
+
+int fieldPyramidComplete(const FieldPyramid* const pyramid) {
+    return pyramid->next < 0;
+}
+
+static int levelFull(const FieldPyramid* const pyramid, int l) {
+    const GLint* const valid = pyramid->valid[l];
+    return valid[0] <= 0 && valid[1] <= 0 &&
+           valid[2] >= pyramid->size[l][0] && valid[3] >= pyramid->size[l][1];
+}
+
+int nextPyramidLevel(FieldPyramid* const pyramid, GLint* const keep) {
+    // Levels carried over whole by a move need nothing evaluated
+    while (pyramid->next >= 0 && levelFull(pyramid,pyramid->next)) --pyramid->next;
+    if (pyramid->next < 0) return -1;
+
+    const int l = pyramid->next--;
+    GLint* const valid = pyramid->valid[l];
+    memcpy(keep,valid,sizeof(GLint)*4);
+
+    valid[0] = 0;
+    valid[1] = 0;
+    valid[2] = pyramid->size[l][0];
+    valid[3] = pyramid->size[l][1];
+    return l;
+}
+
+void viewMoveShift(const FieldPyramid* const pyramid, const FieldInfoMap* const fim,
+                   int zoom, int dirx, int diry, GLint* const shift)
+{
+    // Shifts have to be whole samples of every level they map between. Zooming
+    // out shifts back by twice what zooming in does, so the two undo each other.
+    const GLint quantum = 1 << pyramid->top;
+    const int dir[2] = { dirx, diry };
+    int d;
+    for (d=0; d<2; ++d) {
+        if (zoom != 0) {
+            const GLint s = (GLint)floor(fim->fieldsize[d]/4.0/quantum+0.5)*quantum;
+            shift[d] = zoom < 0 ? s : -2*s;
+        } else {
+            GLint s = (GLint)floor(fim->fieldsize[d]*PROGRESSIVE_PAN_STEP/quantum+0.5)*quantum;
+            if (s == 0) s = quantum;
+            shift[d] = dir[d]*s;
+        }
+    }
+}
+
+int moveFieldPyramid(FieldPyramid* const pyramid, FieldInfoMap* const fim,
+                     int zoom, const GLint* const shift, PyramidCopy* const copies)
+{
+    GLint valid[PROGRESSIVE_MAX_LEVEL+1][4];
+    int numcopies = 0, l, d;
+
+    memset(valid,0,sizeof(valid));
+    for (l=0; l<=pyramid->top; ++l) {
+        // Sample i of level l after the move is sample i+shift/2^from of level
+        // from before it
+        const int from = l+zoom;
+        if (from < 0 || from > pyramid->top) continue;
+
+        GLint offset[2];
+        for (d=0; d<2; ++d) {
+            offset[d] = shift[d]/(1 << from);
+            GLint lo = pyramid->valid[from][d]-offset[d];
+            GLint hi = pyramid->valid[from][d+2]-offset[d];
+            valid[l][d] = lo > 0 ? lo : 0;
+            valid[l][d+2] = hi < pyramid->size[l][d] ? hi : pyramid->size[l][d];
+        }
+        if (valid[l][0] >= valid[l][2] || valid[l][1] >= valid[l][3]) {
+            memset(valid[l],0,sizeof(valid[l]));
+            continue;
+        }
+
+        PyramidCopy* const copy = copies+numcopies++;
+        copy->level = l;
+        copy->from = from;
+        copy->dstx = valid[l][0];
+        copy->dsty = valid[l][1];
+        copy->srcx = valid[l][0]+offset[0];
+        copy->srcy = valid[l][1]+offset[1];
+        copy->width = valid[l][2]-valid[l][0];
+        copy->height = valid[l][3]-valid[l][1];
+    }
+    memcpy(pyramid->valid,valid,sizeof(valid));
+    pyramid->next = pyramid->top;
+
+    const GLfloat scale = zoom < 0 ? 0.5f : zoom > 0 ? 2.0f : 1.0f;
+    for (d=0; d<2; ++d) {
+        fim->fieldoffset[d] += (GLfloat)shift[d]/(GLfloat)fim->fieldsize[d]*fim->fielddims[d];
+        fim->fielddims[d] *= scale;
+    }
+    fim->dirty |= FIM_DIRTY_VIEW;
+    record(0,"View moved to (%f, %f) + (%f, %f); %d blocks carried over\n",
+           fim->fieldoffset[0],fim->fieldoffset[1],fim->fielddims[0],fim->fielddims[1],
+           numcopies);
+
+    return numcopies;
+}
@@ -0,0 +1,59 @@
+// Progressive evaluation for the viewer. The field texture holds a mip-style
+// pyramid in which level l holds every 2^l-th sample of the field, taken at
+// exactly the positions the full-resolution field has there, so a coarse
+// level subsamples the fine one rather than averaging it. Whenever the field
+// or the view changes, the levels are evaluated coarsest first, one per frame,
+// and each pixel shows the finest level holding a current sample for it: the
+// first frame costs 1/4^top of a full evaluation.
+//
+// Pans and zooms move fieldoffset/fielddims by whole samples of the coarsest
+// level, so every sample that stays in view lands on a sample some level
+// already holds. A pan shifts each level, zooming in by 2 turns level l into
+// level l+1 and zooming out turns level l+1 into level l. moveFieldPyramid
+// says which blocks to carry over; only samples outside them are evaluated.
+// Passed to frag.glsl in its preamble as MAX_LEVEL
+#define PROGRESSIVE_MAX_LEVEL 3
+// The coarsest level keeps at least this many samples along its shorter side
+#define PROGRESSIVE_MIN_SIZE 64
+// Pans move the view by this fraction of its size
+#define PROGRESSIVE_PAN_STEP 0.125
+
+typedef struct {
+    int top;
+    GLint size[PROGRESSIVE_MAX_LEVEL+1][2];
+    // Samples of each level holding their current value, as x0, y0, x1, y1
+    // with x1, y1 exclusive; the pyramid is complete when every level is full
+    GLint valid[PROGRESSIVE_MAX_LEVEL+1][4];
+    // Next level to evaluate, -1 once complete
+    int next;
+} FieldPyramid;
+
+// Block of samples to carry over from level from of the pyramid before a move
+// to level level of the pyramid after it
+typedef struct {
+    int level;
+    int from;
+    GLint srcx, srcy;
+    GLint dstx, dsty;
+    GLint width, height;
+} PyramidCopy;
+
+// Levels are sized like GL mip levels of a fieldsize texture; maxlevel caps
+// top, 0 leaving just the field itself
+void initFieldPyramid(FieldPyramid* const pyramid, const GLuint* const fieldsize, int maxlevel);
+void invalidateFieldPyramid(FieldPyramid* const pyramid);
+void completeFieldPyramid(FieldPyramid* const pyramid);
+int fieldPyramidComplete(const FieldPyramid* const pyramid);
+
+// Level to evaluate next, or -1 if none, and the samples it already holds;
+// the level counts as valid from then on
+int nextPyramidLevel(FieldPyramid* const pyramid, GLint* const keep);
+
+// Shift of a pan (zoom 0) by dirx, diry steps, or of zooming in (-1) or out
+// (+1) about the centre of the view, in samples of level 0
+void viewMoveShift(const FieldPyramid* const pyramid, const FieldInfoMap* const fim,
+                   int zoom, int dirx, int diry, GLint* const shift);
+// Move fim's view and the pyramid with it; copies gets at most top+1 blocks to
+// carry over, all read before any is written. Returns how many.
+int moveFieldPyramid(FieldPyramid* const pyramid, FieldInfoMap* const fim,
+                     int zoom, const GLint* const shift, PyramidCopy* const copies);
@@ -0,0 +1,487 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <GL/gl.h>
+
+#include "common.h"
+#include "fim.h"
+#include "cpu-field.h"
+#include "field-file.h"
+#include "sweep.h"
+#include "propagation.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PROPAGATION_X86
+#include <immintrin.h>
+#endif
+
+// Floats per source in a panel: PROPAGATION_PANEL re, then PROPAGATION_PANEL im
+#define PANEL_STRIDE (2*PROPAGATION_PANEL)
+#define BUILD_PIXELS (PROPAGATION_TASK_PANELS*PROPAGATION_PANEL)
+#define BUILD_SOURCES 64
+#define BUILD_SCRATCH_SIZE (2*(BUILD_PIXELS+CPU_POINT_PADDING)+2*BUILD_SOURCES*BUILD_PIXELS)
+
+struct PropagationCache {
+    GLuint width;
+    GLuint height;
+    int numsources;
+    size_t numpanels;
+    GLfloat* panels; // numpanels blocks of numsources*PANEL_STRIDE
+};
+
+typedef struct {
+    GLfloat min;
+    GLfloat max;
+    double sum;
+    double sumsq;
+} DriveStats;
+
+// Sums PROPAGATION_BATCH drives, given for each source as BATCH (re,im)
+// pairs, over one panel into out as BATCH blocks of PANEL_STRIDE
+typedef void (*PanelKernel)(const GLfloat* const panel, int numsources,
+                            const GLfloat* const drives, GLfloat* const out);
+
+typedef struct {
+    const CpuFieldEngine* engine;
+    PropagationCache* cache;
+    const GLfloat* x;
+    const GLfloat* y;
+    const GLfloat* k;
+    GLfloat offset[2];
+    GLfloat dims[2];
+    GLfloat* scratch;
+} BuildJob;
+
+typedef struct {
+    const PropagationCache* cache;
+    PanelKernel kernel;
+    const GLfloat* drives; // numgroups blocks of numsources*2*BATCH
+    int numdrives;
+    int numgroups;
+    GLfloat* const* fields;
+    DriveStats* stats;     // numdrives per task
+} DriveJob;
+
+/*
+ * ----------------------------------------------------------------------------
+ *  Kernels
+ * ----------------------------------------------------------------------------
+ */
+static void panelKernelScalar(const GLfloat* const panel, int numsources,
+                              const GLfloat* const drives, GLfloat* const out)
+{
+    memset(out,0,sizeof(GLfloat)*PROPAGATION_BATCH*PANEL_STRIDE);
+    int s,b,i;
+    for (s=0; s<numsources; ++s) {
+        const GLfloat* const pre = panel+s*PANEL_STRIDE;
+        const GLfloat* const pim = pre+PROPAGATION_PANEL;
+        const GLfloat* const d = drives+s*2*PROPAGATION_BATCH;
+        for (b=0; b<PROPAGATION_BATCH; ++b) {
+            GLfloat* const re = out+b*PANEL_STRIDE;
+            GLfloat* const im = re+PROPAGATION_PANEL;
+            for (i=0; i<PROPAGATION_PANEL; ++i) {
+                re[i] += pre[i]*d[2*b]-pim[i]*d[2*b+1];
+                im[i] += pre[i]*d[2*b+1]+pim[i]*d[2*b];
+            }
+        }
+    }
+}
+
+#ifdef PROPAGATION_X86
+// One ymm per panel half; 6 drives keep 12 accumulators plus the panel and two
+// broadcasts in the 16 registers
+#define PANEL_ACCUMULATE(B)                                                   \
+    do {                                                                      \
+        const __m256 dre = _mm256_broadcast_ss(d+2*(B));                      \
+        const __m256 dim = _mm256_broadcast_ss(d+2*(B)+1);                    \
+        re##B = _mm256_fmadd_ps(pre,dre,_mm256_fnmadd_ps(pim,dim,re##B));     \
+        im##B = _mm256_fmadd_ps(pre,dim,_mm256_fmadd_ps(pim,dre,im##B));      \
+    } while (0)
+#define PANEL_STORE(B)                                                        \
+    do {                                                                      \
+        _mm256_storeu_ps(out+(B)*PANEL_STRIDE,re##B);                         \
+        _mm256_storeu_ps(out+(B)*PANEL_STRIDE+PROPAGATION_PANEL,im##B);       \
+    } while (0)
+
+__attribute__((target("avx2,fma")))
+static void panelKernelAVX2(const GLfloat* const panel, int numsources,
+                            const GLfloat* const drives, GLfloat* const out)
+{
+    __m256 re0 = _mm256_setzero_ps(), im0 = _mm256_setzero_ps();
+    __m256 re1 = _mm256_setzero_ps(), im1 = _mm256_setzero_ps();
+    __m256 re2 = _mm256_setzero_ps(), im2 = _mm256_setzero_ps();
+    __m256 re3 = _mm256_setzero_ps(), im3 = _mm256_setzero_ps();
+    __m256 re4 = _mm256_setzero_ps(), im4 = _mm256_setzero_ps();
+    __m256 re5 = _mm256_setzero_ps(), im5 = _mm256_setzero_ps();
+
+    int s;
+    for (s=0; s<numsources; ++s) {
+        const __m256 pre = _mm256_loadu_ps(panel+s*PANEL_STRIDE);
+        const __m256 pim = _mm256_loadu_ps(panel+s*PANEL_STRIDE+PROPAGATION_PANEL);
+        const GLfloat* const d = drives+s*2*PROPAGATION_BATCH;
+        PANEL_ACCUMULATE(0);
+        PANEL_ACCUMULATE(1);
+        PANEL_ACCUMULATE(2);
+        PANEL_ACCUMULATE(3);
+        PANEL_ACCUMULATE(4);
+        PANEL_ACCUMULATE(5);
+    }
+
+    PANEL_STORE(0);
+    PANEL_STORE(1);
+    PANEL_STORE(2);
+    PANEL_STORE(3);
+    PANEL_STORE(4);
+    PANEL_STORE(5);
+}
+#endif
+
+static PanelKernel selectPanelKernel(void) {
+#if defined(PROPAGATION_X86) && PROPAGATION_PANEL == 8 && PROPAGATION_BATCH == 6
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return panelKernelAVX2;
+#endif
+    return panelKernelScalar;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ *  Cache
+ * ----------------------------------------------------------------------------
+ */
+static size_t numPanels(const FieldInfoMap* const fim) {
+    const size_t pixels = (size_t)fim->fieldsize[0]*fim->fieldsize[1];
+    return (pixels+PROPAGATION_PANEL-1)/PROPAGATION_PANEL;
+}
+
+size_t propagationCacheBytes(const FieldInfoMap* const fim) {
+    const int psn = *(fim->psn) < fim->ps_capacity ? *(fim->psn) : fim->ps_capacity;
+    return numPanels(fim)*(psn > 0 ? psn : 0)*PANEL_STRIDE*sizeof(GLfloat);
+}
+
+// One source at a time over all the task's pixels, BUILD_SOURCES of them
+// before they are transposed into the panels
+static void buildTask(void* arg, int task, unsigned int thread) {
+    BuildJob* const job = (BuildJob*)arg;
+    PropagationCache* const cache = job->cache;
+    const size_t pixels = (size_t)cache->width*cache->height;
+    const GLfloat zero = 0;
+    GLfloat* const px = job->scratch+thread*BUILD_SCRATCH_SIZE;
+    GLfloat* const py = px+BUILD_PIXELS+CPU_POINT_PADDING;
+    GLfloat* const out = py+BUILD_PIXELS+CPU_POINT_PADDING;
+
+    const size_t q0 = (size_t)task*PROPAGATION_TASK_PANELS;
+    const size_t q1 = q0+PROPAGATION_TASK_PANELS < cache->numpanels ?
+                      q0+PROPAGATION_TASK_PANELS : cache->numpanels;
+    const int n = (q1-q0)*PROPAGATION_PANEL;
+    int i,s;
+    for (i=0; i<n+CPU_POINT_PADDING; ++i) {
+        // Past the last pixel repeats it; those lanes are never read back
+        size_t p = q0*PROPAGATION_PANEL+(i < n ? i : 0);
+        if (p >= pixels) p = pixels-1;
+        const GLuint x = p % cache->width, y = p / cache->width;
+        // Same expressions as the compute shader so the sample points agree
+        px[i] = job->offset[0]+(GLfloat)x/(GLfloat)cache->width*job->dims[0];
+        py[i] = job->offset[1]+(GLfloat)y/(GLfloat)cache->height*job->dims[1];
+    }
+
+    int s0,q;
+    for (s0=0; s0<cache->numsources; s0+=BUILD_SOURCES) {
+        const int ns = s0+BUILD_SOURCES > cache->numsources ? cache->numsources-s0 : BUILD_SOURCES;
+        for (s=0; s<ns; ++s) {
+            sumSourcesCpu(job->engine,1,job->x+s0+s,job->y+s0+s,job->k+s0+s,&zero,
+                          NULL,n,px,py,out+2*(size_t)s*BUILD_PIXELS);
+        }
+        for (q=0; q<n/PROPAGATION_PANEL; ++q) {
+            GLfloat* const panel = cache->panels+((q0+q)*cache->numsources+s0)*PANEL_STRIDE;
+            for (s=0; s<ns; ++s) {
+                const GLfloat* const in = out+2*((size_t)s*BUILD_PIXELS+q*PROPAGATION_PANEL);
+                for (i=0; i<PROPAGATION_PANEL; ++i) {
+                    panel[s*PANEL_STRIDE+i] = in[2*i];
+                    panel[s*PANEL_STRIDE+PROPAGATION_PANEL+i] = in[2*i+1];
+                }
+            }
+        }
+    }
+}
+
+PropagationCache* createPropagationCache(CpuFieldEngine* const engine,
+                                         const FieldInfoMap* const fim)
+{
+    int psn = *(fim->psn);
+    if (psn < 0) psn = 0;
+    if (psn > fim->ps_capacity) psn = fim->ps_capacity;
+
+    PropagationCache* const cache = (PropagationCache*)calloc(1,sizeof(PropagationCache));
+    GLfloat* const sources = (GLfloat*)malloc(sizeof(GLfloat)*3*(psn > 0 ? psn : 1));
+    GLfloat* const scratch = (GLfloat*)malloc(sizeof(GLfloat)*BUILD_SCRATCH_SIZE*
+                                              cpuFieldThreads(engine));
+    if (cache == NULL || sources == NULL || scratch == NULL) {
+        record(1,"Failed to allocate propagation cache\n");
+        free(cache);
+        free(sources);
+        free(scratch);
+        return NULL;
+    }
+
+    cache->width = fim->fieldsize[0];
+    cache->height = fim->fieldsize[1];
+    cache->numsources = psn;
+    cache->numpanels = numPanels(fim);
+    cache->panels = (GLfloat*)malloc(propagationCacheBytes(fim)+sizeof(GLfloat));
+    if (cache->panels == NULL) {
+        record(1,"Failed to allocate %zu byte propagation cache\n",propagationCacheBytes(fim));
+        free(cache);
+        free(sources);
+        free(scratch);
+        return NULL;
+    }
+
+    BuildJob job;
+    job.engine = engine;
+    job.cache = cache;
+    job.x = sources;
+    job.y = sources+psn;
+    job.k = sources+2*psn;
+    job.offset[0] = fim->fieldoffset[0];
+    job.offset[1] = fim->fieldoffset[1];
+    job.dims[0] = fim->fielddims[0];
+    job.dims[1] = fim->fielddims[1];
+    job.scratch = scratch;
+
+    int i;
+    for (i=0; i<psn; ++i) {
+        sources[i] = fim->ps_loc[NUM_DIMS*i];
+        sources[psn+i] = fim->ps_loc[NUM_DIMS*i+1];
+        sources[2*psn+i] = fim->ps_freq[i]*2.0f*(GLfloat)PI/(*(fim->mat_c));
+    }
+
+    if (cache->width > 0 && cache->height > 0) {
+        const int numtasks = (cache->numpanels+PROPAGATION_TASK_PANELS-1)/PROPAGATION_TASK_PANELS;
+        runCpuTasks(engine,numtasks,buildTask,&job);
+    }
+
+    free(sources);
+    free(scratch);
+    return cache;
+}
+
+void destroyPropagationCache(PropagationCache* const cache) {
+    if (cache == NULL) return;
+    free(cache->panels);
+    free(cache);
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ *  Drives
+ * ----------------------------------------------------------------------------
+ */
+static void driveTask(void* arg, int task, unsigned int thread) {
+    DriveJob* const job = (DriveJob*)arg;
+    const PropagationCache* const cache = job->cache;
+    const size_t pixels = (size_t)cache->width*cache->height;
+    const int numsources = cache->numsources;
+    GLfloat out[PROPAGATION_BATCH*PANEL_STRIDE];
+    (void)thread;
+
+    DriveStats* const stats = job->stats+(size_t)task*job->numdrives;
+    int b,g,i;
+    for (b=0; b<job->numdrives; ++b) {
+        stats[b].min = INFINITY;
+        stats[b].max = -INFINITY;
+        stats[b].sum = 0;
+        stats[b].sumsq = 0;
+    }
+
+    size_t q = (size_t)task*PROPAGATION_TASK_PANELS;
+    const size_t end = q+PROPAGATION_TASK_PANELS < cache->numpanels ?
+                       q+PROPAGATION_TASK_PANELS : cache->numpanels;
+    for (; q<end; ++q) {
+        const GLfloat* const panel = cache->panels+q*numsources*PANEL_STRIDE;
+        const size_t p0 = q*PROPAGATION_PANEL;
+        const int n = p0+PROPAGATION_PANEL > pixels ? pixels-p0 : PROPAGATION_PANEL;
+
+        // The panel stays in cache across the groups
+        for (g=0; g<job->numgroups; ++g) {
+            job->kernel(panel,numsources,
+                        job->drives+(size_t)g*numsources*2*PROPAGATION_BATCH,out);
+
+            for (b=0; b<PROPAGATION_BATCH && g*PROPAGATION_BATCH+b<job->numdrives; ++b) {
+                const int drive = g*PROPAGATION_BATCH+b;
+                const GLfloat* const re = out+b*PANEL_STRIDE;
+                const GLfloat* const im = re+PROPAGATION_PANEL;
+                GLfloat* const field = job->fields[drive]+2*p0;
+                DriveStats* const st = stats+drive;
+                for (i=0; i<n; ++i) {
+                    field[2*i] = re[i];
+                    field[2*i+1] = im[i];
+                    const GLfloat m = sqrtf(re[i]*re[i]+im[i]*im[i]);
+                    // Samples right on top of a source aren't finite; leave them out
+                    if (!isfinite(m)) continue;
+                    if (m < st->min) st->min = m;
+                    if (m > st->max) st->max = m;
+                    st->sum += m;
+                    st->sumsq += (double)m*m;
+                }
+            }
+        }
+    }
+}
+
+int evaluateDrives(CpuFieldEngine* const engine, const PropagationCache* const cache,
+                   const GLfloat* const drives, int numdrives,
+                   GLfloat* const* const fields, PropagationStats* const stats)
+{
+    const size_t pixels = (size_t)cache->width*cache->height;
+    const int numsources = cache->numsources;
+    if (pixels == 0 || numdrives <= 0) return 0;
+
+    DriveJob job;
+    job.cache = cache;
+    job.kernel = selectPanelKernel();
+    job.numdrives = numdrives;
+    job.numgroups = (numdrives+PROPAGATION_BATCH-1)/PROPAGATION_BATCH;
+    job.fields = fields;
+    const int numtasks = (cache->numpanels+PROPAGATION_TASK_PANELS-1)/PROPAGATION_TASK_PANELS;
+
+    // Drives regrouped source-major within each group, padded with zero drives
+    GLfloat* const grouped = (GLfloat*)calloc((size_t)job.numgroups*(numsources > 0 ? numsources : 1),
+                                              sizeof(GLfloat)*2*PROPAGATION_BATCH);
+    job.stats = (DriveStats*)malloc(sizeof(DriveStats)*numtasks*numdrives);
+    if (grouped == NULL || job.stats == NULL) {
+        record(1,"Failed to allocate drive buffers\n");
+        free(grouped);
+        free(job.stats);
+        return 1;
+    }
+
+    int b,s,t;
+    for (b=0; b<numdrives; ++b) {
+        GLfloat* const group = grouped+(size_t)(b/PROPAGATION_BATCH)*numsources*2*PROPAGATION_BATCH;
+        for (s=0; s<numsources; ++s) {
+            group[s*2*PROPAGATION_BATCH+2*(b%PROPAGATION_BATCH)] = drives[2*((size_t)b*numsources+s)];
+            group[s*2*PROPAGATION_BATCH+2*(b%PROPAGATION_BATCH)+1] = drives[2*((size_t)b*numsources+s)+1];
+        }
+    }
+    job.drives = grouped;
+
+    runCpuTasks(engine,numtasks,driveTask,&job);
+
+    // In task order, so the result doesn't depend on the thread count
+    for (b=0; b<numdrives && stats != NULL; ++b) {
+        DriveStats total;
+        total.min = INFINITY;
+        total.max = -INFINITY;
+        total.sum = 0;
+        total.sumsq = 0;
+        for (t=0; t<numtasks; ++t) {
+            const DriveStats* const st = job.stats+(size_t)t*numdrives+b;
+            if (st->min < total.min) total.min = st->min;
+            if (st->max > total.max) total.max = st->max;
+            total.sum += st->sum;
+            total.sumsq += st->sumsq;
+        }
+        stats[b].min = total.min;
+        stats[b].max = total.max;
+        stats[b].mean = total.sum/pixels;
+        stats[b].rms = sqrt(total.sumsq/pixels);
+    }
+
+    free(grouped);
+    free(job.stats);
+    return 0;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ *  Sweeps
+ * ----------------------------------------------------------------------------
+ */
+int runPropagationSweep(CpuFieldEngine* const engine, Sweep* const sweep,
+                        FieldInfoMap* const fim, FieldDataMap* const fdm,
+                        const char* const outfile)
+{
+    const int numvariants = sweepVariants(sweep);
+    const int batch = numvariants < PROPAGATION_SWEEP_BATCH ? numvariants : PROPAGATION_SWEEP_BATCH;
+    const size_t pixels = (size_t)fim->fieldsize[0]*fim->fieldsize[1];
+    const int psn = *(fim->psn);
+
+    record(1,"Propagation cache: %ux%u samples x %d sources = %.1f MB, "
+           "plus %.1f MB for %d fields at a time\n",
+           fim->fieldsize[0],fim->fieldsize[1],psn,propagationCacheBytes(fim)/1048576.0,
+           sizeof(GLfloat)*2*pixels*batch/1048576.0,batch);
+
+    GLfloat* const fieldblock = (GLfloat*)malloc(sizeof(GLfloat)*2*pixels*batch);
+    GLfloat** const fields = (GLfloat**)malloc(sizeof(GLfloat*)*batch);
+    GLfloat* const drives = (GLfloat*)malloc(sizeof(GLfloat)*2*(size_t)batch*(psn > 0 ? psn : 1));
+    PropagationStats* const stats = (PropagationStats*)malloc(sizeof(PropagationStats)*batch);
+    FILE* fp = NULL;
+    PropagationCache* cache = NULL;
+
+    int failed = fieldblock == NULL || fields == NULL || drives == NULL || stats == NULL;
+    if (failed) record(1,"Failed to allocate sweep buffers\n");
+
+    if (!failed) {
+        fp = fopen(outfile,"wb");
+        if (fp == NULL) {
+            record(1,"Failed to open output file %s\n",outfile);
+            failed = 1;
+        }
+    }
+    const int begun = !failed && !beginSweep(sweep,fim,fdm);
+    if (!begun) failed = 1;
+
+    const double start = wallClock();
+    if (!failed) {
+        cache = createPropagationCache(engine,fim);
+        failed = cache == NULL;
+    }
+    if (!failed) {
+        record(0,"Built propagation cache in %.2fs\n",wallClock()-start);
+        record(0,"Sweeping %d variants of a %ux%u field into %s, %d at a time\n",numvariants,
+               fim->fieldsize[0],fim->fieldsize[1],outfile,batch);
+    }
+
+    int i,j,variant;
+    for (i=0; i<batch && !failed; ++i) fields[i] = fieldblock+2*pixels*i;
+    for (variant=0; variant<numvariants && !failed; variant+=batch) {
+        const int n = variant+batch > numvariants ? numvariants-variant : batch;
+        for (i=0; i<n; ++i) {
+            applySweepVariant(sweep,variant+i,fim,fdm);
+            for (j=0; j<psn; ++j) {
+                drives[2*((size_t)i*psn+j)] = cosf(fim->ps_phase[j]);
+                drives[2*((size_t)i*psn+j)+1] = sinf(fim->ps_phase[j]);
+            }
+        }
+
+        failed = evaluateDrives(engine,cache,drives,n,fields,stats);
+
+        for (i=0; i<n && !failed; ++i) {
+            if (*(fdm->written) != 2) {
+                *(fdm->written) = 1;
+                *(fdm->field_min) = stats[i].min;
+                *(fdm->field_max) = stats[i].max;
+            }
+            *(fdm->field_mean) = stats[i].mean;
+            *(fdm->field_rms) = stats[i].rms;
+            failed = writeFieldRecord(fp,fim,fdm,fields[i]);
+            record(0,"> Variant %d: min %f, max %f, mean %f, rms %f\n",variant+i,
+                   *(fdm->field_min),*(fdm->field_max),*(fdm->field_mean),*(fdm->field_rms));
+        }
+    }
+
+    if (fp != NULL && fclose(fp) != 0) failed = 1;
+    if (failed) record(1,"Cached sweep failed\n");
+    else record(0,"Swept %d variants in %.2fs\n",numvariants,wallClock()-start);
+
+    if (begun) endSweep(sweep);
+    destroyPropagationCache(cache);
+    free(fieldblock);
+    free(fields);
+    free(drives);
+    free(stats);
+    return failed;
+}
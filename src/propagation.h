@@ -0,0 +1,42 @@
+// Propagation cache for work that only changes how each source is driven. The
+// term e^(ikr)/sqrt(r) from every source to every sample doesn't depend on the
+// source's phase or amplitude, so it is evaluated once into a (pixels x
+// sources) complex matrix. A batch of drive vectors d_j = a_j e^(i*phase_j)
+// is then one complex matrix product (pixels x sources)(sources x batch),
+// blocked so that a panel of PROPAGATION_PANEL pixels is read from memory once
+// for the whole batch and reused from cache PROPAGATION_BATCH drives at a time.
+//
+// The cache takes pixels*sources*8 bytes; propagationCacheBytes says how much
+// before anything is allocated.
+#define PROPAGATION_PANEL 8
+#define PROPAGATION_BATCH 6
+#define PROPAGATION_TASK_PANELS 64
+// Drive vectors evaluated together by a cached sweep
+#define PROPAGATION_SWEEP_BATCH 64
+#define PROPAGATION_MAX_BYTES ((size_t)4<<30)
+
+typedef struct PropagationCache PropagationCache;
+
+typedef struct {
+    GLfloat min;
+    GLfloat max;
+    GLfloat mean;
+    GLfloat rms;
+} PropagationStats;
+
+size_t propagationCacheBytes(const FieldInfoMap* const fim);
+
+PropagationCache* createPropagationCache(CpuFieldEngine* const engine,
+                                         const FieldInfoMap* const fim);
+void destroyPropagationCache(PropagationCache* const cache);
+
+// numdrives vectors of psn (re,im) pairs into numdrives fields, each laid out
+// like computeFieldCpu's; stats may be NULL
+int evaluateDrives(CpuFieldEngine* const engine, const PropagationCache* const cache,
+                   const GLfloat* const drives, int numdrives,
+                   GLfloat* const* const fields, PropagationStats* const stats);
+
+// runSweep for sweeps where sweepDrivesOnly holds
+int runPropagationSweep(CpuFieldEngine* const engine, Sweep* const sweep,
+                        FieldInfoMap* const fim, FieldDataMap* const fdm,
+                        const char* const outfile);
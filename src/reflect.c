@@ -0,0 +1,285 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <GL/gl.h>
+
+#include "common.h"
+#include "fim.h"
+#include "reflect.h"
+
+int fieldReflects(const FieldInfoMap* const fim) {
+    return fim->wall_n > 0 && fim->reflect_order > 0;
+}
+
+/* ----
+ *  Wall sequences
+ ---- */
+
+// Reflection in wall w as an affine map; degenerate walls give the identity
+static void wallTransform(const FieldInfoMap* const fim, int w, ImageTransform* const wall) {
+    const GLfloat* const p = fim->wall_loc+4*w;
+    double dx = p[2]-p[0], dy = p[3]-p[1];
+    const double length = sqrt(dx*dx+dy*dy);
+
+    memset(wall,0,sizeof(*wall));
+    wall->amp = fim->wall_coef[w];
+    if (length == 0) {
+        wall->m[0] = 1;
+        wall->m[3] = 1;
+        return;
+    }
+    dx /= length;
+    dy /= length;
+
+    // 2dd^T-I, then whatever keeps the wall's points where they are
+    wall->m[0] = (GLfloat)(2*dx*dx-1);
+    wall->m[1] = (GLfloat)(2*dx*dy);
+    wall->m[2] = (GLfloat)(2*dx*dy);
+    wall->m[3] = (GLfloat)(2*dy*dy-1);
+    wall->t[0] = p[0]-(wall->m[0]*p[0]+wall->m[1]*p[1]);
+    wall->t[1] = p[1]-(wall->m[2]*p[0]+wall->m[3]*p[1]);
+}
+
+// Reflecting in wall after applying t
+static void composeTransform(const ImageTransform* const wall, const ImageTransform* const t,
+                             ImageTransform* const out)
+{
+    out->m[0] = wall->m[0]*t->m[0]+wall->m[1]*t->m[2];
+    out->m[1] = wall->m[0]*t->m[1]+wall->m[1]*t->m[3];
+    out->m[2] = wall->m[2]*t->m[0]+wall->m[3]*t->m[2];
+    out->m[3] = wall->m[2]*t->m[1]+wall->m[3]*t->m[3];
+    out->t[0] = wall->m[0]*t->t[0]+wall->m[1]*t->t[1]+wall->t[0];
+    out->t[1] = wall->m[2]*t->t[0]+wall->m[3]*t->t[1]+wall->t[1];
+    out->amp = wall->amp*t->amp;
+}
+
+/*
+ * Different sequences can land on the same image (in a rectangular room,
+ * reflecting in two adjacent walls either way round does), and it must only
+ * be counted once. Transforms are hashed on their translation in cells of
+ * eps, and compared against everything in the neighbouring cells.
+ */
+#define PLAN_HASH_SIZE 65536
+
+typedef struct {
+    int head[PLAN_HASH_SIZE];
+    int next[REFLECT_MAX_TRANSFORMS];
+    double eps;
+} PlanHash;
+
+static unsigned int planCell(long cx, long cy) {
+    return (unsigned int)((unsigned long)cx*73856093UL^(unsigned long)cy*19349663UL) % PLAN_HASH_SIZE;
+}
+
+static long planCoord(const PlanHash* const hash, GLfloat t) {
+    return (long)floor(t/hash->eps);
+}
+
+static int sameTransform(const PlanHash* const hash, const ImageTransform* const a,
+                         const ImageTransform* const b)
+{
+    int i;
+    for (i=0; i<4; ++i) if (fabsf(a->m[i]-b->m[i]) > 1e-4f) return 0;
+    return fabs(a->t[0]-b->t[0]) <= hash->eps && fabs(a->t[1]-b->t[1]) <= hash->eps;
+}
+
+static int planContains(const PlanHash* const hash, const ImageTransform* const transforms,
+                        const ImageTransform* const t)
+{
+    const long cx = planCoord(hash,t->t[0]), cy = planCoord(hash,t->t[1]);
+    long dx, dy;
+    for (dx=-1; dx<=1; ++dx) {
+        for (dy=-1; dy<=1; ++dy) {
+            int i;
+            for (i=hash->head[planCell(cx+dx,cy+dy)]; i>=0; i=hash->next[i]) {
+                if (sameTransform(hash,transforms+i,t)) return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void planInsert(PlanHash* const hash, const ImageTransform* const transforms, int i) {
+    const unsigned int cell = planCell(planCoord(hash,transforms[i].t[0]),
+                                       planCoord(hash,transforms[i].t[1]));
+    hash->next[i] = hash->head[cell];
+    hash->head[cell] = i;
+}
+
+int initReflectionPlan(const FieldInfoMap* const fim, ReflectionPlan* const plan) {
+    const int order = fim->reflect_order < REFLECT_MAX_ORDER ? fim->reflect_order : REFLECT_MAX_ORDER;
+    const int numwalls = fim->wall_n;
+
+    plan->threshold = fim->reflect_threshold;
+    plan->n = 0;
+    plan->transforms = NULL;
+
+    ImageTransform* const walls = (ImageTransform*)malloc(sizeof(ImageTransform)*(numwalls > 0 ? numwalls : 1));
+    // The last wall of each sequence, so it isn't reflected in again straight away
+    int* const last = (int*)malloc(sizeof(int)*REFLECT_MAX_TRANSFORMS);
+    PlanHash* const hash = (PlanHash*)malloc(sizeof(PlanHash));
+    plan->transforms = (ImageTransform*)malloc(sizeof(ImageTransform)*REFLECT_MAX_TRANSFORMS);
+    if (walls == NULL || last == NULL || hash == NULL || plan->transforms == NULL) {
+        record(1,"Failed to allocate reflection plan\n");
+        free(walls);
+        free(last);
+        free(hash);
+        freeReflectionPlan(plan);
+        return 1;
+    }
+
+    // Duplicates are told apart at a fraction of the walls' scale
+    int w;
+    double scale = 0;
+    for (w=0; w<4*numwalls; ++w) {
+        if (fabs(fim->wall_loc[w]) > scale) scale = fabs(fim->wall_loc[w]);
+    }
+    hash->eps = 1e-5*(scale > 0 ? scale : 1);
+    for (w=0; w<PLAN_HASH_SIZE; ++w) hash->head[w] = -1;
+
+    for (w=0; w<numwalls; ++w) wallTransform(fim,w,walls+w);
+
+    ImageTransform* const t = plan->transforms;
+    memset(t,0,sizeof(*t));
+    t[0].m[0] = 1;
+    t[0].m[3] = 1;
+    t[0].amp = 1;
+    last[0] = -1;
+    planInsert(hash,t,0);
+    plan->n = 1;
+
+    // Breadth first, one order at a time, so a full plan still holds every
+    // sequence of the orders it got through
+    int first = 0, end = 1, o, i, full = 0;
+    int pruned = 0, duplicates = 0;
+    for (o=1; o<=order && !full; ++o) {
+        for (i=first; i<end && !full; ++i) {
+            for (w=0; w<numwalls; ++w) {
+                if (w == last[i]) continue;
+                if (fabsf(walls[w].amp*t[i].amp) < plan->threshold) {
+                    ++pruned;
+                    continue;
+                }
+                if (plan->n == REFLECT_MAX_TRANSFORMS) {
+                    full = 1;
+                    break;
+                }
+                composeTransform(walls+w,t+i,t+plan->n);
+                if (planContains(hash,t,t+plan->n)) {
+                    ++duplicates;
+                    continue;
+                }
+                planInsert(hash,t,plan->n);
+                last[plan->n++] = w;
+            }
+        }
+        first = end;
+        end = plan->n;
+    }
+
+    if (full) {
+        record(1,"Reflections stopped at order %d, %d wall sequences; raise Reflection-Threshold "
+                 "to reach order %d\n",o-1,REFLECT_MAX_TRANSFORMS,order);
+    }
+    record(0,"%d walls to order %d: %d wall sequences, %d pruned below %g, %d duplicates\n",
+           numwalls,order,plan->n-1,pruned,plan->threshold,duplicates);
+
+    free(walls);
+    free(last);
+    free(hash);
+    return 0;
+}
+
+void freeReflectionPlan(ReflectionPlan* const plan) {
+    free(plan->transforms);
+    plan->transforms = NULL;
+    plan->n = 0;
+}
+
+/* ----
+ *  Image sources
+ ---- */
+
+void initImageSources(ImageSources* const images) {
+    memset(images,0,sizeof(*images));
+}
+
+void freeImageSources(ImageSources* const images) {
+    free(images->x);
+    initImageSources(images);
+}
+
+static int reserveImages(ImageSources* const images, int n) {
+    if (n <= images->capacity && images->x != NULL) return 0;
+
+    int capacity = images->capacity > 0 ? 2*images->capacity : 256;
+    while (capacity < n) capacity *= 2;
+    GLfloat* const block = (GLfloat*)malloc(sizeof(GLfloat)*6*(size_t)capacity);
+    if (block == NULL) {
+        record(1,"Failed to allocate space for %d image sources\n",capacity);
+        return 1;
+    }
+    if (images->n > 0) {
+        memcpy(block,images->x,sizeof(GLfloat)*images->n);
+        memcpy(block+capacity,images->y,sizeof(GLfloat)*images->n);
+        memcpy(block+2*capacity,images->z,sizeof(GLfloat)*images->n);
+        memcpy(block+3*capacity,images->k,sizeof(GLfloat)*images->n);
+        memcpy(block+4*capacity,images->phase,sizeof(GLfloat)*images->n);
+        memcpy(block+5*capacity,images->amp,sizeof(GLfloat)*images->n);
+    }
+    free(images->x);
+
+    images->capacity = capacity;
+    images->x = block;
+    images->y = block+capacity;
+    images->z = block+2*capacity;
+    images->k = block+3*capacity;
+    images->phase = block+4*capacity;
+    images->amp = block+5*capacity;
+    return 0;
+}
+
+int expandImageSources(const ReflectionPlan* const plan, int n,
+                       const GLfloat* const x, const GLfloat* const y, const GLfloat* const z,
+                       const GLfloat* const k, const GLfloat* const phase,
+                       const GLfloat* const region, double spreading,
+                       ImageSources* const images)
+{
+    images->n = 0;
+    if (reserveImages(images,n)) return 1;
+
+    int i, j, culled = 0;
+    for (i=0; i<n; ++i) {
+        const double wavelength = k[i] > 0 ? 2*PI/k[i] : 0;
+        for (j=0; j<plan->n; ++j) {
+            const ImageTransform* const t = plan->transforms+j;
+            const GLfloat ix = t->m[0]*x[i]+t->m[1]*y[i]+t->t[0];
+            const GLfloat iy = t->m[2]*x[i]+t->m[3]*y[i]+t->t[1];
+
+            // The source itself always stays
+            if (j > 0 && wavelength > 0) {
+                const double dx = ix < region[0] ? region[0]-ix : ix > region[2] ? ix-region[2] : 0;
+                const double dy = iy < region[1] ? region[1]-iy : iy > region[3] ? iy-region[3] : 0;
+                const double d = sqrt(dx*dx+dy*dy);
+                const double bound = fabs(t->amp)*(d > wavelength ? pow(wavelength/d,spreading) : 1);
+                if (bound < plan->threshold) {
+                    ++culled;
+                    continue;
+                }
+            }
+
+            if (reserveImages(images,images->n+1)) return 1;
+            const int m = images->n++;
+            images->x[m] = ix;
+            images->y[m] = iy;
+            images->z[m] = z != NULL ? z[i] : 0;
+            images->k[m] = k[i];
+            images->phase[m] = phase[i];
+            images->amp[m] = t->amp;
+        }
+    }
+
+    record(0,"%d sources with their images: %d terms, %d images culled\n",n,images->n,culled);
+    return 0;
+}
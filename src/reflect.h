@@ -0,0 +1,71 @@
+// Reflective boundaries by the image-source method. Each Wall is an infinite
+// line through two points with a real reflection coefficient (negative for a
+// pressure-release boundary); a source reflected in a sequence of walls is an
+// image source whose amplitude is the product of their coefficients. Walls
+// are infinite, so the images are exact for rooms whose walls meet at right
+// angles (and for single walls); for other shapes they ignore occlusion.
+//
+// Every wall sequence up to Reflection-Order, never the same wall twice in a
+// row, is a fixed affine map of the source position plus an amplitude, so the
+// sequences are enumerated once per evaluation and applied to every source.
+// Sequences whose amplitude is below Reflection-Threshold are pruned along
+// with everything after them (|coefficient| <= 1, so no later reflection can
+// bring them back). Of the rest, an image is dropped when even at the point of
+// the evaluated region nearest to it its term can't reach the threshold,
+// measured against a direct source one wavelength away. Surviving images go
+// into the same source arrays as the sources themselves, with an amplitude
+// the kernels fold into their spreading factor.
+//
+// Evaluated on the CPU engine only: the PointSources SSBO record has no room
+// for an amplitude, so reflective scenarios aren't evaluated by compute.glsl.
+#define REFLECT_DEFAULT_ORDER 3
+#define REFLECT_DEFAULT_THRESHOLD 1e-3
+#define REFLECT_MAX_ORDER 8
+// Bound on wall sequences, whatever the order and threshold allow
+#define REFLECT_MAX_TRANSFORMS 65536
+
+typedef struct {
+    // p' = m*p+t, m row-major 2x2
+    GLfloat m[4];
+    GLfloat t[2];
+    GLfloat amp;
+} ImageTransform;
+
+typedef struct {
+    int n;
+    // transforms[0] is the identity, i.e. the source itself
+    ImageTransform* transforms;
+    GLfloat threshold;
+} ReflectionPlan;
+
+typedef struct {
+    int n;
+    int capacity;
+    GLfloat* x;
+    GLfloat* y;
+    GLfloat* z;
+    GLfloat* k;
+    GLfloat* phase;
+    GLfloat* amp;
+} ImageSources;
+
+// Walls are set and the order isn't 0
+int fieldReflects(const FieldInfoMap* const fim);
+
+int initReflectionPlan(const FieldInfoMap* const fim, ReflectionPlan* const plan);
+void freeReflectionPlan(ReflectionPlan* const plan);
+
+void initImageSources(ImageSources* const images);
+void freeImageSources(ImageSources* const images);
+
+/*
+ * Images under plan of the n sources in x, y, k, phase (and z, if not NULL,
+ * which images keep) into images, replacing what it held, culled against the
+ * region x0, y0, x1, y1 of the plane. spreading is the exponent of r in the
+ * terms' falloff, 0.5 for the plane and 1 in 3D.
+ */
+int expandImageSources(const ReflectionPlan* const plan, int n,
+                       const GLfloat* const x, const GLfloat* const y, const GLfloat* const z,
+                       const GLfloat* const k, const GLfloat* const phase,
+                       const GLfloat* const region, double spreading,
+                       ImageSources* const images);
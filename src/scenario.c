@@ -0,0 +1,283 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <GL/gl.h>
+
+#include "common.h"
+#include "fim.h"
+#include "fi-parser.h"
+#include "scenario.h"
+#include "reflect.h"
+
+#define SCENARIO_RECORD_ALIGN 16
+
+int isScenario(const void* const data, size_t size) {
+    return size >= 4 && memcmp(data,SCENARIO_MAGIC,4) == 0;
+}
+
+// GLfloat-sized words of records after the header
+static size_t scenarioRecordWords(const ScenarioHeader* const header) {
+    const size_t heights = header->version < 4 ? 0 : (size_t)header->psn;
+    return (size_t)PS_PACKED_STRIDE*header->psn+(size_t)NUM_DIMS*header->proben+
+           (size_t)SCENARIO_WALL_STRIDE*header->walln+heights+
+           SCENARIO_SLICE_STRIDE*header->slicen;
+}
+
+int readScenario(const void* const data, size_t size,
+                 FieldInfoMap* const fim, FieldDataMap* const fdm)
+{
+    ScenarioHeader header;
+    const size_t minheader = offsetof(ScenarioHeader,walln);
+    if (size < minheader) {
+        record(1,"Scenario truncated: no room for a header\n");
+        return 1;
+    }
+    // Older headers are shorter; whatever they lack is filled in below
+    memset(&header,0,sizeof(header));
+    memcpy(&header,data,size < sizeof(header) ? size : sizeof(header));
+
+    if (!isScenario(data,size) || header.version < 1 || header.version > SCENARIO_VERSION) {
+        record(1,"Not a version 1 to %d scenario\n",SCENARIO_VERSION);
+        return 1;
+    }
+    if (header.version < 2) header.proben = 0;
+    if (header.version < 3) {
+        header.walln = 0;
+        header.reflect_order = REFLECT_DEFAULT_ORDER;
+        header.reflect_threshold = REFLECT_DEFAULT_THRESHOLD;
+    }
+    if (header.version < 4) {
+        memset(header.volumeoffset,0,sizeof(header.volumeoffset));
+        memset(header.volumedims,0,sizeof(header.volumedims));
+        memset(header.volumesize,0,sizeof(header.volumesize));
+        header.slicen = 0;
+    }
+    const size_t headerlength = header.version < 3 ? minheader :
+                                header.version < 4 ? offsetof(ScenarioHeader,volumeoffset) :
+                                sizeof(header);
+    if (header.byteorder != SCENARIO_BYTE_ORDER) {
+        record(1,"Scenario byte order doesn't match this machine\n");
+        return 1;
+    }
+    if (header.headersize < headerlength || header.headersize%SCENARIO_RECORD_ALIGN != 0 ||
+            header.psn < 0 || header.proben < 0 || header.walln < 0 || header.slicen < 0 ||
+            header.headersize > size ||
+            (size-header.headersize)/sizeof(GLfloat) < scenarioRecordWords(&header)) {
+        record(1,"Scenario header inconsistent with file size %zu\n",size);
+        return 1;
+    }
+    if (header.reflect_order < 0 || header.reflect_order > REFLECT_MAX_ORDER) {
+        record(1,"Scenario reflection order %d outside [0,%d]\n",
+               header.reflect_order,REFLECT_MAX_ORDER);
+        return 1;
+    }
+
+    *(fim->mat_c) = header.mat_c;
+    *(fim->psn) = header.psn;
+    memcpy(fim->fieldoffset,header.fieldoffset,sizeof(header.fieldoffset));
+    memcpy(fim->fielddims,header.fielddims,sizeof(header.fielddims));
+    memcpy(fim->fieldsize,header.fieldsize,sizeof(header.fieldsize));
+
+    if (header.written == 2) {
+        *(fdm->written) = 2;
+        *(fdm->field_max) = header.field_max;
+        *(fdm->field_min) = header.field_min;
+    }
+
+    fim->reflect_order = header.reflect_order;
+    fim->reflect_threshold = header.reflect_threshold;
+    memcpy(fim->volumeoffset,header.volumeoffset,sizeof(header.volumeoffset));
+    memcpy(fim->volumedims,header.volumedims,sizeof(header.volumedims));
+    memcpy(fim->volumesize,header.volumesize,sizeof(header.volumesize));
+
+    if (reservePointSources(fim,header.psn) || reserveProbes(fim,header.proben) ||
+            reserveWalls(fim,header.walln) || reserveSlices(fim,header.slicen)) return 1;
+
+    const GLfloat* const packed = (const GLfloat*)((const char*)data+header.headersize);
+    int i,d;
+    for (i=0; i<header.psn; ++i) {
+        const GLfloat* const p = packed+PS_PACKED_STRIDE*i;
+        for (d=0; d<NUM_DIMS; ++d) fim->ps_loc[NUM_DIMS*i+d] = p[d];
+        fim->ps_freq[i] = p[NUM_DIMS];
+        fim->ps_phase[i] = p[NUM_DIMS+1];
+    }
+    fim->probe_n = header.proben;
+    if (header.proben > 0) {
+        memcpy(fim->probe_loc,packed+PS_PACKED_STRIDE*header.psn,
+               sizeof(GLfloat)*NUM_DIMS*header.proben);
+    }
+    const GLfloat* const walls = packed+PS_PACKED_STRIDE*header.psn+NUM_DIMS*header.proben;
+    for (i=0; i<header.walln; ++i) {
+        const GLfloat* const w = walls+SCENARIO_WALL_STRIDE*i;
+        memcpy(fim->wall_loc+4*i,w,sizeof(GLfloat)*4);
+        fim->wall_coef[i] = w[4];
+    }
+    fim->wall_n = header.walln;
+
+    const GLfloat* const heights = walls+SCENARIO_WALL_STRIDE*header.walln;
+    if (header.psn > 0 && header.version < 4) {
+        memset(fim->ps_z,0,sizeof(GLfloat)*header.psn);
+    } else if (header.psn > 0) {
+        memcpy(fim->ps_z,heights,sizeof(GLfloat)*header.psn);
+    }
+    if (header.slicen > 0) {
+        memcpy(fim->slices,heights+header.psn,sizeof(FieldSlice)*header.slicen);
+    }
+    fim->slice_n = header.slicen;
+
+    record(0,"Read scenario with %d sources, %d probes, %d walls and %d slices\n",
+           header.psn,header.proben,header.walln,header.slicen);
+    return 0;
+}
+
+int writeScenarioFile(const char* const filename, const FieldInfoMap* const fim,
+                      const FieldDataMap* const fdm)
+{
+    ScenarioHeader header;
+    memset(&header,0,sizeof(header));
+    memcpy(header.magic,SCENARIO_MAGIC,4);
+    header.version = SCENARIO_VERSION;
+    header.byteorder = SCENARIO_BYTE_ORDER;
+    header.headersize = (sizeof(header)+SCENARIO_RECORD_ALIGN-1)/SCENARIO_RECORD_ALIGN*
+                        SCENARIO_RECORD_ALIGN;
+
+    header.psn = *(fim->psn);
+    header.proben = fim->probe_n;
+    header.walln = fim->wall_n;
+    header.slicen = fim->slice_n;
+    header.reflect_order = fim->reflect_order;
+    header.reflect_threshold = fim->reflect_threshold;
+    header.mat_c = *(fim->mat_c);
+    memcpy(header.fieldoffset,fim->fieldoffset,sizeof(header.fieldoffset));
+    memcpy(header.fielddims,fim->fielddims,sizeof(header.fielddims));
+    memcpy(header.fieldsize,fim->fieldsize,sizeof(header.fieldsize));
+    memcpy(header.volumeoffset,fim->volumeoffset,sizeof(header.volumeoffset));
+    memcpy(header.volumedims,fim->volumedims,sizeof(header.volumedims));
+    memcpy(header.volumesize,fim->volumesize,sizeof(header.volumesize));
+
+    // Only a range pinned by the input belongs to the scenario
+    if (*(fdm->written) == 2) {
+        header.written = 2;
+        header.field_max = *(fdm->field_max);
+        header.field_min = *(fdm->field_min);
+    }
+
+    const size_t count = scenarioRecordWords(&header);
+    GLfloat* const packed = (GLfloat*)malloc(sizeof(GLfloat)*(count > 0 ? count : 1));
+    if (packed == NULL) {
+        record(1,"Failed to allocate point source records\n");
+        return 1;
+    }
+    packPointSources(fim,packed);
+    if (header.proben > 0) {
+        memcpy(packed+PS_PACKED_STRIDE*header.psn,fim->probe_loc,
+               sizeof(GLfloat)*NUM_DIMS*header.proben);
+    }
+    GLfloat* const walls = packed+PS_PACKED_STRIDE*header.psn+NUM_DIMS*header.proben;
+    int i;
+    for (i=0; i<header.walln; ++i) {
+        GLfloat* const w = walls+SCENARIO_WALL_STRIDE*i;
+        memcpy(w,fim->wall_loc+4*i,sizeof(GLfloat)*4);
+        w[4] = fim->wall_coef[i];
+    }
+    GLfloat* const heights = walls+SCENARIO_WALL_STRIDE*header.walln;
+    if (header.psn > 0) memcpy(heights,fim->ps_z,sizeof(GLfloat)*header.psn);
+    if (header.slicen > 0) memcpy(heights+header.psn,fim->slices,sizeof(FieldSlice)*header.slicen);
+
+    FILE* fp = fopen(filename,"wb");
+    if (fp == NULL) {
+        record(1,"Failed to open output file %s\n",filename);
+        free(packed);
+        return 1;
+    }
+
+    const char padding[SCENARIO_RECORD_ALIGN] = { 0 };
+    const int failed = fwrite(&header,sizeof(header),1,fp) != 1 ||
+                       fwrite(padding,1,header.headersize-sizeof(header),fp) !=
+                           header.headersize-sizeof(header) ||
+                       fwrite(packed,sizeof(GLfloat),count,fp) != count;
+    if (fclose(fp) != 0 || failed) {
+        record(1,"Failed to write scenario to %s\n",filename);
+        free(packed);
+        return 1;
+    }
+
+    free(packed);
+    record(0,"Wrote scenario with %d sources, %d probes, %d walls and %d slices to %s\n",
+           header.psn,header.proben,header.walln,header.slicen,filename);
+    return 0;
+}
+
+int sameScenario(const FieldInfoMap* const a, const FieldDataMap* const afdm,
+                 const FieldInfoMap* const b, const FieldDataMap* const bfdm)
+{
+    const int psn = *(a->psn);
+    const int apinned = *(afdm->written) == 2, bpinned = *(bfdm->written) == 2;
+
+    if (*(a->mat_c) != *(b->mat_c) || psn != *(b->psn) || a->probe_n != b->probe_n ||
+            a->wall_n != b->wall_n || a->reflect_order != b->reflect_order ||
+            a->reflect_threshold != b->reflect_threshold || a->slice_n != b->slice_n ||
+            memcmp(a->fieldoffset,b->fieldoffset,sizeof(GLfloat)*NUM_DIMS) != 0 ||
+            memcmp(a->fielddims,b->fielddims,sizeof(GLfloat)*NUM_DIMS) != 0 ||
+            memcmp(a->fieldsize,b->fieldsize,sizeof(GLuint)*NUM_DIMS) != 0 ||
+            memcmp(a->volumeoffset,b->volumeoffset,sizeof(a->volumeoffset)) != 0 ||
+            memcmp(a->volumedims,b->volumedims,sizeof(a->volumedims)) != 0 ||
+            memcmp(a->volumesize,b->volumesize,sizeof(a->volumesize)) != 0) {
+        return 0;
+    }
+    if (apinned != bpinned || (apinned && (*(afdm->field_max) != *(bfdm->field_max) ||
+                                           *(afdm->field_min) != *(bfdm->field_min)))) {
+        return 0;
+    }
+
+    if (a->probe_n > 0 &&
+            memcmp(a->probe_loc,b->probe_loc,sizeof(GLfloat)*NUM_DIMS*a->probe_n) != 0) {
+        return 0;
+    }
+    if (a->wall_n > 0 &&
+            (memcmp(a->wall_loc,b->wall_loc,sizeof(GLfloat)*4*a->wall_n) != 0 ||
+             memcmp(a->wall_coef,b->wall_coef,sizeof(GLfloat)*a->wall_n) != 0)) {
+        return 0;
+    }
+    if (a->slice_n > 0 && memcmp(a->slices,b->slices,sizeof(FieldSlice)*a->slice_n) != 0) {
+        return 0;
+    }
+
+    return psn == 0 ||
+           (memcmp(a->ps_loc,b->ps_loc,sizeof(GLfloat)*NUM_DIMS*psn) == 0 &&
+            memcmp(a->ps_freq,b->ps_freq,sizeof(GLfloat)*psn) == 0 &&
+            memcmp(a->ps_phase,b->ps_phase,sizeof(GLfloat)*psn) == 0 &&
+            memcmp(a->ps_z,b->ps_z,sizeof(GLfloat)*psn) == 0);
+}
+
+int loadFieldInfoData(const void* const data, size_t size,
+                      FieldInfoMap* const fim, FieldDataMap* const fdm)
+{
+    if (isScenario(data,size)) return readScenario(data,size,fim,fdm);
+    return parseFieldInfo((const char*)data,size,fim,fdm);
+}
+
+int loadFieldInfoFile(const char* const filename,
+                      FieldInfoMap* const fim, FieldDataMap* const fdm)
+{
+    double parsetime;
+    return loadFieldInfoFileTimed(filename,fim,fdm,&parsetime);
+}
+
+int loadFieldInfoFileTimed(const char* const filename, FieldInfoMap* const fim,
+                           FieldDataMap* const fdm, double* const parsetime)
+{
+    *parsetime = 0;
+    size_t size;
+    int failed;
+    const void* const data = mapFile(filename,&size,&failed);
+    if (failed) return 1;
+
+    const double start = wallClock();
+    failed = loadFieldInfoData(data,size,fim,fdm);
+    *parsetime = wallClock()-start;
+
+    unmapFile(data,size);
+    return failed;
+}
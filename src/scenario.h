@@ -0,0 +1,63 @@
+// Binary scenario: a ScenarioHeader, then psn point source records of
+// PS_PACKED_STRIDE GLfloats (loc, freq, phase), i.e. exactly what goes into
+// the PointSources SSBO, so a mapped file can be uploaded without repacking,
+// then proben probe points of NUM_DIMS GLfloats, then walln walls of
+// SCENARIO_WALL_STRIDE GLfloats (two points, then the reflection coefficient),
+// then psn source heights, then slicen FieldSlices of SCENARIO_SLICE_STRIDE
+// words each. Little-endian; byteorder lets a reader on anything else refuse
+// the file. Records start at headersize, which is a multiple of 16. Version 1
+// files have no probes; versions before 3 have no walls and the default
+// reflection order and threshold, and a header that ends at walln; versions
+// before 4 have no heights, volume or slices, and a header that ends at
+// volumeoffset.
+#define SCENARIO_MAGIC "AFIS"
+#define SCENARIO_VERSION 4
+#define SCENARIO_WALL_STRIDE 5
+#define SCENARIO_SLICE_STRIDE (sizeof(FieldSlice)/sizeof(GLfloat))
+#define SCENARIO_BYTE_ORDER 0x01020304
+
+typedef struct {
+    char magic[4];
+    GLuint version;
+    GLuint byteorder;
+    GLuint headersize;
+
+    GLint psn;
+    GLfloat mat_c;
+    GLint written;
+    GLfloat field_max;
+    GLfloat field_min;
+    GLfloat fieldoffset[NUM_DIMS];
+    GLfloat fielddims[NUM_DIMS];
+    GLuint fieldsize[NUM_DIMS];
+    GLint proben;
+    GLint walln;
+    GLint reflect_order;
+    GLfloat reflect_threshold;
+    GLfloat volumeoffset[3];
+    GLfloat volumedims[3];
+    GLuint volumesize[3];
+    GLint slicen;
+} ScenarioHeader;
+
+int isScenario(const void* const data, size_t size);
+int readScenario(const void* const data, size_t size,
+                 FieldInfoMap* const fim, FieldDataMap* const fdm);
+int writeScenarioFile(const char* const filename, const FieldInfoMap* const fim,
+                      const FieldDataMap* const fdm);
+
+// Every FieldInfoMap member and the pinned FieldData range are equal, bit for
+// bit, including what scenario files don't store, so nothing a conversion
+// drops goes unnoticed
+int sameScenario(const FieldInfoMap* const a, const FieldDataMap* const afdm,
+                 const FieldInfoMap* const b, const FieldDataMap* const bfdm);
+
+// Binary scenario or .fi text, whichever size bytes at data hold
+int loadFieldInfoData(const void* const data, size_t size,
+                      FieldInfoMap* const fim, FieldDataMap* const fdm);
+// Same, from filename
+int loadFieldInfoFile(const char* const filename,
+                      FieldInfoMap* const fim, FieldDataMap* const fdm);
+// Same, and the part of it spent parsing or reading the mapped file into parsetime
+int loadFieldInfoFileTimed(const char* const filename, FieldInfoMap* const fim,
+                           FieldDataMap* const fdm, double* const parsetime);
@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <GL/glew.h>
+
+#include "common.h"
+#include "fim.h"
+#include "progressive.h"
+#include "shader-cache.h"
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+#define MAX_STAGES 2
+
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    unsigned long long key;
+    unsigned int format;
+    unsigned int length;
+} ShaderCacheHeader;
+
+void initShaderVariant(ShaderVariant* const variant) {
+    variant->localx = COMPUTE_LOCAL_FIELD_SIZE_X;
+    variant->localy = COMPUTE_LOCAL_FIELD_SIZE_Y;
+    variant->pixels = COMPUTE_PIXELS_PER_INVOCATION;
+    variant->chunk = COMPUTE_SOURCE_CHUNK_SIZE;
+    variant->sourcecount = 0;
+}
+
+void fieldShaderVariant(const FieldInfoMap* const fim, ShaderVariant* const variant) {
+    const GLint psn = *(fim->psn);
+    variant->sourcecount = psn > 0 && psn <= SHADER_UNROLL_MAX_SOURCES ? psn : 0;
+}
+
+static void writePreamble(char* const preamble, const ShaderVariant* variant) {
+    ShaderVariant plain;
+    if (variant == NULL) {
+        initShaderVariant(&plain);
+        variant = &plain;
+    }
+
+    int n = snprintf(preamble,SHADER_PREAMBLE_SIZE,
+                     "#version 430\n"
+                     "#define NUM_DIMS %d\n"
+                     "#define LOCAL_FIELD_SIZE_X %d\n"
+                     "#define LOCAL_FIELD_SIZE_Y %d\n"
+                     "#define PIXELS_PER_INVOCATION %d\n"
+                     "#define SOURCE_CHUNK_SIZE %d\n"
+                     "#define MAX_LEVEL %d\n",
+                     NUM_DIMS,variant->localx,variant->localy,variant->pixels,variant->chunk,
+                     PROGRESSIVE_MAX_LEVEL);
+    if (variant->sourcecount > 0) {
+        n += snprintf(preamble+n,SHADER_PREAMBLE_SIZE-n,
+                      "#define SOURCE_COUNT %d\n",variant->sourcecount);
+    }
+    // Line numbers in compiler messages are the file's own
+    snprintf(preamble+n,SHADER_PREAMBLE_SIZE-n,"#line 1\n");
+}
+
+static void recordInfoLog(unsigned int level,GLuint shader) {
+    GLchar* infobuf;
+
+    GLint infobuflen = 0;
+    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &infobuflen);
+
+    infobuf = (GLchar*) malloc(sizeof(GLchar)*infobuflen);
+    glGetShaderInfoLog(shader,infobuflen,NULL,infobuf);
+    record(level,infobuf);
+    fflush(stdout);
+
+    free(infobuf);
+}
+
+static int readFile(const char* filename, char* const buffer, int bufsize) {
+    FILE* fp = fopen(filename,"r");
+    if (fp == NULL) {
+        record(1,"Failed to open file %s\n",filename);
+        return 1;
+    }
+
+    long fl;
+
+    fseek(fp,0,SEEK_END);
+    fl = ftell(fp);
+    fseek(fp,0,SEEK_SET);
+
+    if (fl > bufsize) {
+        record(1,"File %s too big for buffer\n",filename);
+        fclose(fp);
+        return 1;
+    }
+
+    fread(buffer,sizeof(char),fl,fp);
+    fclose(fp);
+    return 0;
+}
+
+static unsigned long long hashBytes(unsigned long long h, const void* const data, size_t size) {
+    const unsigned char* const bytes = (const unsigned char*)data;
+    size_t i;
+    for (i=0; i<size; ++i) {
+        h ^= bytes[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+static unsigned long long hashString(unsigned long long h, const char* const s) {
+    // Terminator included, so consecutive strings can't run into each other
+    return hashBytes(h,s != NULL ? s : "",s != NULL ? strlen(s)+1 : 1);
+}
+
+/* ----
+ *  Program binary cache
+ ---- */
+
+void shaderCacheDirectory(char* const dir, size_t size) {
+    const char* const env = getenv("ACOUSTICS_SHADER_CACHE");
+    const char* const xdg = getenv("XDG_CACHE_HOME");
+    const char* const home = getenv("HOME");
+
+    dir[0] = '\0';
+    if (env != NULL) {
+        snprintf(dir,size,"%s",env);
+    } else if (xdg != NULL && xdg[0] != '\0') {
+        mkdir(xdg,0755);
+        snprintf(dir,size,"%s/acoustics-toolkit",xdg);
+    } else if (home != NULL && home[0] != '\0') {
+        snprintf(dir,size,"%s/.cache",home);
+        mkdir(dir,0755);
+        snprintf(dir,size,"%s/.cache/acoustics-toolkit",home);
+    }
+    if (dir[0] != '\0') mkdir(dir,0755);
+}
+
+static int binariesSupported(void) {
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS,&formats);
+    return formats > 0;
+}
+
+unsigned long long driverKey(void) {
+    unsigned long long h = FNV_OFFSET;
+    h = hashString(h,(const char*)glGetString(GL_VENDOR));
+    h = hashString(h,(const char*)glGetString(GL_RENDERER));
+    h = hashString(h,(const char*)glGetString(GL_VERSION));
+    return h;
+}
+
+static unsigned long long programKey(int n, const GLenum* const stages,
+                                     const char* const preamble, char* const* const sources)
+{
+    unsigned long long h = driverKey();
+    int i;
+    for (i=0; i<n; ++i) {
+        h = hashBytes(h,stages+i,sizeof(GLenum));
+        h = hashString(h,preamble);
+        h = hashString(h,sources[i]);
+    }
+    return h;
+}
+
+static GLuint loadCachedProgram(const char* const path, unsigned long long key) {
+    FILE* fp = fopen(path,"rb");
+    if (fp == NULL) return 0;
+
+    ShaderCacheHeader header;
+    void* binary = NULL;
+    GLuint prog = 0;
+    if (fread(&header,sizeof(header),1,fp) == 1 && header.magic == SHADER_CACHE_MAGIC &&
+            header.version == SHADER_CACHE_VERSION && header.key == key && header.length > 0) {
+        binary = malloc(header.length);
+    }
+    if (binary != NULL && fread(binary,1,header.length,fp) == header.length) {
+        prog = glCreateProgram();
+        glProgramBinary(prog,header.format,binary,header.length);
+
+        GLint linked = 0;
+        glGetProgramiv(prog,GL_LINK_STATUS,&linked);
+        if (linked == GL_FALSE) {
+            record(0,"Driver rejected cached program %s; rebuilding\n",path);
+            glDeleteProgram(prog);
+            prog = 0;
+        }
+    }
+    free(binary);
+    fclose(fp);
+    // Clear anything glProgramBinary left behind on a rejected blob
+    while (glGetError() != GL_NO_ERROR);
+    return prog;
+}
+
+static void storeCachedProgram(const char* const path, unsigned long long key, GLuint prog) {
+    GLint length = 0;
+    glGetProgramiv(prog,GL_PROGRAM_BINARY_LENGTH,&length);
+    if (length <= 0) return;
+
+    void* const binary = malloc(length);
+    if (binary == NULL) return;
+
+    ShaderCacheHeader header;
+    GLenum format;
+    glGetProgramBinary(prog,length,NULL,&format,binary);
+    header.magic = SHADER_CACHE_MAGIC;
+    header.version = SHADER_CACHE_VERSION;
+    header.key = key;
+    header.format = format;
+    header.length = (unsigned int)length;
+
+    // Written under a temporary name, so a concurrent launch never loads half
+    char tmp[FILENAME_MAX];
+    snprintf(tmp,sizeof(tmp),"%s.%d",path,(int)getpid());
+    FILE* fp = fopen(tmp,"wb");
+    int failed = fp == NULL;
+    if (!failed) {
+        failed = fwrite(&header,sizeof(header),1,fp) != 1 ||
+                 fwrite(binary,1,length,fp) != (size_t)length;
+        failed = fclose(fp) != 0 || failed;
+    }
+    if (!failed) failed = rename(tmp,path) != 0;
+    if (failed) {
+        record(0,"Could not write shader cache file %s\n",path);
+        remove(tmp);
+    }
+    free(binary);
+}
+
+/* ----
+ *  Compilation
+ ---- */
+
+static GLuint compileStage(GLenum stage, const char* const filename,
+                           const char* const preamble, const char* const source)
+{
+    GLuint shader = glCreateShader(stage);
+    const GLchar* strings[] = { preamble, source };
+    glShaderSource(shader,2,strings,NULL);
+    glCompileShader(shader);
+
+    GLint compiled = 0;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+    if (compiled == GL_FALSE) {
+        record(1,"Compilation of %s failed:\n",filename);
+        recordInfoLog(1,shader);
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+static GLuint linkStages(int n, const GLenum* const stages, const char* const* const filenames,
+                         const char* const preamble, char* const* const sources, int retrievable)
+{
+    GLuint shaders[MAX_STAGES];
+    int i;
+    for (i=0; i<n; ++i) {
+        shaders[i] = compileStage(stages[i],filenames[i],preamble,sources[i]);
+        if (shaders[i] == 0) {
+            while (i-- > 0) glDeleteShader(shaders[i]);
+            return 0;
+        }
+    }
+
+    GLuint prog = glCreateProgram();
+    if (retrievable) glProgramParameteri(prog,GL_PROGRAM_BINARY_RETRIEVABLE_HINT,GL_TRUE);
+    for (i=0; i<n; ++i) glAttachShader(prog,shaders[i]);
+
+    glLinkProgram(prog);
+
+    GLint linked = 0;
+    glGetProgramiv(prog, GL_LINK_STATUS, &linked);
+    if (linked == GL_FALSE) {
+        GLint infobuflen = 0;
+        glGetProgramiv(prog, GL_INFO_LOG_LENGTH, &infobuflen);
+
+        GLchar* infobuf = (GLchar*) malloc(sizeof(GLchar)*infobuflen);
+        glGetProgramInfoLog(prog,infobuflen,NULL,infobuf);
+
+        record(1,infobuf);
+        fflush(stdout);
+
+        free(infobuf);
+
+        glDeleteProgram(prog);
+        prog = 0;
+    } else {
+        for (i=0; i<n; ++i) glDetachShader(prog,shaders[i]);
+    }
+
+    for (i=0; i<n; ++i) glDeleteShader(shaders[i]);
+    return prog;
+}
+
+static GLuint buildProgram(int n, const GLenum* const stages, const char* const* const filenames,
+                           const ShaderVariant* const variant)
+{
+    char preamble[SHADER_PREAMBLE_SIZE];
+    writePreamble(preamble,variant);
+
+    char* sources[MAX_STAGES];
+    int i, failed = 0;
+    for (i=0; i<n; ++i) {
+        // One byte short so the source always stays null terminated
+        sources[i] = (char*)calloc(MAX_SHADER_BUF_SIZE,1);
+        if (sources[i] == NULL || readFile(filenames[i],sources[i],MAX_SHADER_BUF_SIZE-1)) {
+            record(1,"Could not read shader %s\n",filenames[i]);
+            failed = 1;
+        }
+    }
+    if (failed) {
+        for (i=0; i<n; ++i) free(sources[i]);
+        return 0;
+    }
+
+    char cachefile[FILENAME_MAX];
+    unsigned long long key = 0;
+    cachefile[0] = '\0';
+    if (binariesSupported()) {
+        char dir[FILENAME_MAX-32];
+        shaderCacheDirectory(dir,sizeof(dir));
+        key = programKey(n,stages,preamble,sources);
+        if (dir[0] != '\0') snprintf(cachefile,sizeof(cachefile),"%s/%016llx.bin",dir,key);
+    }
+
+    GLuint prog = cachefile[0] != '\0' ? loadCachedProgram(cachefile,key) : 0;
+    if (prog != 0) {
+        record(0,"Loaded %s from shader cache %s\n",filenames[n-1],cachefile);
+    } else {
+        prog = linkStages(n,stages,filenames,preamble,sources,cachefile[0] != '\0');
+        if (prog != 0 && cachefile[0] != '\0') {
+            storeCachedProgram(cachefile,key,prog);
+            record(0,"Compiled %s; cached as %s\n",filenames[n-1],cachefile);
+        }
+    }
+
+    for (i=0; i<n; ++i) free(sources[i]);
+    return prog;
+}
+
+GLuint createShaderProgram(void) {
+    const GLenum stages[] = { GL_VERTEX_SHADER, GL_FRAGMENT_SHADER };
+    const char* const filenames[] = { "vert.glsl", "frag.glsl" };
+    return buildProgram(2,stages,filenames,NULL);
+}
+
+GLuint createComputeProgram(const char* const filename, const ShaderVariant* const variant) {
+    const GLenum stages[] = { GL_COMPUTE_SHADER };
+    return buildProgram(1,stages,&filename,variant);
+}
@@ -0,0 +1,53 @@
+// Shader programs. Every stage is compiled from its .glsl file behind a
+// preamble the host generates: the #version line and the constants host and
+// shaders have to agree on (NUM_DIMS, the compute work group size, the depth
+// of the field pyramid), plus compute.glsl's launch shape and whatever else
+// the variant specialises, so the .glsl files never repeat them by hand.
+//
+// Linked programs are kept on disk as glGetProgramBinary blobs, one file per
+// program named after a hash of the driver (vendor, renderer, version) and of
+// the complete source of every stage, preamble included. A later launch with
+// the same driver and variant loads the blob instead of compiling; blobs the
+// driver rejects are rebuilt and replaced. The cache lives in
+// $ACOUSTICS_SHADER_CACHE if set (empty turns it off), otherwise in
+// $XDG_CACHE_HOME/acoustics-toolkit or ~/.cache/acoustics-toolkit.
+#define MAX_SHADER_BUF_SIZE 16384
+#define SHADER_PREAMBLE_SIZE 512
+#define SHADER_CACHE_MAGIC 0x43535441
+#define SHADER_CACHE_VERSION 1
+
+// Launch shape compute.glsl gets unless autotune.h has a better one
+#define COMPUTE_LOCAL_FIELD_SIZE_X 32
+#define COMPUTE_LOCAL_FIELD_SIZE_Y 32
+#define COMPUTE_PIXELS_PER_INVOCATION 1
+#define COMPUTE_SOURCE_CHUNK_SIZE 1024
+// Scenarios with at most this many sources get compute.glsl specialised to
+// their exact count
+#define SHADER_UNROLL_MAX_SOURCES 64
+
+typedef struct {
+    // Work group size, samples each invocation evaluates (LOCAL_FIELD_SIZE_X
+    // apart along x) and sources staged in shared memory at a time; sizes are
+    // powers of two
+    GLint localx;
+    GLint localy;
+    GLint pixels;
+    GLint chunk;
+    // Exact number of sources full passes sum over, 0 for any
+    GLint sourcecount;
+} ShaderVariant;
+
+// The default launch shape, not specialised to anything
+void initShaderVariant(ShaderVariant* const variant);
+// Specialise variant to fim's scenario
+void fieldShaderVariant(const FieldInfoMap* const fim, ShaderVariant* const variant);
+
+// Directory the cache lives in, empty if it's off
+void shaderCacheDirectory(char* const dir, size_t size);
+// Hash of the GL vendor, renderer and version
+unsigned long long driverKey(void);
+
+// vert.glsl and frag.glsl
+GLuint createShaderProgram(void);
+// variant may be NULL for the general program
+GLuint createComputeProgram(const char* const filename, const ShaderVariant* const variant);
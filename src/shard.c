@@ -0,0 +1,688 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sched.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <GL/gl.h>
+
+#include "common.h"
+#include "fim.h"
+#include "cpu-field.h"
+#include "scenario.h"
+#include "sweep.h"
+#include "tiled.h"
+#include "shard.h"
+
+enum {
+    TILE_TODO,
+    TILE_OUT,
+    TILE_DONE
+};
+
+typedef struct {
+    int fd;
+    // Local workers only, 0 otherwise
+    pid_t pid;
+    // The tile it's evaluating, -1 for none, and when it was sent
+    int tile;
+    double sent;
+    int tiles;
+    char name[96];
+} ShardWorker;
+
+/* ----
+ *  Messages
+ ---- */
+
+static int sendAll(int fd, const void* const data, size_t size) {
+    const char* p = (const char*)data;
+    while (size > 0) {
+        const ssize_t n = send(fd,p,size,MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 1;
+        p += n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+static int recvAll(int fd, void* const data, size_t size) {
+    char* p = (char*)data;
+    while (size > 0) {
+        const ssize_t n = recv(fd,p,size,0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 1;
+        p += n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+// Header, then a and b, either of which may be empty
+static int sendMessage(int fd, GLuint type, const void* const a, size_t asize,
+                       const void* const b, size_t bsize)
+{
+    ShardHeader header;
+    memcpy(header.magic,SHARD_MAGIC,4);
+    header.version = SHARD_VERSION;
+    header.byteorder = SHARD_BYTE_ORDER;
+    header.type = type;
+    header.length = (GLuint)(asize+bsize);
+    return sendAll(fd,&header,sizeof(header)) ||
+           (asize > 0 && sendAll(fd,a,asize)) ||
+           (bsize > 0 && sendAll(fd,b,bsize));
+}
+
+// Nonzero at the end of the stream or on anything that isn't a header we speak
+static int recvHeader(int fd, ShardHeader* const header) {
+    if (recvAll(fd,header,sizeof(*header))) return 1;
+    if (memcmp(header->magic,SHARD_MAGIC,4) != 0 || header->version != SHARD_VERSION ||
+            header->byteorder != SHARD_BYTE_ORDER) {
+        record(1,"Shard peer isn't speaking version %d of the protocol in this byte order\n",
+               SHARD_VERSION);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * address split at its last colon outside brackets into host, brackets
+ * stripped, and port. -1 if either doesn't fit, otherwise whether there was
+ * a colon; without one port is empty and host is all of address.
+ */
+static int splitAddress(const char* const address, size_t length, char* const host,
+                        size_t hostsize, char* const port, size_t portsize)
+{
+    const char* const colon = (const char*)memrchr(address,':',length);
+    const char* const bracket = (const char*)memchr(address,']',length);
+    size_t hostlength = length;
+    if (colon != NULL && (bracket == NULL || colon > bracket)) hostlength = (size_t)(colon-address);
+
+    const int hascolon = hostlength < length;
+    port[0] = '\0';
+    if (hascolon) {
+        const size_t portlength = length-hostlength-1;
+        if (portlength >= portsize) return -1;
+        memcpy(port,colon+1,portlength);
+        port[portlength] = '\0';
+    }
+    const char* h = address;
+    if (hostlength >= 2 && h[0] == '[' && h[hostlength-1] == ']') {
+        ++h;
+        hostlength -= 2;
+    }
+    if (hostlength >= hostsize) return -1;
+    memcpy(host,h,hostlength);
+    host[hostlength] = '\0';
+    return hascolon;
+}
+
+// Sends and receives on fd give up after seconds
+static void setSocketTimeout(int fd, double seconds) {
+    struct timeval tv;
+    tv.tv_sec = (time_t)seconds;
+    tv.tv_usec = (suseconds_t)((seconds-(double)tv.tv_sec)*1e6);
+    setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+    setsockopt(fd,SOL_SOCKET,SO_SNDTIMEO,&tv,sizeof(tv));
+}
+
+/* ----
+ *  Worker
+ ---- */
+
+/*
+ * One coordinator's session on fd, from HELLO to QUIT; nonzero if it broke
+ * off before QUIT
+ */
+static int serveCoordinator(int fd, unsigned int numthreads) {
+    ShardHeader header;
+    if (recvHeader(fd,&header) || header.type != SHARD_HELLO) {
+        record(1,"Shard coordinator didn't open with HELLO\n");
+        return 1;
+    }
+    if (header.length > SHARD_MAX_SCENARIO_BYTES) {
+        record(1,"Shard coordinator's scenario of %u bytes is over the %u allowed\n",
+               header.length,SHARD_MAX_SCENARIO_BYTES);
+        return 1;
+    }
+    char* const scenario = (char*)malloc(header.length > 0 ? header.length : 1);
+    if (scenario == NULL || recvAll(fd,scenario,header.length)) {
+        record(1,"Failed to receive the scenario from the shard coordinator\n");
+        free(scenario);
+        return 1;
+    }
+
+    FieldInfoMap fim;
+    FieldDataMap fdm;
+    CpuFieldEngine* engine = NULL;
+    memset(&fim,0,sizeof(fim));
+    memset(&fdm,0,sizeof(fdm));
+    int failed = initFieldInfoMapHost(&fim) || initFieldDataMapHost(&fdm);
+    if (!failed) failed = loadFieldInfoData(scenario,header.length,&fim,&fdm);
+    free(scenario);
+    // Tiles are parts of this
+    const GLuint fieldsize[2] = { fim.fieldsize != NULL ? fim.fieldsize[0] : 0,
+                                  fim.fieldsize != NULL ? fim.fieldsize[1] : 0 };
+    if (!failed) {
+        engine = createCpuFieldEngine(numthreads);
+        if (engine == NULL) {
+            record(1,"Failed to create CPU field engine\n");
+            failed = 1;
+        }
+    }
+
+    ShardReady ready;
+    ready.status = failed;
+    ready.threads = engine != NULL ? cpuFieldThreads(engine) : 0;
+    if (sendMessage(fd,SHARD_READY,&ready,sizeof(ready),NULL,0)) failed = 1;
+
+    GLfloat* field = NULL;
+    size_t capacity = 0;
+    int tiles = 0;
+    while (!failed) {
+        if (recvHeader(fd,&header)) {
+            record(1,"Shard coordinator went away without QUIT\n");
+            failed = 1;
+            break;
+        }
+        if (header.type == SHARD_QUIT) break;
+
+        ShardTask task;
+        if (header.type != SHARD_TASK || header.length != sizeof(task) ||
+                recvAll(fd,&task,sizeof(task))) {
+            record(1,"Unexpected shard message of type %u\n",header.type);
+            failed = 1;
+            break;
+        }
+        if (task.size[0] > fieldsize[0] || task.size[1] > fieldsize[1]) {
+            record(1,"Shard task of %ux%u is larger than the %ux%u field\n",
+                   task.size[0],task.size[1],fieldsize[0],fieldsize[1]);
+            failed = 1;
+            break;
+        }
+
+        const size_t n = (size_t)task.size[0]*task.size[1];
+        if (n > capacity) {
+            free(field);
+            field = (GLfloat*)malloc(sizeof(GLfloat)*2*n);
+            capacity = field != NULL ? n : 0;
+        }
+
+        fim.fieldoffset[0] = task.offset[0];
+        fim.fieldoffset[1] = task.offset[1];
+        fim.fielddims[0] = task.dims[0];
+        fim.fielddims[1] = task.dims[1];
+        fim.fieldsize[0] = task.size[0];
+        fim.fieldsize[1] = task.size[1];
+        *(fdm.written) = task.written;
+
+        ShardResult result;
+        memset(&result,0,sizeof(result));
+        result.tile = task.tile;
+        result.status = n > capacity || computeFieldCpu(engine,&fim,&fdm,field);
+        if (result.status == 0) {
+            result.stats.min = *(fdm.field_min);
+            result.stats.max = *(fdm.field_max);
+            result.stats.mean = *(fdm.field_mean);
+            result.stats.rms = *(fdm.field_rms);
+        }
+        if (sendMessage(fd,SHARD_RESULT,&result,sizeof(result),
+                        field,result.status == 0 ? sizeof(GLfloat)*2*n : 0)) failed = 1;
+        ++tiles;
+    }
+
+    record(0,"Shard worker %d evaluated %d tiles\n",(int)getpid(),tiles);
+    destroyCpuFieldEngine(engine);
+    free(field);
+    free(fdm.block_start);
+    freeFieldInfoMap(&fim);
+    return failed;
+}
+
+int serveShards(const char* const address, unsigned int numthreads) {
+    char host[256], port[16];
+    int split = splitAddress(address,strlen(address),host,sizeof(host),port,sizeof(port));
+    // A port alone
+    if (split == 0) {
+        if (strlen(host) >= sizeof(port)) split = -1;
+        else strcpy(port,host);
+        host[0] = '\0';
+    }
+    if (split < 0 || port[0] == '\0') {
+        record(1,"Can't serve shards on \"%s\"; expected [host:]port\n",address);
+        return 1;
+    }
+
+    struct addrinfo hints, *addresses, *a;
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if (getaddrinfo(host[0] != '\0' ? host : NULL,port,&hints,&addresses) != 0) {
+        record(1,"Can't serve shards on %s\n",address);
+        return 1;
+    }
+
+    int fd = -1;
+    for (a=addresses; a!=NULL && fd<0; a=a->ai_next) {
+        fd = socket(a->ai_family,a->ai_socktype,a->ai_protocol);
+        if (fd < 0) continue;
+        const int on = 1;
+        setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
+        if (bind(fd,a->ai_addr,a->ai_addrlen) != 0 || listen(fd,SOMAXCONN) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) {
+        record(1,"Failed to listen on %s\n",address);
+        return 1;
+    }
+
+    if (host[0] == '\0') {
+        record(1,"Serving shards on port %s of every interface, to whoever connects\n",port);
+    } else {
+        record(0,"Serving shards on %s\n",address);
+    }
+    for (;;) {
+        const int conn = accept(fd,NULL,NULL);
+        if (conn < 0) {
+            if (errno == EINTR) continue;
+            record(1,"Failed to accept a shard coordinator\n");
+            break;
+        }
+        const int on = 1;
+        setsockopt(conn,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+        record(0,"Shard coordinator connected\n");
+        if (serveCoordinator(conn,numthreads)) record(1,"Shard session ended early\n");
+        close(conn);
+    }
+
+    close(fd);
+    return 1;
+}
+
+/* ----
+ *  Workers from the coordinator's side
+ ---- */
+
+/*
+ * Local worker i of n takes the i'th contiguous share of the online
+ * processors. Neighbouring processor numbers usually share a package, so
+ * each worker's threads, and the memory they first touch, stay on one node
+ * where there are several. Returns how many processors that is.
+ */
+static unsigned int pinLocalWorker(int i, int n) {
+    const long online = sysconf(_SC_NPROCESSORS_ONLN);
+    const int cpus = online > 0 ? (int)online : 1;
+    int first = i%cpus, count = 1;
+    if (n < cpus) {
+        first = (int)((long)i*cpus/n);
+        count = (int)((long)(i+1)*cpus/n)-first;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    int c;
+    for (c=first; c<first+count; ++c) CPU_SET(c,&set);
+    if (sched_setaffinity(0,sizeof(set),&set) != 0) {
+        record(1,"Couldn't pin local worker %d to processors %d-%d\n",i,first,first+count-1);
+    } else {
+        record(0,"Local worker %d on processors %d-%d\n",i,first,first+count-1);
+    }
+    return (unsigned int)count;
+}
+
+// Forks up to n local workers into workers; how many it managed
+static int startLocalWorkers(ShardWorker* const workers, int n, double timeout) {
+    int i,j;
+    for (i=0; i<n; ++i) {
+        int pair[2];
+        if (socketpair(AF_UNIX,SOCK_STREAM,0,pair) != 0) {
+            record(1,"Failed to create a socket pair for local worker %d\n",i);
+            return i;
+        }
+
+        const pid_t pid = fork();
+        if (pid < 0) {
+            record(1,"Failed to fork local worker %d\n",i);
+            close(pair[0]);
+            close(pair[1]);
+            return i;
+        }
+        if (pid == 0) {
+            // Only its own end, so the others see the coordinator go
+            close(pair[0]);
+            for (j=0; j<i; ++j) close(workers[j].fd);
+            _exit(serveCoordinator(pair[1],pinLocalWorker(i,n)));
+        }
+
+        close(pair[1]);
+        setSocketTimeout(pair[0],timeout);
+        workers[i].fd = pair[0];
+        workers[i].pid = pid;
+        workers[i].tile = -1;
+        snprintf(workers[i].name,sizeof(workers[i].name),"local worker %d",i);
+    }
+    return n;
+}
+
+// host:port, [host]:port or host alone for SHARD_DEFAULT_PORT; -1 if it can't
+static int connectWorker(const char* const address, size_t length, double timeout) {
+    char host[256], port[16];
+    const int split = splitAddress(address,length,host,sizeof(host),port,sizeof(port));
+    if (split < 0 || host[0] == '\0' || (split && port[0] == '\0')) return -1;
+    if (!split) strcpy(port,SHARD_DEFAULT_PORT);
+
+    struct addrinfo hints, *addresses, *a;
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host,port,&hints,&addresses) != 0) return -1;
+
+    int fd = -1;
+    for (a=addresses; a!=NULL && fd<0; a=a->ai_next) {
+        fd = socket(a->ai_family,a->ai_socktype,a->ai_protocol);
+        if (fd >= 0 && connect(fd,a->ai_addr,a->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+
+    if (fd >= 0) {
+        const int on = 1;
+        setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on));
+        setSocketTimeout(fd,timeout);
+    }
+    return fd;
+}
+
+// Its tile goes back on the queue; a local one is stopped, as it may be hung
+static void dropWorker(ShardWorker* const worker, char* const state, int* const next) {
+    if (worker->tile >= 0) {
+        record(1,"Lost %s; handing tile %d to another\n",worker->name,worker->tile);
+        state[worker->tile] = TILE_TODO;
+        if (worker->tile < *next) *next = worker->tile;
+    } else {
+        record(1,"Lost %s\n",worker->name);
+    }
+    close(worker->fd);
+    if (worker->pid > 0) kill(worker->pid,SIGKILL);
+    worker->fd = -1;
+    worker->tile = -1;
+}
+
+static int countWorkers(const ShardWorker* const workers, int numworkers) {
+    int alive = 0, i;
+    for (i=0; i<numworkers; ++i) alive += workers[i].fd >= 0;
+    return alive;
+}
+
+/* ----
+ *  Coordinator
+ ---- */
+
+/*
+ * Every tile through whichever workers are left, dropping any that hold a
+ * tile for longer than timeout seconds; nonzero if a tile failed to evaluate
+ * or to be written, or the workers ran out first
+ */
+static int runShards(ShardWorker* const workers, int numworkers, TiledOutput* const out,
+                     double timeout)
+{
+    const int total = numTiles(out);
+    char* const state = (char*)calloc(total > 0 ? total : 1,1);
+    GLfloat* const tile = (GLfloat*)malloc(sizeof(GLfloat)*2*(size_t)out->tilesize*out->tilesize);
+    struct pollfd* const fds = (struct pollfd*)malloc(sizeof(struct pollfd)*numworkers);
+    int* const polled = (int*)malloc(sizeof(int)*numworkers);
+    if (state == NULL || tile == NULL || fds == NULL || polled == NULL) {
+        record(1,"Failed to allocate %ux%u tile\n",out->tilesize,out->tilesize);
+        free(state);
+        free(tile);
+        free(fds);
+        free(polled);
+        return 1;
+    }
+
+    int failed = 0, done = 0, next = 0, i;
+    while (!failed && done < total) {
+        for (i=0; i<numworkers; ++i) {
+            ShardWorker* const w = workers+i;
+            if (w->fd < 0 || w->tile >= 0) continue;
+            while (next < total && state[next] != TILE_TODO) ++next;
+            if (next >= total) break;
+
+            TileExtent extent;
+            tileExtent(out,next,&extent);
+            ShardTask task;
+            task.tile = next;
+            task.offset[0] = extent.offset[0];
+            task.offset[1] = extent.offset[1];
+            task.dims[0] = extent.dims[0];
+            task.dims[1] = extent.dims[1];
+            task.size[0] = extent.size[0];
+            task.size[1] = extent.size[1];
+            task.written = out->written != 2 ? 0 : 2;
+            if (sendMessage(w->fd,SHARD_TASK,&task,sizeof(task),NULL,0)) {
+                dropWorker(w,state,&next);
+                continue;
+            }
+            state[next] = TILE_OUT;
+            w->tile = next;
+            w->sent = wallClock();
+        }
+
+        if (countWorkers(workers,numworkers) == 0) {
+            record(1,"No shard workers left with %d of %d tiles to go\n",total-done,total);
+            failed = 1;
+            break;
+        }
+
+        // Until the earliest outstanding tile is due
+        const double now = wallClock();
+        double wait = timeout;
+        int numfds = 0;
+        for (i=0; i<numworkers; ++i) {
+            if (workers[i].fd < 0 || workers[i].tile < 0) continue;
+            fds[numfds].fd = workers[i].fd;
+            fds[numfds].events = POLLIN;
+            fds[numfds].revents = 0;
+            polled[numfds++] = i;
+            if (workers[i].sent+timeout-now < wait) wait = workers[i].sent+timeout-now;
+        }
+        const double ms = wait > 0 ? wait*1000+1 : 0;
+        const int ready = poll(fds,numfds,ms < INT_MAX ? (int)ms : INT_MAX);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            record(1,"Failed to wait for shard workers\n");
+            failed = 1;
+            break;
+        }
+
+        int f;
+        for (f=0; f<numfds && !failed; ++f) {
+            ShardWorker* const w = workers+polled[f];
+            if (fds[f].revents == 0) {
+                if (wallClock()-w->sent >= timeout) {
+                    record(1,"%s took over %.0fs on tile %d\n",w->name,timeout,w->tile);
+                    dropWorker(w,state,&next);
+                }
+                continue;
+            }
+
+            TileExtent extent;
+            tileExtent(out,w->tile,&extent);
+            const size_t bytes = sizeof(GLfloat)*2*(size_t)extent.size[0]*extent.size[1];
+            ShardHeader header;
+            ShardResult result;
+            if (recvHeader(w->fd,&header) || header.type != SHARD_RESULT ||
+                    header.length < sizeof(result) || recvAll(w->fd,&result,sizeof(result)) ||
+                    result.tile != w->tile ||
+                    header.length != sizeof(result)+(result.status == 0 ? bytes : 0) ||
+                    (result.status == 0 && recvAll(w->fd,tile,bytes))) {
+                dropWorker(w,state,&next);
+                continue;
+            }
+            if (result.status != 0) {
+                record(1,"%s failed to evaluate tile %d\n",w->name,result.tile);
+                failed = 1;
+                break;
+            }
+
+            failed = placeTile(out,result.tile,tile,&result.stats);
+            state[result.tile] = TILE_DONE;
+            w->tile = -1;
+            ++w->tiles;
+            ++done;
+            record(0,"> Tile %u,%u: %ux%u at %u,%u from %s\n",
+                   result.tile%out->tilesx,result.tile/out->tilesx,extent.size[0],extent.size[1],
+                   extent.origin[0],extent.origin[1],w->name);
+        }
+    }
+
+    free(state);
+    free(tile);
+    free(fds);
+    free(polled);
+    return failed;
+}
+
+int runSharded(const char* const infile, const char* const outfile,
+               const ShardOptions* const options)
+{
+    int failed;
+    size_t size;
+    const void* const scenario = mapFile(infile,&size,&failed);
+    if (failed) {
+        record(1,"Failed to load input file %s\n",infile);
+        return 1;
+    }
+    if (size > SHARD_MAX_SCENARIO_BYTES) {
+        record(1,"%s is over the %u bytes a shard worker takes\n",infile,
+               SHARD_MAX_SCENARIO_BYTES);
+        unmapFile(scenario,size);
+        return 1;
+    }
+    const double timeout = options->timeout > 0 ? options->timeout : SHARD_DEFAULT_TIMEOUT;
+
+    int maxworkers = options->localworkers > 0 ? options->localworkers : 0;
+    const char* c;
+    if (options->remoteworkers != NULL) {
+        ++maxworkers;
+        for (c=options->remoteworkers; *c!='\0'; ++c) maxworkers += *c == ',';
+    }
+    ShardWorker* const workers = (ShardWorker*)calloc(maxworkers > 0 ? maxworkers : 1,
+                                                      sizeof(ShardWorker));
+    if (workers == NULL) {
+        record(1,"Failed to allocate shard workers\n");
+        unmapFile(scenario,size);
+        return 1;
+    }
+
+    // Forked first, while this process has no threads and nothing else open
+    int numworkers = 0;
+    if (options->localworkers > 0) numworkers = startLocalWorkers(workers,options->localworkers,timeout);
+
+    FieldInfoMap fim;
+    FieldDataMap fdm;
+    memset(&fim,0,sizeof(fim));
+    memset(&fdm,0,sizeof(fdm));
+    failed = initFieldInfoMapHost(&fim) || initFieldDataMapHost(&fdm);
+    if (!failed && loadFieldInfoData(scenario,size,&fim,&fdm)) {
+        record(1,"Failed to load input file %s\n",infile);
+        failed = 1;
+    }
+
+    if (!failed && options->remoteworkers != NULL) {
+        const char* start = options->remoteworkers;
+        while (*start != '\0') {
+            const char* const end = strchr(start,',') != NULL ? strchr(start,',') : start+strlen(start);
+            const size_t length = (size_t)(end-start);
+            if (length > 0) {
+                ShardWorker* const w = workers+numworkers;
+                snprintf(w->name,sizeof(w->name),"%.*s",(int)length,start);
+                w->tile = -1;
+                w->fd = connectWorker(start,length,timeout);
+                if (w->fd < 0) record(1,"Couldn't reach shard worker %s\n",w->name);
+                else ++numworkers;
+            }
+            start = *end == ',' ? end+1 : end;
+        }
+    }
+
+    // Every worker parses the scenario at once
+    int i;
+    for (i=0; i<numworkers && !failed; ++i) {
+        if (sendMessage(workers[i].fd,SHARD_HELLO,scenario,size,NULL,0)) {
+            record(1,"Failed to send the scenario to %s\n",workers[i].name);
+            close(workers[i].fd);
+            workers[i].fd = -1;
+        }
+    }
+    unsigned int threads = 0;
+    for (i=0; i<numworkers && !failed; ++i) {
+        if (workers[i].fd < 0) continue;
+        ShardHeader header;
+        ShardReady ready;
+        if (recvHeader(workers[i].fd,&header) || header.type != SHARD_READY ||
+                header.length != sizeof(ready) || recvAll(workers[i].fd,&ready,sizeof(ready)) ||
+                ready.status != 0) {
+            record(1,"%s couldn't take the scenario\n",workers[i].name);
+            close(workers[i].fd);
+            workers[i].fd = -1;
+            continue;
+        }
+        threads += ready.threads;
+    }
+
+    if (!failed && countWorkers(workers,numworkers) == 0) {
+        record(1,"No shard workers to run on\n");
+        failed = 1;
+    }
+
+    TiledOutput out;
+    if (!failed) failed = openTiledOutput(&out,&fim,&fdm,options->tilesize,outfile);
+    if (!failed) {
+        record(0,"Sharding %d tiles over %d workers with %u threads in all\n",
+               numTiles(&out),countWorkers(workers,numworkers),threads);
+        failed = runShards(workers,numworkers,&out,timeout);
+        failed = closeTiledOutput(&out,&fim,&fdm,options->mapfile,failed);
+    }
+    if (!failed) {
+        record(0,"Field min %f, max %f, mean %f, rms %f\n",
+               *(fdm.field_min),*(fdm.field_max),*(fdm.field_mean),*(fdm.field_rms));
+    }
+
+    for (i=0; i<numworkers; ++i) {
+        if (workers[i].fd >= 0) {
+            sendMessage(workers[i].fd,SHARD_QUIT,NULL,0,NULL,0);
+            close(workers[i].fd);
+            record(0,"%s took %d tiles\n",workers[i].name,workers[i].tiles);
+        }
+        int status;
+        if (workers[i].pid > 0 && waitpid(workers[i].pid,&status,0) == workers[i].pid &&
+                !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+            record(1,"%s exited abnormally\n",workers[i].name);
+        }
+    }
+
+    free(workers);
+    free(fdm.block_start);
+    freeFieldInfoMap(&fim);
+    unmapFile(scenario,size);
+    return failed;
+}
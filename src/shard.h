@@ -0,0 +1,88 @@
+// Tiled runs spread over worker processes. The coordinator cuts the field
+// into tiles exactly as runTiled does (tiled.h) and hands them out one at a
+// time to whichever worker is free; each worker evaluates its tiles on the
+// CPU as fields in their own right and sends back the samples and FieldData,
+// which the coordinator places into the output file and combines into the
+// whole field's range, mean and RMS. The file is the one runTiled writes with
+// the CPU engine, byte for byte, whichever worker took which tile.
+//
+// Workers are local, forked before the coordinator sets anything else up and
+// talking over a socketpair, each pinned to its own contiguous share of the
+// processors with that many engine threads; or remote, another machine
+// running serveShards, over TCP. A worker that goes away, or takes longer
+// than the timeout over a message, has its tile handed to another; the run
+// fails only once there are none left. serveShards trusts whoever connects:
+// give it an address to bind to rather than every interface where the
+// network isn't private.
+//
+// Protocol: every message is a ShardHeader then length bytes of payload, all
+// in the sender's byte order, which has to be the receiver's too.
+//   HELLO   the scenario's input file, as loadFieldInfoData takes it, at
+//           most SHARD_MAX_SCENARIO_BYTES
+//   READY   ShardReady
+//   TASK    ShardTask, no larger than the scenario's Field-Size
+//   RESULT  ShardResult, then size[0]*size[1] (re,im) GLfloat pairs, rows in
+//           y, if status is 0
+//   QUIT    nothing; the worker closes its end
+// The coordinator sends HELLO and waits for READY, then keeps one TASK
+// outstanding per worker until every tile is in, then sends QUIT.
+#define SHARD_MAGIC "ASHD"
+#define SHARD_VERSION 1
+#define SHARD_BYTE_ORDER 0x01020304
+#define SHARD_DEFAULT_PORT "7077"
+#define SHARD_MAX_SCENARIO_BYTES (1u<<30)
+// Seconds a worker gets for a message, a tile's RESULT included
+#define SHARD_DEFAULT_TIMEOUT 600.0
+
+enum {
+    SHARD_HELLO,
+    SHARD_READY,
+    SHARD_TASK,
+    SHARD_RESULT,
+    SHARD_QUIT
+};
+
+typedef struct {
+    char magic[4];
+    GLuint version;
+    GLuint byteorder;
+    GLuint type;
+    GLuint length;
+} ShardHeader;
+
+typedef struct {
+    GLint status;
+    GLuint threads;
+} ShardReady;
+
+typedef struct {
+    GLint tile;
+    GLfloat offset[2];
+    GLfloat dims[2];
+    GLuint size[2];
+    GLint written;
+} ShardTask;
+
+typedef struct {
+    GLint tile;
+    GLint status;
+    TileStats stats;
+} ShardResult;
+
+typedef struct {
+    int localworkers;
+    // "host:port,host:port,..." of serveShards processes, or NULL
+    const char* remoteworkers;
+    // 0 for TILED_DEFAULT_SIZE
+    GLuint tilesize;
+    const char* mapfile;
+    // Seconds, 0 for SHARD_DEFAULT_TIMEOUT
+    double timeout;
+} ShardOptions;
+
+int runSharded(const char* const infile, const char* const outfile,
+               const ShardOptions* const options);
+// Serve coordinators on address, one after another, until killed; each gets
+// numthreads engine threads, 0 for one per online processor. address is
+// host:port, [host]:port, or a port alone for every interface.
+int serveShards(const char* const address, unsigned int numthreads);
@@ -0,0 +1,199 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <GL/gl.h>
+
+#include "common.h"
+#include "fim.h"
+#include "field-file.h"
+#include "sweep.h"
+
+int parseSweepAxis(const char* const spec, Sweep* const sweep) {
+    if (sweep->numaxes >= MAX_SWEEP_AXES) {
+        record(1,"Too many sweep axes (at most %d)\n",MAX_SWEEP_AXES);
+        return 1;
+    }
+
+    SweepAxis* const axis = sweep->axes+sweep->numaxes;
+    char blockname[64], index[16];
+
+    if (sscanf(spec,"%63[^:]:%15[^:]:%f:%f:%d",
+               blockname,index,&axis->start,&axis->stop,&axis->steps) != 5 ||
+            axis->steps < 1) {
+        record(1,"Malformed sweep \"%s\"; expected Block:Index:Start:Stop:Steps\n",spec);
+        return 1;
+    }
+
+    if (strcmp("Material-C",blockname) == 0) {
+        axis->block = SWEEP_MATERIAL_C;
+    } else if (strcmp("PointSource-Phase",blockname) == 0) {
+        axis->block = SWEEP_PS_PHASE;
+    } else if (strcmp("PointSource-Frequency",blockname) == 0) {
+        axis->block = SWEEP_PS_FREQUENCY;
+    } else if (strcmp("PointSource-PhaseStep",blockname) == 0) {
+        axis->block = SWEEP_PS_PHASE_STEP;
+    } else {
+        record(1,"\"%s\" cannot be swept\n",blockname);
+        return 1;
+    }
+
+    if (strcmp(index,"*") == 0) {
+        axis->index = -1;
+    } else if (sscanf(index,"%d",&axis->index) != 1 || axis->index < 0) {
+        record(1,"Bad sweep source index \"%s\"\n",index);
+        return 1;
+    }
+
+    // Variants are numbered with an int
+    if ((long long)sweepVariants(sweep)*axis->steps > INT_MAX) {
+        record(1,"Sweep \"%s\" takes the sweep past %d variants\n",spec,INT_MAX);
+        return 1;
+    }
+
+    record(0,"Sweep axis %d: %s[%s] from %f to %f in %d steps\n",sweep->numaxes,
+           blockname,index,axis->start,axis->stop,axis->steps);
+    ++sweep->numaxes;
+    return 0;
+}
+
+int sweepVariants(const Sweep* const sweep) {
+    long long n = 1;
+    int i;
+    for (i=0; i<sweep->numaxes && n <= INT_MAX; ++i) n *= sweep->axes[i].steps;
+    return n <= INT_MAX ? (int)n : -1;
+}
+
+int sweepDrivesOnly(const Sweep* const sweep) {
+    int a;
+    for (a=0; a<sweep->numaxes; ++a) {
+        if (sweep->axes[a].block != SWEEP_PS_PHASE &&
+            sweep->axes[a].block != SWEEP_PS_PHASE_STEP) return 0;
+    }
+    return 1;
+}
+
+void applySweepVariant(const Sweep* const sweep, int variant,
+                       FieldInfoMap* const fim, FieldDataMap* const fdm)
+{
+    const int psn = *(fim->psn);
+
+    *(fim->mat_c) = sweep->base_mat_c;
+    memcpy(fim->ps_freq,sweep->base_ps_freq,sizeof(GLfloat)*psn);
+    memcpy(fim->ps_phase,sweep->base_ps_phase,sizeof(GLfloat)*psn);
+
+    int a,i;
+    for (a=sweep->numaxes-1; a>=0; --a) {
+        const SweepAxis* const axis = sweep->axes+a;
+        const int step = variant % axis->steps;
+        variant /= axis->steps;
+
+        const GLfloat value = axis->steps > 1 ?
+            axis->start+(axis->stop-axis->start)*step/(GLfloat)(axis->steps-1) :
+            axis->start;
+
+        const int first = axis->index < 0 ? 0 : axis->index;
+        const int last = axis->index < 0 ? psn : axis->index+1;
+
+        switch (axis->block) {
+        case SWEEP_MATERIAL_C:
+            *(fim->mat_c) = value;
+            break;
+        case SWEEP_PS_PHASE:
+            for (i=first; i<last; ++i) fim->ps_phase[i] = value;
+            break;
+        case SWEEP_PS_FREQUENCY:
+            for (i=first; i<last; ++i) fim->ps_freq[i] = value;
+            break;
+        case SWEEP_PS_PHASE_STEP:
+            for (i=first; i<last; ++i) fim->ps_phase[i] += i*value;
+            break;
+        }
+    }
+
+    // Let the evaluation rescan min/max unless the file pinned them
+    if (sweep->base_written != 2) *(fdm->written) = 0;
+}
+
+int beginSweep(Sweep* const sweep, const FieldInfoMap* const fim,
+               const FieldDataMap* const fdm)
+{
+    const int psn = *(fim->psn);
+
+    int a;
+    for (a=0; a<sweep->numaxes; ++a) {
+        if (sweep->axes[a].index >= psn) {
+            record(1,"Sweep axis %d refers to source %d but there are only %d\n",
+                   a,sweep->axes[a].index,psn);
+            return 1;
+        }
+    }
+
+    GLfloat* const base = (GLfloat*)malloc(sizeof(GLfloat)*2*(psn > 0 ? psn : 1));
+    if (base == NULL) {
+        record(1,"Failed to allocate sweep buffers\n");
+        return 1;
+    }
+
+    sweep->base_mat_c = *(fim->mat_c);
+    sweep->base_ps_freq = base;
+    sweep->base_ps_phase = base+psn;
+    memcpy(sweep->base_ps_freq,fim->ps_freq,sizeof(GLfloat)*psn);
+    memcpy(sweep->base_ps_phase,fim->ps_phase,sizeof(GLfloat)*psn);
+    sweep->base_written = *(fdm->written);
+    return 0;
+}
+
+void endSweep(Sweep* const sweep) {
+    free(sweep->base_ps_freq);
+    sweep->base_ps_freq = NULL;
+    sweep->base_ps_phase = NULL;
+}
+
+int runSweep(Sweep* const sweep, FieldInfoMap* const fim, FieldDataMap* const fdm,
+             SweepEvalFunc eval, void* arg, const char* const outfile)
+{
+    const int numvariants = sweepVariants(sweep);
+    const size_t fieldlength = 2*(size_t)fim->fieldsize[0]*fim->fieldsize[1];
+
+    GLfloat* const field = (GLfloat*)malloc(sizeof(GLfloat)*fieldlength);
+    if (field == NULL) {
+        record(1,"Failed to allocate sweep buffers\n");
+        return 1;
+    }
+
+    FILE* fp = fopen(outfile,"wb");
+    if (fp == NULL) {
+        record(1,"Failed to open output file %s\n",outfile);
+        free(field);
+        return 1;
+    }
+
+    if (numvariants < 0 || beginSweep(sweep,fim,fdm)) {
+        fclose(fp);
+        free(field);
+        return 1;
+    }
+
+    record(0,"Sweeping %d variants of a %ux%u field into %s\n",numvariants,
+           fim->fieldsize[0],fim->fieldsize[1],outfile);
+
+    const double start = wallClock();
+    int failed = 0;
+    int variant;
+    for (variant=0; variant<numvariants && !failed; ++variant) {
+        applySweepVariant(sweep,variant,fim,fdm);
+
+        failed = eval(arg,fim,fdm,field) || writeFieldRecord(fp,fim,fdm,field);
+        record(0,"> Variant %d: min %f, max %f, mean %f, rms %f\n",variant,
+               *(fdm->field_min),*(fdm->field_max),*(fdm->field_mean),*(fdm->field_rms));
+    }
+
+    if (fclose(fp) != 0) failed = 1;
+    if (failed) record(1,"Sweep stopped at variant %d\n",variant-1);
+    else record(0,"Swept %d variants in %.2fs\n",numvariants,wallClock()-start);
+
+    free(field);
+    endSweep(sweep);
+    return failed;
+}
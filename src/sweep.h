@@ -0,0 +1,58 @@
+// Parameter sweeps: every combination of the axes' values is applied to a
+// base FieldInfoMap in turn, evaluated by a caller-supplied function and the
+// results streamed to one file of consecutive field records. Axes are given
+// on the command line as
+//
+//     Block:Index:Start:Stop:Steps
+//
+// where Block is Material-C, PointSource-Phase, PointSource-Frequency or
+// PointSource-PhaseStep (phase[i] = base phase[i] + i*value, i.e. a linear
+// steering gradient) and Index is a source index or * for all sources. The
+// first axis given varies slowest.
+#define MAX_SWEEP_AXES 8
+
+enum {
+    SWEEP_MATERIAL_C,
+    SWEEP_PS_PHASE,
+    SWEEP_PS_FREQUENCY,
+    SWEEP_PS_PHASE_STEP
+};
+
+typedef struct {
+    int block;
+    int index;
+    GLfloat start;
+    GLfloat stop;
+    int steps;
+} SweepAxis;
+
+typedef struct {
+    int numaxes;
+    SweepAxis axes[MAX_SWEEP_AXES];
+
+    GLfloat base_mat_c;
+    GLfloat* base_ps_freq;
+    GLfloat* base_ps_phase;
+    GLint base_written;
+} Sweep;
+
+// Evaluates fim into field (fieldsize[0]*fieldsize[1] (re,im) pairs) and
+// updates fdm the way the compute shader would; returns nonzero on failure
+typedef int (*SweepEvalFunc)(void* arg, const FieldInfoMap* const fim,
+                             FieldDataMap* const fdm, GLfloat* const field);
+
+int parseSweepAxis(const char* const spec, Sweep* const sweep);
+// At most INT_MAX, which parseSweepAxis makes sure of; -1 past it
+int sweepVariants(const Sweep* const sweep);
+// Nonzero when only source phases vary, i.e. the propagation from every
+// source to every sample is the same for all variants
+int sweepDrivesOnly(const Sweep* const sweep);
+
+// Snapshot the base values the axes are applied to; endSweep releases them
+int beginSweep(Sweep* const sweep, const FieldInfoMap* const fim,
+               const FieldDataMap* const fdm);
+void endSweep(Sweep* const sweep);
+void applySweepVariant(const Sweep* const sweep, int variant,
+                       FieldInfoMap* const fim, FieldDataMap* const fdm);
+int runSweep(Sweep* const sweep, FieldInfoMap* const fim, FieldDataMap* const fdm,
+             SweepEvalFunc eval, void* arg, const char* const outfile);
@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <GL/gl.h>
+
+#include "common.h"
+#include "fim.h"
+#include "field-file.h"
+#include "sweep.h"
+#include "tiled.h"
+
+/*
+ * Second pass: |field| scaled from [field_min,field_max] to [0,65535], a band
+ * of rows at a time, from whichever format the field was stored in
+ */
+static int writeNormalisedMap(int fd, int format, GLuint width, GLuint height, size_t bandpixels,
+                              const FieldDataMap* const fdm, const char* const mapfile)
+{
+    if (width == 0 || height == 0) {
+        record(1,"Field is empty; no normalised map written to %s\n",mapfile);
+        return 0;
+    }
+
+    const size_t bandrows = bandpixels/width > 0 ? bandpixels/width : 1;
+    const size_t rowbytes = fieldRowBytes(format,width);
+    unsigned char* const band = (unsigned char*)malloc(rowbytes*bandrows);
+    GLfloat* const mag = (GLfloat*)malloc(sizeof(GLfloat)*width*bandrows);
+    unsigned char* const out = (unsigned char*)malloc(2*(size_t)width*bandrows);
+    FILE* fp = fopen(mapfile,"wb");
+    if (band == NULL || mag == NULL || out == NULL || fp == NULL) {
+        record(1,"Failed to set up normalised map %s\n",mapfile);
+        free(band);
+        free(mag);
+        free(out);
+        if (fp != NULL) fclose(fp);
+        return 1;
+    }
+
+    const GLfloat fmin = *(fdm->field_min);
+    const GLfloat range = *(fdm->field_max)-fmin > 0 ? *(fdm->field_max)-fmin : 1;
+
+    int failed = fprintf(fp,"P5\n%u %u\n65535\n",width,height) < 0;
+    GLuint y;
+    for (y=0; y<height && !failed; y+=bandrows) {
+        const size_t rows = y+bandrows > height ? height-y : bandrows;
+        const size_t pixels = rows*width;
+        failed = readFileAt(fd,band,rowbytes*rows,sizeof(FieldFileHeader)+(off_t)rowbytes*y);
+        if (!failed) decodeFieldMagnitude(format,band,width,rows,mag);
+
+        size_t i;
+        for (i=0; i<pixels && !failed; ++i) {
+            GLfloat v = (mag[i]-fmin)/range;
+            v = v > 0 ? (v < 1 ? v : 1) : 0; // NaN at a source comes out as 0
+            const unsigned int q = (unsigned int)(v*65535.0f+0.5f);
+            out[2*i] = q >> 8; // PGM wants big-endian
+            out[2*i+1] = q & 0xff;
+        }
+        if (!failed) failed = fwrite(out,2,pixels,fp) != pixels;
+    }
+
+    if (fclose(fp) != 0) failed = 1;
+    if (failed) record(1,"Failed to write normalised map %s\n",mapfile);
+    else record(0,"Wrote normalised map to %s\n",mapfile);
+
+    free(band);
+    free(mag);
+    free(out);
+    return failed;
+}
+
+int openTiledOutput(TiledOutput* const out, const FieldInfoMap* const fim,
+                    const FieldDataMap* const fdm, GLuint tilesize, const char* const outfile)
+{
+    memset(out,0,sizeof(*out));
+    out->outfile = outfile;
+    out->width = fim->fieldsize[0];
+    out->height = fim->fieldsize[1];
+    out->offset[0] = fim->fieldoffset[0];
+    out->offset[1] = fim->fieldoffset[1];
+    out->dims[0] = fim->fielddims[0];
+    out->dims[1] = fim->fielddims[1];
+    out->written = *(fdm->written);
+    out->format = fieldFormat();
+    out->rowbytes = fieldRowBytes(out->format,out->width);
+
+    if (tilesize == 0) tilesize = TILED_DEFAULT_SIZE;
+    // Tiles have to start on a block of the row
+    if (fieldFormatBlocked(out->format) && tilesize%FIELD_FORMAT_BLOCK != 0) {
+        tilesize += FIELD_FORMAT_BLOCK-tilesize%FIELD_FORMAT_BLOCK;
+        record(1,"Tiles rounded up to %u for %s's blocks\n",tilesize,fieldFormatName(out->format));
+    }
+    out->tilesize = tilesize;
+    out->tilesx = (out->width+tilesize-1)/tilesize;
+    out->tilesy = (out->height+tilesize-1)/tilesize;
+    // No tiles at all; the file gets a header and nothing else, as untiled
+    if (out->width == 0 || out->height == 0)
+        record(1,"Field is %ux%u; only a header will be written\n",out->width,out->height);
+
+    out->encoded = (unsigned char*)malloc(fieldRowBytes(out->format,tilesize));
+    out->stats = (TileStats*)malloc(sizeof(TileStats)*(numTiles(out) > 0 ? numTiles(out) : 1));
+    if (out->encoded == NULL || out->stats == NULL) {
+        record(1,"Failed to allocate %ux%u tile\n",tilesize,tilesize);
+        free(out->encoded);
+        free(out->stats);
+        return 1;
+    }
+
+    out->fd = open(outfile,O_RDWR|O_CREAT|O_TRUNC,0644);
+    if (out->fd < 0) {
+        record(1,"Failed to open output file %s\n",outfile);
+        free(out->encoded);
+        free(out->stats);
+        return 1;
+    }
+
+    record(0,"Evaluating %ux%u field as %ux%u tiles of up to %ux%u into %s as %s\n",
+           out->width,out->height,out->tilesx,out->tilesy,tilesize,tilesize,outfile,
+           fieldFormatName(out->format));
+    out->start = wallClock();
+    return 0;
+}
+
+int numTiles(const TiledOutput* const out) {
+    return (int)(out->tilesx*out->tilesy);
+}
+
+void tileExtent(const TiledOutput* const out, int t, TileExtent* const extent) {
+    const GLuint x0 = (t%out->tilesx)*out->tilesize, y0 = (t/out->tilesx)*out->tilesize;
+    const GLuint w = x0+out->tilesize > out->width ? out->width-x0 : out->tilesize;
+    const GLuint h = y0+out->tilesize > out->height ? out->height-y0 : out->tilesize;
+
+    extent->origin[0] = x0;
+    extent->origin[1] = y0;
+    extent->size[0] = w;
+    extent->size[1] = h;
+    extent->offset[0] = out->offset[0]+(GLfloat)x0/(GLfloat)out->width*out->dims[0];
+    extent->offset[1] = out->offset[1]+(GLfloat)y0/(GLfloat)out->height*out->dims[1];
+    extent->dims[0] = (GLfloat)w/(GLfloat)out->width*out->dims[0];
+    extent->dims[1] = (GLfloat)h/(GLfloat)out->height*out->dims[1];
+}
+
+int placeTile(TiledOutput* const out, int t, const GLfloat* const tile,
+              const TileStats* const stats)
+{
+    TileExtent extent;
+    tileExtent(out,t,&extent);
+    const GLuint x0 = extent.origin[0], y0 = extent.origin[1];
+    const GLuint w = extent.size[0], h = extent.size[1];
+
+    GLuint row;
+    for (row=0; row<h; ++row) {
+        const off_t at = sizeof(FieldFileHeader)+(off_t)out->rowbytes*(y0+row)+
+                         fieldRowBytes(out->format,x0);
+        int failed;
+        if (out->format == FIELD_FORMAT_RG32F) {
+            failed = writeFileAt(out->fd,tile+2*(size_t)row*w,sizeof(GLfloat)*2*w,at);
+        } else {
+            encodeFieldRows(out->format,tile+2*(size_t)row*w,w,1,2*(size_t)w,out->encoded);
+            failed = writeFileAt(out->fd,out->encoded,fieldRowBytes(out->format,w),at);
+        }
+        if (failed) return 1;
+    }
+
+    out->stats[t] = *stats;
+    return 0;
+}
+
+int closeTiledOutput(TiledOutput* const out, const FieldInfoMap* const fim,
+                     FieldDataMap* const fdm, const char* const mapfile, int failed)
+{
+    if (!failed && numTiles(out) > 0) {
+        // Tile mean and RMS back to sums so tiles of any size combine, in
+        // tile order whichever order they came in
+        GLfloat min = INFINITY, max = -INFINITY;
+        double sum = 0, sumsq = 0;
+        int t;
+        for (t=0; t<numTiles(out); ++t) {
+            TileExtent extent;
+            tileExtent(out,t,&extent);
+            const TileStats* const s = out->stats+t;
+            const double n = (double)extent.size[0]*extent.size[1];
+            if (s->min < min) min = s->min;
+            if (s->max > max) max = s->max;
+            sum += s->mean*n;
+            sumsq += (double)s->rms*s->rms*n;
+        }
+
+        if (out->written != 2) {
+            *(fdm->written) = 1;
+            *(fdm->field_min) = min;
+            *(fdm->field_max) = max;
+        }
+        *(fdm->field_mean) = sum/((double)out->width*out->height);
+        *(fdm->field_rms) = sqrt(sumsq/((double)out->width*out->height));
+    }
+    if (!failed) {
+        FieldFileHeader header;
+        fillFieldFileHeader(&header,fim,fdm);
+        failed = writeFileAt(out->fd,&header,sizeof(header),0);
+    }
+
+    if (failed) {
+        record(1,"Failed to write tiled field to %s\n",out->outfile);
+    } else {
+        record(0,"Wrote %ux%u field to %s in %.2fs\n",out->width,out->height,out->outfile,
+               wallClock()-out->start);
+        if (mapfile != NULL) {
+            failed = writeNormalisedMap(out->fd,out->format,out->width,out->height,
+                                        (size_t)out->tilesize*out->tilesize,fdm,mapfile);
+        }
+    }
+
+    if (close(out->fd) != 0) failed = 1;
+    free(out->encoded);
+    free(out->stats);
+    return failed;
+}
+
+int runTiled(FieldInfoMap* const fim, FieldDataMap* const fdm,
+             SweepEvalFunc eval, void* arg, GLuint tilesize,
+             const char* const outfile, const char* const mapfile)
+{
+    TiledOutput out;
+    if (openTiledOutput(&out,fim,fdm,tilesize,outfile)) return 1;
+
+    GLfloat* const tile = (GLfloat*)malloc(sizeof(GLfloat)*2*(size_t)out.tilesize*out.tilesize);
+    if (tile == NULL) {
+        record(1,"Failed to allocate %ux%u tile\n",out.tilesize,out.tilesize);
+        return closeTiledOutput(&out,fim,fdm,NULL,1);
+    }
+
+    int failed = 0, t;
+    for (t=0; t<numTiles(&out) && !failed; ++t) {
+        TileExtent extent;
+        tileExtent(&out,t,&extent);
+        fim->fieldoffset[0] = extent.offset[0];
+        fim->fieldoffset[1] = extent.offset[1];
+        fim->fielddims[0] = extent.dims[0];
+        fim->fielddims[1] = extent.dims[1];
+        fim->fieldsize[0] = extent.size[0];
+        fim->fieldsize[1] = extent.size[1];
+        if (out.written != 2) *(fdm->written) = 0;
+
+        failed = eval(arg,fim,fdm,tile);
+        if (failed) break;
+
+        TileStats stats;
+        stats.min = *(fdm->field_min);
+        stats.max = *(fdm->field_max);
+        stats.mean = *(fdm->field_mean);
+        stats.rms = *(fdm->field_rms);
+        failed = placeTile(&out,t,tile,&stats);
+
+        record(0,"> Tile %u,%u: %ux%u at %u,%u\n",t%out.tilesx,t/out.tilesx,
+               extent.size[0],extent.size[1],extent.origin[0],extent.origin[1]);
+    }
+
+    fim->fieldoffset[0] = out.offset[0];
+    fim->fieldoffset[1] = out.offset[1];
+    fim->fielddims[0] = out.dims[0];
+    fim->fielddims[1] = out.dims[1];
+    fim->fieldsize[0] = out.width;
+    fim->fieldsize[1] = out.height;
+
+    free(tile);
+    return closeTiledOutput(&out,fim,fdm,mapfile,failed);
+}
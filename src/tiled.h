@@ -0,0 +1,67 @@
+// Out-of-core evaluation for fields too big to hold at once. The field is cut
+// into tiles of at most tilesize x tilesize samples; each is evaluated on its
+// own as a field in its own right (fieldoffset/fielddims narrowed to the
+// tile) and written straight into its place in an ordinary field file, so
+// only one tile is ever in memory. Tile sample positions are computed from
+// the narrowed offset rather than the full field's, which moves them by at
+// most a few ulps. The file is in the current field format (field-file.h);
+// for the blocked ones tilesize is rounded up to a whole number of blocks.
+//
+// FieldData ends up with the range, mean and RMS of the whole field. If
+// mapfile is given, a second pass streams the field back and writes |field|
+// normalised by that range as a 16 bit greyscale PGM.
+#define TILED_DEFAULT_SIZE 2048
+#define TILED_AUTO_PIXELS (4096*4096)
+
+int runTiled(FieldInfoMap* const fim, FieldDataMap* const fdm,
+             SweepEvalFunc eval, void* arg, GLuint tilesize,
+             const char* const outfile, const char* const mapfile);
+
+/*
+ * The file side of runTiled, for callers that evaluate the tiles themselves
+ * (shard.h). Tiles are numbered in rows from the field's origin and may be
+ * placed in any order; the whole field's statistics are combined in tile
+ * order at the close all the same, so the file doesn't depend on it.
+ */
+typedef struct {
+    GLfloat min;
+    GLfloat max;
+    GLfloat mean;
+    GLfloat rms;
+} TileStats;
+
+typedef struct {
+    GLuint origin[2];
+    GLuint size[2];
+    // The tile as a field in its own right
+    GLfloat offset[2];
+    GLfloat dims[2];
+} TileExtent;
+
+typedef struct {
+    int fd;
+    int format;
+    const char* outfile;
+    GLuint width, height;
+    GLfloat offset[2];
+    GLfloat dims[2];
+    GLint written;
+    GLuint tilesize, tilesx, tilesy;
+    size_t rowbytes;
+    unsigned char* encoded;
+    TileStats* stats;
+    double start;
+} TiledOutput;
+
+// The field is fim's; tilesize 0 for TILED_DEFAULT_SIZE
+int openTiledOutput(TiledOutput* const out, const FieldInfoMap* const fim,
+                    const FieldDataMap* const fdm, GLuint tilesize, const char* const outfile);
+int numTiles(const TiledOutput* const out);
+void tileExtent(const TiledOutput* const out, int t, TileExtent* const extent);
+// Tile t's extent.size samples, RG32F rows, and the FieldData they came with
+int placeTile(TiledOutput* const out, int t, const GLfloat* const tile,
+              const TileStats* const stats);
+// Given every tile was placed (failed 0), sets FieldData for the whole field,
+// writes the header and then the map if there is one; closes the file either way
+int closeTiledOutput(TiledOutput* const out, const FieldInfoMap* const fim,
+                     FieldDataMap* const fdm, const char* const mapfile, int failed);
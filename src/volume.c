@@ -0,0 +1,471 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <GL/gl.h>
+
+#include "common.h"
+#include "fim.h"
+#include "cpu-field.h"
+#include "reflect.h"
+#include "field-file.h"
+#include "volume.h"
+
+typedef struct {
+    GLfloat min;
+    GLfloat max;
+    double sum;
+    double sumsq;
+} VolumeStats;
+
+static void clearStats(VolumeStats* const stats) {
+    stats->min = INFINITY;
+    stats->max = -INFINITY;
+    stats->sum = 0;
+    stats->sumsq = 0;
+}
+
+static void addSamples(VolumeStats* const stats, const GLfloat* const values, size_t n) {
+    size_t i;
+    for (i=0; i<n; ++i) {
+        const GLfloat m = sqrtf(values[2*i]*values[2*i]+values[2*i+1]*values[2*i+1]);
+        // Samples right on top of a source aren't finite; leave them out
+        if (!isfinite(m)) continue;
+        if (m < stats->min) stats->min = m;
+        if (m > stats->max) stats->max = m;
+        stats->sum += m;
+        stats->sumsq += (double)m*m;
+    }
+}
+
+static void mergeStats(VolumeStats* const a, const VolumeStats* const b) {
+    if (b->min < a->min) a->min = b->min;
+    if (b->max > a->max) a->max = b->max;
+    a->sum += b->sum;
+    a->sumsq += b->sumsq;
+}
+
+static void storeStats(FieldDataMap* const fdm, const VolumeStats* const stats, double n) {
+    if (*(fdm->written) != 2) {
+        *(fdm->written) = 1;
+        *(fdm->field_min) = stats->min;
+        *(fdm->field_max) = stats->max;
+    }
+    *(fdm->field_mean) = stats->sum/n;
+    *(fdm->field_rms) = sqrt(stats->sumsq/n);
+}
+
+int fieldHasVolumeData(const FieldInfoMap* const fim) {
+    if (fim->slice_n > 0 || fim->volumesize[0] > 0 ||
+        fim->volumesize[1] > 0 || fim->volumesize[2] > 0) return 1;
+
+    int i;
+    for (i=0; i<*(fim->psn) && i<fim->ps_capacity; ++i) {
+        if (fim->ps_z[i] != 0) return 1;
+    }
+    return 0;
+}
+
+/*
+ * x, y, z, k, phase and amplitude arrays of psn sources each, in one block;
+ * with reflective walls, the sources and their images culled against the
+ * region x0, y0, x1, y1 of the plane (walls are vertical, so images keep z)
+ */
+static GLfloat* prepareSources3(const FieldInfoMap* const fim, const GLfloat* const region,
+                                int* const psn)
+{
+    int n = *(fim->psn);
+    if (n < 0) n = 0;
+    if (n > fim->ps_capacity) n = fim->ps_capacity;
+    *psn = n;
+
+    GLfloat* sources = (GLfloat*)malloc(sizeof(GLfloat)*6*(n > 0 ? n : 1));
+    if (sources == NULL) {
+        record(1,"Failed to allocate 3D source arrays\n");
+        return NULL;
+    }
+
+    int i;
+    for (i=0; i<n; ++i) {
+        sources[i] = fim->ps_loc[NUM_DIMS*i];
+        sources[n+i] = fim->ps_loc[NUM_DIMS*i+1];
+        sources[2*n+i] = fim->ps_z[i];
+        sources[3*n+i] = fim->ps_freq[i]*2.0f*(GLfloat)PI/(*(fim->mat_c));
+        sources[4*n+i] = fim->ps_phase[i];
+        sources[5*n+i] = 1;
+    }
+    if (!fieldReflects(fim)) return sources;
+
+    ReflectionPlan plan;
+    ImageSources images;
+    initImageSources(&images);
+    int failed = initReflectionPlan(fim,&plan);
+    if (!failed) {
+        failed = expandImageSources(&plan,n,sources,sources+n,sources+2*n,sources+3*n,
+                                    sources+4*n,region,1.0,&images);
+        freeReflectionPlan(&plan);
+    }
+    free(sources);
+    sources = NULL;
+    if (!failed) {
+        n = images.n;
+        sources = (GLfloat*)malloc(sizeof(GLfloat)*6*(n > 0 ? n : 1));
+        if (sources == NULL) record(1,"Failed to allocate 3D source arrays\n");
+    }
+    if (sources != NULL) {
+        memcpy(sources,images.x,sizeof(GLfloat)*n);
+        memcpy(sources+n,images.y,sizeof(GLfloat)*n);
+        memcpy(sources+2*n,images.z,sizeof(GLfloat)*n);
+        memcpy(sources+3*n,images.k,sizeof(GLfloat)*n);
+        memcpy(sources+4*n,images.phase,sizeof(GLfloat)*n);
+        memcpy(sources+5*n,images.amp,sizeof(GLfloat)*n);
+        *psn = n;
+    }
+    freeImageSources(&images);
+    return sources;
+}
+
+/* ----
+ *  Volumes
+ ---- */
+
+#define VOLUME_BRICK_SAMPLES (VOLUME_BRICK_SIZE*VOLUME_BRICK_SIZE*VOLUME_BRICK_SIZE)
+#define VOLUME_ROW_SIZE (VOLUME_BRICK_SIZE+CPU_POINT_PADDING)
+
+typedef struct {
+    const CpuFieldEngine* engine;
+    int numsources;
+    const GLfloat* sources;
+    GLuint size[3];
+    int bricks[3];
+    // Sample coordinates along each axis, padded by CPU_POINT_PADDING
+    GLfloat* axes[3];
+    // Per thread: a row of y and a row of z coordinates
+    GLfloat* scratch;
+
+    // First brick of the batch; task t evaluates brick first+t into out+t
+    int first;
+    GLfloat* out;
+    VolumeStats* stats;
+    // One brick row in the field format
+    unsigned char* encoded;
+} VolumeJob;
+
+// Extent of brick b along each axis, as start and count
+static void brickExtent(const VolumeJob* const job, int b, GLuint* const start, GLuint* const count) {
+    const int index[3] = { b % job->bricks[0], (b/job->bricks[0]) % job->bricks[1],
+                           b/(job->bricks[0]*job->bricks[1]) };
+    int d;
+    for (d=0; d<3; ++d) {
+        start[d] = (GLuint)index[d]*VOLUME_BRICK_SIZE;
+        count[d] = start[d]+VOLUME_BRICK_SIZE > job->size[d] ? job->size[d]-start[d] : VOLUME_BRICK_SIZE;
+    }
+}
+
+static void brickTask(void* arg, int task, unsigned int thread) {
+    VolumeJob* const job = (VolumeJob*)arg;
+    const int s = job->numsources;
+    GLuint start[3], count[3];
+    brickExtent(job,job->first+task,start,count);
+
+    GLfloat* const ys = job->scratch+2*VOLUME_ROW_SIZE*thread;
+    GLfloat* const zs = ys+VOLUME_ROW_SIZE;
+    // Packed as count[0] x count[1] x count[2], x fastest
+    GLfloat* const out = job->out+2*(size_t)VOLUME_BRICK_SAMPLES*task;
+
+    GLuint y,z;
+    int i;
+    for (z=0; z<count[2]; ++z) {
+        for (i=0; i<VOLUME_ROW_SIZE; ++i) zs[i] = job->axes[2][start[2]+z];
+        for (y=0; y<count[1]; ++y) {
+            for (i=0; i<VOLUME_ROW_SIZE; ++i) ys[i] = job->axes[1][start[1]+y];
+            sumSources3Cpu(job->engine,s,job->sources,job->sources+s,job->sources+2*s,
+                           job->sources+3*s,job->sources+4*s,job->sources+5*s,count[0],
+                           job->axes[0]+start[0],ys,zs,
+                           out+2*((size_t)z*count[1]+y)*count[0]);
+        }
+    }
+
+    clearStats(job->stats+task);
+    addSamples(job->stats+task,out,(size_t)count[0]*count[1]*count[2]);
+}
+
+static int writeBrick(int fd, const VolumeJob* const job, int b, const GLfloat* const brick) {
+    GLuint start[3], count[3];
+    brickExtent(job,b,start,count);
+
+    const int format = fieldFormat();
+    const size_t rowbytes = fieldRowBytes(format,job->size[0]);
+    GLuint y,z;
+    for (z=0; z<count[2]; ++z) {
+        for (y=0; y<count[1]; ++y) {
+            const GLfloat* const row = brick+2*((size_t)z*count[1]+y)*count[0];
+            const off_t at = sizeof(VolumeFileHeader)+
+                             (off_t)rowbytes*((off_t)(start[2]+z)*job->size[1]+start[1]+y)+
+                             fieldRowBytes(format,start[0]);
+            if (format == FIELD_FORMAT_RG32F) {
+                if (writeFileAt(fd,row,sizeof(GLfloat)*2*count[0],at)) return 1;
+            } else {
+                encodeFieldRows(format,row,count[0],1,2*(size_t)count[0],job->encoded);
+                if (writeFileAt(fd,job->encoded,fieldRowBytes(format,count[0]),at)) return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int runVolume(CpuFieldEngine* const engine, const FieldInfoMap* const fim,
+              FieldDataMap* const fdm, const char* const outfile)
+{
+    const GLuint* const size = fim->volumesize;
+    if (size[0] == 0 || size[1] == 0 || size[2] == 0) {
+        record(1,"No Volume-Size to evaluate\n");
+        return 1;
+    }
+
+    VolumeJob job;
+    int d;
+    job.engine = engine;
+    for (d=0; d<3; ++d) {
+        job.size[d] = size[d];
+        job.bricks[d] = (size[d]+VOLUME_BRICK_SIZE-1)/VOLUME_BRICK_SIZE;
+    }
+    const int numbricks = job.bricks[0]*job.bricks[1]*job.bricks[2];
+    const int batch = VOLUME_BRICKS_PER_THREAD*cpuFieldThreads(engine);
+
+    const GLfloat x0 = fim->volumeoffset[0], x1 = x0+fim->volumedims[0];
+    const GLfloat y0 = fim->volumeoffset[1], y1 = y0+fim->volumedims[1];
+    const GLfloat region[4] = { x0 < x1 ? x0 : x1, y0 < y1 ? y0 : y1,
+                                x0 < x1 ? x1 : x0, y0 < y1 ? y1 : y0 };
+    job.sources = prepareSources3(fim,region,&job.numsources);
+    job.axes[0] = (GLfloat*)malloc(sizeof(GLfloat)*(size[0]+size[1]+size[2]+3*CPU_POINT_PADDING));
+    job.scratch = (GLfloat*)malloc(sizeof(GLfloat)*2*VOLUME_ROW_SIZE*cpuFieldThreads(engine));
+    job.out = (GLfloat*)malloc(sizeof(GLfloat)*2*(size_t)VOLUME_BRICK_SAMPLES*batch);
+    job.stats = (VolumeStats*)malloc(sizeof(VolumeStats)*batch);
+    job.encoded = (unsigned char*)malloc(fieldRowBytes(fieldFormat(),VOLUME_BRICK_SIZE));
+    const int fd = open(outfile,O_RDWR|O_CREAT|O_TRUNC,0644);
+    if (job.sources == NULL || job.axes[0] == NULL || job.scratch == NULL ||
+            job.out == NULL || job.stats == NULL || job.encoded == NULL || fd < 0) {
+        if (fd < 0) record(1,"Failed to open output file %s\n",outfile);
+        else record(1,"Failed to allocate volume buffers\n");
+        free((GLfloat*)job.sources);
+        free(job.axes[0]);
+        free(job.scratch);
+        free(job.out);
+        free(job.stats);
+        free(job.encoded);
+        if (fd >= 0) close(fd);
+        return 1;
+    }
+
+    // Same expression as the field's own samples
+    GLuint i;
+    for (d=0; d<3; ++d) {
+        if (d > 0) job.axes[d] = job.axes[d-1]+size[d-1]+CPU_POINT_PADDING;
+        for (i=0; i<size[d]+CPU_POINT_PADDING; ++i) {
+            job.axes[d][i] = fim->volumeoffset[d]+(GLfloat)i/(GLfloat)size[d]*fim->volumedims[d];
+        }
+    }
+
+    record(0,"Evaluating %ux%ux%u volume of %d sources as %d bricks of up to %d^3, "
+             "%d at a time, into %s\n",
+           size[0],size[1],size[2],job.numsources,numbricks,VOLUME_BRICK_SIZE,batch,outfile);
+
+    VolumeStats total;
+    clearStats(&total);
+    const double start = wallClock();
+    int failed = 0, b;
+    for (job.first=0; job.first<numbricks && !failed; job.first+=batch) {
+        const int n = job.first+batch > numbricks ? numbricks-job.first : batch;
+        runCpuTasks(engine,n,brickTask,&job);
+
+        // In brick order, so the totals don't depend on the thread count
+        for (b=0; b<n && !failed; ++b) {
+            failed = writeBrick(fd,&job,job.first+b,job.out+2*(size_t)VOLUME_BRICK_SAMPLES*b);
+            mergeStats(&total,job.stats+b);
+        }
+    }
+
+    if (!failed) {
+        storeStats(fdm,&total,(double)size[0]*size[1]*size[2]);
+
+        VolumeFileHeader header;
+        memset(&header,0,sizeof(header));
+        memcpy(header.magic,VOLUME_FILE_MAGIC,4);
+        header.version = VOLUME_FILE_VERSION;
+        for (d=0; d<3; ++d) {
+            header.size[d] = size[d];
+            header.offset[d] = fim->volumeoffset[d];
+            header.dims[d] = fim->volumedims[d];
+        }
+        header.field_min = *(fdm->field_min);
+        header.field_max = *(fdm->field_max);
+        header.field_mean = *(fdm->field_mean);
+        header.field_rms = *(fdm->field_rms);
+        header.format = fieldFormat();
+        failed = writeFileAt(fd,&header,sizeof(header),0);
+    }
+
+    if (close(fd) != 0) failed = 1;
+    if (failed) {
+        record(1,"Failed to write volume to %s\n",outfile);
+    } else {
+        record(0,"Wrote %ux%ux%u volume to %s in %.2fs; min %f, max %f, rms %f\n",
+               size[0],size[1],size[2],outfile,wallClock()-start,
+               *(fdm->field_min),*(fdm->field_max),*(fdm->field_rms));
+    }
+
+    free((GLfloat*)job.sources);
+    free(job.axes[0]);
+    free(job.scratch);
+    free(job.out);
+    free(job.stats);
+    free(job.encoded);
+    return failed;
+}
+
+/* ----
+ *  Slices
+ ---- */
+
+typedef struct {
+    const CpuFieldEngine* engine;
+    int numsources;
+    const GLfloat* sources;
+    const FieldSlice* slice;
+    // Per thread: a row of x, y and z coordinates
+    GLfloat* scratch;
+    size_t rowsize;
+
+    GLfloat* field;
+    VolumeStats* stats;
+} SliceJob;
+
+static void sliceRowTask(void* arg, int task, unsigned int thread) {
+    SliceJob* const job = (SliceJob*)arg;
+    const FieldSlice* const slice = job->slice;
+    const int s = job->numsources;
+    const GLuint width = slice->size[0];
+    const GLfloat fy = (GLfloat)task/(GLfloat)slice->size[1];
+
+    GLfloat* const p[3] = { job->scratch+3*job->rowsize*thread,
+                            job->scratch+(3*thread+1)*job->rowsize,
+                            job->scratch+(3*thread+2)*job->rowsize };
+    GLuint i;
+    int d;
+    for (d=0; d<3; ++d) {
+        for (i=0; i<job->rowsize; ++i) {
+            p[d][i] = slice->origin[d]+(GLfloat)i/(GLfloat)width*slice->u[d]+fy*slice->v[d];
+        }
+    }
+
+    GLfloat* const row = job->field+2*(size_t)task*width;
+    sumSources3Cpu(job->engine,s,job->sources,job->sources+s,job->sources+2*s,
+                   job->sources+3*s,job->sources+4*s,job->sources+5*s,width,
+                   p[0],p[1],p[2],row);
+
+    clearStats(job->stats+task);
+    addSamples(job->stats+task,row,width);
+}
+
+static GLfloat vectorLength(const GLfloat* const v) {
+    return sqrtf(v[0]*v[0]+v[1]*v[1]+v[2]*v[2]);
+}
+
+int runSlices(CpuFieldEngine* const engine, FieldInfoMap* const fim,
+              FieldDataMap* const fdm, const char* const outfile)
+{
+    if (fim->slice_n <= 0) {
+        record(1,"No Volume-Slice planes to evaluate\n");
+        return 1;
+    }
+
+    // Sizes of the largest slice, and the rectangle every slice's corners lie in
+    GLuint maxwidth = 0, maxheight = 0;
+    GLfloat region[4] = { INFINITY, INFINITY, -INFINITY, -INFINITY };
+    int n, c, d;
+    for (n=0; n<fim->slice_n; ++n) {
+        const FieldSlice* const slice = fim->slices+n;
+        if (slice->size[0] > maxwidth) maxwidth = slice->size[0];
+        if (slice->size[1] > maxheight) maxheight = slice->size[1];
+        for (c=0; c<4; ++c) {
+            for (d=0; d<2; ++d) {
+                const GLfloat p = slice->origin[d]+(c & 1 ? slice->u[d] : 0)+(c & 2 ? slice->v[d] : 0);
+                if (p < region[d]) region[d] = p;
+                if (p > region[d+2]) region[d+2] = p;
+            }
+        }
+    }
+
+    SliceJob job;
+    job.engine = engine;
+    job.rowsize = maxwidth+CPU_POINT_PADDING;
+    job.sources = prepareSources3(fim,region,&job.numsources);
+    job.scratch = (GLfloat*)malloc(sizeof(GLfloat)*3*job.rowsize*cpuFieldThreads(engine));
+    job.field = (GLfloat*)malloc(sizeof(GLfloat)*2*(size_t)maxwidth*maxheight+1);
+    job.stats = (VolumeStats*)malloc(sizeof(VolumeStats)*(maxheight+1));
+    FILE* fp = fopen(outfile,"wb");
+    if (job.sources == NULL || job.scratch == NULL || job.field == NULL ||
+            job.stats == NULL || fp == NULL) {
+        if (fp == NULL) record(1,"Failed to open output file %s\n",outfile);
+        else record(1,"Failed to allocate slice buffers\n");
+        free((GLfloat*)job.sources);
+        free(job.scratch);
+        free(job.field);
+        free(job.stats);
+        if (fp != NULL) fclose(fp);
+        return 1;
+    }
+
+    // Each slice goes out as a field of its own; the plane's are put back after
+    const GLfloat offset[2] = { fim->fieldoffset[0], fim->fieldoffset[1] };
+    const GLfloat dims[2] = { fim->fielddims[0], fim->fielddims[1] };
+    const GLuint fieldsize[2] = { fim->fieldsize[0], fim->fieldsize[1] };
+    const GLint written = *(fdm->written);
+
+    const double start = wallClock();
+    int failed = 0, y;
+    for (n=0; n<fim->slice_n && !failed; ++n) {
+        const FieldSlice* const slice = fim->slices+n;
+        job.slice = slice;
+        runCpuTasks(engine,slice->size[1],sliceRowTask,&job);
+
+        VolumeStats total;
+        clearStats(&total);
+        for (y=0; y<(int)slice->size[1]; ++y) mergeStats(&total,job.stats+y);
+        if (written != 2) *(fdm->written) = 0;
+        storeStats(fdm,&total,(double)slice->size[0]*slice->size[1]);
+
+        fim->fieldoffset[0] = 0;
+        fim->fieldoffset[1] = 0;
+        fim->fielddims[0] = vectorLength(slice->u);
+        fim->fielddims[1] = vectorLength(slice->v);
+        fim->fieldsize[0] = slice->size[0];
+        fim->fieldsize[1] = slice->size[1];
+        failed = writeFieldRecord(fp,fim,fdm,job.field);
+
+        record(0,"> Slice %d: %ux%u at (%f, %f, %f); min %f, max %f\n",n,
+               slice->size[0],slice->size[1],
+               slice->origin[0],slice->origin[1],slice->origin[2],
+               *(fdm->field_min),*(fdm->field_max));
+    }
+
+    fim->fieldoffset[0] = offset[0];
+    fim->fieldoffset[1] = offset[1];
+    fim->fielddims[0] = dims[0];
+    fim->fielddims[1] = dims[1];
+    fim->fieldsize[0] = fieldsize[0];
+    fim->fieldsize[1] = fieldsize[1];
+
+    if (fclose(fp) != 0) failed = 1;
+    if (failed) record(1,"Failed to write slices to %s\n",outfile);
+    else record(0,"Wrote %d slices to %s in %.2fs\n",fim->slice_n,outfile,wallClock()-start);
+
+    free((GLfloat*)job.sources);
+    free(job.scratch);
+    free(job.field);
+    free(job.stats);
+    return failed;
+}
@@ -0,0 +1,43 @@
+// 3D evaluation on the CPU engine. The plane pipeline (NUM_DIMS, compute.glsl,
+// the viewer) stays 2D with cylindrical 1/sqrt(r) spreading; here sources sit
+// at (x, y, PointSource-Height) and spread spherically, e^{i(phase+kr)}/r.
+//
+// A volume (Volume-Offset/-Dimensions/-Size) is sampled like the field with a
+// third axis, at offset + i/size*dims along each, and evaluated in bricks of
+// VOLUME_BRICK_SIZE^3 samples, one per task. At most VOLUME_BRICKS_PER_THREAD
+// bricks per thread are held at once; each batch is written straight into its
+// place in the output file before the next starts, so memory stays bounded
+// whatever the volume's size. Slices (Volume-Slice) are planes through the
+// same sources, written as ordinary field records back to back, one per
+// slice, with fielddims the lengths of u and v. Compiled scenarios (-convert)
+// hold heights, volumes and slices as well as the plane.
+#define VOLUME_FILE_MAGIC "AVOL"
+#define VOLUME_FILE_VERSION 2
+// A whole number of FIELD_FORMAT_BLOCKs, so bricks start on a block of the row
+#define VOLUME_BRICK_SIZE 32
+#define VOLUME_BRICKS_PER_THREAD 2
+
+// Followed by size[1]*size[2] rows of size[0] samples in the header's field
+// format (field-file.h), native byte order, x fastest, then y, then z
+typedef struct {
+    char magic[4];
+    GLuint version;
+    GLuint size[3];
+    GLfloat offset[3];
+    GLfloat dims[3];
+    GLfloat field_min;
+    GLfloat field_max;
+    GLfloat field_mean;
+    GLfloat field_rms;
+    GLuint format;
+} VolumeFileHeader;
+
+// Anything only 3D evaluation reads is set
+int fieldHasVolumeData(const FieldInfoMap* const fim);
+
+// fim's volume into outfile; FieldData gets its range, mean and RMS
+int runVolume(CpuFieldEngine* const engine, const FieldInfoMap* const fim,
+              FieldDataMap* const fdm, const char* const outfile);
+// fim's slices into outfile, each with its own FieldData
+int runSlices(CpuFieldEngine* const engine, FieldInfoMap* const fim,
+              FieldDataMap* const fdm, const char* const outfile);
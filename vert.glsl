@@ -1,5 +1,4 @@
-#version 430
-
+// Compiled behind the preamble from shader-cache.c
 layout(location = 0) in vec4 vin;
 
 uniform mat4 ortho;